@@ -0,0 +1,208 @@
+/*
+ * Compares the lock-free chunked list against a sorted array behind a ck_rwlock, the obvious
+ * locked alternative for a small in-memory ordered index.
+ *
+ * usage: bench_chunked_list [threads] [key range] [seconds] [update percent]
+ */
+#include "chunked_list.h"
+
+#include <ck_pr.h>
+#include <ck_rwlock.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct locked_array {
+    ck_rwlock_t lock;
+    uint32_t count;
+    uint32_t capacity;
+    uint64_t *key_data;
+};
+
+// Index of the first entry with a key >= key
+static uint32_t __locked_array_lower_bound(struct locked_array *array, uint32_t key) {
+    uint32_t low = 0;
+    uint32_t high = array->count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if ((uint32_t) (array->key_data[mid] >> 32) < key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static int locked_array_insert(struct locked_array *array, uint32_t key, uint32_t value) {
+    ck_rwlock_write_lock(&array->lock);
+    uint32_t i = __locked_array_lower_bound(array, key);
+    if (i < array->count && (uint32_t) (array->key_data[i] >> 32) == key) {
+        ck_rwlock_write_unlock(&array->lock);
+        return -1;
+    }
+    memmove(&array->key_data[i + 1], &array->key_data[i],
+            (array->count - i) * sizeof(uint64_t));
+    array->key_data[i] = (((uint64_t) key) << 32) | value;
+    array->count++;
+    ck_rwlock_write_unlock(&array->lock);
+    return 0;
+}
+
+static int locked_array_delete(struct locked_array *array, uint32_t key) {
+    ck_rwlock_write_lock(&array->lock);
+    uint32_t i = __locked_array_lower_bound(array, key);
+    if (i == array->count || (uint32_t) (array->key_data[i] >> 32) != key) {
+        ck_rwlock_write_unlock(&array->lock);
+        return -1;
+    }
+    memmove(&array->key_data[i], &array->key_data[i + 1],
+            (array->count - i - 1) * sizeof(uint64_t));
+    array->count--;
+    ck_rwlock_write_unlock(&array->lock);
+    return 0;
+}
+
+static int locked_array_find(struct locked_array *array, uint32_t key, uint32_t *value) {
+    ck_rwlock_read_lock(&array->lock);
+    uint32_t i = __locked_array_lower_bound(array, key);
+    int ret = -1;
+    if (i < array->count && (uint32_t) (array->key_data[i] >> 32) == key) {
+        *value = (uint32_t) array->key_data[i];
+        ret = 0;
+    }
+    ck_rwlock_read_unlock(&array->lock);
+    return ret;
+}
+
+struct bench {
+    chunked_list_t *list;
+    struct locked_array *array;
+    uint32_t key_range;
+    uint32_t update_percent;
+    int stop;
+    uint32_t __padding;
+};
+
+struct worker {
+    struct bench *bench;
+    uint64_t ops;
+    uint32_t seed;
+    uint32_t __padding;
+};
+
+static inline uint32_t __next_random(uint32_t *seed) {
+    // xorshift32
+    uint32_t x = *seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *seed = x;
+    return x;
+}
+
+static void *__list_worker(void *data) {
+    struct worker *worker = (struct worker*) data;
+    struct bench *bench = worker->bench;
+    uint32_t value;
+
+    while (!ck_pr_load_int(&bench->stop)) {
+        uint32_t r = __next_random(&worker->seed);
+        uint32_t key = r % bench->key_range;
+        uint32_t op = (r >> 16) % 100;
+        if (op < bench->update_percent / 2) {
+            bench->list->insert(bench->list, key, key);
+        } else if (op < bench->update_percent) {
+            bench->list->delete(bench->list, key);
+        } else {
+            bench->list->find(bench->list, key, &value);
+        }
+        worker->ops++;
+    }
+    return NULL;
+}
+
+static void *__array_worker(void *data) {
+    struct worker *worker = (struct worker*) data;
+    struct bench *bench = worker->bench;
+    uint32_t value;
+
+    while (!ck_pr_load_int(&bench->stop)) {
+        uint32_t r = __next_random(&worker->seed);
+        uint32_t key = r % bench->key_range;
+        uint32_t op = (r >> 16) % 100;
+        if (op < bench->update_percent / 2) {
+            locked_array_insert(bench->array, key, key);
+        } else if (op < bench->update_percent) {
+            locked_array_delete(bench->array, key);
+        } else {
+            locked_array_find(bench->array, key, &value);
+        }
+        worker->ops++;
+    }
+    return NULL;
+}
+
+static double __run(struct bench *bench, void *(*body)(void *), int threads, int seconds) {
+    pthread_t *handles = calloc(threads, sizeof(pthread_t));
+    struct worker *workers = calloc(threads, sizeof(struct worker));
+    ensure(handles != NULL && workers != NULL, "Failed to allocate workers");
+
+    bench->stop = 0;
+    for (int i = 0; i < threads; i++) {
+        workers[i].bench = bench;
+        workers[i].seed = 2463534242u + i * 7919;
+        ensure(pthread_create(&handles[i], NULL, body, &workers[i]) == 0, "Failed to start worker");
+    }
+
+    struct timespec duration = { seconds, 0 };
+    nanosleep(&duration, NULL);
+    ck_pr_store_int(&bench->stop, 1);
+
+    uint64_t ops = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(handles[i], NULL);
+        ops += workers[i].ops;
+    }
+
+    free(handles);
+    free(workers);
+    return (double) ops / seconds / 1e6;
+}
+
+int main(int argc, char **argv) {
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    uint32_t key_range = argc > 2 ? (uint32_t) atoi(argv[2]) : 100000;
+    int seconds = argc > 3 ? atoi(argv[3]) : 2;
+    uint32_t update_percent = argc > 4 ? (uint32_t) atoi(argv[4]) : 20;
+
+    struct locked_array array;
+    memset(&array, 0, sizeof(array));
+    ck_rwlock_init(&array.lock);
+    array.capacity = key_range;
+    array.key_data = calloc(key_range, sizeof(uint64_t));
+    ensure(array.key_data != NULL, "Failed to allocate array");
+
+    struct bench bench;
+    memset(&bench, 0, sizeof(bench));
+    bench.list = create_chunked_list();
+    bench.array = &array;
+    bench.key_range = key_range;
+    bench.update_percent = update_percent;
+
+    // Start both half full, which is where a uniform insert/delete mix keeps them
+    for (uint32_t key = 0; key < key_range; key += 2) {
+        bench.list->insert(bench.list, key, key);
+        locked_array_insert(&array, key, key);
+    }
+
+    printf("threads=%d keys=%u updates=%u%%\n", threads, key_range, update_percent);
+    printf("chunked list:   %8.2f Mops/s\n", __run(&bench, __list_worker, threads, seconds));
+    printf("rwlock array:   %8.2f Mops/s\n", __run(&bench, __array_worker, threads, seconds));
+
+    bench.list->destroy(bench.list);
+    free(array.key_data);
+    return 0;
+}
@@ -0,0 +1,163 @@
+/*
+ * Measures how much producers and consumers of one storage manager get in each other's way: the
+ * rate of writes and pops, and how many times they had to retry a compare and swap because another
+ * thread got there first, per operation.
+ *
+ * Producers write, then consumers pop what they wrote, then both run at once with producers
+ * rotating through small segments that consumers follow them through.
+ *
+ * To see what the cache line padding and the CAS backoff are worth, compare against a build
+ * configured with -DSOFTHEAP_NO_CONTENTION_TUNING=ON, on a machine with more cores than threads.
+ *
+ * usage: bench_contention [threads] [records per thread] [record size]
+ */
+#include "storage_manager.h"
+
+// For "DELETE_IF_EXISTS"
+#include "store.h"
+
+#include <ck_pr.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_NAME "bench_contention.str"
+
+// Big enough that the write and pop phases stay in a handful of segments, and small enough that the
+// mixed phase goes through plenty of them
+#define BENCH_SEGMENT_SIZE (64 * 1024 * 1024)
+#define BENCH_MIXED_SEGMENT_SIZE (1024 * 1024)
+
+struct bench {
+    storage_manager_t *storage_manager;
+    uint32_t records;
+    uint32_t record_size;
+
+    // Records popped by every consumer so far, so they know when the producers are done
+    uint64_t popped;
+    uint64_t total;
+
+    // Producers still writing.  Consumers only see segments once they are synced, so the last
+    // producer to finish syncs the one it leaves behind.
+    uint32_t producers;
+    uint32_t __padding;
+};
+
+static double __now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void *__producer(void *data) {
+    struct bench *bench = (struct bench*) data;
+    char *record = calloc(1, bench->record_size);
+    ensure(record != NULL, "Failed to allocate record");
+
+    for (uint32_t i = 0; i < bench->records; i++) {
+        memcpy(record, &i, sizeof(i) < bench->record_size ? sizeof(i) : bench->record_size);
+        ensure(bench->storage_manager->write(bench->storage_manager, record,
+                                             bench->record_size) == 0, "Write failed");
+    }
+
+    if (ck_pr_faa_32(&bench->producers, -1) == 1) {
+        bench->storage_manager->sync(bench->storage_manager, 1);
+    }
+
+    free(record);
+    return NULL;
+}
+
+static void *__consumer(void *data) {
+    struct bench *bench = (struct bench*) data;
+    char *record = calloc(1, bench->record_size);
+    ensure(record != NULL, "Failed to allocate record");
+
+    while (ck_pr_load_64(&bench->popped) < bench->total) {
+        uint32_t len = 0;
+        if (bench->storage_manager->pop_into(bench->storage_manager, record, bench->record_size,
+                                             &len) == 0) {
+            ck_pr_inc_64(&bench->popped);
+        }
+    }
+
+    free(record);
+    return NULL;
+}
+
+/*
+ * Runs producer and consumer threads to completion, and reports the rate and retries since the
+ * last report
+ */
+static void __run(const char *phase, struct bench *bench, int producers, int consumers,
+                  storage_manager_stats_t *last) {
+    int threads = producers + consumers;
+    bench->producers = producers;
+    bench->popped = 0;
+    pthread_t *handles = calloc(threads, sizeof(pthread_t));
+    ensure(handles != NULL, "Failed to allocate threads");
+
+    double start = __now();
+    for (int i = 0; i < threads; i++) {
+        void *(*body)(void *) = i < producers ? __producer : __consumer;
+        ensure(pthread_create(&handles[i], NULL, body, bench) == 0, "Failed to start thread");
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(handles[i], NULL);
+    }
+    double seconds = __now() - start;
+    free(handles);
+
+    storage_manager_stats_t stats;
+    bench->storage_manager->get_stats(bench->storage_manager, &stats);
+    uint64_t written = stats.records_written - last->records_written;
+    uint64_t popped = stats.records_popped - last->records_popped;
+    uint64_t write_retries = stats.write_retries - last->write_retries;
+    uint64_t pop_retries = stats.pop_retries - last->pop_retries;
+    *last = stats;
+
+    printf("%-6s  writes %8.2f Mops/s %8.4f retries/op    pops %8.2f Mops/s %8.4f retries/op\n",
+           phase,
+           written > 0 ? written / seconds / 1e6 : 0.0,
+           written > 0 ? (double) write_retries / written : 0.0,
+           popped > 0 ? popped / seconds / 1e6 : 0.0,
+           popped > 0 ? (double) pop_retries / popped : 0.0);
+}
+
+static storage_manager_t *__create(uint32_t segment_size) {
+    storage_manager_options_t options = { .codec = SM_CODEC_NONE, .flags = DELETE_IF_EXISTS };
+    storage_manager_t *storage_manager = create_storage_manager_with_options(".", BENCH_NAME,
+                                                                             segment_size,
+                                                                             &options);
+    ensure(storage_manager != NULL, "Failed to create storage manager");
+    return storage_manager;
+}
+
+int main(int argc, char **argv) {
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    uint32_t records = argc > 2 ? (uint32_t) atoi(argv[2]) : 200000;
+    uint32_t record_size = argc > 3 ? (uint32_t) atoi(argv[3]) : 64;
+
+    struct bench bench;
+    memset(&bench, 0, sizeof(bench));
+    bench.records = records;
+    bench.record_size = record_size;
+    bench.total = (uint64_t) records * threads;
+
+    printf("threads=%d records=%u size=%u\n", threads, records, record_size);
+    storage_manager_stats_t last;
+    memset(&last, 0, sizeof(last));
+
+    bench.storage_manager = __create(BENCH_SEGMENT_SIZE);
+    __run("write", &bench, threads, 0, &last);
+    __run("pop", &bench, 0, threads, &last);
+    bench.storage_manager->destroy(bench.storage_manager);
+
+    memset(&last, 0, sizeof(last));
+    bench.storage_manager = __create(BENCH_MIXED_SEGMENT_SIZE);
+    __run("mixed", &bench, threads, threads, &last);
+    bench.storage_manager->destroy(bench.storage_manager);
+    return 0;
+}
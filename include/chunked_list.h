@@ -0,0 +1,128 @@
+#ifndef __SH_CHUNKED_LIST_H__
+#define __SH_CHUNKED_LIST_H__
+
+#include "common.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/**
+ * A lock-free ordered set of 32 bit keys, each carrying a 32 bit value, after Braginsky and
+ * Petrank's "Locality-Conscious Lock-Free Linked Lists".
+ *
+ * Keys live in chunks of CL_CHUNK_SIZE entries.  Each chunk owns a contiguous key range and
+ * keeps its entries on a sorted linked list threaded through the chunk by index, so a search
+ * walks one small block of memory instead of chasing a pointer per key.  The chunks themselves
+ * form a linked list ordered by key range.
+ *
+ * Chunks are never modified in place once they fill up or drain.  Instead the chunk is frozen,
+ * its live entries are copied out into one replacement (copy), two replacements (split), or
+ * one or two replacements shared with its successor (merge), and the replacement is swapped in
+ * with a single CAS on the predecessor.  Any thread that runs into a frozen chunk helps finish
+ * the replacement before retrying, so no operation ever waits on another.  Retired chunks are
+ * reclaimed with ck_epoch.
+ */
+
+// Number of entries per chunk, entry 0 of every chunk is the list head
+#ifndef CL_CHUNK_SIZE
+#define CL_CHUNK_SIZE 512
+#endif
+
+// Chunks that drain below this many live entries are merged with their successor
+#define CL_MERGE_THRESHOLD (CL_CHUNK_SIZE / 8)
+
+/**
+ * An entry in a chunk.
+ *
+ * key_data holds the key in the top 32 bits and the value in the bottom 32.  It is written
+ * once by the thread that allocated the entry before the entry is linked in, so it never needs
+ * to be frozen.
+ *
+ * next holds the index of the next entry in the top 62 bits (0, the head, terminates the list),
+ * a freeze bit and a delete bit.  Every change to the list is a CAS on some entry's next word
+ * that expects both bits clear.
+ */
+struct list_entry {
+    uint64_t key_data;
+    uint64_t next;
+};
+
+/**
+ * A chunk of entries.  The freeze word holds a pointer to the chunk's merge buddy with the
+ * freeze state packed into its low three bits.
+ */
+struct list_chunk {
+    // Next entry to hand out, entries are never reused within a chunk
+    uint64_t counter;
+    struct list_entry values[CL_CHUNK_SIZE];
+
+    // First chunk of the replacement once this chunk has been frozen
+    uint64_t new;
+
+    // Next chunk in the list, the low bit freezes it
+    uint64_t next;
+
+    // Merge buddy and freeze state
+    uint64_t freeze;
+
+    // Smallest key this chunk may hold, fixed for the life of the chunk
+    uint32_t min_key;
+
+    // Approximate count of live entries, only used to decide when to merge
+    uint32_t live;
+};
+
+typedef struct chunked_list {
+
+    /**
+     * Inserts key with the given value
+     *
+     * return
+     *  0 - success
+     *  -1 - the key is already present
+     */
+    int (*insert)(struct chunked_list *, uint32_t key, uint32_t value);
+
+    /**
+     * Deletes key
+     *
+     * return
+     *  0 - success
+     *  -1 - the key is not present
+     */
+    int (*delete)(struct chunked_list *, uint32_t key);
+
+    /**
+     * Looks up key, storing its value in value if value is not NULL
+     *
+     * return
+     *  0 - success
+     *  -1 - the key is not present
+     */
+    int (*find)(struct chunked_list *, uint32_t key, uint32_t *value);
+
+    /**
+     * Calls func for every key in ascending order.  This is weakly consistent, keys inserted or
+     * deleted while iterating may or may not be seen.
+     */
+    int (*iterate)(struct chunked_list *, void (*func)(uint32_t key, uint32_t value, void *),
+                   void *);
+
+    /**
+     * Destroys the list.  No other thread may be using it.
+     */
+    int (*destroy)(struct chunked_list *);
+
+    // First chunk, treated exactly like the next word of a chunk that is never frozen
+    uint64_t head;
+
+    // Epoch used to reclaim retired chunks, and the key of each thread's record for it
+    struct ck_epoch *epoch;
+    pthread_key_t record_key;
+
+    uint32_t __padding;
+} chunked_list_t;
+
+chunked_list_t* create_chunked_list();
+
+#endif
@@ -2,6 +2,7 @@
 #define __SH_COMMON_H__
 
 #define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
 #define _BSD_SOURCE
 #define _GNU_SOURCE // asprintf
 
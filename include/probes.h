@@ -0,0 +1,50 @@
+#ifndef __SH_PROBES_H__
+#define __SH_PROBES_H__
+
+/**
+ * USDT probes for tracing a live process with perf, bpftrace or systemtap, under the "softheap"
+ * provider.  They are built in unless configured with -DSOFTHEAP_PROBES=OFF, with the sys/sdt.h
+ * vendored under sdt.  A built in probe is a single nop until a tracer attaches to it.  Turned off,
+ * the probes compile to nothing, and their arguments are not evaluated.
+ *
+ * Probes, with their arguments:
+ *
+ *  segment__allocate(segment number)      - a segment was created for writing
+ *  segment__reopen(segment number)        - a closed segment was opened again for reading
+ *  segment__close(segment number)         - a synced segment was closed to wait for readers
+ *  segment__free(segment number)          - a read segment was freed and its file deleted
+ *  store__sync__begin(file name, bytes)   - an mmap store started waiting out its writers to sync
+ *  store__sync__end(file name, bytes)     - the store reached disk
+ *  write__reserve(offset, size)           - space was reserved in an mmap store
+ *  write__commit(offset, size)            - a reservation was committed, at its final size
+ *  write__retry(retries)                  - reserving lost the race for the write cursor
+ *  pop__claim(offset, size)               - a record of an mmap store was claimed by a reader
+ *  pop__retry(offset)                     - claiming lost the race for the read cursor
+ *  pop__free(segment number)              - a storage manager cursor was freed
+ *  pav__update(file name, old, new)       - a persistent atomic value was changed and persisted
+ *
+ * For example, to see which files slow syncs were on:
+ *
+ *  bpftrace -e 'usdt:libsoftheap.so:softheap:store__sync__begin { @s[tid] = nsecs; }
+ *               usdt:libsoftheap.so:softheap:store__sync__end /@s[tid]/ {
+ *                   @[str(arg0)] = hist(nsecs - @s[tid]); delete(@s[tid]); }'
+ */
+
+#ifdef SOFTHEAP_PROBES
+
+#include <sys/sdt.h>
+
+#define SH_PROBE1(name, a) DTRACE_PROBE1(softheap, name, a)
+#define SH_PROBE2(name, a, b) DTRACE_PROBE2(softheap, name, a, b)
+#define SH_PROBE3(name, a, b, c) DTRACE_PROBE3(softheap, name, a, b, c)
+
+#else
+
+// sizeof keeps variables that only exist for a probe from being unused, without evaluating them
+#define SH_PROBE1(name, a) do { (void) sizeof(a); } while (0)
+#define SH_PROBE2(name, a, b) do { (void) sizeof(a); (void) sizeof(b); } while (0)
+#define SH_PROBE3(name, a, b, c) do { (void) sizeof(a); (void) sizeof(b); (void) sizeof(c); } while (0)
+
+#endif
+
+#endif
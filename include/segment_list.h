@@ -154,6 +154,58 @@ typedef struct segment_list {
      */
     int (*close)(struct segment_list *);
 
+    /**
+     * Args:
+     * dictionary: lz4 dictionary, copied
+     * size: size of the dictionary
+     *
+     * Side effects: Segments allocated from now on compress against this dictionary
+     */
+    int (*set_dictionary)(struct segment_list *, const void *, uint32_t);
+
+    /**
+     * Args:
+     * segment number: The number of the segment to compact
+     * level: lz4 high compression level
+     * Errors: Segment not in the CLOSED state, or did not come out smaller
+     *
+     * Side effects: Rewrites the closed segment's file with lz4's high compression mode.  The new
+     * file is built on the side and renamed over the old one only if the segment is still closed,
+     * so a reader that opens the segment in the meantime just makes this fail.
+     */
+    int (*compact_segment)(struct segment_list *, uint32_t, int);
+
+    /**
+     * Args:
+     * compress: whether segments are lz4 stores over their mmap store, or the mmap store alone
+     * level: lz4 high compression level, or 0 for lz4's fast mode
+     *
+     * Side effects: Segments allocated or opened from now on use this store stack.  Segments are
+     * only readable with the stack they were written with, so this belongs right after the list
+     * is created or opened.  Lists start out compressing in the fast mode.
+     */
+    int (*set_compression)(struct segment_list *, bool, int);
+
+    /**
+     * Args:
+     * segment number: The number of the segment whose store to open
+     * reopen: whether to open the segment's existing file, or create it afresh
+     *
+     * Returns: the store of the segment, with the store stack of the list, which the caller owns.
+     * The segment is not added to the list.  This is for segments kept track of somewhere else,
+     * like the segments of the storage manager's SM_SHARED mode.
+     */
+    store_t* (*open_store)(struct segment_list *, uint32_t, bool);
+
+    /**
+     * Args:
+     * segment number: The number of the segment whose file to delete
+     * Errors: The file does not exist
+     *
+     * Side effects: Deletes the file of a segment that is not in the list, without opening it
+     */
+    int (*delete_store)(struct segment_list *, uint32_t);
+
     // Circular buffer of segments
     segment_t *segment_buffer;
 
@@ -173,6 +225,19 @@ typedef struct segment_list {
     // TODO: Check performance of this.  Improve granularity.
     ck_rwlock_t *lock;
 
+    // Dictionary new segments compress against, guarded by the lock
+    void *dictionary;
+    uint32_t dictionary_size;
+
+    // Store stack segments use, see set_compression
+    uint32_t compress;
+    int level;
+    uint32_t __padding;
+
+    // Counters from stats.h the list and the stores of its segments add to, or NULL.  Like
+    // set_compression, this belongs right after the list is created or opened.
+    struct sh_stats *stats;
+
 } segment_list_t;
 
 segment_list_t* create_segment_list(const char* base_dir, const char* name, uint32_t segment_size,
@@ -23,62 +23,29 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
-#include <stdint.h>
-#include <math.h>
-#include <stdlib.h>
+#ifndef __SH_SOFTHEAP_H__
+#define __SH_SOFTHEAP_H__
+
+#include "common.h"
+#include "softheap_prototype.h"
 
 //TODO - Get the right mmap support somehow
 #include <sys/mman.h>
 
-#define SH_SYNC 0x00100
-#define SH_LOCKED 0x02000
-
-// TODO: This is a pointer party, make it better for cache lines
-struct sh_values {
-    struct sh_values *next;
-    struct sh_values *prev;
-    uint_fast32_t count;
-    // TODO - Implement this unrolled list to be cache oblivious
-    void* values[64];
-};
-
-struct sh_node {
-    void* key;
-    struct sh_node* left;
-    struct sh_node* right;
-    struct sh_values elements;
-    uint_fast32_t rank;
-};
-
-struct sh_tree {
-    struct sh_node* root;
-    struct sh_tree* suffixMin;
-    struct sh_tree* next;
-    struct sh_tree* prev;
-};
-
-typedef struct softheap {
-    struct sh_tree* tree;
-    uint_fast32_t size_table[32];
-    /** Maybe
-     *
-    softheap_t* (*new)(int error, int (*compar)(const void *, const void *), int flags);
-    int (*destroy)(softheap_t *softheap);
-    int (*sync)(softheap_t *softheap);
-    uint32_t (*cardinality)(softheap_t *heap);
-    size_t (*size)(softheap_t *heap);
-    int (*add)(softheap_t *heap, void* key, void* value);
-    void* (*delete)(softheap_t *heap, void* key);
-    int (*meld)(softheap_t *dest, softheap_t *src);
-    int (*extractmin)(softheap_t *heap, void** key, void** value);
-    */
-} softheap_t;
-
-//
+// The generic heap orders opaque keys with a user supplied comparator
+#define SH_PTR_LESS(heap, a, b) ((heap)->compar((a), (b)) < 0)
+
+SH_PROTOTYPE(ptr, void*, SH_PTR_LESS)
+
+typedef sh_ptr_t softheap_t;
 
 /**
  * Allocates a new softheap
  *
+ * error is the inverse of the error rate, that is a heap created with an error of 8 will
+ * corrupt at most 1/8th of its keys.  compar is called with the keys exactly as they were
+ * given to sh_add and follows the usual qsort conventions.
+ *
  * NULL == ERROR
  */
 softheap_t* sh_create(int error, int (*compar)(const void *, const void *), int flags);
@@ -115,17 +82,30 @@ size_t sh_size(softheap_t *heap);
 int sh_add(softheap_t *heap, void* key, void* value);
 
 /**
- * Deletes an element from the softheap
- * currently containing it. It is assumed that 
- * the element is currently contained in exactly one
- * soft heap)
+ * Insert n elements into the heap in one pass.  The elements are built into trees bottom-up
+ * and melded in once, which is linear in n rather than paying for a meld per element.  All
+ * memory needed is reserved from the arena before any work is done.
+ *
+ * values may be NULL
+ *
+ * return
+ *  0 - success
+ *  -1 - failure
+ */
+int sh_build(softheap_t *heap, void** keys, void** values, uint32_t n);
+
+/**
+ * Not supported, and aborts the process if called.  Kaplan and Zwick give soft heaps no delete, and
+ * the lazy deletion it would take is not implemented: keep track of deleted keys and skip them as
+ * they are extracted instead.
  */
 void* sh_delete(softheap_t *heap, void* key);
 
 /**
  * Melds the two softheaps together,
- * destroying and altering dest in the 
- * process
+ * altering dest in the process.  src is left
+ * empty (its arena is handed over to dest) but
+ * must still be destroyed
  */
 int sh_meld(softheap_t *dest, softheap_t *src);
 
@@ -135,7 +115,21 @@ int sh_meld(softheap_t *dest, softheap_t *src);
  */
 int sh_extractmin(softheap_t *heap, void** key, void** value);
 
+/**
+ * Extracts up to k of the (potentially) lowest values from the heap, subject to corruption.
+ * Every element sharing the current minimum node is handed out before the heap is repaired,
+ * so the sift and suffix-min maintenance is paid once per node rather than once per element.
+ *
+ * values may be NULL
+ *
+ * return
+ *  the number of elements extracted
+ */
+uint32_t sh_extract_batch(softheap_t *heap, uint32_t k, void** keys, void** values);
+
 /**
  * Iterates the softheap
  */
 int sh_iterate(softheap_t *heap, void (*func)(void*,void*));
+
+#endif
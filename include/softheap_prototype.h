@@ -0,0 +1,615 @@
+/**
+ * Copyright (c) 2014, URX Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __SH_SOFTHEAP_PROTOTYPE_H__
+#define __SH_SOFTHEAP_PROTOTYPE_H__
+
+#include "common.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * The soft heap algorithm as a template, in the style of ck's CK_*_PROTOTYPE macros.
+ *
+ * SH_PROTOTYPE(name, type, less) generates a heap sh_<name>_t whose keys are stored by value
+ * as `type`, with `less(heap, a, b)` expanded inline wherever two keys are compared.  Every
+ * generated function is static inline, so a specialization costs nothing unless it is used,
+ * and the compiler sees the comparison rather than an indirect call through a comparator.
+ *
+ * The generic void* heap in softheap.h is one such instantiation, softheap_typed.h carries
+ * the common fixed width ones.
+ */
+
+#define SH_SYNC 0x00100
+#define SH_LOCKED 0x02000
+
+// Ranks never exceed log2 of the number of inserted elements, so this is plenty
+#define SH_MAX_RANK 64
+
+// Default amount of memory the arena maps at a time
+#define SH_ARENA_SLAB_SIZE (1024 * 1024)
+
+enum sh_arena_kind {
+    SH_ARENA_ITEM = 0,
+    SH_ARENA_NODE = 1,
+    SH_ARENA_TREE = 2,
+    SH_ARENA_KINDS = 3
+};
+
+/**
+ * Bump allocator over anonymous mmap()'d slabs, with a free list per object kind.  Nodes,
+ * items and trees for a heap all come from here, so tearing a heap down is just unmapping
+ * its slabs, and bulk operations can reserve everything they need up front.
+ *
+ * The arena does not know the layout of what it hands out, a freed object has its first word
+ * reused as the free list link.
+ */
+struct sh_arena {
+    struct sh_arena_slab* slabs;
+    char* cursor;
+    char* limit;
+    void* free[SH_ARENA_KINDS];
+    size_t mapped;
+    int flags;
+    uint32_t __padding;
+};
+
+/**
+ * Maps a new slab of at least `bytes` into the arena
+ *
+ * return
+ *  0 - success
+ *  -1 - failure
+ */
+int sh_arena_map(struct sh_arena *arena, size_t bytes);
+
+/**
+ * Hand every slab and free object owned by src over to dest, leaving src empty
+ */
+void sh_arena_adopt(struct sh_arena *dest, struct sh_arena *src);
+
+/**
+ * Unmaps everything the arena owns
+ */
+void sh_arena_release(struct sh_arena *arena);
+
+/**
+ * Fills the rank size table for a heap with the given inverse error rate
+ */
+void sh_size_table_init(uint_fast32_t *size_table, int error);
+
+/**
+ * Make sure that the next `bytes` worth of allocations can be served without going back to
+ * the kernel
+ */
+static inline int sh_arena_reserve(struct sh_arena *arena, size_t bytes) {
+    if ((size_t) (arena->limit - arena->cursor) >= bytes) return 0;
+    return sh_arena_map(arena, bytes);
+}
+
+static inline void* sh_arena_alloc(struct sh_arena *arena, int kind, size_t size) {
+    void **object = (void**) arena->free[kind];
+    if (object != NULL) {
+        arena->free[kind] = *object;
+        return object;
+    }
+
+    if (sh_arena_reserve(arena, size) != 0) return NULL;
+    void *ptr = arena->cursor;
+    arena->cursor += size;
+    return ptr;
+}
+
+static inline void sh_arena_free(struct sh_arena *arena, int kind, void *ptr) {
+    *(void**) ptr = arena->free[kind];
+    arena->free[kind] = ptr;
+}
+
+/*
+ * How a heap finds the tree holding the minimum root.
+ *
+ * SUFFIX keeps Kaplan and Zwick's suffix minima in the tree list, which works for any key type
+ * but has to walk back along the list whenever a root changes.
+ *
+ * PACKED keeps a copy of every root key in an array indexed by rank, with empty ranks holding a
+ * sentinel that compares greater than or equal to every key.  Ranks are unique once trees have
+ * been combined, so finding the minimum is an argmin over SH_MAX_RANK packed keys, which the
+ * typed heaps do with SSE4/AVX2.  Only the rank whose root changed is touched on update, and
+ * the cost of the argmin does not depend on how many trees are live.
+ */
+#define __SH_SUFFIX_FIELDS(name, type)
+#define __SH_SUFFIX_FUNCTIONS(name, type, sentinel, argmin)
+#define __SH_SUFFIX_INIT(name, heap)                    ((void) 0)
+#define __SH_SUFFIX_SET(name, heap, tree)               ((void) 0)
+#define __SH_SUFFIX_CLEAR(name, heap, tree, rank)       ((void) 0)
+#define __SH_SUFFIX_UPDATE(name, heap, tree)            __sh_##name##_update_suffix_min(tree, heap)
+#define __SH_SUFFIX_MIN(name, heap)                     ((heap)->tree->suffixMin)
+
+#define __SH_PACKED_FIELDS(name, type)                                                      \
+    type roots[SH_MAX_RANK];                                                                \
+    struct sh_##name##_tree *by_rank[SH_MAX_RANK];
+#define __SH_PACKED_INIT(name, heap)                    __sh_##name##_index_reset(heap)
+#define __SH_PACKED_SET(name, heap, tree)               __sh_##name##_index_set(heap, tree)
+#define __SH_PACKED_CLEAR(name, heap, tree, rank)       __sh_##name##_index_clear(heap, tree, rank)
+#define __SH_PACKED_UPDATE(name, heap, tree)            ((void) (tree))
+#define __SH_PACKED_MIN(name, heap)                     __sh_##name##_index_min(heap)
+
+#define __SH_PACKED_FUNCTIONS(name, type, sentinel, argmin) \
+static inline void __sh_##name##_index_reset(sh_##name##_t *heap) {                                 \
+    for (int rank = 0; rank < SH_MAX_RANK; rank++) {                                                \
+        heap->roots[rank] = sentinel;                                                               \
+        heap->by_rank[rank] = NULL;                                                                 \
+    }                                                                                               \
+}                                                                                                   \
+                                                                                                    \
+static inline void __sh_##name##_index_set(sh_##name##_t *heap, struct sh_##name##_tree *tree) {    \
+    heap->roots[tree->rank] = tree->root->key;                                                      \
+    heap->by_rank[tree->rank] = tree;                                                               \
+}                                                                                                   \
+                                                                                                    \
+static inline void __sh_##name##_index_clear(sh_##name##_t *heap,                                   \
+                                             struct sh_##name##_tree *tree,                         \
+                                             uint_fast32_t rank) {                                  \
+    if (heap->by_rank[rank] != tree) return;                                                        \
+    heap->roots[rank] = sentinel;                                                                   \
+    heap->by_rank[rank] = NULL;                                                                     \
+}                                                                                                   \
+                                                                                                    \
+static inline struct sh_##name##_tree* __sh_##name##_index_min(sh_##name##_t *heap) {               \
+    struct sh_##name##_tree *tree = heap->by_rank[argmin(heap->roots)];                             \
+                                                                                                    \
+    /* Only possible when every live root equals the sentinel, so any of them is a minimum */       \
+    return tree != NULL ? tree : heap->tree;                                                        \
+}
+
+/**
+ * SH_PROTOTYPE(name, type, less) generates a heap ordered by `less`, tracking the minimum root
+ * with suffix minima.
+ */
+#define SH_PROTOTYPE(name, type, less)                                                      \
+    __SH_PROTOTYPE(name, type, less, SUFFIX, 0, 0)
+
+/**
+ * SH_PACKED_PROTOTYPE(name, type, less, sentinel, argmin) generates a heap that tracks its
+ * roots in a packed array instead.  `sentinel` must not compare less than any key, and
+ * `argmin(const type *keys)` must return the index of a minimum of SH_MAX_RANK keys, preferring
+ * the lowest index on ties.
+ */
+#define SH_PACKED_PROTOTYPE(name, type, less, sentinel, argmin)                             \
+    __SH_PROTOTYPE(name, type, less, PACKED, sentinel, argmin)
+
+/*
+ * Soft heap internals, following section 3 of Kaplan and Zwick.
+ *
+ * Elements live on singly linked lists hanging off the nodes so that sift can concatenate
+ * lists in O(1), each node carries the (possibly corrupted) common key of its items.
+ */
+#define __SH_PROTOTYPE(name, type, less, index, sentinel, argmin) \
+struct sh_##name##_item {                                                                           \
+    type key;                                                                                       \
+    void *value;                                                                                    \
+    struct sh_##name##_item *next;                                                                  \
+};                                                                                                  \
+                                                                                                    \
+struct sh_##name##_node {                                                                           \
+    type key;                                                                                       \
+    struct sh_##name##_node *left;                                                                  \
+    struct sh_##name##_node *right;                                                                 \
+    struct sh_##name##_item *head;                                                                  \
+    struct sh_##name##_item *tail;                                                                  \
+    uint_fast32_t count;                                                                            \
+    uint_fast32_t rank;                                                                             \
+};                                                                                                  \
+                                                                                                    \
+struct sh_##name##_tree {                                                                           \
+    struct sh_##name##_node *root;                                                                  \
+    struct sh_##name##_tree *suffixMin;                                                             \
+    struct sh_##name##_tree *next;                                                                  \
+    struct sh_##name##_tree *prev;                                                                  \
+    uint_fast32_t rank;                                                                             \
+};                                                                                                  \
+                                                                                                    \
+typedef struct sh_##name {                                                                          \
+    struct sh_##name##_tree *tree;                                                                  \
+    int (*compar)(const void *, const void *);                                                      \
+    struct sh_arena arena;                                                                          \
+    uint_fast32_t cardinality;                                                                      \
+    uint_fast32_t size_table[SH_MAX_RANK];                                                          \
+    __SH_##index##_FIELDS(name, type)                                                               \
+} sh_##name##_t;                                                                                    \
+                                                                                                    \
+static inline bool __sh_##name##_leaf(struct sh_##name##_node *node) {                              \
+    return node->left == NULL && node->right == NULL;                                               \
+}                                                                                                   \
+                                                                                                    \
+static inline struct sh_##name##_node* __sh_##name##_node_init(struct sh_##name##_node *node,       \
+                                                              struct sh_##name##_item *item) {      \
+    node->key = item->key;                                                                          \
+    node->left = NULL;                                                                              \
+    node->right = NULL;                                                                             \
+    node->head = item;                                                                              \
+    node->tail = item;                                                                              \
+    node->count = 1;                                                                                \
+    node->rank = 0;                                                                                 \
+    return node;                                                                                    \
+}                                                                                                   \
+                                                                                                    \
+static inline void __sh_##name##_sift(sh_##name##_t *heap, struct sh_##name##_node *x) {            \
+    while (x->count < heap->size_table[x->rank] && !__sh_##name##_leaf(x)) {                        \
+        if (x->left == NULL ||                                                                      \
+            (x->right != NULL && less(heap, x->right->key, x->left->key))) {                        \
+            struct sh_##name##_node *tmp = x->left;                                                 \
+            x->left = x->right;                                                                     \
+            x->right = tmp;                                                                         \
+        }                                                                                           \
+                                                                                                    \
+        /* Move the items of the smaller child up, corrupting them to the child's key */            \
+        struct sh_##name##_node *child = x->left;                                                   \
+        if (child->head != NULL) {                                                                  \
+            if (x->head == NULL) {                                                                  \
+                x->head = child->head;                                                              \
+            } else {                                                                                \
+                x->tail->next = child->head;                                                        \
+            }                                                                                       \
+            x->tail = child->tail;                                                                  \
+            x->count += child->count;                                                               \
+        }                                                                                           \
+        x->key = child->key;                                                                        \
+        child->head = NULL;                                                                         \
+        child->tail = NULL;                                                                         \
+        child->count = 0;                                                                           \
+                                                                                                    \
+        if (__sh_##name##_leaf(child)) {                                                            \
+            sh_arena_free(&heap->arena, SH_ARENA_NODE, child);                                      \
+            x->left = NULL;                                                                         \
+        } else {                                                                                    \
+            __sh_##name##_sift(heap, child);                                                        \
+        }                                                                                           \
+    }                                                                                               \
+}                                                                                                   \
+                                                                                                    \
+static inline struct sh_##name##_node* __sh_##name##_combine(sh_##name##_t *heap,                   \
+                                                            struct sh_##name##_node *x,             \
+                                                            struct sh_##name##_node *y) {           \
+    struct sh_##name##_node *z = (struct sh_##name##_node*)                                         \
+        sh_arena_alloc(&heap->arena, SH_ARENA_NODE, sizeof(struct sh_##name##_node));               \
+    ensure(z != NULL, "Failed to allocate soft heap node");                                         \
+                                                                                                    \
+    z->left = x;                                                                                    \
+    z->right = y;                                                                                   \
+    z->head = NULL;                                                                                 \
+    z->tail = NULL;                                                                                 \
+    z->count = 0;                                                                                   \
+    z->rank = x->rank + 1;                                                                          \
+    ensure(z->rank < SH_MAX_RANK, "Soft heap rank overflow");                                       \
+                                                                                                    \
+    __sh_##name##_sift(heap, z);                                                                    \
+    return z;                                                                                       \
+}                                                                                                   \
+                                                                                                    \
+static inline void __sh_##name##_update_suffix_min(struct sh_##name##_tree *tree,                   \
+                                                   sh_##name##_t *heap) {                           \
+    while (tree != NULL) {                                                                          \
+        if (tree->next == NULL ||                                                                   \
+            !less(heap, tree->next->suffixMin->root->key, tree->root->key)) {                       \
+            tree->suffixMin = tree;                                                                 \
+        } else {                                                                                    \
+            tree->suffixMin = tree->next->suffixMin;                                                \
+        }                                                                                           \
+        tree = tree->prev;                                                                          \
+    }                                                                                               \
+}                                                                                                   \
+                                                                                                    \
+__SH_##index##_FUNCTIONS(name, type, sentinel, argmin)                                              \
+                                                                                                    \
+static inline void __sh_##name##_remove_tree(sh_##name##_t *heap, struct sh_##name##_tree *tree) {  \
+    __SH_##index##_CLEAR(name, heap, tree, tree->rank);                                             \
+    if (tree->prev == NULL) {                                                                       \
+        heap->tree = tree->next;                                                                    \
+    } else {                                                                                        \
+        tree->prev->next = tree->next;                                                              \
+    }                                                                                               \
+    if (tree->next != NULL) tree->next->prev = tree->prev;                                          \
+    sh_arena_free(&heap->arena, SH_ARENA_TREE, tree);                                               \
+}                                                                                                   \
+                                                                                                    \
+/*                                                                                                  \
+ * Merge a rank ordered list of trees into the heap's rank ordered list.  Trees of equal rank       \
+ * end up adjacent so that they can be combined.                                                    \
+ */                                                                                                 \
+static inline void __sh_##name##_merge_into(sh_##name##_t *heap, struct sh_##name##_tree *trees) {  \
+    struct sh_##name##_tree *prev = NULL;                                                           \
+    struct sh_##name##_tree *curr = heap->tree;                                                     \
+                                                                                                    \
+    while (trees != NULL) {                                                                         \
+        struct sh_##name##_tree *tree = trees;                                                      \
+        trees = trees->next;                                                                        \
+                                                                                                    \
+        while (curr != NULL && curr->rank < tree->rank) {                                           \
+            prev = curr;                                                                            \
+            curr = curr->next;                                                                      \
+        }                                                                                           \
+                                                                                                    \
+        tree->prev = prev;                                                                          \
+        tree->next = curr;                                                                          \
+        if (prev == NULL) {                                                                         \
+            heap->tree = tree;                                                                      \
+        } else {                                                                                    \
+            prev->next = tree;                                                                      \
+        }                                                                                           \
+        if (curr != NULL) curr->prev = tree;                                                        \
+        prev = tree;                                                                                \
+    }                                                                                               \
+}                                                                                                   \
+                                                                                                    \
+/*                                                                                                  \
+ * Combine trees of equal rank until ranks are unique again.  Nothing past rank k was touched       \
+ * by the merge, so we can stop as soon as we are past it and have nothing left to carry.           \
+ */                                                                                                 \
+static inline void __sh_##name##_repeated_combine(sh_##name##_t *heap, uint_fast32_t k) {           \
+    struct sh_##name##_tree *tree = heap->tree;                                                     \
+    if (tree == NULL) return;                                                                       \
+                                                                                                    \
+    while (tree->next != NULL) {                                                                    \
+        if (tree->rank == tree->next->rank) {                                                       \
+            if (tree->next->next == NULL || tree->next->next->rank != tree->rank) {                 \
+                __SH_##index##_CLEAR(name, heap, tree, tree->rank);                                 \
+                tree->root = __sh_##name##_combine(heap, tree->root, tree->next->root);             \
+                tree->rank = tree->root->rank;                                                      \
+                __sh_##name##_remove_tree(heap, tree->next);                                        \
+                                                                                                    \
+                /* The combined tree may need to carry into the next one */                         \
+                continue;                                                                           \
+            }                                                                                       \
+        } else if (tree->rank > k) {                                                                \
+            break;                                                                                  \
+        }                                                                                           \
+        __SH_##index##_SET(name, heap, tree);                                                       \
+        tree = tree->next;                                                                          \
+    }                                                                                               \
+                                                                                                    \
+    __SH_##index##_SET(name, heap, tree);                                                           \
+    __SH_##index##_UPDATE(name, heap, tree);                                                        \
+}                                                                                                   \
+                                                                                                    \
+/*                                                                                                  \
+ * Called after items have been taken off the root of the minimum tree.  Refill the root if it      \
+ * has dropped below half of its target size, dropping the tree once it has nothing left.           \
+ */                                                                                                 \
+static inline void __sh_##name##_repair(sh_##name##_t *heap, struct sh_##name##_tree *tree) {       \
+    struct sh_##name##_node *x = tree->root;                                                        \
+    if (x->count * 2 > heap->size_table[x->rank]) return;                                           \
+                                                                                                    \
+    if (!__sh_##name##_leaf(x)) {                                                                   \
+        __sh_##name##_sift(heap, x);                                                                \
+        __SH_##index##_SET(name, heap, tree);                                                       \
+        __SH_##index##_UPDATE(name, heap, tree);                                                    \
+    } else if (x->count == 0) {                                                                     \
+        struct sh_##name##_tree *prev = tree->prev;                                                 \
+        sh_arena_free(&heap->arena, SH_ARENA_NODE, x);                                              \
+        __sh_##name##_remove_tree(heap, tree);                                                      \
+        __SH_##index##_UPDATE(name, heap, prev);                                                    \
+    }                                                                                               \
+}                                                                                                   \
+                                                                                                    \
+static inline void __sh_##name##_iterate_node(struct sh_##name##_node *node,                        \
+                                              void (*func)(type, void*)) {                          \
+    if (node == NULL) return;                                                                       \
+    for (struct sh_##name##_item *item = node->head; item != NULL; item = item->next) {             \
+        func(item->key, item->value);                                                               \
+    }                                                                                               \
+    __sh_##name##_iterate_node(node->left, func);                                                   \
+    __sh_##name##_iterate_node(node->right, func);                                                  \
+}                                                                                                   \
+                                                                                                    \
+static inline sh_##name##_t* sh_##name##_create(int error, int flags) {                             \
+    sh_##name##_t *heap = (sh_##name##_t*) calloc(1, sizeof(sh_##name##_t));                        \
+    if (heap == NULL) return NULL;                                                                  \
+                                                                                                    \
+    heap->arena.flags = flags;                                                                      \
+    sh_size_table_init(heap->size_table, error);                                                    \
+    __SH_##index##_INIT(name, heap);                                                                \
+    return heap;                                                                                    \
+}                                                                                                   \
+                                                                                                    \
+static inline int sh_##name##_destroy(sh_##name##_t *heap) {                                        \
+    sh_arena_release(&heap->arena);                                                                 \
+    free(heap);                                                                                     \
+    return 0;                                                                                       \
+}                                                                                                   \
+                                                                                                    \
+static inline uint32_t sh_##name##_cardinality(sh_##name##_t *heap) {                               \
+    return heap->cardinality;                                                                       \
+}                                                                                                   \
+                                                                                                    \
+static inline size_t sh_##name##_size(sh_##name##_t *heap) {                                        \
+    return sizeof(sh_##name##_t) + heap->arena.mapped;                                              \
+}                                                                                                   \
+                                                                                                    \
+static inline int sh_##name##_add(sh_##name##_t *heap, type key, void *value) {                     \
+    struct sh_##name##_item *item = (struct sh_##name##_item*)                                      \
+        sh_arena_alloc(&heap->arena, SH_ARENA_ITEM, sizeof(struct sh_##name##_item));               \
+    struct sh_##name##_node *node = (struct sh_##name##_node*)                                      \
+        sh_arena_alloc(&heap->arena, SH_ARENA_NODE, sizeof(struct sh_##name##_node));               \
+    struct sh_##name##_tree *tree = (struct sh_##name##_tree*)                                      \
+        sh_arena_alloc(&heap->arena, SH_ARENA_TREE, sizeof(struct sh_##name##_tree));               \
+    if (item == NULL || node == NULL || tree == NULL) return -1;                                    \
+                                                                                                    \
+    item->key = key;                                                                                \
+    item->value = value;                                                                            \
+    item->next = NULL;                                                                              \
+                                                                                                    \
+    tree->root = __sh_##name##_node_init(node, item);                                               \
+    tree->rank = 0;                                                                                 \
+    tree->next = NULL;                                                                              \
+    tree->prev = NULL;                                                                              \
+    tree->suffixMin = tree;                                                                         \
+                                                                                                    \
+    __sh_##name##_merge_into(heap, tree);                                                           \
+    __sh_##name##_repeated_combine(heap, 0);                                                        \
+    heap->cardinality++;                                                                            \
+    return 0;                                                                                       \
+}                                                                                                   \
+                                                                                                    \
+static inline int sh_##name##_build(sh_##name##_t *heap, type *keys, void **values, uint32_t n) {   \
+    if (n == 0) return 0;                                                                           \
+                                                                                                    \
+    /* n leaves plus at most n - 1 combined nodes, and a tree per bit of n */                       \
+    size_t required = (sizeof(struct sh_##name##_item) * n) +                                       \
+                      (sizeof(struct sh_##name##_node) * 2 * n) +                                   \
+                      (sizeof(struct sh_##name##_tree) * SH_MAX_RANK);                              \
+    if (sh_arena_reserve(&heap->arena, required) != 0) return -1;                                   \
+                                                                                                    \
+    /* Build bottom-up like a binary counter, carry[r] holds the pending tree of rank r.  This      \
+     * performs n - 1 combines and never touches the tree list or the suffix minima. */             \
+    struct sh_##name##_node *carry[SH_MAX_RANK] = { NULL };                                         \
+    for (uint32_t i = 0; i < n; i++) {                                                              \
+        struct sh_##name##_item *item = (struct sh_##name##_item*)                                  \
+            sh_arena_alloc(&heap->arena, SH_ARENA_ITEM, sizeof(struct sh_##name##_item));           \
+        struct sh_##name##_node *node = (struct sh_##name##_node*)                                  \
+            sh_arena_alloc(&heap->arena, SH_ARENA_NODE, sizeof(struct sh_##name##_node));           \
+                                                                                                    \
+        item->key = keys[i];                                                                        \
+        item->value = values == NULL ? NULL : values[i];                                            \
+        item->next = NULL;                                                                          \
+        __sh_##name##_node_init(node, item);                                                        \
+                                                                                                    \
+        uint_fast32_t rank = 0;                                                                     \
+        while (carry[rank] != NULL) {                                                               \
+            node = __sh_##name##_combine(heap, carry[rank], node);                                  \
+            carry[rank] = NULL;                                                                     \
+            rank++;                                                                                 \
+        }                                                                                           \
+        carry[rank] = node;                                                                         \
+    }                                                                                               \
+                                                                                                    \
+    /* What is left over is one tree per set bit of n, already in rank order */                     \
+    struct sh_##name##_tree *first = NULL;                                                          \
+    struct sh_##name##_tree *last = NULL;                                                           \
+    uint_fast32_t max_rank = 0;                                                                     \
+    for (uint_fast32_t rank = 0; rank < SH_MAX_RANK; rank++) {                                      \
+        if (carry[rank] == NULL) continue;                                                          \
+                                                                                                    \
+        struct sh_##name##_tree *tree = (struct sh_##name##_tree*)                                  \
+            sh_arena_alloc(&heap->arena, SH_ARENA_TREE, sizeof(struct sh_##name##_tree));           \
+        tree->root = carry[rank];                                                                   \
+        tree->rank = rank;                                                                          \
+        tree->next = NULL;                                                                          \
+        tree->prev = last;                                                                          \
+        tree->suffixMin = tree;                                                                     \
+        if (last == NULL) {                                                                         \
+            first = tree;                                                                           \
+        } else {                                                                                    \
+            last->next = tree;                                                                      \
+        }                                                                                           \
+        last = tree;                                                                                \
+        max_rank = rank;                                                                            \
+    }                                                                                               \
+                                                                                                    \
+    __sh_##name##_merge_into(heap, first);                                                          \
+    __sh_##name##_repeated_combine(heap, max_rank);                                                 \
+    heap->cardinality += n;                                                                         \
+    return 0;                                                                                       \
+}                                                                                                   \
+                                                                                                    \
+static inline int sh_##name##_meld(sh_##name##_t *dest, sh_##name##_t *src) {                       \
+    if (src->tree == NULL) return 0;                                                                \
+                                                                                                    \
+    /* Only the ranks of the shorter list can collide, so only combine that far */                  \
+    uint_fast32_t k = 0;                                                                            \
+    for (struct sh_##name##_tree *tree = src->tree; tree != NULL; tree = tree->next) {              \
+        k = tree->rank;                                                                             \
+    }                                                                                               \
+                                                                                                    \
+    sh_arena_adopt(&dest->arena, &src->arena);                                                      \
+    __sh_##name##_merge_into(dest, src->tree);                                                      \
+    __sh_##name##_repeated_combine(dest, k);                                                        \
+                                                                                                    \
+    dest->cardinality += src->cardinality;                                                          \
+    src->tree = NULL;                                                                               \
+    src->cardinality = 0;                                                                           \
+    __SH_##index##_INIT(name, src);                                                                 \
+    return 0;                                                                                       \
+}                                                                                                   \
+                                                                                                    \
+static inline int sh_##name##_extractmin(sh_##name##_t *heap, type *key, void **value) {            \
+    if (heap->tree == NULL) return -1;                                                              \
+                                                                                                    \
+    struct sh_##name##_tree *tree = __SH_##index##_MIN(name, heap);                                 \
+    struct sh_##name##_node *x = tree->root;                                                        \
+                                                                                                    \
+    struct sh_##name##_item *item = x->head;                                                        \
+    x->head = item->next;                                                                           \
+    if (x->head == NULL) x->tail = NULL;                                                            \
+    x->count--;                                                                                     \
+                                                                                                    \
+    *key = item->key;                                                                               \
+    if (value != NULL) *value = item->value;                                                        \
+    sh_arena_free(&heap->arena, SH_ARENA_ITEM, item);                                               \
+    heap->cardinality--;                                                                            \
+                                                                                                    \
+    __sh_##name##_repair(heap, tree);                                                               \
+    return 0;                                                                                       \
+}                                                                                                   \
+                                                                                                    \
+static inline uint32_t sh_##name##_extract_batch(sh_##name##_t *heap, uint32_t k,                   \
+                                                 type *keys, void **values) {                       \
+    uint32_t extracted = 0;                                                                         \
+                                                                                                    \
+    while (extracted < k && heap->tree != NULL) {                                                   \
+        struct sh_##name##_tree *tree = __SH_##index##_MIN(name, heap);                             \
+        struct sh_##name##_node *x = tree->root;                                                    \
+                                                                                                    \
+        /* Everything on this node shares the current minimum key, so drain as much as we can       \
+         * before paying for the repair */                                                          \
+        while (extracted < k && x->head != NULL) {                                                  \
+            struct sh_##name##_item *item = x->head;                                                \
+            x->head = item->next;                                                                   \
+            x->count--;                                                                             \
+                                                                                                    \
+            keys[extracted] = item->key;                                                            \
+            if (values != NULL) values[extracted] = item->value;                                    \
+            extracted++;                                                                            \
+            sh_arena_free(&heap->arena, SH_ARENA_ITEM, item);                                       \
+        }                                                                                           \
+        if (x->head == NULL) x->tail = NULL;                                                        \
+                                                                                                    \
+        __sh_##name##_repair(heap, tree);                                                           \
+    }                                                                                               \
+                                                                                                    \
+    heap->cardinality -= extracted;                                                                 \
+    return extracted;                                                                               \
+}                                                                                                   \
+                                                                                                    \
+static inline int sh_##name##_iterate(sh_##name##_t *heap, void (*func)(type, void*)) {             \
+    for (struct sh_##name##_tree *tree = heap->tree; tree != NULL; tree = tree->next) {             \
+        __sh_##name##_iterate_node(tree->root, func);                                               \
+    }                                                                                               \
+    return 0;                                                                                       \
+}
+
+#endif
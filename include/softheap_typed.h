@@ -0,0 +1,209 @@
+/**
+ * Copyright (c) 2014, URX Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __SH_SOFTHEAP_TYPED_H__
+#define __SH_SOFTHEAP_TYPED_H__
+
+#include "softheap_prototype.h"
+#include <math.h>
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__SSE4_2__) || defined(__SSE4_1__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/**
+ * Soft heaps specialized for common key types.  Keys are stored by value in the items and
+ * nodes, and compared inline, rather than through a comparator and a pointer per key.
+ *
+ *  sh_u32_t    - uint32_t keys
+ *  sh_u64_t    - uint64_t keys
+ *  sh_double_t - double keys, NaNs are not ordered and must not be inserted
+ *
+ * These track their roots in a packed array (see SH_PACKED_PROTOTYPE) and find the minimum root
+ * with the argmins below.  They use AVX2 or SSE4 when the compiler targets it, build with
+ * -DSOFTHEAP_NATIVE=ON or an explicit -march to get them, and fall back to a scalar scan.
+ *
+ * The API mirrors softheap.h with the prefix changed and keys passed by value, for example
+ *
+ *   sh_u64_t *heap = sh_u64_create(64, 0);
+ *   sh_u64_add(heap, deadline, task);
+ *   sh_u64_extractmin(heap, &deadline, &task);
+ *   sh_u64_destroy(heap);
+ */
+
+#define SH_SCALAR_LESS(heap, a, b) ((a) < (b))
+
+/**
+ * Index of the first minimum of SH_MAX_RANK keys.  The vector paths reduce to the minimum
+ * value first and then look for the first lane equal to it, so ties break the same way as
+ * the scalar scan.
+ */
+static inline uint_fast32_t sh_argmin_u32(const uint32_t *keys) {
+#if defined(__AVX2__)
+    __m256i min = _mm256_loadu_si256((const __m256i*) keys);
+    for (int i = 8; i < SH_MAX_RANK; i += 8) {
+        min = _mm256_min_epu32(min, _mm256_loadu_si256((const __m256i*) (keys + i)));
+    }
+    __m128i half = _mm_min_epu32(_mm256_castsi256_si128(min), _mm256_extracti128_si256(min, 1));
+    half = _mm_min_epu32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(1, 0, 3, 2)));
+    half = _mm_min_epu32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(2, 3, 0, 1)));
+    __m256i target = _mm256_broadcastd_epi32(half);
+
+    for (int i = 0; i < SH_MAX_RANK; i += 8) {
+        __m256i eq = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*) (keys + i)), target);
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(eq));
+        if (mask != 0) return i + __builtin_ctz(mask);
+    }
+    return 0;
+#elif defined(__SSE4_1__)
+    __m128i min = _mm_loadu_si128((const __m128i*) keys);
+    for (int i = 4; i < SH_MAX_RANK; i += 4) {
+        min = _mm_min_epu32(min, _mm_loadu_si128((const __m128i*) (keys + i)));
+    }
+    min = _mm_min_epu32(min, _mm_shuffle_epi32(min, _MM_SHUFFLE(1, 0, 3, 2)));
+    min = _mm_min_epu32(min, _mm_shuffle_epi32(min, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    for (int i = 0; i < SH_MAX_RANK; i += 4) {
+        __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*) (keys + i)), min);
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(eq));
+        if (mask != 0) return i + __builtin_ctz(mask);
+    }
+    return 0;
+#else
+    uint_fast32_t best = 0;
+    for (uint_fast32_t i = 1; i < SH_MAX_RANK; i++) {
+        if (keys[i] < keys[best]) best = i;
+    }
+    return best;
+#endif
+}
+
+static inline uint_fast32_t sh_argmin_u64(const uint64_t *keys) {
+#if defined(__AVX2__)
+    // There is no unsigned 64 bit compare, flip the sign bits and use the signed one
+    const __m256i bias = _mm256_set1_epi64x((long long) 0x8000000000000000ULL);
+    __m256i min = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) keys), bias);
+    for (int i = 4; i < SH_MAX_RANK; i += 4) {
+        __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (keys + i)), bias);
+        min = _mm256_blendv_epi8(min, v, _mm256_cmpgt_epi64(min, v));
+    }
+    __m256i swapped = _mm256_permute4x64_epi64(min, _MM_SHUFFLE(1, 0, 3, 2));
+    min = _mm256_blendv_epi8(min, swapped, _mm256_cmpgt_epi64(min, swapped));
+    swapped = _mm256_permute4x64_epi64(min, _MM_SHUFFLE(2, 3, 0, 1));
+    min = _mm256_blendv_epi8(min, swapped, _mm256_cmpgt_epi64(min, swapped));
+    __m256i target = _mm256_xor_si256(min, bias);
+
+    for (int i = 0; i < SH_MAX_RANK; i += 4) {
+        __m256i eq = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*) (keys + i)), target);
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(eq));
+        if (mask != 0) return i + __builtin_ctz(mask);
+    }
+    return 0;
+#elif defined(__SSE4_2__)
+    const __m128i bias = _mm_set1_epi64x((long long) 0x8000000000000000ULL);
+    __m128i min = _mm_xor_si128(_mm_loadu_si128((const __m128i*) keys), bias);
+    for (int i = 2; i < SH_MAX_RANK; i += 2) {
+        __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i*) (keys + i)), bias);
+        min = _mm_blendv_epi8(min, v, _mm_cmpgt_epi64(min, v));
+    }
+    __m128i swapped = _mm_shuffle_epi32(min, _MM_SHUFFLE(1, 0, 3, 2));
+    min = _mm_blendv_epi8(min, swapped, _mm_cmpgt_epi64(min, swapped));
+    __m128i target = _mm_xor_si128(min, bias);
+
+    for (int i = 0; i < SH_MAX_RANK; i += 2) {
+        __m128i eq = _mm_cmpeq_epi64(_mm_loadu_si128((const __m128i*) (keys + i)), target);
+        int mask = _mm_movemask_pd(_mm_castsi128_pd(eq));
+        if (mask != 0) return i + __builtin_ctz(mask);
+    }
+    return 0;
+#else
+    uint_fast32_t best = 0;
+    for (uint_fast32_t i = 1; i < SH_MAX_RANK; i++) {
+        if (keys[i] < keys[best]) best = i;
+    }
+    return best;
+#endif
+}
+
+static inline uint_fast32_t sh_argmin_double(const double *keys) {
+#if defined(__AVX2__)
+    __m256d min = _mm256_loadu_pd(keys);
+    for (int i = 4; i < SH_MAX_RANK; i += 4) {
+        min = _mm256_min_pd(min, _mm256_loadu_pd(keys + i));
+    }
+    min = _mm256_min_pd(min, _mm256_permute2f128_pd(min, min, 1));
+    min = _mm256_min_pd(min, _mm256_permute_pd(min, 0x5));
+
+    for (int i = 0; i < SH_MAX_RANK; i += 4) {
+        int mask = _mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(keys + i), min, _CMP_EQ_OQ));
+        if (mask != 0) return i + __builtin_ctz(mask);
+    }
+    return 0;
+#elif defined(__SSE4_1__)
+    __m128d min = _mm_loadu_pd(keys);
+    for (int i = 2; i < SH_MAX_RANK; i += 2) {
+        min = _mm_min_pd(min, _mm_loadu_pd(keys + i));
+    }
+    min = _mm_min_pd(min, _mm_shuffle_pd(min, min, 1));
+
+    for (int i = 0; i < SH_MAX_RANK; i += 2) {
+        int mask = _mm_movemask_pd(_mm_cmpeq_pd(_mm_loadu_pd(keys + i), min));
+        if (mask != 0) return i + __builtin_ctz(mask);
+    }
+    return 0;
+#else
+    uint_fast32_t best = 0;
+    for (uint_fast32_t i = 1; i < SH_MAX_RANK; i++) {
+        if (keys[i] < keys[best]) best = i;
+    }
+    return best;
+#endif
+}
+
+SH_PACKED_PROTOTYPE(u32, uint32_t, SH_SCALAR_LESS, UINT32_MAX, sh_argmin_u32)
+SH_PACKED_PROTOTYPE(u64, uint64_t, SH_SCALAR_LESS, UINT64_MAX, sh_argmin_u64)
+SH_PACKED_PROTOTYPE(double, double, SH_SCALAR_LESS, INFINITY, sh_argmin_double)
+
+/**
+ * Generates sh_<name>_t for fixed size byte string keys of `size` bytes, ordered by memcmp().
+ * The key type is sh_<name>_key_t, a struct wrapping the bytes so that it can be passed and
+ * stored by value, eg.
+ *
+ *   SH_BYTES_PROTOTYPE(uuid, 16)
+ *
+ *   sh_uuid_key_t key;
+ *   memcpy(key.bytes, id, 16);
+ *   sh_uuid_add(heap, key, value);
+ */
+#define SH_BYTES_LESS(heap, a, b) (memcmp((a).bytes, (b).bytes, sizeof((a).bytes)) < 0)
+
+#define SH_BYTES_PROTOTYPE(name, size)                                                      \
+typedef struct sh_##name##_key {                                                            \
+    uint8_t bytes[size];                                                                    \
+} sh_##name##_key_t;                                                                        \
+SH_PROTOTYPE(name, sh_##name##_key_t, SH_BYTES_LESS)
+
+#endif
@@ -0,0 +1,178 @@
+#ifndef __SH_STATS_H__
+#define __SH_STATS_H__
+
+#include "common.h"
+#include <stdint.h>
+#include <sched.h>
+#include <ck_pr.h>
+
+/**
+ * Counters shared by the layers of a storage manager, so it can report what it has been doing.
+ *
+ * Each counter is kept once per shard, and a thread adds to the shard of the CPU it is running on,
+ * so threads on different CPUs never write the same cache line.  The adds are still atomic, since a
+ * thread can be moved between reading its CPU and adding.  Reading a counter sums it over the
+ * shards, which is only a snapshot while other threads keep adding.
+ */
+enum sh_stat {
+    // Storage manager
+    SH_STAT_RECORDS_WRITTEN,
+    SH_STAT_BYTES_WRITTEN,
+    SH_STAT_RECORDS_POPPED,
+    SH_STAT_BYTES_POPPED,
+    SH_STAT_SYNCS,
+    SH_STAT_SYNC_NS,
+    SH_STAT_QUOTA_WAITS,
+    SH_STAT_QUOTA_REJECTIONS,
+    SH_STAT_RECORDS_DROPPED,
+
+    // Segment list
+    SH_STAT_SEGMENTS_ALLOCATED,
+    SH_STAT_SEGMENTS_REOPENED,
+    SH_STAT_SEGMENTS_CLOSED,
+    SH_STAT_SEGMENTS_FREED,
+
+    // mmap stores
+    SH_STAT_STORE_BYTES_WRITTEN,
+    SH_STAT_WRITE_RETRIES,
+    SH_STAT_POP_RETRIES,
+
+    // lz4 stores
+    SH_STAT_LZ4_BYTES_IN,
+    SH_STAT_LZ4_BYTES_OUT,
+    SH_STAT_LZ4_RAW_FRAMES,
+    SH_STAT_LZ4_DECOMPRESSIONS,
+
+    SH_STAT_COUNT
+};
+
+// Counters a shard takes up, rounded up to whole cache lines
+#define SH_STATS_CACHE_LINE 64
+#define SH_STATS_STRIDE \
+    ((((SH_STAT_COUNT * sizeof(uint64_t)) + SH_STATS_CACHE_LINE - 1) / SH_STATS_CACHE_LINE) * \
+     (SH_STATS_CACHE_LINE / sizeof(uint64_t)))
+
+// Most shards a set of counters has, however many CPUs there are
+#define SH_STATS_MAX_SHARDS 64
+
+typedef struct sh_stats {
+
+    // shard_count * SH_STATS_STRIDE counters, aligned to a cache line
+    uint64_t *counters;
+
+    // A power of two, so a CPU finds its shard with a mask
+    uint32_t shard_count;
+    uint32_t __padding;
+
+} sh_stats_t;
+
+/**
+ * Allocates a set of counters, all zero, with a shard per CPU
+ *
+ * NULL == ERROR
+ */
+sh_stats_t* sh_stats_create();
+
+void sh_stats_destroy(sh_stats_t *stats);
+
+/**
+ * The shard of shard_count, a power of two, for the CPU this thread is running on
+ */
+static inline uint32_t sh_stats_shard(uint32_t shard_count) {
+    int cpu = sched_getcpu();
+    return cpu < 0 ? 0 : ((uint32_t) cpu & (shard_count - 1));
+}
+
+/**
+ * Adds value to a counter.  Does nothing if stats is NULL, so layers used on their own do not have
+ * to check.
+ */
+static inline void sh_stats_add(sh_stats_t *stats, enum sh_stat stat, uint64_t value) {
+    if (stats == NULL) return;
+
+    uint32_t shard = sh_stats_shard(stats->shard_count);
+    ck_pr_add_64(&stats->counters[(shard * SH_STATS_STRIDE) + stat], value);
+}
+
+/**
+ * Sums every counter over the shards into counters, which has room for SH_STAT_COUNT
+ */
+void sh_stats_sum(sh_stats_t *stats, uint64_t *counters);
+
+/**
+ * Sums a single counter over the shards, for reading one often without summing the rest
+ */
+uint64_t sh_stats_get(sh_stats_t *stats, enum sh_stat stat);
+
+/**
+ * Monotonic clock in nanoseconds, for timing what goes into the _NS counters and histograms
+ */
+uint64_t sh_stats_now_ns();
+
+/**
+ * Wall clock in nanoseconds since the epoch, only good to a few milliseconds but cheap enough to
+ * read for every record.  Unlike sh_stats_now_ns it still means something after a restart.
+ */
+uint64_t sh_stats_wall_ns();
+
+/**
+ * A histogram of values, usually latencies in nanoseconds, sharded the same way as the counters.
+ *
+ * Buckets are log scaled the way HDR histograms are.  Values below 2^SH_HISTOGRAM_SUB_BITS get a
+ * bucket each, and every power of two above that is split into 2^SH_HISTOGRAM_SUB_BITS buckets, so
+ * a value is known to within 1/2^SH_HISTOGRAM_SUB_BITS of itself whatever its size.
+ */
+#define SH_HISTOGRAM_SUB_BITS 3
+#define SH_HISTOGRAM_SUB_BUCKETS (1 << SH_HISTOGRAM_SUB_BITS)
+#define SH_HISTOGRAM_BUCKETS ((64 - SH_HISTOGRAM_SUB_BITS + 1) * SH_HISTOGRAM_SUB_BUCKETS)
+
+typedef struct sh_histogram {
+
+    // shard_count * SH_HISTOGRAM_BUCKETS counts, aligned to a cache line
+    uint64_t *counts;
+
+    // A power of two, as for sh_stats_t
+    uint32_t shard_count;
+    uint32_t __padding;
+
+} sh_histogram_t;
+
+/**
+ * Allocates an empty histogram with a shard per CPU
+ *
+ * NULL == ERROR
+ */
+sh_histogram_t* sh_histogram_create();
+
+void sh_histogram_destroy(sh_histogram_t *histogram);
+
+static inline uint32_t sh_histogram_bucket(uint64_t value) {
+    if (value < SH_HISTOGRAM_SUB_BUCKETS) return (uint32_t) value;
+
+    // The top bit picks the power of two, the bits under it the bucket within it
+    uint32_t top = 63 - __builtin_clzll(value);
+    uint32_t shift = top - SH_HISTOGRAM_SUB_BITS;
+    return ((shift + 1) * SH_HISTOGRAM_SUB_BUCKETS) +
+           (uint32_t) ((value >> shift) & (SH_HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+static inline void sh_histogram_record(sh_histogram_t *histogram, uint64_t value) {
+    uint32_t shard = sh_stats_shard(histogram->shard_count);
+    ck_pr_inc_64(&histogram->counts[(shard * SH_HISTOGRAM_BUCKETS) + sh_histogram_bucket(value)]);
+}
+
+/**
+ * Sums the buckets over the shards into counts, which has room for SH_HISTOGRAM_BUCKETS
+ *
+ * return
+ *  the number of values recorded
+ */
+uint64_t sh_histogram_sum(sh_histogram_t *histogram, uint64_t *counts);
+
+/**
+ * The largest value that can be in the bucket holding the given percentile (0 to 100) of the values
+ * counted in counts, or 0 if there are none
+ */
+uint64_t sh_histogram_percentile(const uint64_t *counts, double percentile);
+
+#endif
@@ -31,9 +31,120 @@ typedef struct storage_manager_cursor {
      */
     void* data;
 
+    /**
+     * When the data was written, in nanoseconds since the epoch to within a few milliseconds, or 0
+     * without SM_TIMESTAMPS
+     */
+    uint64_t enqueue_time_ns;
+
 } storage_manager_cursor_t;
 
 
+/**
+ * What a storage manager has done since it was created or opened, from storage_manager->get_stats.
+ * Every field but segments_open only ever goes up, so rates come from the difference between two
+ * snapshots.
+ */
+typedef struct storage_manager_stats {
+
+    /**
+     * Records written and popped, and the bytes they took up before compression
+     */
+    uint64_t records_written;
+    uint64_t bytes_written;
+    uint64_t records_popped;
+    uint64_t bytes_popped;
+
+    /**
+     * Segments synced to disk, and the nanoseconds it took in total
+     */
+    uint64_t syncs;
+    uint64_t sync_ns;
+
+    /**
+     * Segments allocated for writing, reopened for reading after being closed, closed to wait for
+     * readers, and freed once read, and how many of them are open right now
+     */
+    uint64_t segments_allocated;
+    uint64_t segments_reopened;
+    uint64_t segments_closed;
+    uint64_t segments_freed;
+    uint64_t segments_open;
+
+    /**
+     * Bytes the segment files took, after compression and with the lz4 frame headers, and how many
+     * times writers reserving space and readers popping records had to retry because another thread
+     * got there first
+     */
+    uint64_t store_bytes_written;
+    uint64_t write_retries;
+    uint64_t pop_retries;
+
+    /**
+     * Bytes that went into lz4 compression and came out of it, frames stored as they were because
+     * they did not come out smaller, and frames decompressed.  LZ4_BLOCKS frames hold many records.
+     */
+    uint64_t lz4_bytes_in;
+    uint64_t lz4_bytes_out;
+    uint64_t lz4_raw_frames;
+    uint64_t lz4_decompressions;
+
+    /**
+     * With SM_TIMESTAMPS, how long ago the oldest record not yet popped was written, as of the last
+     * pop.  It is 0 once a pop finds nothing, and after a reopen until something is written or
+     * popped.
+     */
+    uint64_t oldest_unconsumed_age_ns;
+
+    /**
+     * Writes that found the queue at its quota and waited for room, writes turned away by the quota,
+     * and records dropped unread to make room, see storage_manager_options_t.  Dropped records
+     * count as popped too.
+     */
+    uint64_t quota_waits;
+    uint64_t quota_rejections;
+    uint64_t records_dropped;
+
+} storage_manager_stats_t;
+
+/**
+ * Operations SM_LATENCY keeps a latency histogram for
+ *
+ * SM_OP_WRITE - write
+ * SM_OP_POP - pop_cursor and pop_into calls that popped something, calls that found nothing to pop
+ *  are not counted so that idle consumers do not drown out the rest
+ * SM_OP_SYNC - sync
+ * SM_OP_ROTATE - allocating the next segment once the one being written is full or synced
+ * SM_OP_FREE - freeing segments once they have been read
+ * SM_OP_LAG - not an operation, but how long popped records waited between write and pop, which
+ *  SM_TIMESTAMPS keeps whether SM_LATENCY is on or not
+ */
+enum storage_manager_operation {
+    SM_OP_WRITE = 0,
+    SM_OP_POP = 1,
+    SM_OP_SYNC = 2,
+    SM_OP_ROTATE = 3,
+    SM_OP_FREE = 4,
+    SM_OP_LAG = 5
+};
+
+/**
+ * Latency percentiles of an operation, from storage_manager->get_latency.  Each percentile is the
+ * most the operation could have taken at that percentile, which is at most an eighth more than it
+ * really took.
+ */
+typedef struct storage_manager_latency {
+
+    uint64_t count;
+
+    uint64_t p50_ns;
+    uint64_t p90_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+    uint64_t max_ns;
+
+} storage_manager_latency_t;
+
 typedef struct storage_manager {
 
     /**
@@ -47,6 +158,8 @@ typedef struct storage_manager {
      * Args: self, data, len
      * Returns: 0 on success
      * -1 on failure
+     * -2 if the queue is at its quota and the quota policy turned the write away, see
+     *  storage_manager_options_t
      *  TODO: Better error reporting
      */
     int (*write)(struct storage_manager *, void *, uint32_t);
@@ -70,6 +183,20 @@ typedef struct storage_manager {
      */
     void (*free_cursor) (struct storage_manager *, storage_manager_cursor_t *);
 
+    /**
+     * Pop the next element of data straight into buf, which has room for cap bytes, like pop_cursor
+     * without the cursor.  The data is decompressed or copied into buf once, and the segment it
+     * came from is released before this returns.  Data that does not fit is left for the next pop.
+     *
+     * Args: self, buf, cap, len
+     * Returns: 0 on success, with *len set to the size of the data
+     * 1 if the data does not fit, with *len set to its size
+     * -1 if there is nothing to pop
+     * DECOMPRESSION_FAULT from store.h if the data is corrupt on disk, with *len set to its size.
+     * The data is gone, and the next pop goes on to what came after it.
+     */
+    int (*pop_into) (struct storage_manager *, void *, uint32_t, uint32_t *);
+
     /**
      * Destroy this storage_manager, all calls after a destroy
      * are undefined
@@ -100,11 +227,244 @@ typedef struct storage_manager {
      */
     int (*sync) (struct storage_manager *, int);
 
+    /**
+     * Take a snapshot of the counters of this storage manager and the segments under it.  The
+     * counters are cheap enough to always be on, and can be read while other threads are using the
+     * storage manager.
+     *
+     * Args: self, stats
+     * return
+     *  0 - success
+     */
+    int (*get_stats) (struct storage_manager *, storage_manager_stats_t *);
+
+    /**
+     * Take a snapshot of the latency percentiles of an operation since the storage manager was
+     * created or opened with SM_LATENCY, or of SM_OP_LAG with SM_TIMESTAMPS.
+     *
+     * Args: self, operation, latency
+     * return
+     *  0 - success
+     *  -1 - the flag for the operation is off
+     */
+    int (*get_latency) (struct storage_manager *, enum storage_manager_operation,
+                        storage_manager_latency_t *);
+
+    /**
+     * Records written and not yet popped, and their size as written.  Both are read from counters,
+     * without touching the segments, so they are cheap enough to poll.
+     *
+     * What was synced carries over a close and reopen, counted the way the reopened storage manager
+     * hands it out again.  A record popped from a segment that was not finished before the close is
+     * popped again after it, so it is waiting again too.  After a crash rather than a close, the
+     * counts of the last segments synced may not have reached the disk, and both come up short by
+     * what those segments hold.
+     *
+     * Args: self
+     */
+    uint64_t (*depth) (struct storage_manager *);
+    uint64_t (*backlog_bytes) (struct storage_manager *);
+
 } storage_manager_t;
 
+/**
+ * Flags for create_storage_manager and open_storage_manager, alongside DELETE_IF_EXISTS and
+ * LZ4_BLOCKS from store.h, which are passed down to every segment
+ *
+ * SM_RING_BUFFER puts a bounded in-memory ring in front of the segments.  Writes go to the ring and
+ * pop_cursor hands them straight to consumers, without a sync in between.  The ring only spills to
+ * segments when it fills up, or on sync and close, so records that have not been through either are
+ * lost if the process dies.  Consumers pop from the ring concurrently, but producers take turns at
+ * it, and the one that fills it up spills it before the others get in.
+ */
+#define SM_RING_BUFFER 0x0100
+
+/**
+ * SM_LZ4_DICTIONARY samples the first records written, trains an lz4 dictionary on them and
+ * compresses every segment allocated after that against it.  This pays off for queues of small,
+ * similar records.  Each segment carries its own copy of the dictionary, and a reopened storage
+ * manager trains a new one.
+ */
+#define SM_LZ4_DICTIONARY 0x0200
+
+/**
+ * SM_COMPACT(level) runs a background thread that rewrites the segments waiting in the backlog
+ * with lz4's high compression mode at the given level (1 to 15, or 0 for the default of 9), once
+ * they are closed and before anyone reads them.  The thread runs at idle CPU and IO priority and
+ * rests as long as it works, so it only gets what foreground writes leave over.
+ */
+#define SM_COMPACT(level) (0x0400 | (((level) & 0xF) << 12))
+
+/**
+ * SM_ASYNC_WRITE(workers) moves compression off the producers.  write copies the record onto a
+ * queue and returns, and a pool of worker threads (1 to 15, or 0 for one less than the number of
+ * cores) compresses and appends queued records to the segments.  Each producer thread always goes
+ * through the same worker, so records from one producer keep their order.  A producer that gets
+ * too far ahead of its worker waits for it, and sync waits for everything written before it.  A
+ * record a worker fails to write is reported by the next sync, which fails.  It has no effect with
+ * SM_RING_BUFFER, which already keeps writes off the segments.
+ */
+#define SM_ASYNC_WRITE(workers) (0x0800 | (((workers) & 0xF) << 16))
+
+/**
+ * SM_READ_AHEAD(workers) pops and decompresses records ahead of consumers on a pool of worker
+ * threads (1 to 15, or 0 for one less than the number of cores), keeping a bounded window of them
+ * ready, so that pop_cursor is a pointer hand off.  Workers take turns popping records, which
+ * numbers them, and decompress them side by side, so more workers decode more records at once.
+ * Records are handed over in the order they were numbered, which is the order they were written,
+ * and a single consumer sees them in that order.  Consumers that get ahead of the workers pop and
+ * decompress records themselves, in turn with them.  SM_CODEC_LZ4_FRAMED and SM_CODEC_LZ4_STREAM
+ * frames still decompress one at a time, in order.  Records read ahead but not popped at close are
+ * read again after a reopen, along with the rest of their segment.  It has no effect with
+ * SM_RING_BUFFER, which already hands records over without decompressing them.
+ */
+#define SM_READ_AHEAD(workers) (0x00100000 | (((workers) & 0xF) << 24))
+
+/**
+ * SM_LATENCY keeps a latency histogram of each of the operations in storage_manager_operation, for
+ * get_latency.  Every operation reads the clock twice more, and threads on different CPUs record
+ * into their own copy of each histogram.
+ */
+#define SM_LATENCY 0x00200000
+
+/**
+ * SM_TIMESTAMPS has write stamp every record with the time, from a coarse clock that is cheap to
+ * read.  Popped cursors carry it as enqueue_time_ns, the SM_OP_LAG histogram of get_latency keeps
+ * how long records waited to be popped, and get_stats reports the age of the oldest record not yet
+ * popped.  Each record takes 8 more bytes in the segments, and pop_into asks for 8 bytes more than
+ * the record when it does not fit, which is the room it needs to take the timestamp off.  Like the
+ * codec, this is persisted and a queue always reopens the way it was created.
+ */
+#define SM_TIMESTAMPS 0x00400000
+
+/**
+ * SM_SHARED lets several processes write to and pop from the same queue, each through its own
+ * storage manager on the same directory.  One process creates the queue and the rest open it once
+ * it has.  They coordinate through a control file that every one of them maps, under a robust
+ * process shared mutex that is only taken when a process moves on to another segment.  Each one
+ * also holds a lock on a byte of a lease file, which the kernel drops when the process dies, so
+ * that the others can tell without relying on pids.  A child forked with the queue open keeps its
+ * parent's lease until it exits or execs.
+ *
+ * Segments are handed out whole.  A process writes to a segment of its own until it fills up or is
+ * synced, and a consumer process claims the oldest finished segment and pops it to the end, so
+ * records from one producer keep their order for a single consumer, and otherwise arrive roughly in
+ * the order they were written, as with several consumers in one process.  Records only reach other
+ * processes once synced.  When a process dies, what it wrote and had not synced is lost as in an
+ * unclean close, and a segment it was popping is popped again from the start by the next process to
+ * open the queue or claim a segment.  SM_RING_BUFFER, SM_COMPACT, SM_READ_AHEAD and SM_ASYNC_WRITE
+ * have no effect, so that a write the quota policy turns away says so.  Like the codec, this is
+ * persisted.
+ */
+#define SM_SHARED 0x00800000
+
+/**
+ * SM_SINGLE_PRODUCER promises that only one thread ever writes to and syncs the storage manager,
+ * and SM_SINGLE_CONSUMER that only one thread ever pops from it.  Each then keeps hold of the
+ * segment it is on rather than going to the segment list for every record, and moves the cursors
+ * of its stores with plain stores rather than compare and swap loops, so that with SM_CODEC_NONE a
+ * write comes down to a copy and a store fence.  Breaking the promise corrupts the queue.
+ *
+ * SM_SINGLE_PRODUCER has no effect with SM_RING_BUFFER or SM_ASYNC_WRITE, which write and sync from
+ * threads of their own, and SM_SINGLE_CONSUMER none with SM_READ_AHEAD or SM_QUOTA_DROP_OLDEST,
+ * which pop from threads of their own.
+ */
+#define SM_SINGLE_PRODUCER 0x10000000
+#define SM_SINGLE_CONSUMER 0x20000000
+
+/**
+ * How records are stored in the segments of a storage manager
+ *
+ * SM_CODEC_LZ4 compresses each record with lz4's fast mode, and is what create_storage_manager
+ * uses.  Small or incompressible records are kept as they are.
+ *
+ * SM_CODEC_NONE stores records as they are written, with no lz4 store in between.  pop_cursor
+ * hands out pointers straight into the segment mapping, with no decompression buffer or copy, which
+ * suits records that are already compressed.  SM_LZ4_DICTIONARY and SM_COMPACT have no effect.
+ *
+ * SM_CODEC_LZ4HC compresses with lz4's high compression mode at the options' level.  Writes are a
+ * lot slower, reads are not.
+ *
+ * SM_CODEC_LZ4_FRAMED stages records into blocks compressed as one frame, as LZ4_BLOCKS from
+ * store.h does.  Small records compress far better together.
+ *
+ * SM_CODEC_LZ4_STREAM compresses each record against the ones written before it in the same
+ * segment, as LZ4_STREAM from store.h does.  Unlike SM_CODEC_LZ4_FRAMED nothing waits in memory
+ * for a block to fill, but writers to a segment take turns, and so do consumers popping records
+ * that depend on each other.  SM_LZ4_DICTIONARY has no effect.
+ */
+enum storage_manager_codec {
+    SM_CODEC_LZ4 = 0,
+    SM_CODEC_NONE = 1,
+    SM_CODEC_LZ4HC = 2,
+    SM_CODEC_LZ4_FRAMED = 3,
+    SM_CODEC_LZ4_STREAM = 4
+};
+
+/**
+ * What write does when the queue is at one of its quotas
+ *
+ * SM_QUOTA_FAIL turns the write away with -2 straight away.
+ *
+ * SM_QUOTA_BLOCK waits up to quota_timeout_ms for consumers to make room, or for as long as it
+ * takes if that is 0, and turns the write away with -2 if they do not.  Writers wake as consumers
+ * pop records and free segments.
+ *
+ * SM_QUOTA_DROP_OLDEST pops and drops the oldest records until there is room.
+ *
+ * Consumers can only pop synced records, so both of these sync the queue before anything else.
+ */
+enum storage_manager_quota_policy {
+    SM_QUOTA_FAIL = 0,
+    SM_QUOTA_BLOCK = 1,
+    SM_QUOTA_DROP_OLDEST = 2
+};
+
+typedef struct storage_manager_options {
+
+    enum storage_manager_codec codec;
+
+    /**
+     * lz4 high compression level for SM_CODEC_LZ4HC (1 to 16), or 0 for the default of 9
+     */
+    int level;
+
+    /**
+     * The same flags create_storage_manager and open_storage_manager take
+     */
+    int flags;
+
+    enum storage_manager_quota_policy quota_policy;
+
+    /**
+     * Quotas on what waits in the queue, or 0 for none.  max_bytes counts records as written, as
+     * backlog_bytes does.  A record bigger than max_bytes still goes into an empty queue.
+     * max_segments counts full segments the read segment has not reached yet.  Whatever it is set
+     * to, the queue stops short of the most segments the segment list can hold, so a queue nobody
+     * reads turns writes away rather than aborting.  Quotas are not persisted.
+     */
+    uint64_t max_bytes;
+    uint32_t max_segments;
+
+    uint32_t quota_timeout_ms;
+
+} storage_manager_options_t;
+
 storage_manager_t* create_storage_manager(const char* base_dir, const char* name,
                                           int segment_size, int flags);
 storage_manager_t* open_storage_manager(const char* base_dir, const char* name,
                                         int segment_size, int flags);
 
+/**
+ * Like create_storage_manager, with the codec and level of the options.  The codec is persisted
+ * alongside the sync values, so a queue always reopens with the codec it was created with,
+ * whatever the options passed to open_storage_manager_with_options say.
+ */
+storage_manager_t* create_storage_manager_with_options(const char* base_dir, const char* name,
+                                                       int segment_size,
+                                                       const storage_manager_options_t *options);
+storage_manager_t* open_storage_manager_with_options(const char* base_dir, const char* name,
+                                                     int segment_size,
+                                                     const storage_manager_options_t *options);
+
 #endif
@@ -6,6 +6,8 @@
 #include <stddef.h>
 #include <stdint.h>
 
+struct sh_stats;
+
 enum store_read_status {
     /**
      * The read was successful and the cursor is valid
@@ -132,6 +134,32 @@ typedef struct store {
      */
     uint32_t (*write)(struct store *, void *, uint32_t);
 
+    /*
+     * Reserve space for a block of up to size bytes, so the caller can build the block in place
+     * rather than copying it in.  The reservation counts as a write in flight until it is
+     * committed, so a sync waits for it.  Stores that transform data on the way in, like the lz4
+     * store, leave this and commit NULL.
+     *
+     * params
+     *  size - the most the block can take up
+     *  *offset - set to the offset of the block in the store
+     *
+     * return
+     *  where to build the block
+     *  NULL if the store is full or has started syncing
+     */
+    void* (*reserve)(struct store *, uint32_t, uint32_t *);
+
+    /*
+     * Commit a block from reserve, shrinking it to size, which must not be more than was reserved.
+     * Only the last block in the store can give space back.  If another block has been reserved
+     * since, this one keeps its reserved size and reads return the unused bytes at its end.
+     *
+     * return
+     *  the offset in the store
+     */
+    uint32_t (*commit)(struct store *, uint32_t, uint32_t);
+
     /**
      * Create a read cursor for this store
      *
@@ -157,6 +185,38 @@ typedef struct store {
      */
     store_cursor_t* (*pop_cursor) (struct store *);
 
+    /**
+     * Like pop_cursor, but may leave the record for load_cursor to decompress.  Popping has to
+     * happen in order and is cheap, decompressing does not and is not, so whoever pops records in
+     * order can hand them to other threads to load.  The cursor's size is already set, its data is
+     * NULL until it is loaded.  NULL for stores whose pop_cursor has nothing to leave for later.
+     *
+     * return
+     *  NULL - The cursor could not be bound / created
+     */
+    store_cursor_t* (*pop_cursor_unloaded) (struct store *);
+
+    /**
+     * Loads a cursor from pop_cursor_unloaded, from any thread.  A loaded cursor is left alone.
+     *
+     * return
+     *  SUCCESS, DECOMPRESSION_FAULT if the record is corrupt, or ERROR if there is no memory to
+     *  decompress it into
+     */
+    enum store_read_status (*load_cursor) (struct store *, store_cursor_t *);
+
+    /**
+     * Pop the next record straight into buf, which has room for cap bytes, rather than into a
+     * cursor.  A record that does not fit is left for the next pop, by either call.
+     *
+     * return
+     *  0 - success, *len is set to the size of the record
+     *  1 - the record does not fit, *len is set to its size
+     *  -1 - there is nothing to pop
+     *  DECOMPRESSION_FAULT - the record is corrupt, *len is set to its size and it is popped anyway
+     */
+    int (*pop_into) (struct store *, void *, uint32_t, uint32_t *);
+
     /**
      * Return remaining capacity of the store
      * This number is saved in the store at the
@@ -205,14 +265,88 @@ typedef struct store {
      *  1 - failure
      */
     int (*destroy) (struct store *);
+
+    /**
+     * Counters from stats.h this store adds to, NULL unless whoever opened the store sets it.  An
+     * lz4 store does not pass it on to its underlying store.
+     */
+    struct sh_stats *stats;
 } store_t;
 
 // Flags for store creation
 #define DELETE_IF_EXISTS 0x0001
 
+// lz4 stores stage records into blocks and compress each block as one frame, with a table of where
+// each record starts.  Small records compress far better together and readers decompress once per
+// block.  Staged records only reach the underlying store when the block fills up, on sync, or on
+// a close that syncs.  Stores read frames of either kind no matter how they are opened.
+#define LZ4_BLOCKS 0x0002
+
+// lz4 stores compress each record against the records written before it in the same store, with a
+// restart point every few records so that a reader seeking into the middle only goes back that
+// far.  Consecutive records that look alike compress far better, and readers going through in order
+// decompress each record once.  Records are written one at a time, and dictionaries are not used.
+// Can not be combined with LZ4_BLOCKS.
+#define LZ4_STREAM 0x0004
+
+// mmap stores that only ever have one thread writing to them, which is also the only one to sync
+// them, move their write cursor with plain stores instead of compare and swap loops, and do not
+// count writers for the sync to wait on
+#define SINGLE_WRITER 0x0008
+
+// mmap stores that only ever have one thread popping from them move their read cursor with plain
+// stores instead of compare and swap loops
+#define SINGLE_READER 0x0010
+
 store_t* create_mmap_store(uint32_t size, const char* base_dir,
                            const char* name, int flags);
 store_t* open_mmap_store(const char* base_dir, const char* name, int flags);
 store_t* open_lz4_store(store_t *underlying_store, int flags);
 
+/**
+ * Opens an lz4 store over a new, empty store.  The first frame records the size of the largest
+ * record in the store, so that readers of a reopened store can size their decompression buffers
+ * once rather than growing them as they go.
+ */
+store_t* create_lz4_store(store_t *underlying_store, int flags);
+
+/**
+ * Like create_lz4_store, but compresses records with lz4's high compression mode at the given level
+ * (1 to 16, or 0 for the default of 9).  Writes get a lot slower for somewhat smaller records,
+ * reads are just as fast, and the store reopens with open_lz4_store like any other.
+ */
+store_t* create_lz4hc_store(store_t *underlying_store, int level, int flags);
+
+/**
+ * Like create_lz4_store, but compresses every record against the given dictionary.  The
+ * dictionary is written as a header frame of the underlying store, so reopening it with
+ * open_lz4_store picks it back up.  If the underlying store is too small to hold it, the
+ * store goes without.
+ */
+store_t* open_lz4_store_with_dictionary(store_t *underlying_store, const void *dictionary,
+                                        uint32_t size, int flags);
+
+/**
+ * Rewrites every record of source, a synced lz4 store, into dest, a new empty store underneath
+ * another lz4 store, using lz4's high compression mode at the given level (1 to 16, 9 is a good
+ * default).  Records come out in the same order and read back through open_lz4_store.  Records
+ * that were compressed against a dictionary are recompressed without it.
+ *
+ * return
+ *  the bytes the records take up in dest, or 0 if they did not all fit.  source_bytes is set to
+ *  the bytes they took up in source.
+ */
+uint32_t compact_lz4_store(store_t *source, store_t *dest, int level, uint32_t *source_bytes);
+
+/**
+ * Builds a dictionary of at most capacity bytes out of the content that shows up across the most
+ * samples.  lz4 can not use more than 64KB of dictionary, small records usually do well with a few
+ * KB.
+ *
+ * return
+ *  the size of the dictionary, which is 0 if the samples have nothing in common
+ */
+uint32_t train_lz4_dictionary(const void **samples, const uint32_t *sizes, uint32_t count,
+                              void *dictionary, uint32_t capacity);
+
 #endif
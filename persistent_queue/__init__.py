@@ -1,3 +1,3 @@
-__all__ = [ "PersistentQueue" ]
+__all__ = [ "PersistentQueue", "CorruptItemError" ]
 
-from .persistent_queue import PersistentQueue
+from .persistent_queue import PersistentQueue, CorruptItemError
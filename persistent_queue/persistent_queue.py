@@ -25,6 +25,11 @@ ffi.dlopen(None)
 ffi.dlopen(os.path.join(script_directory, "./libck.so.0.4.3"))
 sm_lib = ffi.dlopen(os.path.join(script_directory,"./libsoftheap.so"))
 
+class CorruptItemError(IOError):
+    """An item that was corrupt on disk was popped.  It is gone from the queue, so popping again
+    moves on to the next one."""
+    pass
+
 class PersistentQueue(object):
     """Persistent String Queue Implemented in C"""
 
@@ -33,6 +38,11 @@ class PersistentQueue(object):
         # Whether this queue actually has an active storage manager
         self.active = False
 
+        # Buffer items are popped into, grown whenever an item does not fit
+        self.buffer_size = 4096
+        self.buffer = ffi.new("char[]", self.buffer_size)
+        self.length = ffi.new("uint32_t*")
+
     def open(self, queue_dir):
         """Open the data files of this persistent queue"""
         assert self.active is False
@@ -72,35 +82,72 @@ class PersistentQueue(object):
         ret = self.sm.write(self.sm, c_item, len(c_item))
         return ret
 
+    def _pop_into(self):
+        """Pop an item into the buffer, growing it as needed.  Returns -1 if there is nothing to pop,
+        and raises CorruptItemError for an item that is corrupt on disk"""
+        ret = self.sm.pop_into(self.sm, self.buffer, self.buffer_size, self.length)
+        while ret == 1:
+            self.buffer_size = self.length[0]
+            self.buffer = ffi.new("char[]", self.buffer_size)
+            ret = self.sm.pop_into(self.sm, self.buffer, self.buffer_size, self.length)
+
+        # DECOMPRESSION_FAULT and the other store read errors, which are never pickles
+        if ret > 1:
+            raise CorruptItemError("Popped an item that is corrupt on disk (error %d)" % ret)
+        return ret
+
     def pop(self):
-        """Pop an item off of the persistent queue.  This item must be explicitly freed"""
+        """Pop an item off of the persistent queue.  Raises CorruptItemError if the item is corrupt
+        on disk."""
         assert self.active is True
-        cursor = self.sm.pop_cursor(self.sm)
 
         # We may have data in the queue that has not yet been synced.  Sync the data that we have in
         # the queue and try again.  If we still don't get anything, then the queue was empty at the
         # time we called sync.
-        if cursor == ffi.NULL:
+        if self._pop_into() < 0:
             self.sm.sync(self.sm, 1)
-            cursor = self.sm.pop_cursor(self.sm)
-            if cursor == ffi.NULL:
+            if self._pop_into() < 0:
                 return None
 
-        # Convert the value from a C void* to a python string
-        cast = ffi.cast("char*", cursor.data)
-        raw_value = ffi.string(cast, cursor.size)
-
-        # Convert the value back into its original object
+        # Convert the value back into its original object, straight from the buffer the storage
+        # manager copied it into
         # TODO: This could be slow, but I think the data has to be serialized for it to be storable
         # in the queue.
-        value = pickle.loads(raw_value)
-        del cast
-        del raw_value
+        return pickle.loads(ffi.buffer(self.buffer, self.length[0])[:])
 
-        # Free the underlying cursor, since we've already extracted the data we need
-        self.sm.free_cursor(self.sm, cursor)
+    def stats(self):
+        """Counters of this queue as a dict, see storage_manager_stats_t for what each one means"""
+        assert self.active is True
+        c_stats = ffi.new("storage_manager_stats_t*")
+        self.sm.get_stats(self.sm, c_stats)
+        return dict((field, getattr(c_stats, field))
+                    for field, _ in ffi.typeof("storage_manager_stats_t").fields)
+
+    def latency(self):
+        """Latency percentiles of each operation as a dict of dicts, or None if the queue was not
+        opened with SM_LATENCY"""
+        assert self.active is True
+        c_latency = ffi.new("storage_manager_latency_t*")
+        operations = { "write": sm_lib.SM_OP_WRITE, "pop": sm_lib.SM_OP_POP,
+                       "sync": sm_lib.SM_OP_SYNC, "rotate": sm_lib.SM_OP_ROTATE,
+                       "free": sm_lib.SM_OP_FREE }
+        latency = {}
+        for name, operation in operations.items():
+            if self.sm.get_latency(self.sm, operation, c_latency) < 0:
+                return None
+            latency[name] = dict((field, getattr(c_latency, field))
+                                 for field, _ in ffi.typeof("storage_manager_latency_t").fields)
+        return latency
 
-        return value
+    def depth(self):
+        """Records written to this queue and not yet popped"""
+        assert self.active is True
+        return self.sm.depth(self.sm)
+
+    def backlog_bytes(self):
+        """Size of the records written to this queue and not yet popped"""
+        assert self.active is True
+        return self.sm.backlog_bytes(self.sm)
 
     # Queue destruction methods
     def __del__(self):
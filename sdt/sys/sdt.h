@@ -0,0 +1,79 @@
+/*
+ * <sys/sdt.h> - static user space probe points, in the format of the header of the same name that
+ * systemtap ships (systemtap-sdt-dev, systemtap-sdt-devel), which is dedicated to the public domain.
+ * This is the part of it softheap uses: STAP_PROBE and DTRACE_PROBE with up to three arguments, for
+ * GCC and Clang on ELF targets.  Each probe is a nop, and a version 3 note in .note.stapsdt that
+ * tells perf, bpftrace, bcc and systemtap where it is and where its arguments live.  There are no
+ * semaphores, so arguments are always evaluated, the way they are in the original when a probe has
+ * no semaphore.
+ */
+
+#ifndef _SYS_SDT_H
+#define _SYS_SDT_H 1
+
+#if __SIZEOF_POINTER__ == 8
+#define _SDT_ASM_ADDR ".8byte "
+#else
+#define _SDT_ASM_ADDR ".4byte "
+#endif
+
+/*
+ * Arguments are described to the tracer as "size@operand", with a negative size for signed ones.
+ * Pointers count as unsigned integers of their size.  %n prints the negated size operand.
+ */
+#define _SDT_ARGTYPE(x) __typeof__(__builtin_choose_expr(__builtin_classify_type(x) == 5, 0UL, (x)))
+#define _SDT_ARGSIGNED(x) ((_SDT_ARGTYPE(x)) -1 < (_SDT_ARGTYPE(x)) 1)
+#define _SDT_ARGSIZE(x) ((int) sizeof(_SDT_ARGTYPE(x)))
+#define _SDT_ARG(n, x) \
+    [_SDT_S##n] "n" ((_SDT_ARGSIGNED(x) ? 1 : -1) * _SDT_ARGSIZE(x)), [_SDT_A##n] "nor" (x)
+#define _SDT_ARGFMT(n) "%n[_SDT_S" #n "]@%[_SDT_A" #n "]"
+
+/*
+ * The probe site, its note, and the .stapsdt.base symbol tracers use to tell how far the object
+ * was moved from where it was linked, one per object through the comdat group
+ */
+#define _SDT_ASM_BODY(provider, name, args)                                                       \
+    "990: nop\n"                                                                                  \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n"                                                 \
+    ".balign 4\n"                                                                                 \
+    ".4byte 992f-991f, 994f-993f, 3\n"                                                            \
+    "991: .asciz \"stapsdt\"\n"                                                                   \
+    "992: .balign 4\n"                                                                            \
+    "993: " _SDT_ASM_ADDR "990b\n"                                                                \
+    _SDT_ASM_ADDR "_.stapsdt.base\n"                                                              \
+    _SDT_ASM_ADDR "0\n"                                                                           \
+    ".asciz \"" #provider "\"\n"                                                                  \
+    ".asciz \"" #name "\"\n"                                                                      \
+    ".asciz \"" args "\"\n"                                                                       \
+    "994: .balign 4\n"                                                                            \
+    ".popsection\n"                                                                               \
+    ".ifndef _.stapsdt.base\n"                                                                    \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"                       \
+    ".weak _.stapsdt.base\n"                                                                      \
+    ".hidden _.stapsdt.base\n"                                                                    \
+    "_.stapsdt.base: .space 1\n"                                                                  \
+    ".size _.stapsdt.base, 1\n"                                                                   \
+    ".popsection\n"                                                                               \
+    ".endif\n"
+
+#define STAP_PROBE(provider, name)                                                                \
+    __asm__ __volatile__ (_SDT_ASM_BODY(provider, name, ""))
+
+#define STAP_PROBE1(provider, name, a)                                                            \
+    __asm__ __volatile__ (_SDT_ASM_BODY(provider, name, _SDT_ARGFMT(1)) :: _SDT_ARG(1, a))
+
+#define STAP_PROBE2(provider, name, a, b)                                                         \
+    __asm__ __volatile__ (_SDT_ASM_BODY(provider, name, _SDT_ARGFMT(1) " " _SDT_ARGFMT(2))       \
+                          :: _SDT_ARG(1, a), _SDT_ARG(2, b))
+
+#define STAP_PROBE3(provider, name, a, b, c)                                                      \
+    __asm__ __volatile__ (_SDT_ASM_BODY(provider, name,                                           \
+                                        _SDT_ARGFMT(1) " " _SDT_ARGFMT(2) " " _SDT_ARGFMT(3))    \
+                          :: _SDT_ARG(1, a), _SDT_ARG(2, b), _SDT_ARG(3, c))
+
+#define DTRACE_PROBE(provider, name) STAP_PROBE(provider, name)
+#define DTRACE_PROBE1(provider, name, a) STAP_PROBE1(provider, name, a)
+#define DTRACE_PROBE2(provider, name, a, b) STAP_PROBE2(provider, name, a, b)
+#define DTRACE_PROBE3(provider, name, a, b, c) STAP_PROBE3(provider, name, a, b, c)
+
+#endif
@@ -0,0 +1,588 @@
+#include "chunked_list.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ck_pr.h>
+#include <ck_stack.h>
+
+// ck_epoch's structures are padded for cache lines, which -Wpadded does not like
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpadded"
+#include <ck_epoch.h>
+#pragma GCC diagnostic pop
+
+// Entry next word
+#define CL_DELETE_BIT ((uint64_t) 1)
+#define CL_FREEZE_BIT ((uint64_t) 2)
+#define CL_INDEX(word) ((uint32_t) ((word) >> 2))
+#define CL_NEXT(index) (((uint64_t) (index)) << 2)
+
+// Entry key_data word
+#define CL_KEY(key_data) ((uint32_t) ((key_data) >> 32))
+#define CL_DATA(key_data) ((uint32_t) (key_data))
+
+// Chunk next word
+#define CL_CHUNK_FROZEN ((uint64_t) 1)
+#define CL_CHUNK(word) ((struct list_chunk*) (uintptr_t) ((word) & ~CL_CHUNK_FROZEN))
+#define CL_CHUNK_WORD(chunk) ((uint64_t) (uintptr_t) (chunk))
+
+/*
+ * Chunk freeze word.  A chunk starts out NO_FREEZE, and is frozen exactly once, either by an
+ * operation on it (FROZEN) or by its predecessor claiming it for a merge (SLAVE).  Whoever
+ * helps a FROZEN chunk decides what to do with it with a single CAS, to COPY (or split) it on
+ * its own or to merge it as the MASTER of its successor.
+ */
+enum cl_freeze_state {
+    CL_NO_FREEZE = 0,
+    CL_FROZEN = 1,
+    CL_COPY = 2,
+    CL_MASTER = 3,
+    CL_SLAVE = 4
+};
+
+#define CL_STATE(word) ((word) & 7)
+#define CL_BUDDY(word) ((struct list_chunk*) (uintptr_t) ((word) & ~((uint64_t) 7)))
+#define CL_FREEZE_WORD(buddy, state) (((uint64_t) (uintptr_t) (buddy)) | (state))
+
+enum cl_search_result {
+    CL_FOUND = 0,
+    CL_NOT_FOUND = 1,
+    CL_FROZEN_CHUNK = 2
+};
+
+/*
+ * Per thread epoch record, kept in thread local storage so that the destructor can find the
+ * epoch it belongs to
+ */
+struct cl_record {
+    ck_epoch_record_t record;
+    chunked_list_t *list;
+    char __padding[CK_MD_CACHELINE - sizeof(chunked_list_t*)];
+};
+
+struct cl_retired {
+    ck_epoch_entry_t entry;
+    struct list_chunk *chunk;
+};
+
+CK_STACK_CONTAINER(struct ck_epoch_record, record_next, __cl_record_container)
+
+//
+// Epoch management
+//
+
+static void __cl_release_record(void *data) {
+    struct cl_record *record = (struct cl_record*) data;
+
+    // Run everything this thread retired before handing the record on
+    ck_epoch_barrier(record->list->epoch, &record->record);
+    ck_epoch_unregister(record->list->epoch, &record->record);
+}
+
+static ck_epoch_record_t* __cl_record(chunked_list_t *list) {
+    struct cl_record *record = (struct cl_record*) pthread_getspecific(list->record_key);
+    if (record != NULL) return &record->record;
+
+    record = (struct cl_record*) ck_epoch_recycle(list->epoch);
+    if (record == NULL) {
+        ensure(posix_memalign((void**) &record, CK_MD_CACHELINE, sizeof(struct cl_record)) == 0,
+               "Failed to allocate epoch record");
+        memset(record, 0, sizeof(struct cl_record));
+        record->list = list;
+        ck_epoch_register(list->epoch, &record->record);
+    }
+
+    ensure(pthread_setspecific(list->record_key, record) == 0, "Failed to set epoch record");
+    return &record->record;
+}
+
+static void __cl_free_retired(ck_epoch_entry_t *entry) {
+    struct cl_retired *retired = (struct cl_retired*) entry;
+    free(retired->chunk);
+    free(retired);
+}
+
+static void __cl_retire(chunked_list_t *list, ck_epoch_record_t *record,
+                        struct list_chunk *chunk) {
+    struct cl_retired *retired = (struct cl_retired*) malloc(sizeof(struct cl_retired));
+    ensure(retired != NULL, "Failed to allocate retired chunk");
+    retired->chunk = chunk;
+    ck_epoch_call(list->epoch, record, &retired->entry, __cl_free_retired);
+}
+
+//
+// Chunks
+//
+
+/*
+ * Allocates a chunk holding the given (sorted) entries
+ */
+static struct list_chunk* __cl_chunk_alloc(uint32_t min_key, const uint64_t *key_data,
+                                           uint32_t count, uint64_t next) {
+    struct list_chunk *chunk = NULL;
+    ensure(posix_memalign((void**) &chunk, CK_MD_CACHELINE, sizeof(struct list_chunk)) == 0,
+           "Failed to allocate chunk");
+    memset(chunk, 0, sizeof(struct list_chunk));
+
+    for (uint32_t i = 1; i <= count; i++) {
+        chunk->values[i].key_data = key_data[i - 1];
+        chunk->values[i].next = CL_NEXT(i < count ? i + 1 : 0);
+    }
+    chunk->values[0].next = CL_NEXT(count > 0 ? 1 : 0);
+
+    chunk->counter = count + 1;
+    chunk->min_key = min_key;
+    chunk->live = count;
+    chunk->next = next;
+    return chunk;
+}
+
+/*
+ * Finds the chunk whose key range holds key.  The chunk found may be frozen.
+ */
+static struct list_chunk* __cl_find_chunk(chunked_list_t *list, uint32_t key) {
+    struct list_chunk *chunk = CL_CHUNK(ck_pr_load_64(&list->head));
+    for (;;) {
+        struct list_chunk *next = CL_CHUNK(ck_pr_load_64(&chunk->next));
+        if (next == NULL || ck_pr_load_32(&next->min_key) > key) return chunk;
+        chunk = next;
+    }
+}
+
+/*
+ * Harris style search of the list inside a chunk.  Unlinks deleted entries on the way, and
+ * leaves prev at the last entry with a key less than key and cur at the entry after it (0 at the
+ * end of the list), along with cur's next word.
+ */
+static int __cl_search(struct list_chunk *chunk, uint32_t key,
+                       uint32_t *prev_out, uint32_t *cur_out, uint64_t *cur_next_out) {
+retry:;
+    uint32_t prev = 0;
+    uint64_t prev_next = ck_pr_load_64(&chunk->values[0].next);
+    if (prev_next & CL_FREEZE_BIT) return CL_FROZEN_CHUNK;
+
+    uint32_t cur = CL_INDEX(prev_next);
+    while (cur != 0) {
+        uint64_t cur_next = ck_pr_load_64(&chunk->values[cur].next);
+        if (cur_next & CL_FREEZE_BIT) return CL_FROZEN_CHUNK;
+
+        if (cur_next & CL_DELETE_BIT) {
+            if (!ck_pr_cas_64(&chunk->values[prev].next, CL_NEXT(cur), CL_NEXT(CL_INDEX(cur_next)))) {
+                if (ck_pr_load_64(&chunk->values[prev].next) & CL_FREEZE_BIT) return CL_FROZEN_CHUNK;
+                goto retry;
+            }
+            cur = CL_INDEX(cur_next);
+            continue;
+        }
+
+        uint32_t cur_key = CL_KEY(ck_pr_load_64(&chunk->values[cur].key_data));
+        if (cur_key >= key) {
+            *prev_out = prev;
+            *cur_out = cur;
+            *cur_next_out = cur_next;
+            return cur_key == key ? CL_FOUND : CL_NOT_FOUND;
+        }
+
+        prev = cur;
+        cur = CL_INDEX(cur_next);
+    }
+
+    *prev_out = prev;
+    *cur_out = 0;
+    *cur_next_out = 0;
+    return CL_NOT_FOUND;
+}
+
+/*
+ * Sets the freeze bit on every entry and on the chunk's next pointer, after which nothing in the
+ * chunk can change
+ */
+static void __cl_freeze_entries(struct list_chunk *chunk) {
+    for (uint32_t i = 0; i < CL_CHUNK_SIZE; i++) {
+        if (!(ck_pr_load_64(&chunk->values[i].next) & CL_FREEZE_BIT)) {
+            ck_pr_or_64(&chunk->values[i].next, CL_FREEZE_BIT);
+        }
+    }
+    if (!(ck_pr_load_64(&chunk->next) & CL_CHUNK_FROZEN)) {
+        ck_pr_or_64(&chunk->next, CL_CHUNK_FROZEN);
+    }
+}
+
+/*
+ * Copies the live entries of a frozen chunk out in key order
+ */
+static uint32_t __cl_collect(struct list_chunk *chunk, uint64_t *key_data) {
+    uint32_t count = 0;
+    uint32_t cur = CL_INDEX(ck_pr_load_64(&chunk->values[0].next));
+    while (cur != 0) {
+        uint64_t next = ck_pr_load_64(&chunk->values[cur].next);
+        if (!(next & CL_DELETE_BIT)) key_data[count++] = ck_pr_load_64(&chunk->values[cur].key_data);
+        cur = CL_INDEX(next);
+    }
+    return count;
+}
+
+static uint32_t __cl_count_live(struct list_chunk *chunk) {
+    uint32_t count = 0;
+    uint32_t cur = CL_INDEX(ck_pr_load_64(&chunk->values[0].next));
+    while (cur != 0) {
+        uint64_t next = ck_pr_load_64(&chunk->values[cur].next);
+        if (!(next & CL_DELETE_BIT)) count++;
+        cur = CL_INDEX(next);
+    }
+    return count;
+}
+
+/*
+ * Decides how a FROZEN chunk is to be replaced.  Every helper sees the same frozen entries and
+ * so wants the same thing, the only race is over whether the successor can be claimed for a
+ * merge, and the successor's freeze word settles that.
+ */
+static uint64_t __cl_decide(struct list_chunk *chunk) {
+    uint64_t word = ck_pr_load_64(&chunk->freeze);
+    if (CL_STATE(word) != CL_FROZEN) return word;
+
+    uint64_t desired = CL_FREEZE_WORD(NULL, CL_COPY);
+    struct list_chunk *next = CL_CHUNK(ck_pr_load_64(&chunk->next));
+    if (next != NULL && __cl_count_live(chunk) < CL_MERGE_THRESHOLD) {
+        uint64_t slave = CL_FREEZE_WORD(chunk, CL_SLAVE);
+        ck_pr_cas_64(&next->freeze, CL_NO_FREEZE, slave);
+        if (ck_pr_load_64(&next->freeze) == slave) desired = CL_FREEZE_WORD(next, CL_MASTER);
+    }
+
+    ck_pr_cas_64(&chunk->freeze, word, desired);
+    return ck_pr_load_64(&chunk->freeze);
+}
+
+/*
+ * Builds the replacement for a decided chunk, returning its first chunk and the chunk that
+ * should follow the replacement
+ */
+static struct list_chunk* __cl_build(struct list_chunk *chunk, uint64_t word, uint64_t *next) {
+    uint64_t key_data[2 * CL_CHUNK_SIZE];
+
+    uint32_t count = __cl_collect(chunk, key_data);
+    *next = ck_pr_load_64(&chunk->next) & ~CL_CHUNK_FROZEN;
+
+    if (CL_STATE(word) == CL_MASTER) {
+        struct list_chunk *buddy = CL_BUDDY(word);
+        __cl_freeze_entries(buddy);
+        count += __cl_collect(buddy, key_data + count);
+        *next = ck_pr_load_64(&buddy->next) & ~CL_CHUNK_FROZEN;
+    }
+
+    // Leave plenty of room in whatever we build, or we will be back here almost immediately
+    if (count <= CL_CHUNK_SIZE / 2) {
+        return __cl_chunk_alloc(chunk->min_key, key_data, count, *next);
+    }
+
+    uint32_t half = count / 2;
+    struct list_chunk *second = __cl_chunk_alloc(CL_KEY(key_data[half]), key_data + half,
+                                                 count - half, *next);
+    return __cl_chunk_alloc(chunk->min_key, key_data, half, CL_CHUNK_WORD(second));
+}
+
+static void __cl_help(chunked_list_t *list, ck_epoch_record_t *record, struct list_chunk *chunk);
+
+/*
+ * Swaps the replacement in for chunk (and its buddy) by pointing the predecessor at it
+ */
+static void __cl_install(chunked_list_t *list, ck_epoch_record_t *record,
+                         struct list_chunk *chunk, uint64_t word,
+                         struct list_chunk *replacement) {
+    for (;;) {
+        struct list_chunk *prev_chunk = NULL;
+        uint64_t *prev = &list->head;
+        uint64_t cur_word = ck_pr_load_64(prev);
+
+        while (CL_CHUNK(cur_word) != chunk) {
+            struct list_chunk *cur = CL_CHUNK(cur_word);
+
+            // Walked past where the chunk would be, so somebody already replaced it
+            if (cur == NULL || ck_pr_load_32(&cur->min_key) > chunk->min_key) return;
+
+            prev_chunk = cur;
+            prev = &cur->next;
+            cur_word = ck_pr_load_64(prev);
+        }
+
+        // The predecessor is being replaced itself, its replacement will point to us
+        if (cur_word & CL_CHUNK_FROZEN) {
+            __cl_help(list, record, prev_chunk);
+            continue;
+        }
+
+        if (ck_pr_cas_64(prev, CL_CHUNK_WORD(chunk), CL_CHUNK_WORD(replacement))) {
+            __cl_retire(list, record, chunk);
+            if (CL_STATE(word) == CL_MASTER) __cl_retire(list, record, CL_BUDDY(word));
+            return;
+        }
+    }
+}
+
+/*
+ * Takes a chunk that has been frozen all the way through to being replaced in the list
+ */
+static void __cl_help(chunked_list_t *list, ck_epoch_record_t *record, struct list_chunk *chunk) {
+    __cl_freeze_entries(chunk);
+    uint64_t word = __cl_decide(chunk);
+
+    if (CL_STATE(word) == CL_SLAVE) {
+        struct list_chunk *master = CL_BUDDY(word);
+        __cl_freeze_entries(master);
+        if (__cl_decide(master) == CL_FREEZE_WORD(chunk, CL_MASTER)) {
+            __cl_help(list, record, master);
+            return;
+        }
+
+        // The master was claimed for something else before it got to us, we are on our own
+        ck_pr_cas_64(&chunk->freeze, word, CL_FREEZE_WORD(NULL, CL_COPY));
+        word = ck_pr_load_64(&chunk->freeze);
+    }
+
+    ensure(CL_STATE(word) == CL_COPY || CL_STATE(word) == CL_MASTER,
+           "Helping a chunk that is not frozen");
+
+    struct list_chunk *replacement = CL_CHUNK(ck_pr_load_64(&chunk->new));
+    if (replacement == NULL) {
+        uint64_t next = 0;
+        struct list_chunk *candidate = __cl_build(chunk, word, &next);
+        if (ck_pr_cas_64(&chunk->new, 0, CL_CHUNK_WORD(candidate))) {
+            replacement = candidate;
+        } else {
+            // Nobody else has seen our candidate, so it can go straight back
+            while (candidate != NULL && CL_CHUNK_WORD(candidate) != next) {
+                struct list_chunk *second = CL_CHUNK(candidate->next);
+                free(candidate);
+                candidate = second;
+            }
+            replacement = CL_CHUNK(ck_pr_load_64(&chunk->new));
+        }
+    }
+
+    __cl_install(list, record, chunk, word, replacement);
+}
+
+static void __cl_freeze(chunked_list_t *list, ck_epoch_record_t *record,
+                        struct list_chunk *chunk) {
+    ck_pr_cas_64(&chunk->freeze, CL_NO_FREEZE, CL_FREEZE_WORD(NULL, CL_FROZEN));
+    __cl_help(list, record, chunk);
+}
+
+//
+// Operations, all called inside an epoch section
+//
+
+static int __cl_insert(chunked_list_t *list, ck_epoch_record_t *record,
+                       uint32_t key, uint32_t value) {
+    uint64_t key_data = (((uint64_t) key) << 32) | value;
+
+    for (;;) {
+        struct list_chunk *chunk = __cl_find_chunk(list, key);
+
+        uint32_t prev, cur;
+        uint64_t cur_next;
+        int found = __cl_search(chunk, key, &prev, &cur, &cur_next);
+        if (found == CL_FOUND) return -1;
+        if (found == CL_FROZEN_CHUNK) {
+            __cl_help(list, record, chunk);
+            continue;
+        }
+
+        uint64_t index = ck_pr_faa_64(&chunk->counter, 1);
+        if (index >= CL_CHUNK_SIZE) {
+            __cl_freeze(list, record, chunk);
+            continue;
+        }
+
+        struct list_entry *entry = &chunk->values[index];
+        ck_pr_store_64(&entry->key_data, key_data);
+
+        for (;;) {
+            // Nobody else writes our entry until the chunk is frozen
+            uint64_t entry_next = ck_pr_load_64(&entry->next);
+            if ((entry_next & CL_FREEZE_BIT) ||
+                !ck_pr_cas_64(&entry->next, entry_next, CL_NEXT(cur))) {
+                break;
+            }
+
+            ck_pr_fence_store();
+            if (ck_pr_cas_64(&chunk->values[prev].next, CL_NEXT(cur), CL_NEXT(index))) {
+                ck_pr_inc_32(&chunk->live);
+                return 0;
+            }
+
+            // Abandon the entry if we lost to the same key, it is dropped when the chunk is copied
+            found = __cl_search(chunk, key, &prev, &cur, &cur_next);
+            if (found == CL_FOUND) return -1;
+            if (found == CL_FROZEN_CHUNK) break;
+        }
+
+        __cl_help(list, record, chunk);
+    }
+}
+
+static int __cl_delete(chunked_list_t *list, ck_epoch_record_t *record, uint32_t key) {
+    for (;;) {
+        struct list_chunk *chunk = __cl_find_chunk(list, key);
+
+        uint32_t prev, cur;
+        uint64_t cur_next;
+        int found = __cl_search(chunk, key, &prev, &cur, &cur_next);
+        if (found == CL_NOT_FOUND) return -1;
+        if (found == CL_FROZEN_CHUNK) {
+            __cl_help(list, record, chunk);
+            continue;
+        }
+
+        // Marking the entry is the delete, unlinking it is just tidying up
+        if (ck_pr_cas_64(&chunk->values[cur].next, cur_next, cur_next | CL_DELETE_BIT)) {
+            __cl_search(chunk, key, &prev, &cur, &cur_next);
+
+            uint32_t live = ck_pr_faa_32(&chunk->live, (uint32_t) -1);
+            if (live == CL_MERGE_THRESHOLD && CL_CHUNK(ck_pr_load_64(&chunk->next)) != NULL) {
+                __cl_freeze(list, record, chunk);
+            }
+            return 0;
+        }
+
+        if (ck_pr_load_64(&chunk->values[cur].next) & CL_FREEZE_BIT) {
+            __cl_help(list, record, chunk);
+        }
+    }
+}
+
+static int __cl_find(chunked_list_t *list, ck_epoch_record_t *record, uint32_t key,
+                     uint32_t *value) {
+    for (;;) {
+        struct list_chunk *chunk = __cl_find_chunk(list, key);
+
+        uint32_t prev, cur;
+        uint64_t cur_next;
+        int found = __cl_search(chunk, key, &prev, &cur, &cur_next);
+        if (found == CL_FROZEN_CHUNK) {
+            __cl_help(list, record, chunk);
+            continue;
+        }
+
+        if (found == CL_NOT_FOUND) return -1;
+        if (value != NULL) *value = CL_DATA(ck_pr_load_64(&chunk->values[cur].key_data));
+        return 0;
+    }
+}
+
+/*
+ * Enters an epoch section for the calling thread, returning its record
+ */
+static inline ck_epoch_record_t* __cl_begin(chunked_list_t *list) {
+    ck_epoch_record_t *record = __cl_record(list);
+    ck_epoch_begin(list->epoch, record);
+    return record;
+}
+
+static inline void __cl_end(chunked_list_t *list, ck_epoch_record_t *record) {
+    ck_epoch_end(list->epoch, record);
+
+    // Free whatever chunks this thread has retired, once nobody can be looking at them
+    if (record->n_pending > 0) ck_epoch_poll(list->epoch, record);
+}
+
+int _chunked_list_insert(chunked_list_t *list, uint32_t key, uint32_t value) {
+    ck_epoch_record_t *record = __cl_begin(list);
+    int ret = __cl_insert(list, record, key, value);
+    __cl_end(list, record);
+    return ret;
+}
+
+int _chunked_list_delete(chunked_list_t *list, uint32_t key) {
+    ck_epoch_record_t *record = __cl_begin(list);
+    int ret = __cl_delete(list, record, key);
+    __cl_end(list, record);
+    return ret;
+}
+
+int _chunked_list_find(chunked_list_t *list, uint32_t key, uint32_t *value) {
+    ck_epoch_record_t *record = __cl_begin(list);
+    int ret = __cl_find(list, record, key, value);
+    __cl_end(list, record);
+    return ret;
+}
+
+int _chunked_list_iterate(chunked_list_t *list, void (*func)(uint32_t, uint32_t, void *),
+                          void *ctx) {
+    ck_epoch_record_t *record = __cl_begin(list);
+
+    // Frozen chunks can still be walked, but may overlap their replacements, so only ever move
+    // forwards through the keys
+    bool emitted = false;
+    uint32_t last = 0;
+    for (struct list_chunk *chunk = CL_CHUNK(ck_pr_load_64(&list->head));
+         chunk != NULL;
+         chunk = CL_CHUNK(ck_pr_load_64(&chunk->next))) {
+
+        uint32_t cur = CL_INDEX(ck_pr_load_64(&chunk->values[0].next));
+        while (cur != 0) {
+            uint64_t next = ck_pr_load_64(&chunk->values[cur].next);
+            if (!(next & CL_DELETE_BIT)) {
+                uint64_t key_data = ck_pr_load_64(&chunk->values[cur].key_data);
+                if (!emitted || CL_KEY(key_data) > last) {
+                    func(CL_KEY(key_data), CL_DATA(key_data), ctx);
+                    last = CL_KEY(key_data);
+                    emitted = true;
+                }
+            }
+            cur = CL_INDEX(next);
+        }
+    }
+
+    __cl_end(list, record);
+    return 0;
+}
+
+int _chunked_list_destroy(chunked_list_t *list) {
+    // Threads still holding records must not try to hand them back after this
+    pthread_key_delete(list->record_key);
+
+    // Nobody else is in the list, so everything retired can go now
+    ck_stack_entry_t *cursor = NULL;
+    CK_STACK_FOREACH(&list->epoch->records, cursor) {
+        ck_epoch_reclaim(__cl_record_container(cursor));
+    }
+
+    struct list_chunk *chunk = CL_CHUNK(list->head);
+    while (chunk != NULL) {
+        struct list_chunk *next = CL_CHUNK(chunk->next);
+        free(chunk);
+        chunk = next;
+    }
+
+    ck_stack_entry_t *tmp = NULL;
+    CK_STACK_FOREACH_SAFE(&list->epoch->records, cursor, tmp) {
+        free(__cl_record_container(cursor));
+    }
+
+    free(list->epoch);
+    free(list);
+    return 0;
+}
+
+chunked_list_t* create_chunked_list() {
+    chunked_list_t *list = (chunked_list_t*) calloc(1, sizeof(chunked_list_t));
+    ensure(list != NULL, "Failed to allocate chunked list");
+
+    list->insert = _chunked_list_insert;
+    list->delete = _chunked_list_delete;
+    list->find = _chunked_list_find;
+    list->iterate = _chunked_list_iterate;
+    list->destroy = _chunked_list_destroy;
+
+    list->epoch = (ck_epoch_t*) calloc(1, sizeof(ck_epoch_t));
+    ensure(list->epoch != NULL, "Failed to allocate epoch");
+    ck_epoch_init(list->epoch);
+    ensure(pthread_key_create(&list->record_key, __cl_release_record) == 0,
+           "Failed to create epoch record key");
+
+    // The first chunk holds everything from key 0 up, and always will
+    list->head = CL_CHUNK_WORD(__cl_chunk_alloc(0, NULL, 0, 0));
+    return list;
+}
@@ -1,4 +1,5 @@
 #include "persistent_atomic_value.h"
+#include "probes.h"
 
 int _compare_and_swap(persistent_atomic_value_t *pav, uint32_t old_value, uint32_t new_value) {
     // First lock this counter
@@ -55,6 +56,8 @@ end:
 
     if (fail != 0) {
         ck_pr_store_32(&pav->_current_value, old_value);
+    } else {
+        SH_PROBE3(pav__update, pav->_filename, old_value, new_value);
     }
 
     ck_rwlock_write_unlock(pav->_lock);
@@ -1,6 +1,12 @@
 #include "store.h"
 #include <persistent_atomic_value.h>
 #include <segment_list.h>
+#include "stats.h"
+#include "probes.h"
+#include <string.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
 
 static inline segment_t *__segment_number_to_segment(segment_list_t *segment_list, uint32_t segment_number) {
     // TODO: Think about the ABA problem.  I think it's ok for now because we never decrease the
@@ -28,22 +34,12 @@ static inline bool __is_segment_number_in_segment_list_inlock(segment_list_t *se
 }
 
 /**
- * Allocate a segment.  We are assuming the list is either locked or being accessed from a single
- * threaded context
+ * Create the store of a segment, or reopen it from its file.  We are assuming the list is either
+ * locked or being accessed from a single threaded context
  */
-int _allocate_segment_inlock(segment_list_t *segment_list, uint32_t segment_number, bool reopen_store) {
-
-    segment_t *segment = __segment_number_to_segment(segment_list, segment_number);
-
-    ensure(segment->state == FREE || segment->state == CLOSED,
-           "Attempted to initialize segment that is not either free or closed");
-    ensure(segment->segment_number != segment_number || segment_number == 0,
-           "Attempted to initialize already initizlized segment");
-    ensure(segment->store == NULL,
-           "Attempted to segment with store already initialized");
+store_t* _open_store_inlock(segment_list_t *segment_list, uint32_t segment_number, bool reopen_store) {
 
-    // Create a new lz4 store
-    // TODO: Add ability to decide which store should be used
+    // Create a new store, an lz4 store over an mmap store unless set_compression said otherwise
     char *segment_name = NULL;
     ensure(asprintf(&segment_name, "%s%i", segment_list->name, segment_number) > 0,
            "Failed to allocate segment_name");
@@ -82,13 +78,54 @@ int _allocate_segment_inlock(segment_list_t *segment_list, uint32_t segment_numb
 
     free(segment_name);
     ensure(delegate != NULL, "Failed to allocate underlying mmap store");
-
-    // NOTE: The lz4 store takes ownership of the delegate
-    store_t *store = open_lz4_store(delegate, segment_list->flags);
+    delegate->stats = segment_list->stats;
+
+    // NOTE: The lz4 store takes ownership of the delegate.  A reopened store finds its dictionary on
+    // its own.
+    store_t *store = NULL;
+    if (!segment_list->compress) {
+        store = delegate;
+    } else if (!reopen_store && segment_list->dictionary != NULL) {
+        store = open_lz4_store_with_dictionary(delegate, segment_list->dictionary,
+                                               segment_list->dictionary_size,
+                                               segment_list->flags);
+    } else if (!reopen_store && segment_list->level > 0) {
+        store = create_lz4hc_store(delegate, segment_list->level, segment_list->flags);
+    } else if (!reopen_store) {
+        store = create_lz4_store(delegate, segment_list->flags);
+    } else {
+        store = open_lz4_store(delegate, segment_list->flags);
+    }
     ensure(store != NULL, "Failed to allocate underlying mmap store");
+    store->stats = segment_list->stats;
+    sh_stats_add(segment_list->stats,
+                 reopen_store ? SH_STAT_SEGMENTS_REOPENED : SH_STAT_SEGMENTS_ALLOCATED, 1);
+    if (reopen_store) {
+        SH_PROBE1(segment__reopen, segment_number);
+    } else {
+        SH_PROBE1(segment__allocate, segment_number);
+    }
+
+    return store;
+}
+
+/**
+ * Allocate a segment.  We are assuming the list is either locked or being accessed from a single
+ * threaded context
+ */
+int _allocate_segment_inlock(segment_list_t *segment_list, uint32_t segment_number, bool reopen_store) {
+
+    segment_t *segment = __segment_number_to_segment(segment_list, segment_number);
+
+    ensure(segment->state == FREE || segment->state == CLOSED,
+           "Attempted to initialize segment that is not either free or closed");
+    ensure(segment->segment_number != segment_number || segment_number == 0,
+           "Attempted to initialize already initizlized segment");
+    ensure(segment->store == NULL,
+           "Attempted to segment with store already initialized");
 
     // Add the store we created to the segment we are initializing
-    segment->store = store;
+    segment->store = _open_store_inlock(segment_list, segment_number, reopen_store);
 
     // Initialize the segment with its number for debugging
     segment->segment_number = segment_number;
@@ -114,10 +151,14 @@ int _free_segment_inlock(segment_list_t *segment_list, uint32_t segment_number,
     if (destroy_store) {
         segment->store->destroy(segment->store);
         segment->state = FREE;
+        sh_stats_add(segment_list->stats, SH_STAT_SEGMENTS_FREED, 1);
+        SH_PROBE1(segment__free, segment_number);
     }
     else {
         segment->store->close(segment->store, 1);
         segment->state = CLOSED;
+        sh_stats_add(segment_list->stats, SH_STAT_SEGMENTS_CLOSED, 1);
+        SH_PROBE1(segment__close, segment_number);
     }
 
     // Zero out the segment we just freed for debugging
@@ -127,6 +168,26 @@ int _free_segment_inlock(segment_list_t *segment_list, uint32_t segment_number,
     return 0;
 }
 
+store_t* _segment_list_open_store(segment_list_t *segment_list, uint32_t segment_number,
+                                 bool reopen_store) {
+
+    // Only the dictionary needs guarding, so a read lock does
+    ck_rwlock_read_lock(segment_list->lock);
+    store_t *store = _open_store_inlock(segment_list, segment_number, reopen_store);
+    ck_rwlock_read_unlock(segment_list->lock);
+    return store;
+}
+
+int _segment_list_delete_store(segment_list_t *segment_list, uint32_t segment_number) {
+    char *segment_path = NULL;
+    ensure(asprintf(&segment_path, "%s/%s%i", segment_list->base_dir, segment_list->name,
+                    segment_number) > 0,
+           "Failed to allocate segment_path");
+    int ret = unlink(segment_path);
+    free(segment_path);
+    return ret;
+}
+
 // TODO: Decide how to handle the flags.  Should they be passed to the underlying store?
 int _segment_list_allocate_segment(segment_list_t *segment_list, uint32_t segment_number) {
     ck_rwlock_write_lock(segment_list->lock);
@@ -380,6 +441,131 @@ bool _segment_list_is_empty(struct segment_list *segment_list) {
     return toRet;
 }
 
+int _segment_list_set_dictionary(segment_list_t *segment_list, const void *dictionary, uint32_t size) {
+    void *copy = malloc(size);
+    if (copy == NULL) return -1;
+    memcpy(copy, dictionary, size);
+
+    ck_rwlock_write_lock(segment_list->lock);
+    void *old = segment_list->dictionary;
+    segment_list->dictionary = copy;
+    segment_list->dictionary_size = size;
+    ck_rwlock_write_unlock(segment_list->lock);
+
+    // Stores keep their own copy, so nothing still points at the old one
+    if (old != NULL) free(old);
+    return 0;
+}
+
+/*
+ * Returns true if the segment is closed, meaning that nobody has it open and its file is complete.
+ * Note that this is unsynchronized, so it must be called from within a lock.
+ */
+static inline bool __is_segment_closed_inlock(segment_list_t *segment_list, uint32_t segment_number) {
+    return __is_segment_number_in_segment_list_inlock(segment_list, segment_number) &&
+           __segment_number_to_segment(segment_list, segment_number)->state == CLOSED;
+}
+
+/*
+ * Gives the file space past the end of the data back to the filesystem.  Store files are allocated
+ * at their full size up front, so without this a compacted segment would save no disk at all.  The
+ * file size is left alone, since the store checks it on open.  Filesystems that can not punch holes
+ * just keep the space.
+ */
+void __release_unused_space(const char *path, uint32_t used, uint32_t size) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    off_t start = ((used + page_size - 1) / page_size) * page_size;
+    if (start >= size) return;
+
+    int fd = open(path, O_RDWR);
+    if (fd == -1) return;
+    fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, size - start);
+    close(fd);
+}
+
+int _segment_list_set_compression(segment_list_t *segment_list, bool compress, int level) {
+    ck_rwlock_write_lock(segment_list->lock);
+    segment_list->compress = compress;
+    segment_list->level = level;
+    ck_rwlock_write_unlock(segment_list->lock);
+    return 0;
+}
+
+int _segment_list_compact_segment(segment_list_t *segment_list, uint32_t segment_number, int level) {
+    // There is nothing to recompress in plain mmap stores
+    if (!segment_list->compress) return -1;
+
+    char *segment_name = NULL;
+    char *compact_name = NULL;
+    ensure(asprintf(&segment_name, "%s%i", segment_list->name, segment_number) > 0,
+           "Failed to allocate segment_name");
+    ensure(asprintf(&compact_name, "%s%i.compact", segment_list->name, segment_number) > 0,
+           "Failed to allocate compact_name");
+
+    // Open the file with the lock held, so that it can not be read and deleted from under us.  Once
+    // it is mapped, it stays valid for us even if that happens.
+    store_t *source = NULL;
+    ck_rwlock_read_lock(segment_list->lock);
+    if (__is_segment_closed_inlock(segment_list, segment_number)) {
+        store_t *delegate = open_mmap_store(segment_list->base_dir, segment_name, segment_list->flags);
+        ensure(delegate != NULL, "Failed to open segment to compact");
+        source = open_lz4_store(delegate, segment_list->flags);
+        ensure(source != NULL, "Failed to open segment to compact");
+    }
+    ck_rwlock_read_unlock(segment_list->lock);
+
+    if (source == NULL) {
+        free(segment_name);
+        free(compact_name);
+        return -1;
+    }
+
+    // This is the slow part, and no lock is held for it
+    store_t *dest = create_mmap_store(segment_list->segment_size, segment_list->base_dir,
+                                      compact_name, segment_list->flags | DELETE_IF_EXISTS);
+    ensure(dest != NULL, "Failed to create compacted segment");
+
+    uint32_t source_bytes = 0;
+    uint32_t dest_bytes = compact_lz4_store(source, dest, level, &source_bytes);
+    source->close(source, false);
+
+    char *segment_path = NULL;
+    char *compact_path = NULL;
+    ensure(asprintf(&segment_path, "%s/%s", segment_list->base_dir, segment_name) > 0,
+           "Failed to allocate segment_path");
+    ensure(asprintf(&compact_path, "%s/%s", segment_list->base_dir, compact_name) > 0,
+           "Failed to allocate compact_path");
+
+    bool smaller = dest_bytes > 0 && dest_bytes < source_bytes;
+    if (smaller) {
+        dest->close(dest, true);
+        __release_unused_space(compact_path, (sizeof(uint32_t) * 2) + dest_bytes,
+                               segment_list->segment_size);
+    } else {
+        dest->destroy(dest);
+    }
+
+    // Take the write lock to swap, so nobody can open the segment halfway through.  If someone
+    // opened it while we were compacting, they are reading the old file and the new one is useless.
+    int ret = -1;
+    if (smaller) {
+        ck_rwlock_write_lock(segment_list->lock);
+        if (__is_segment_closed_inlock(segment_list, segment_number) &&
+            rename(compact_path, segment_path) == 0) {
+            ret = 0;
+        }
+        ck_rwlock_write_unlock(segment_list->lock);
+
+        if (ret != 0) unlink(compact_path);
+    }
+
+    free(segment_path);
+    free(compact_path);
+    free(segment_name);
+    free(compact_name);
+    return ret;
+}
+
 // TODO: The code in this function is almost identical to _segment_list_close.  Factor this out and
 // eliminate the duplication
 int _segment_list_destroy(segment_list_t *segment_list) {
@@ -408,6 +594,7 @@ int _segment_list_destroy(segment_list_t *segment_list) {
         segment_list->tail++;
     }
 
+    free(segment_list->dictionary);
     free(segment_list->segment_buffer);
     free(segment_list->lock);
     free(segment_list);
@@ -440,6 +627,7 @@ int _segment_list_close(segment_list_t *segment_list) {
         segment_list->tail++;
     }
 
+    free(segment_list->dictionary);
     free(segment_list->segment_buffer);
     free(segment_list->lock);
     free(segment_list);
@@ -466,6 +654,11 @@ segment_list_t* create_segment_list(const char* base_dir, const char* name, uint
     segment_list->get_segment_for_reading     = _segment_list_get_segment_for_reading;
     segment_list->release_segment_for_writing = _segment_list_release_segment_for_writing;
     segment_list->release_segment_for_reading = _segment_list_release_segment_for_reading;
+    segment_list->set_dictionary              = _segment_list_set_dictionary;
+    segment_list->compact_segment             = _segment_list_compact_segment;
+    segment_list->set_compression             = _segment_list_set_compression;
+    segment_list->open_store                  = _segment_list_open_store;
+    segment_list->delete_store                = _segment_list_delete_store;
 
     // TODO: Make the number of segments configurable
     // TODO: Find a batter way to manage segments than allocating a large circular buffer up front.
@@ -482,6 +675,7 @@ segment_list_t* create_segment_list(const char* base_dir, const char* name, uint
     segment_list->flags        = flags;
     segment_list->base_dir     = base_dir;
     segment_list->segment_size = segment_size;
+    segment_list->compress     = true;
 
     // Lock for the segment list
     segment_list->lock = (ck_rwlock_t*) calloc(1, sizeof(ck_rwlock_t));
@@ -509,6 +703,11 @@ segment_list_t* open_segment_list(const char* base_dir, const char* name, uint32
     segment_list->is_empty = _segment_list_is_empty;
     segment_list->destroy = _segment_list_destroy;
     segment_list->close = _segment_list_close;
+    segment_list->set_dictionary = _segment_list_set_dictionary;
+    segment_list->compact_segment = _segment_list_compact_segment;
+    segment_list->set_compression = _segment_list_set_compression;
+    segment_list->open_store = _segment_list_open_store;
+    segment_list->delete_store = _segment_list_delete_store;
 
     // TODO: Make the number of segments configurable
     // TODO: Find a batter way to manage segments than allocating a large circular buffer up front.
@@ -525,6 +724,7 @@ segment_list_t* open_segment_list(const char* base_dir, const char* name, uint32
     segment_list->base_dir = base_dir;
     segment_list->name = name;
     segment_list->flags = flags;
+    segment_list->compress = true;
 
     ensure(start_segment <= end_segment, "Start segment greater than end segment");
 
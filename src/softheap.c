@@ -27,39 +27,126 @@
 #include "softheap.h"
 
 // Private declarations follow
-#define __SIZE_TABLE_LEN 32
+#define __SIZE_TABLE_LEN SH_MAX_RANK
 
-/**
- * Allocates a new softheap
- *
- * NULL == ERROR
- */
-softheap_t* sh_create(int error, int (*compar)(const void *, const void *), int flags) {
-    // Not yet using shadow pages
-    softheap_t *heap = calloc(1, sizeof(struct softheap));
+struct sh_arena_slab {
+    struct sh_arena_slab *next;
+    size_t size;
+};
+
+//
+// Arena
+//
+
+int sh_arena_map(struct sh_arena *arena, size_t bytes) {
+    size_t size = bytes + sizeof(struct sh_arena_slab);
+    if (size < SH_ARENA_SLAB_SIZE) size = SH_ARENA_SLAB_SIZE;
+
+    int mmap_flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    if (arena->flags & SH_LOCKED) mmap_flags |= MAP_LOCKED;
+
+    void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, mmap_flags, -1, 0);
+    if (mapping == MAP_FAILED) return -1;
+
+    // The tail of the previous slab is abandoned, it is returned when the heap is destroyed
+    struct sh_arena_slab *slab = (struct sh_arena_slab*) mapping;
+    slab->next = arena->slabs;
+    slab->size = size;
+    arena->slabs = slab;
+    arena->cursor = (char*) (slab + 1);
+    arena->limit = ((char*) mapping) + size;
+    arena->mapped += size;
+    return 0;
+}
+
+void sh_arena_adopt(struct sh_arena *dest, struct sh_arena *src) {
+    if (src->slabs != NULL) {
+        // Keep dest's current slab at the head so it keeps bumping from it
+        struct sh_arena_slab *last = src->slabs;
+        while (last->next != NULL) last = last->next;
+
+        if (dest->slabs == NULL) {
+            dest->slabs = src->slabs;
+            dest->cursor = src->cursor;
+            dest->limit = src->limit;
+        } else {
+            last->next = dest->slabs->next;
+            dest->slabs->next = src->slabs;
+        }
+        dest->mapped += src->mapped;
+    }
+
+    for (int kind = 0; kind < SH_ARENA_KINDS; kind++) {
+        while (src->free[kind] != NULL) {
+            void **object = (void**) src->free[kind];
+            src->free[kind] = *object;
+            sh_arena_free(dest, kind, object);
+        }
+    }
+
+    src->slabs = NULL;
+    src->cursor = NULL;
+    src->limit = NULL;
+    src->mapped = 0;
+}
+
+void sh_arena_release(struct sh_arena *arena) {
+    // Everything a heap owns lives in the arena, so destroying it is destroying the mmap()
+    struct sh_arena_slab *slab = arena->slabs;
+    while (slab != NULL) {
+        struct sh_arena_slab *next = slab->next;
+        ensure(munmap(slab, slab->size) == 0, "Failed to unmap soft heap arena");
+        slab = next;
+    }
 
-    // TODO - Null check (actually implement the shadow pages)
+    arena->slabs = NULL;
+    arena->cursor = NULL;
+    arena->limit = NULL;
+    arena->mapped = 0;
+    for (int kind = 0; kind < SH_ARENA_KINDS; kind++) arena->free[kind] = NULL;
+}
 
-    // Section 2.1 in the paper
-    double r = (log2(1/error)) + 5;
+void sh_size_table_init(uint_fast32_t *size_table, int error) {
+    // Section 2.1 in the paper, r = log2(1/e) + 5 where e = 1/error
+    uint_fast32_t r = 5;
+    for (uint64_t i = 1; i < (uint64_t) error; i <<= 1) r++;
 
     for (int i=0; i<__SIZE_TABLE_LEN; i++) {
         if (i <= r) {
-            heap->size_table[i] = 1;
+            size_table[i] = 1;
         } else {
-            heap->size_table[i] = (3 * heap->size_table[i-1] + 1) / 2;
+            size_table[i] = (3 * size_table[i-1] + 1) / 2;
         }
     }
+}
+
+//
+// The generic heap, the algorithm itself is the ptr instantiation of SH_PROTOTYPE
+//
+
+/**
+ * Allocates a new softheap
+ *
+ * NULL == ERROR
+ */
+softheap_t* sh_create(int error, int (*compar)(const void *, const void *), int flags) {
+    // Not yet using shadow pages
+    softheap_t *heap = sh_ptr_create(error, flags);
+    if (heap == NULL) return NULL;
 
-    // Yes we do use calloc but that might change, dont assume these are NULL
-    heap->tree = NULL;
+    heap->compar = compar;
     return heap;
 }
 
 int sh_destroy(softheap_t *softheap) {
-    // Stub, why ? because this is actually really really easy
-    // when we are on shadow-pages, to destroy, destroy the mmap()
-    return 1;
+    return sh_ptr_destroy(softheap);
+}
+
+/**
+ * Heaps live in anonymous memory for now, so there is nothing to flush
+ */
+int sh_sync(softheap_t *softheap) {
+    return 0;
 }
 
 /**
@@ -67,40 +154,43 @@ int sh_destroy(softheap_t *softheap) {
  * (that is how many elements are in the heap)
  */
 uint32_t sh_cardinality(softheap_t *heap) {
-    return -1;
+    return sh_ptr_cardinality(heap);
 }
 
 /**
  * Return the size of the heap in memory
  */
 size_t sh_size(softheap_t *heap) {
-    return -1;
+    return sh_ptr_size(heap);
 }
 
 /**
  * Insert a new element into the heap
  */
-int sh_insert(softheap_t *heap, void* key, void* value) {
-    return -1;
+int sh_add(softheap_t *heap, void* key, void* value) {
+    return sh_ptr_add(heap, key, value);
+}
+
+int sh_build(softheap_t *heap, void** keys, void** values, uint32_t n) {
+    return sh_ptr_build(heap, keys, values, n);
 }
 
 /**
- * Deletes an element from the softheap
- * currently containing it. It is assumed that 
- * the element is currently contained in exactly one
- * soft heap)
+ * Not supported, see softheap.h.  Aborts rather than return a NULL that looks like a key that was
+ * not found.
  */
 void* sh_delete(softheap_t *heap, void* key) {
+    ensure(false, "sh_delete is not supported, soft heaps have no delete");
     return NULL;
 }
 
 /**
  * Melds the two softheaps together,
- * destroying and altering dest in the 
- * process
+ * altering dest in the process
  */
 int sh_meld(softheap_t *dest, softheap_t *src) {
-    return -1;
+    if (dest->compar != src->compar) return -1;
+    return sh_ptr_meld(dest, src);
 }
 
 /**
@@ -108,9 +198,13 @@ int sh_meld(softheap_t *dest, softheap_t *src) {
  * the heap, subject to corruption
  */
 int sh_extractmin(softheap_t *heap, void** key, void** value) {
-    return -1;
+    return sh_ptr_extractmin(heap, key, value);
+}
+
+uint32_t sh_extract_batch(softheap_t *heap, uint32_t k, void** keys, void** values) {
+    return sh_ptr_extract_batch(heap, k, keys, values);
 }
 
 int sh_iterate(softheap_t *heap, void (*func)(void*,void*)) {
-    return -1;
+    return sh_ptr_iterate(heap, func);
 }
@@ -0,0 +1,140 @@
+#include "stats.h"
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Shards for the CPUs, rounded up to a power of two.  CPUs past the last shard share with the ones
+ * before.
+ */
+uint32_t __sh_stats_shard_count() {
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    uint32_t shard_count = 1;
+    while (shard_count < cpus && shard_count < SH_STATS_MAX_SHARDS) {
+        shard_count <<= 1;
+    }
+    return shard_count;
+}
+
+/*
+ * Allocates size bytes of zeroes aligned to a cache line
+ */
+uint64_t* __sh_stats_alloc(size_t size) {
+    uint64_t *data = NULL;
+    if (posix_memalign((void**) &data, SH_STATS_CACHE_LINE, size) != 0) return NULL;
+    memset(data, 0, size);
+    return data;
+}
+
+sh_stats_t* sh_stats_create() {
+    sh_stats_t *stats = calloc(1, sizeof(sh_stats_t));
+    if (stats == NULL) return NULL;
+
+    stats->shard_count = __sh_stats_shard_count();
+    stats->counters = __sh_stats_alloc(stats->shard_count * SH_STATS_STRIDE * sizeof(uint64_t));
+    if (stats->counters == NULL) {
+        free(stats);
+        return NULL;
+    }
+
+    return stats;
+}
+
+void sh_stats_destroy(sh_stats_t *stats) {
+    free(stats->counters);
+    free(stats);
+}
+
+void sh_stats_sum(sh_stats_t *stats, uint64_t *counters) {
+    memset(counters, 0, sizeof(uint64_t) * SH_STAT_COUNT);
+    for (uint32_t shard = 0; shard < stats->shard_count; shard++) {
+        uint64_t *shard_counters = &stats->counters[shard * SH_STATS_STRIDE];
+        for (int stat = 0; stat < SH_STAT_COUNT; stat++) {
+            counters[stat] += ck_pr_load_64(&shard_counters[stat]);
+        }
+    }
+}
+
+uint64_t sh_stats_get(sh_stats_t *stats, enum sh_stat stat) {
+    uint64_t value = 0;
+    for (uint32_t shard = 0; shard < stats->shard_count; shard++) {
+        value += ck_pr_load_64(&stats->counters[(shard * SH_STATS_STRIDE) + stat]);
+    }
+    return value;
+}
+
+uint64_t sh_stats_now_ns() {
+    struct timespec now;
+    ensure(clock_gettime(CLOCK_MONOTONIC, &now) == 0, "Failed to read the monotonic clock");
+    return ((uint64_t) now.tv_sec * 1000000000ULL) + (uint64_t) now.tv_nsec;
+}
+
+uint64_t sh_stats_wall_ns() {
+    struct timespec now;
+    ensure(clock_gettime(CLOCK_REALTIME_COARSE, &now) == 0, "Failed to read the coarse clock");
+    return ((uint64_t) now.tv_sec * 1000000000ULL) + (uint64_t) now.tv_nsec;
+}
+
+sh_histogram_t* sh_histogram_create() {
+    sh_histogram_t *histogram = calloc(1, sizeof(sh_histogram_t));
+    if (histogram == NULL) return NULL;
+
+    // A shard's buckets are a whole number of cache lines, so shards never share one
+    histogram->shard_count = __sh_stats_shard_count();
+    histogram->counts = __sh_stats_alloc(histogram->shard_count * SH_HISTOGRAM_BUCKETS *
+                                         sizeof(uint64_t));
+    if (histogram->counts == NULL) {
+        free(histogram);
+        return NULL;
+    }
+
+    return histogram;
+}
+
+void sh_histogram_destroy(sh_histogram_t *histogram) {
+    free(histogram->counts);
+    free(histogram);
+}
+
+uint64_t sh_histogram_sum(sh_histogram_t *histogram, uint64_t *counts) {
+    uint64_t total = 0;
+    memset(counts, 0, sizeof(uint64_t) * SH_HISTOGRAM_BUCKETS);
+    for (uint32_t shard = 0; shard < histogram->shard_count; shard++) {
+        uint64_t *shard_counts = &histogram->counts[shard * SH_HISTOGRAM_BUCKETS];
+        for (int bucket = 0; bucket < SH_HISTOGRAM_BUCKETS; bucket++) {
+            uint64_t count = ck_pr_load_64(&shard_counts[bucket]);
+            counts[bucket] += count;
+            total += count;
+        }
+    }
+    return total;
+}
+
+/*
+ * The largest value that lands in bucket, the inverse of sh_histogram_bucket
+ */
+uint64_t __sh_histogram_bucket_max(uint32_t bucket) {
+    if (bucket < SH_HISTOGRAM_SUB_BUCKETS) return bucket;
+
+    uint32_t shift = (bucket / SH_HISTOGRAM_SUB_BUCKETS) - 1;
+    uint64_t sub = (bucket % SH_HISTOGRAM_SUB_BUCKETS) + SH_HISTOGRAM_SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+uint64_t sh_histogram_percentile(const uint64_t *counts, double percentile) {
+    uint64_t total = 0;
+    for (int bucket = 0; bucket < SH_HISTOGRAM_BUCKETS; bucket++) total += counts[bucket];
+    if (total == 0) return 0;
+
+    // The rank of the value we are after, counting from 1
+    uint64_t rank = (uint64_t) ((percentile / 100.0) * total + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > total) rank = total;
+
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < SH_HISTOGRAM_BUCKETS; bucket++) {
+        seen += counts[bucket];
+        if (seen >= rank) return __sh_histogram_bucket_max(bucket);
+    }
+    return __sh_histogram_bucket_max(SH_HISTOGRAM_BUCKETS - 1);
+}
@@ -3,9 +3,180 @@
 #include "store.h"
 #include "segment_list.h"
 #include "persistent_atomic_value.h"
+#include "stats.h"
+#include "probes.h"
 
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+#include <ck_ring.h>
+#include <ck_rwlock.h>
+#include <spinlock/fas.h>
+
+// Slots in the SM_RING_BUFFER front ring, one is always left empty so it holds one record less.
+// Must be a power of two.
+#define SM_RING_SIZE 4096
+
+// Records sampled to train the SM_LZ4_DICTIONARY dictionary, the most bytes of them kept, and how
+// big a dictionary to train
+#define SM_DICTIONARY_SAMPLES 1024
+#define SM_DICTIONARY_SAMPLE_BYTES (1024 * 1024)
+#define SM_DICTIONARY_SIZE (16 * 1024)
+
+// SM_COMPACT leaves alone the segment being read and this many after it, readers would get to them
+// before compaction paid off.  With nothing to do, it looks again this often.
+#define SM_COMPACT_DISTANCE 2
+#define SM_COMPACT_IDLE_MS 100
+
+// Records each SM_ASYNC_WRITE worker queues up before producers wait for it to catch up
+#define SM_ASYNC_QUEUE 1024
+
+// Producer and consumer cache lines, see __producer_line.  SOFTHEAP_NO_CONTENTION_TUNING shrinks
+// them to a word, to measure what they are worth.
+#ifdef SOFTHEAP_NO_CONTENTION_TUNING
+#define SM_LINE sizeof(uint64_t)
+#else
+#define SM_LINE CK_MD_CACHELINE
+#endif
+
+// Records SM_READ_AHEAD workers keep ready for consumers, and so the slots they go in
+#define SM_READ_AHEAD_DEPTH 256
+
+// Operations in storage_manager_operation, counting SM_OP_LAG
+#define SM_OPERATIONS 6
+
+// SM_TIMESTAMPS records are the enqueue time followed by the record.  Records up to
+// SM_STAMPED_STACK bytes are stamped on the stack, bigger ones on the heap.
+#define SM_TIMESTAMP_SIZE sizeof(uint64_t)
+#define SM_STAMPED_STACK 1024
+
+// The codec and its level share one persisted value
+#define SM_CODEC_VALUE(codec, level) ((uint32_t) (codec) | ((uint32_t) (level) << 8))
+#define SM_CODEC_EXTRACT(value) ((enum storage_manager_codec) ((value) & 0xFF))
+#define SM_LEVEL_EXTRACT(value) ((int) (((value) >> 8) & 0xFF))
+
+// Set in the persisted codec value of queues whose records carry SM_TIMESTAMPS, and of SM_SHARED
+// queues
+#define SM_CODEC_TIMESTAMPS 0x10000
+#define SM_CODEC_SHARED 0x20000
+
+// First word of an SM_SHARED control file.  Segment owners used to be pids.
+#define SM_SHARED_MAGIC 0x53485349U
+
+// Processes that can have an SM_SHARED queue open at once, each holds a lease on one byte of the
+// lease file.  A segment owner of SM_SHARED_NO_LEASE is nobody.
+#define SM_SHARED_LEASES 4096
+#define SM_SHARED_NO_LEASE UINT32_MAX
+
+// The counts file has a slot per segment, like the segment list, and segment n uses slot
+// n % MAX_SEGMENTS
+#define SM_COUNTS_SIZE (MAX_SEGMENTS * sizeof(struct segment_count))
+
+// Most segments max_segments lets wait, short of what the segment list can hold.  Segments behind
+// the read segment that readers still hold and the one being written take up slots too.
+#define SM_QUOTA_SEGMENTS (MAX_SEGMENTS - 64)
+
+// How often SM_SHARED writers waiting under the quotas look for room consumers in other processes
+// made
+#define SM_SHARED_QUOTA_POLL_MS 10
+
+// glibc has no wrapper for ioprio_set, these come from linux/ioprio.h
+#define SM_IOPRIO_WHO_PROCESS 1
+#define SM_IOPRIO_CLASS_IDLE 3
+#define SM_IOPRIO_CLASS_SHIFT 13
+
+/*
+ * Records and bytes written to a segment, as kept in the counts file behind depth and
+ * backlog_bytes.  The slot of a segment is persisted before the sync head moves past it.
+ */
+struct segment_count {
+    uint64_t bytes;
+    uint32_t records;
+    uint32_t __padding;
+};
+
+/*
+ * Where a segment of an SM_SHARED queue is.  Writing and reading segments belong to their owner,
+ * sealed ones are waiting for a consumer to claim them.
+ */
+enum shared_segment_state {
+    SHARED_FREE = 0,
+    SHARED_WRITING = 1,
+    SHARED_SEALED = 2,
+    SHARED_READING = 3
+};
+
+/*
+ * A segment of an SM_SHARED queue as the control file keeps it.  The owner is the lease of the
+ * process that claimed it.  The state and owner only change under the control lock, the owner
+ * always first, the counts are atomics.
+ */
+struct shared_control_segment {
+    uint32_t state;
+    uint32_t owner;
+    uint64_t records;
+    uint64_t bytes;
+    uint64_t popped_records;
+    uint64_t popped_bytes;
+};
+
+/*
+ * The control file of an SM_SHARED queue, mapped into every process that has it open.  Segments
+ * before read_segment are all free, and write_segment is the next one to hand to a writer.
+ */
+struct shared_control {
+    uint32_t magic;
+
+    // Sealed segments, so that idle consumers can see there is nothing to claim without the lock
+    uint32_t sealed;
+
+    // Robust and process shared, guards the segment states and the two segment numbers
+    pthread_mutex_t lock;
+    uint32_t write_segment;
+    uint32_t read_segment;
+
+    // Records and bytes written to the queue and not yet popped, behind depth and backlog_bytes
+    uint64_t records;
+    uint64_t bytes;
+
+    struct shared_control_segment segments[MAX_SEGMENTS];
+};
+
+/*
+ * A segment this process has claimed, with its store open.  A reading segment is held by the
+ * storage manager for as long as it is the current one, and by each cursor into it.
+ */
+struct shared_segment {
+    store_t *store;
+    uint32_t segment_number;
+    uint32_t refcount; // Must be CAS guarded
+};
+
+/*
+ * What a process keeps of an SM_SHARED queue.  Writers and readers hold their lock shared while
+ * they use the current segment, and exclusively to move on to another one.  The lease is a lock
+ * the kernel drops along with lease_fd when the process dies, which is how other processes tell
+ * that the segments it claimed are up for recovery.
+ */
+struct shared_state {
+    struct shared_control *control;
+    char *control_filename;
+    char *lease_filename;
+    struct shared_segment *write;
+    struct shared_segment *read;
+    ck_rwlock_t write_lock;
+    ck_rwlock_t read_lock;
+    int lease_fd;
+    uint32_t lease;
+};
 
 typedef struct storage_manager_cursor_impl {
     storage_manager_cursor_t cursor;
@@ -15,10 +186,78 @@ typedef struct storage_manager_cursor_impl {
      */
     uint32_t segment_number;
     uint32_t __padding;
+
+    /**
+     * The store cursor holding the data, or NULL if this is a record from the front ring, in which
+     * case the data follows the cursor in the same allocation
+     */
     store_cursor_t *underlying_cursor;
 
+    /**
+     * With SM_SHARED, the claimed segment the record is in, which the cursor holds
+     */
+    struct shared_segment *shared_segment;
+
+    /**
+     * The next record held back by pop_into, for records from the front ring
+     */
+    struct storage_manager_cursor_impl *next;
+
+    /**
+     * The store the record was popped from while the data is not loaded yet, see
+     * pop_cursor_unloaded, otherwise NULL
+     */
+    store_t *unloaded;
+
 } storage_manager_cursor_impl_t;
 
+/*
+ * Where an SM_READ_AHEAD record waits for a consumer, record n in slot n % SM_READ_AHEAD_DEPTH.
+ * sequence is n + 1 once the record is loaded, so 0 until the slot is first used.
+ */
+struct ready_slot {
+    storage_manager_cursor_impl_t *record;
+    uint64_t sequence;
+};
+
+/*
+ * A record waiting for an SM_ASYNC_WRITE worker, with the data inline
+ */
+struct write_request {
+    struct write_request *next;
+    uint32_t size;
+    uint32_t __padding;
+    char data[];
+};
+
+struct storage_manager_impl;
+
+/*
+ * An SM_ASYNC_WRITE worker and its queue.  Each producer thread always hands its records to the
+ * same worker, which writes them in the order they were queued.
+ */
+struct write_worker {
+    struct storage_manager_impl *sm;
+    pthread_t thread;
+
+    // Guards everything below.  wakeup tells the worker there is work or it should stop, written
+    // tells producers and syncs that records have gone out.
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    pthread_cond_t written;
+
+    struct write_request *head;
+    struct write_request *tail;
+
+    // Records ever queued and ever written, so a sync can wait for just what was queued before it
+    uint64_t queued;
+    uint64_t done;
+
+    // Records that could not be written since the last sync, which reports them
+    uint32_t failed;
+    uint32_t stop;
+};
+
 typedef struct storage_manager_impl {
     storage_manager_t storage_manager;
 
@@ -28,22 +267,154 @@ typedef struct storage_manager_impl {
     persistent_atomic_value_t* sync_head;
     persistent_atomic_value_t* sync_tail;
 
+    // Codec and level the segments are written with, persisted as SM_CODEC_VALUE
+    persistent_atomic_value_t* codec;
+
+    // Records and bytes written to each segment, mapped from the counts file.  A reopened storage
+    // manager starts depth and backlog_bytes from what the synced segments hold.
+    struct segment_count *counts;
+    char *counts_filename;
+    uint64_t base_records;
+    uint64_t base_bytes;
+
+    // Counters behind get_stats, shared with the segment list and the stores of its segments
+    sh_stats_t *stats;
+
+    // SM_LATENCY histograms behind get_latency, one per operation.  All NULL when the mode is off,
+    // except SM_OP_LAG, which SM_TIMESTAMPS keeps.
+    sh_histogram_t *latency[SM_OPERATIONS];
+
+    // Enqueue time of the oldest record not yet popped as far as we know, 0 if there are none.
+    // Only kept with SM_TIMESTAMPS.
+    uint64_t oldest_time;
+
+    // Records the front ring has spilled to segments that have not been popped yet.  While this is
+    // non zero the ring only holds records newer than what is on disk.
+    uint32_t spilled;
+
+    // SM_SINGLE_PRODUCER and SM_SINGLE_CONSUMER
+    uint32_t single_producer;
+    uint32_t single_consumer;
+    uint32_t __padding_single;
+
+    // What producers move is kept a cache line away from what consumers move, and from the fields
+    // above that everyone reads, so that a write on one side does not invalidate the other's.
+    char __producer_line[SM_LINE];
+
     // Transient write segment number
     uint32_t write_segment; // Must be CAS guarded
 
-    // The current segment we are reading
-    uint32_t read_segment; // Must be CAS guarded
-
     // The next segment we are going to "close".  This will leave the file, but free the in memory
     // structures.  The use case of this is for the middle of a large queue, which will not be used
-    // until the reader reaches it
+    // until the reader reaches it.  Only moved when syncs go through.
     uint32_t next_close_segment; // Must be CAS guarded
 
-    uint32_t __padding;
+    // The segment the single producer is on, holding a reference to it, and NULL until it is needed
+    // again.  Only the one producer touches it.
+    segment_t *write_handle;
+
+    char __consumer_line[SM_LINE];
+
+    // The current segment we are reading
+    uint32_t read_segment; // Must be CAS guarded
+    uint32_t __padding_read;
+
+    // The segment the single consumer is on, like write_handle
+    segment_t *read_handle;
+
+    char __end_line[SM_LINE];
 
     // Base directory containing our data files
     const char *base_dir;
 
+    // Serializes producers of the front ring, which is a single producer ring, so producers take
+    // turns rather than enqueue concurrently.  Spills happen with this held so that nothing is
+    // enqueued behind records on their way to disk, and since a spill compresses and writes a whole
+    // ring of records, waiters sleep rather than spin.
+    pthread_mutex_t producer_lock;
+
+    // Guards the SM_LZ4_DICTIONARY samples below
+    ck_spinlock_fas_t sample_lock;
+    uint32_t __padding_sample;
+
+    // Front ring of SM_RING_BUFFER mode, ring_buffer is NULL when the mode is off
+    ck_ring_buffer_t *ring_buffer;
+    ck_ring_t ring;
+
+    // Records pop_into took off the front ring but could not fit, newest first.  They are older
+    // than anything still in the ring, so they are handed out first.  Guarded by the held lock.
+    storage_manager_cursor_impl_t *held;
+
+    // Records sampled for SM_LZ4_DICTIONARY, back to back.  samples is NULL when the mode is off or
+    // once the dictionary has been trained.
+    char *samples;
+    uint32_t sample_count;
+    uint32_t sample_bytes;
+    uint32_t sample_sizes[SM_DICTIONARY_SAMPLES];
+
+    // SM_COMPACT background compaction, compact_level is 0 when the mode is off.  The lock and
+    // condition only exist so that stopping the thread does not wait out its rest.
+    pthread_t compactor;
+    pthread_mutex_t compactor_lock;
+    pthread_cond_t compactor_wakeup;
+    uint32_t compactor_stop;
+    uint32_t next_compact_segment;
+    int compact_level;
+
+    // Guards the held records of the front ring
+    ck_spinlock_fas_t held_lock;
+
+    // SM_ASYNC_WRITE workers, workers is NULL when the mode is off
+    struct write_worker *workers;
+    uint32_t worker_count;
+    uint32_t __padding_workers;
+
+    // Serializes popping from the segments with SM_READ_AHEAD, by workers and by consumers that
+    // find nothing ready, and numbers the records in the order they were written.  Only popping
+    // happens under it, records are decompressed after, by whoever popped them.
+    pthread_mutex_t ready_lock;
+
+    // SM_READ_AHEAD workers and the slots of records they have popped and decompressed ahead of
+    // consumers, readers is NULL when the mode is off.  ahead_claimed is the number the next record
+    // popped gets, and only moves under the ready lock.  ahead_taken is the number of the next
+    // record a consumer takes, consumers take them in order, waiting for a record that is still
+    // being decompressed.  The lock and condition only exist so that idle workers can sleep, until
+    // a segment is synced or consumers have taken half of the slots they found full.  Every wakeup
+    // moves reader_generation on, so that a worker does not sleep through one that came while it
+    // was looking.
+    pthread_t *readers;
+    struct ready_slot *ready_slots;
+    uint64_t ahead_claimed;
+    uint64_t ahead_taken;
+    pthread_mutex_t reader_lock;
+    pthread_cond_t reader_wakeup;
+    uint32_t reader_count;
+    uint32_t reader_stop;
+    uint32_t reader_generation;
+    uint32_t ready_full;
+
+    // Records of each segment read ahead and not handed to a consumer yet, by segment number modulo
+    // MAX_SEGMENTS.  The sync tail waits for them, so a reopen reads them again.
+    uint32_t *ahead;
+
+    // Whether records carry SM_TIMESTAMPS, as persisted in the codec value
+    uint32_t timestamps;
+
+    // Quotas from the options, max_segments is never 0.  Writers blocked on them wait on the quota
+    // condition, and consumers only take the lock to wake them when quota_waiters says there are
+    // any.
+    enum storage_manager_quota_policy quota_policy;
+    uint64_t max_bytes;
+    uint32_t max_segments;
+    uint32_t quota_timeout_ms;
+    uint32_t quota_waiters;
+    uint32_t __padding;
+    pthread_mutex_t quota_lock;
+    pthread_cond_t quota_wakeup;
+
+    // SM_SHARED segments and control file, NULL when the mode is off
+    struct shared_state *shared;
+
 } storage_manager_impl_t;
 
 //
@@ -51,240 +422,2424 @@ typedef struct storage_manager_impl {
 //
 
 /*
- * Pops a read cursor from the segment given by segment_number.  The caller is responsible for retry
- * logic.
+ * Starts timing an operation for SM_LATENCY, returning 0 without reading the clock if it is off
  */
-storage_manager_cursor_impl_t* _pop_cursor(storage_manager_impl_t* sm, int segment_number) {
+static inline uint64_t _latency_start(storage_manager_impl_t* sm) {
+    return sm->latency[SM_OP_WRITE] != NULL ? sh_stats_now_ns() : 0;
+}
 
-    // Get the segment list
-    segment_list_t *sl = sm->segment_list;
+static inline void _latency_record(storage_manager_impl_t* sm,
+                                   enum storage_manager_operation operation, uint64_t start) {
+    if (sm->latency[operation] != NULL) {
+        sh_histogram_record(sm->latency[operation], sh_stats_now_ns() - start);
+    }
+}
 
-    // Get this segment.  Increments the segment refcount
-    segment_t* segment = sl->get_segment_for_reading(sl, segment_number);
+/*
+ * Maps the counts file of a queue, creating it if it is not there, so queues from before there was
+ * one start out with nothing counted.  A new queue always starts from an empty one.
+ */
+void _open_counts(storage_manager_impl_t* sm, const char* base_dir, const char* name, bool create) {
+    ensure(asprintf(&sm->counts_filename, "%s/%s.counts", base_dir, name) > 0,
+           "Failed to allocate counts_filename");
 
-    // If we couldn't get the segment, return NULL so the caller can retry with a different segment
-    if (segment == NULL) {
-        return NULL;
+    int open_flags = O_RDWR | O_CREAT;
+    if (create) {
+        open_flags = open_flags | O_TRUNC;
     }
+    int fd = open(sm->counts_filename, open_flags, (mode_t)0600);
+    ensure(fd >= 0, "Failed to open counts file");
+    ensure(ftruncate(fd, SM_COUNTS_SIZE) == 0, "Failed to size counts file");
 
-    // Get the store in this segment
-    store_t* store = segment->store;
+    sm->counts = mmap(NULL, SM_COUNTS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ensure(sm->counts != MAP_FAILED, "Failed to map counts file");
+    close(fd);
+}
 
-    // Get the store cursor from the store
-    store_cursor_t *store_cursor = store->pop_cursor(store);
-    if (store_cursor == NULL) {
-        sl->release_segment_for_reading(sl, segment_number);
-        return NULL;
+/*
+ * Writes the counts of every segment written so far back to the counts file, waiting for the disk
+ * with MS_SYNC and only scheduling it with MS_ASYNC
+ */
+void _sync_counts(storage_manager_impl_t* sm, int msync_flags) {
+    ensure(msync(sm->counts, SM_COUNTS_SIZE, msync_flags) == 0, "Unable to msync counts");
+}
+
+/*
+ * Starts depth and backlog_bytes of a reopened storage manager from the segments it reopened, and
+ * clears the slots of the rest, which writes that never got synced may have left behind
+ */
+void _load_counts(storage_manager_impl_t* sm) {
+    uint64_t sync_tail = sm->sync_tail->get_value(sm->sync_tail);
+    uint64_t sync_head = sm->sync_head->get_value(sm->sync_head);
+
+    for (uint64_t segment_number = sync_tail; segment_number < sync_tail + MAX_SEGMENTS;
+         segment_number++) {
+        struct segment_count *count = &sm->counts[segment_number % MAX_SEGMENTS];
+        if (segment_number < sync_head) {
+            sm->base_records += count->records;
+            sm->base_bytes += count->bytes;
+        } else {
+            memset(count, 0, sizeof(struct segment_count));
+        }
     }
+    _sync_counts(sm, MS_SYNC);
+}
 
-    // Allocate a storage manager cursor
-    storage_manager_cursor_impl_t *storage_manager_cursor = calloc(1, sizeof(storage_manager_cursor_impl_t));
-    ensure(storage_manager_cursor != NULL, "Storage manager cursor is null");
+/*
+ * Counts a record written to a segment.  The caller must still hold the segment, so that the count
+ * is in before anyone can sync it.
+ */
+void _count_written(storage_manager_impl_t* sm, uint32_t segment_number, uint32_t size) {
+    struct segment_count *count = &sm->counts[segment_number % MAX_SEGMENTS];
 
-    // Initialize the storage manager cursor using the underlying store cursor
-    storage_manager_cursor->cursor.size = store_cursor->size;
-    storage_manager_cursor->cursor.data = store_cursor->data;
-    storage_manager_cursor->segment_number = segment_number;
-    storage_manager_cursor->underlying_cursor = store_cursor;
+    // Counted as written, without the timestamp
+    if (sm->timestamps) {
+        size -= SM_TIMESTAMP_SIZE;
+    }
+    ck_pr_inc_32(&count->records);
+    ck_pr_add_64(&count->bytes, size);
+}
 
-    return storage_manager_cursor;
+/*
+ * Clears the slot of a segment the sync tail moved past, ready for the segment that reuses it
+ */
+void _clear_count(storage_manager_impl_t* sm, uint32_t segment_number) {
+    struct segment_count *count = &sm->counts[segment_number % MAX_SEGMENTS];
+    ck_pr_store_32(&count->records, 0);
+    ck_pr_store_64(&count->bytes, 0);
 }
 
-void _close_cursor(storage_manager_impl_t* sm, storage_manager_cursor_impl_t* cursor) {
+void _close_counts(storage_manager_impl_t* sm, bool destroy) {
+    if (destroy) {
+        unlink(sm->counts_filename);
+    } else {
+        _sync_counts(sm, MS_SYNC);
+    }
+    munmap(sm->counts, SM_COUNTS_SIZE);
+    free(sm->counts_filename);
+}
 
-    // Get the segment list
+/*
+ * Reads one of the SM_SHARED counts of the whole queue, which processes dying part way through a write or a
+ * pop can leave a little behind
+ */
+uint64_t _shared_count(uint64_t *count) {
+    int64_t value = (int64_t) ck_pr_load_64(count);
+    return value > 0 ? (uint64_t) value : 0;
+}
+
+/*
+ * Records written and not yet popped, see depth
+ */
+uint64_t _depth(storage_manager_impl_t* sm) {
+
+    // Other processes write and pop too, so only the control file knows
+    if (sm->shared != NULL) {
+        return _shared_count(&sm->shared->control->records);
+    }
+
+    // Popped first, so that a record popped in between has already been seen written
+    uint64_t popped = sh_stats_get(sm->stats, SH_STAT_RECORDS_POPPED);
+    uint64_t written = sm->base_records + sh_stats_get(sm->stats, SH_STAT_RECORDS_WRITTEN);
+    return written > popped ? written - popped : 0;
+}
+
+/*
+ * Bytes written and not yet popped, see backlog_bytes
+ */
+uint64_t _backlog_bytes(storage_manager_impl_t* sm) {
+    if (sm->shared != NULL) {
+        return _shared_count(&sm->shared->control->bytes);
+    }
+
+    uint64_t popped = sh_stats_get(sm->stats, SH_STAT_BYTES_POPPED);
+    uint64_t written = sm->base_bytes + sh_stats_get(sm->stats, SH_STAT_BYTES_WRITTEN);
+    return written > popped ? written - popped : 0;
+}
+
+/*
+ * Wakes writers waiting for room under the quotas, if there are any.  Only SM_QUOTA_BLOCK writers
+ * ever wait, so the other policies skip the fence.
+ */
+void _wake_quota(storage_manager_impl_t* sm) {
+    if (sm->quota_policy != SM_QUOTA_BLOCK) {
+        return;
+    }
+
+    ck_pr_fence_memory();
+    if (ck_pr_load_32(&sm->quota_waiters) == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&sm->quota_lock);
+    pthread_cond_broadcast(&sm->quota_wakeup);
+    pthread_mutex_unlock(&sm->quota_lock);
+}
+
+/*
+ * Counts a record popped, or dropped, which may make room under the quotas
+ */
+/*
+ * Size of a popped record as the storage manager counts it, without its timestamp.  A corrupt
+ * record can be too short to have one, and counts as empty.
+ */
+uint32_t _unstamped_size(storage_manager_impl_t* sm, uint32_t size) {
+    if (!sm->timestamps) return size;
+    return size > SM_TIMESTAMP_SIZE ? size - SM_TIMESTAMP_SIZE : 0;
+}
+
+void _count_popped(storage_manager_impl_t* sm, uint32_t size) {
+    sh_stats_add(sm->stats, SH_STAT_RECORDS_POPPED, 1);
+    sh_stats_add(sm->stats, SH_STAT_BYTES_POPPED, size);
+    _wake_quota(sm);
+}
+
+/*
+ * Frees segments up to segment_number, see free_segments
+ */
+void _free_segments(storage_manager_impl_t* sm, uint32_t segment_number) {
     segment_list_t *sl = sm->segment_list;
+    uint64_t start = _latency_start(sm);
+    sl->free_segments(sl, segment_number, 1/* destroy_store */);
+    _latency_record(sm, SM_OP_FREE, start);
+    _wake_quota(sm);
+}
 
-    // Free the underlying store cursor
-    cursor->underlying_cursor->destroy(cursor->underlying_cursor);
+//
+// SM_SHARED
+//
 
-    // Release this segment's usage by this cursor
-    sl->release_segment_for_reading(sl, cursor->segment_number);
+/*
+ * Takes the control lock of an SM_SHARED queue.  A process that died holding it was at most part
+ * way through a few single word stores, each of which leaves the control file usable, so the lock
+ * is just marked consistent again.
+ */
+void _lock_control(struct shared_control *control) {
+    int ret = pthread_mutex_lock(&control->lock);
+    if (ret == EOWNERDEAD) {
+        ret = pthread_mutex_consistent(&control->lock);
+    }
+    ensure(ret == 0, "Failed to lock shared control file");
+}
 
-    // Now, if we have read past segments that we have synced, we can free a segment.  Only attempt
-    // to free one to reduce contention
-    uint32_t current_sync_tail = sm->sync_tail->get_value(sm->sync_tail);
+void _unlock_control(struct shared_control *control) {
+    ensure(pthread_mutex_unlock(&control->lock) == 0, "Failed to unlock shared control file");
+}
 
-    ensure(current_sync_tail <= ck_pr_load_32(&sm->read_segment),
-           "Invariant broken: Our current sync tail is greater than our current read segment, "
-           "which means we were still reading from a segment that has been freed.");
+/*
+ * Takes the first free lease, a write lock on one byte of the lease file.  It belongs to the open
+ * file rather than the process, so two storage managers in one process hold separate leases, and
+ * the kernel lets go of it when the last descriptor is closed, however the process ends.  Pids get
+ * reused and mean nothing across pid namespaces, leases do not.  Returns SM_SHARED_NO_LEASE if
+ * every one is taken.
+ */
+uint32_t _take_lease(int lease_fd) {
+    for (uint32_t lease = 0; lease < SM_SHARED_LEASES; lease++) {
+        struct flock lock = { .l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = lease,
+                              .l_len = 1 };
+        if (fcntl(lease_fd, F_OFD_SETLK, &lock) == 0) {
+            return lease;
+        }
+        ensure(errno == EAGAIN || errno == EACCES, "Failed to take shared lease");
+    }
+    return SM_SHARED_NO_LEASE;
+}
 
-    if (ck_pr_load_32(&sm->read_segment) > current_sync_tail) {
+/*
+ * Whether the process that claimed a segment still holds its lease.  Our own lock never conflicts
+ * with itself, so our own lease is told by number.
+ */
+bool _owner_alive(struct shared_state *shared, uint32_t owner) {
+    if (owner == shared->lease) {
+        return true;
+    }
 
-        // Bump the sync tail
-        int ret = sm->sync_tail->compare_and_swap(sm->sync_tail,
-                                                  current_sync_tail,
-                                                  current_sync_tail + 1);
+    struct flock lock = { .l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = owner, .l_len = 1 };
+    ensure(fcntl(shared->lease_fd, F_OFD_GETLK, &lock) == 0, "Failed to check shared lease");
+    return lock.l_type != F_UNLCK;
+}
 
-        // If we lost the race, let the thread that won continue trying to free segments.  A thread
-        // that has seen a larger sync tail may call the free segments function before us, which is
-        // why the free_segments function has the semantics of freeing up to the given segment.
-        if (ret < 0) {
-            goto exit;
+/*
+ * Marks a segment free, and moves the read segment past the free ones at the front.  The caller
+ * holds the control lock.
+ */
+void _free_shared_segment(struct shared_control *control, uint32_t segment_number) {
+    ck_pr_store_32(&control->segments[segment_number % MAX_SEGMENTS].state, SHARED_FREE);
+    while (control->read_segment != control->write_segment &&
+           control->segments[control->read_segment % MAX_SEGMENTS].state == SHARED_FREE) {
+        ck_pr_store_32(&control->read_segment, control->read_segment + 1);
+    }
+}
+
+/*
+ * Seals a segment that is going to be read again from the start, which puts what was popped from
+ * it back in the queue.  The caller holds the control lock.
+ */
+void _reseal_shared_segment(struct shared_control *control, uint32_t segment_number) {
+    struct shared_control_segment *segment = &control->segments[segment_number % MAX_SEGMENTS];
+    ck_pr_add_64(&control->records, ck_pr_fas_64(&segment->popped_records, 0));
+    ck_pr_add_64(&control->bytes, ck_pr_fas_64(&segment->popped_bytes, 0));
+    ck_pr_store_32(&segment->state, SHARED_SEALED);
+    ck_pr_store_32(&control->sealed, control->sealed + 1);
+}
+
+/*
+ * Cleans up after processes that died with segments claimed.  What a writer had not synced is lost,
+ * as in an unclean close, and a segment a reader had claimed is read again.  The caller holds the
+ * control lock.
+ */
+void _recover_shared(storage_manager_impl_t* sm) {
+    struct shared_state *shared = sm->shared;
+    struct shared_control *control = shared->control;
+    segment_list_t *sl = sm->segment_list;
+
+    for (uint32_t segment_number = control->read_segment;
+         segment_number != control->write_segment; segment_number++) {
+        struct shared_control_segment *segment = &control->segments[segment_number % MAX_SEGMENTS];
+        if ((segment->state != SHARED_WRITING && segment->state != SHARED_READING) ||
+            _owner_alive(shared, segment->owner)) {
+            continue;
         }
 
-        // We won the race, now it's our responsibility to free this from the segment list
-        // free_segments returns the segment we've freed up to, so make sure we've at least freed
-        // past the segment we are responsible for freeing.  We may have freed more if another
-        // thread was faster.
-        while (sl->free_segments(sl, current_sync_tail, 1/* destroy_store */) <= current_sync_tail) {
-            // TODO: Return and handle different types of errors from the free_segments function
+        if (segment->state == SHARED_READING) {
+            _reseal_shared_segment(control, segment_number);
+            continue;
         }
+
+        // The writer may have died before it even created the file
+        ck_pr_sub_64(&control->records, ck_pr_load_64(&segment->records));
+        ck_pr_sub_64(&control->bytes, ck_pr_load_64(&segment->bytes));
+        sl->delete_store(sl, segment_number);
+        _free_shared_segment(control, segment_number);
+    }
+}
+
+/*
+ * Counts a record written to or popped from a segment, without its timestamp, as the storage
+ * manager counts it
+ */
+void _count_shared_written(storage_manager_impl_t* sm, uint32_t segment_number, uint32_t size) {
+    struct shared_control *control = sm->shared->control;
+    struct shared_control_segment *segment = &control->segments[segment_number % MAX_SEGMENTS];
+    if (sm->timestamps) {
+        size -= SM_TIMESTAMP_SIZE;
     }
+    ck_pr_inc_64(&segment->records);
+    ck_pr_add_64(&segment->bytes, size);
+    ck_pr_inc_64(&control->records);
+    ck_pr_add_64(&control->bytes, size);
+}
 
-exit:
+void _count_shared_popped(storage_manager_impl_t* sm, uint32_t segment_number, uint32_t size) {
+    struct shared_control *control = sm->shared->control;
+    struct shared_control_segment *segment = &control->segments[segment_number % MAX_SEGMENTS];
+    size = _unstamped_size(sm, size);
+    ck_pr_inc_64(&segment->popped_records);
+    ck_pr_add_64(&segment->popped_bytes, size);
+    ck_pr_dec_64(&control->records);
+    ck_pr_sub_64(&control->bytes, size);
+}
 
-    // Free the cursor
-    free(cursor);
+/*
+ * Claims the next segment for this process to write to, and creates it.  Returns NULL if every
+ * segment is in use, which is always over the segment quota.
+ */
+struct shared_segment* _claim_shared_write(storage_manager_impl_t* sm) {
+    struct shared_state *shared = sm->shared;
+    struct shared_control *control = shared->control;
+    uint64_t start = _latency_start(sm);
+
+    _lock_control(control);
+    _recover_shared(sm);
+    uint32_t segment_number = control->write_segment;
+    if (segment_number - control->read_segment >= MAX_SEGMENTS) {
+        _unlock_control(control);
+        return NULL;
+    }
 
-    return;
+    struct shared_control_segment *segment = &control->segments[segment_number % MAX_SEGMENTS];
+    ensure(segment->state == SHARED_FREE, "Claimed a shared segment that is still in use");
+    segment->owner = shared->lease;
+    ck_pr_store_64(&segment->records, 0);
+    ck_pr_store_64(&segment->bytes, 0);
+    ck_pr_store_64(&segment->popped_records, 0);
+    ck_pr_store_64(&segment->popped_bytes, 0);
+    ck_pr_store_32(&segment->state, SHARED_WRITING);
+    ck_pr_store_32(&control->write_segment, segment_number + 1);
+    _unlock_control(control);
+
+    // Consumers pass over segments being written, so the file can be created outside the lock
+    struct shared_segment *claimed = calloc(1, sizeof(struct shared_segment));
+    ensure(claimed != NULL, "Failed to allocate shared segment");
+    claimed->segment_number = segment_number;
+    claimed->store = sm->segment_list->open_store(sm->segment_list, segment_number, false);
+    ensure(claimed->store != NULL, "Failed to create shared segment");
+
+    _latency_record(sm, SM_OP_ROTATE, start);
+    return claimed;
 }
 
-int _allocate_and_advance_write_segment(storage_manager_impl_t* sm, uint32_t current_write_segment) {
+/*
+ * Syncs and closes a segment this process is done writing, and hands it to the consumers.  An
+ * empty one is freed instead.
+ */
+void _seal_shared_write(storage_manager_impl_t* sm, struct shared_segment *sealed) {
+    struct shared_control *control = sm->shared->control;
+    store_t *store = sealed->store;
+
+    bool empty = store->start_cursor(store) == store->cursor(store);
+    if (empty) {
+        store->destroy(store);
+        sh_stats_add(sm->stats, SH_STAT_SEGMENTS_FREED, 1);
+    } else {
+        uint64_t sync_start = sh_stats_now_ns();
+        while (store->sync(store) != 0);
+        sh_stats_add(sm->stats, SH_STAT_SYNCS, 1);
+        sh_stats_add(sm->stats, SH_STAT_SYNC_NS, sh_stats_now_ns() - sync_start);
+        store->close(store, false);
+        sh_stats_add(sm->stats, SH_STAT_SEGMENTS_CLOSED, 1);
+    }
 
-    // Get the segment list
-    segment_list_t *sl = sm->segment_list;
+    _lock_control(control);
+    if (empty) {
+        _free_shared_segment(control, sealed->segment_number);
+    } else {
+        ck_pr_store_32(&control->segments[sealed->segment_number % MAX_SEGMENTS].state,
+                       SHARED_SEALED);
+        ck_pr_store_32(&control->sealed, control->sealed + 1);
+    }
+    _unlock_control(control);
 
-    // Try to allocate the segment after what we think is the current write segment
-    int ret = sl->allocate_segment(sl, current_write_segment + 1);
+    free(sealed);
+}
 
-    // Only bump the segment number if we successfully allocated the segment.  This is only
-    // to reduce contention.  At this point we are guaranteed that the segment was
-    // allocated just because we called the function.
-    // TODO: Actually deal with the error.  It could fail for a reason besides that we lost
-    // the race and the segment was already allocated before we got to it.
-    if (ret >= 0) {
+bool _over_quota(storage_manager_impl_t* sm, uint32_t size);
+int _make_room(storage_manager_impl_t* sm, uint32_t size);
+void _wait_for_segment(storage_manager_impl_t* sm);
+
+/*
+ * Appends a record to the segment this process is writing, moving on to a new one once it is full,
+ * see _write_segments.  Writers in other processes can get past the quota check in write together
+ * and use up every segment, in which case the quota policy decides what happens to the record.
+ */
+int _write_shared(storage_manager_impl_t* sm, void *data, uint32_t size) {
+    struct shared_state *shared = sm->shared;
+
+    while (true) {
+        ck_rwlock_read_lock(&shared->write_lock);
+        struct shared_segment *segment = shared->write;
+        if (segment != NULL && segment->store->write(segment->store, data, size) > 0) {
+            _count_shared_written(sm, segment->segment_number, size);
+            ck_rwlock_read_unlock(&shared->write_lock);
+            return 0;
+        }
+        ck_rwlock_read_unlock(&shared->write_lock);
+
+        // Full, or nothing claimed yet.  The first writer to get here moves us on.
+        bool claimed = true;
+        ck_rwlock_write_lock(&shared->write_lock);
+        if (shared->write == segment) {
+            if (segment != NULL) {
+                _seal_shared_write(sm, segment);
+            }
+            shared->write = _claim_shared_write(sm);
+            claimed = shared->write != NULL;
+        }
+        ck_rwlock_write_unlock(&shared->write_lock);
+
+        // Out of segments is over the segment quota, unless consumers made room since.  The quota
+        // policy can let us through without making room, when every record it could drop is in a
+        // segment another process holds, so then we wait a while rather than spin on the claim.
+        if (!claimed && _over_quota(sm, size)) {
+            int ret = _make_room(sm, size);
+            if (ret != 0) {
+                return ret;
+            }
+            if (_over_quota(sm, size)) {
+                _wait_for_segment(sm);
+            }
+        }
+    }
+}
+
+/*
+ * Seals the segment this process is writing, if sync_currently_writing_segment is set.  Full
+ * segments are sealed as soon as they fill up, so there is nothing else to sync.
+ */
+int _sync_shared(storage_manager_impl_t* sm, int sync_currently_writing_segment) {
+    struct shared_state *shared = sm->shared;
+    if (!sync_currently_writing_segment) {
+        return 0;
+    }
+
+    ck_rwlock_write_lock(&shared->write_lock);
+    if (shared->write != NULL) {
+        _seal_shared_write(sm, shared->write);
+        shared->write = NULL;
+    }
+    ck_rwlock_write_unlock(&shared->write_lock);
+    return 0;
+}
+
+/*
+ * Claims the oldest sealed segment for this process to read, or returns NULL if there is none
+ */
+struct shared_segment* _claim_shared_read(storage_manager_impl_t* sm) {
+    struct shared_state *shared = sm->shared;
+    struct shared_control *control = shared->control;
+
+    // Idle consumers stay off the lock
+    if (ck_pr_load_32(&control->sealed) == 0) {
+        return NULL;
+    }
+
+    _lock_control(control);
+    _recover_shared(sm);
+    uint32_t segment_number = control->read_segment;
+    while (segment_number != control->write_segment &&
+           control->segments[segment_number % MAX_SEGMENTS].state != SHARED_SEALED) {
+        segment_number++;
+    }
+    if (segment_number == control->write_segment) {
+        _unlock_control(control);
+        return NULL;
+    }
+
+    struct shared_control_segment *segment = &control->segments[segment_number % MAX_SEGMENTS];
+    segment->owner = shared->lease;
+    ck_pr_store_32(&segment->state, SHARED_READING);
+    ck_pr_store_32(&control->sealed, control->sealed - 1);
+    _unlock_control(control);
+
+    // The storage manager holds the segment for as long as it is the one being read
+    struct shared_segment *claimed = calloc(1, sizeof(struct shared_segment));
+    ensure(claimed != NULL, "Failed to allocate shared segment");
+    claimed->segment_number = segment_number;
+    claimed->refcount = 1;
+    claimed->store = sm->segment_list->open_store(sm->segment_list, segment_number, true);
+    ensure(claimed->store != NULL, "Failed to open shared segment");
+    return claimed;
+}
+
+/*
+ * Drops a reference to a segment this process is reading.  The last one deletes it, once the
+ * storage manager has moved past it and every cursor into it has been freed.
+ */
+void _release_shared_read(storage_manager_impl_t* sm, struct shared_segment *segment) {
+    bool zero = false;
+    ck_pr_dec_32_zero(&segment->refcount, &zero);
+    if (!zero) {
+        return;
+    }
+
+    struct shared_control *control = sm->shared->control;
+    uint64_t start = _latency_start(sm);
+    segment->store->destroy(segment->store);
+    sh_stats_add(sm->stats, SH_STAT_SEGMENTS_FREED, 1);
+
+    _lock_control(control);
+    _free_shared_segment(control, segment->segment_number);
+    _unlock_control(control);
+
+    _latency_record(sm, SM_OP_FREE, start);
+    free(segment);
+    _wake_quota(sm);
+}
+
+/*
+ * Moves this process on from a segment it has read to the end to the next sealed one.  Returns
+ * false if there is none.
+ */
+bool _next_shared_read(storage_manager_impl_t* sm, struct shared_segment *done) {
+    struct shared_state *shared = sm->shared;
+    bool found = true;
+
+    ck_rwlock_write_lock(&shared->read_lock);
+    if (shared->read == done) {
+        shared->read = _claim_shared_read(sm);
+        found = shared->read != NULL;
+        if (done != NULL) {
+            _release_shared_read(sm, done);
+        }
+    }
+    ck_rwlock_write_unlock(&shared->read_lock);
+    return found;
+}
+
+/*
+ * Pops a record from the segment this process is reading, see _pop_segments.  The cursor holds the
+ * segment.
+ */
+storage_manager_cursor_impl_t* _pop_shared(storage_manager_impl_t* sm) {
+    struct shared_state *shared = sm->shared;
+
+    while (true) {
+        ck_rwlock_read_lock(&shared->read_lock);
+        struct shared_segment *segment = shared->read;
+        store_cursor_t *store_cursor = NULL;
+        if (segment != NULL) {
+            store_cursor = segment->store->pop_cursor(segment->store);
+        }
+        if (store_cursor != NULL) {
+            ck_pr_inc_32(&segment->refcount);
+            ck_rwlock_read_unlock(&shared->read_lock);
+            _count_shared_popped(sm, segment->segment_number, store_cursor->size);
+
+            storage_manager_cursor_impl_t *cursor = calloc(1, sizeof(storage_manager_cursor_impl_t));
+            ensure(cursor != NULL, "Storage manager cursor is null");
+            cursor->cursor.size = store_cursor->size;
+            cursor->cursor.data = store_cursor->data;
+            cursor->segment_number = segment->segment_number;
+            cursor->underlying_cursor = store_cursor;
+            cursor->shared_segment = segment;
+            return cursor;
+        }
+        ck_rwlock_read_unlock(&shared->read_lock);
+
+        if (!_next_shared_read(sm, segment)) {
+            return NULL;
+        }
+    }
+}
+
+/*
+ * Like _pop_shared, but pops into a buffer, see _pop_segments_into
+ */
+int _pop_shared_into(storage_manager_impl_t* sm, void *buf, uint32_t cap, uint32_t *len) {
+    struct shared_state *shared = sm->shared;
+
+    while (true) {
+        ck_rwlock_read_lock(&shared->read_lock);
+        struct shared_segment *segment = shared->read;
+        int ret = -1;
+        if (segment != NULL) {
+            ret = segment->store->pop_into(segment->store, buf, cap, len);
+        }
+        if (ret == 0 || ret == DECOMPRESSION_FAULT) {
+            _count_shared_popped(sm, segment->segment_number, *len);
+        }
+        ck_rwlock_read_unlock(&shared->read_lock);
+
+        if (ret >= 0) {
+            return ret;
+        }
+        if (!_next_shared_read(sm, segment)) {
+            return -1;
+        }
+    }
+}
+
+/*
+ * Maps the control file of an SM_SHARED queue, which a new queue starts over, and takes a lease.
+ * Opening one also cleans up after processes that died with segments claimed.
+ */
+void _init_shared(storage_manager_impl_t* sm, const char* base_dir, const char* name, bool create) {
+    struct shared_state *shared = calloc(1, sizeof(struct shared_state));
+    ensure(shared != NULL, "Failed to allocate shared state");
+    ensure(asprintf(&shared->control_filename, "%s/%s.control", base_dir, name) > 0,
+           "Failed to allocate control_filename");
+    ensure(asprintf(&shared->lease_filename, "%s/%s.lease", base_dir, name) > 0,
+           "Failed to allocate lease_filename");
+    ck_rwlock_init(&shared->write_lock);
+    ck_rwlock_init(&shared->read_lock);
+    shared->lease = SM_SHARED_NO_LEASE;
+    sm->shared = shared;
+
+    // Children forked with the queue open share the descriptor, and with it the lease, until they
+    // exit or exec
+    shared->lease_fd = open(shared->lease_filename, O_RDWR | O_CREAT | O_CLOEXEC, (mode_t)0600);
+    ensure(shared->lease_fd >= 0, "Failed to open shared lease file");
+
+    int open_flags = O_RDWR;
+    if (create) {
+        open_flags = open_flags | O_CREAT | O_TRUNC;
+    }
+    int fd = open(shared->control_filename, open_flags, (mode_t)0600);
+    ensure(fd >= 0, "Failed to open shared control file");
+    ensure(ftruncate(fd, sizeof(struct shared_control)) == 0, "Failed to size shared control file");
+
+    struct shared_control *control = mmap(NULL, sizeof(struct shared_control),
+                                          PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ensure(control != MAP_FAILED, "Failed to map shared control file");
+    close(fd);
+    shared->control = control;
+
+    if (!create) {
+        ensure(ck_pr_load_32(&control->magic) == SM_SHARED_MAGIC, "Bad shared control file");
+
+        // The lease may be one a dead process held, so recover before taking it up as our own
+        _lock_control(control);
+        uint32_t lease = _take_lease(shared->lease_fd);
+        ensure(lease != SM_SHARED_NO_LEASE, "Too many processes have the shared queue open");
+        _recover_shared(sm);
+        shared->lease = lease;
+        _unlock_control(control);
+        return;
+    }
+
+    shared->lease = _take_lease(shared->lease_fd);
+    ensure(shared->lease != SM_SHARED_NO_LEASE, "Too many processes have the shared queue open");
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    ensure(pthread_mutex_init(&control->lock, &attr) == 0, "Failed to initialize control lock");
+    pthread_mutexattr_destroy(&attr);
+
+    // The magic goes in last, so other processes never see a lock that is not ready
+    ck_pr_fence_store();
+    ck_pr_store_32(&control->magic, SM_SHARED_MAGIC);
+}
+
+/*
+ * Lets go of the segments this process holds.  The one being written is sealed, and the one being
+ * read goes back to be read again from the start, unless it was read to the end.  Destroying the
+ * queue deletes every segment, whoever holds it.
+ */
+void _close_shared(storage_manager_impl_t* sm, bool destroy) {
+    struct shared_state *shared = sm->shared;
+    struct shared_control *control = shared->control;
+    segment_list_t *sl = sm->segment_list;
+
+    if (!destroy) {
+        _sync_shared(sm, 1/*sync_currently_writing_segment*/);
+    } else if (shared->write != NULL) {
+        shared->write->store->destroy(shared->write->store);
+        free(shared->write);
+    }
+
+    struct shared_segment *read = shared->read;
+    if (read != NULL) {
+        struct shared_control_segment *segment =
+            &control->segments[read->segment_number % MAX_SEGMENTS];
+        bool finished = ck_pr_load_64(&segment->popped_records) == ck_pr_load_64(&segment->records);
+        if (destroy || finished) {
+            read->refcount = 1;
+            _release_shared_read(sm, read);
+        } else {
+            read->store->close(read->store, false);
+            sh_stats_add(sm->stats, SH_STAT_SEGMENTS_CLOSED, 1);
+            _lock_control(control);
+            _reseal_shared_segment(control, read->segment_number);
+            _unlock_control(control);
+            free(read);
+        }
+    }
+
+    if (destroy) {
+        _lock_control(control);
+        for (uint32_t segment_number = control->read_segment;
+             segment_number != control->write_segment; segment_number++) {
+            if (control->segments[segment_number % MAX_SEGMENTS].state != SHARED_FREE) {
+                sl->delete_store(sl, segment_number);
+            }
+        }
+        _unlock_control(control);
+        unlink(shared->control_filename);
+        unlink(shared->lease_filename);
+    }
+
+    // Gives up the lease, after everything this process claimed has been handed back
+    close(shared->lease_fd);
+    munmap(control, sizeof(struct shared_control));
+    free(shared->control_filename);
+    free(shared->lease_filename);
+    free(shared);
+    sm->shared = NULL;
+}
+
+/*
+ * Pops a read cursor from the segment given by segment_number.  The caller is responsible for retry
+ * logic.  Without load, the record may be left for _load_record, if the store can do that.
+ */
+storage_manager_cursor_impl_t* _pop_cursor(storage_manager_impl_t* sm, int segment_number,
+                                           bool load) {
+
+    // Get the segment list
+    segment_list_t *sl = sm->segment_list;
+
+    // Get this segment.  Increments the segment refcount
+    segment_t* segment = sl->get_segment_for_reading(sl, segment_number);
+
+    // If we couldn't get the segment, return NULL so the caller can retry with a different segment
+    if (segment == NULL) {
+        return NULL;
+    }
+
+    // Get the store in this segment
+    store_t* store = segment->store;
+
+    // Get the store cursor from the store
+    bool unloaded = !load && store->pop_cursor_unloaded != NULL;
+    store_cursor_t *store_cursor = unloaded ? store->pop_cursor_unloaded(store) :
+                                              store->pop_cursor(store);
+    if (store_cursor == NULL) {
+        sl->release_segment_for_reading(sl, segment_number);
+        return NULL;
+    }
+
+    // Allocate a storage manager cursor
+    storage_manager_cursor_impl_t *storage_manager_cursor = calloc(1, sizeof(storage_manager_cursor_impl_t));
+    ensure(storage_manager_cursor != NULL, "Storage manager cursor is null");
+
+    // Initialize the storage manager cursor using the underlying store cursor
+    storage_manager_cursor->cursor.size = store_cursor->size;
+    storage_manager_cursor->cursor.data = store_cursor->data;
+    storage_manager_cursor->segment_number = segment_number;
+    storage_manager_cursor->underlying_cursor = store_cursor;
+    storage_manager_cursor->unloaded = unloaded ? store : NULL;
+
+    return storage_manager_cursor;
+}
+
+/*
+ * Loads a record _pop_cursor left unloaded.  The segment is held by the cursor, so its store is
+ * still open.
+ */
+void _load_record(storage_manager_cursor_impl_t* record) {
+    if (record->unloaded == NULL) return;
+
+    store_cursor_t *store_cursor = record->underlying_cursor;
+    ensure(record->unloaded->load_cursor(record->unloaded, store_cursor) == SUCCESS,
+           "Failed to decompress cursor");
+    record->cursor.size = store_cursor->size;
+    record->cursor.data = store_cursor->data;
+    record->unloaded = NULL;
+}
+
+/*
+ * Releases a segment reference taken for reading, freeing segments we have read past
+ */
+void _release_segment(storage_manager_impl_t* sm, uint32_t segment_number) {
+
+    // Get the segment list
+    segment_list_t *sl = sm->segment_list;
+
+    // Release this segment's usage by this reader
+    sl->release_segment_for_reading(sl, segment_number);
+
+    // Now, if we have read past segments that we have synced, we can free a segment.  Only attempt
+    // to free one to reduce contention
+    uint32_t current_sync_tail = sm->sync_tail->get_value(sm->sync_tail);
+
+    ensure(current_sync_tail <= ck_pr_load_32(&sm->read_segment),
+           "Invariant broken: Our current sync tail is greater than our current read segment, "
+           "which means we were still reading from a segment that has been freed.");
+
+    // Whoever moved the tail past this segment could not free it while we held it, so now it is
+    // ours to free
+    if (segment_number < current_sync_tail) {
+        _free_segments(sm, segment_number);
+        return;
+    }
+
+    if (ck_pr_load_32(&sm->read_segment) > current_sync_tail) {
+
+        // Records read ahead of consumers are not consumed yet, so the tail waits for them.  They
+        // are counted before the read segment can move past their segment.
+        if (sm->ahead != NULL) {
+            ck_pr_fence_load();
+            if (ck_pr_load_32(&sm->ahead[current_sync_tail % MAX_SEGMENTS]) > 0) {
+                return;
+            }
+        }
+
+        // Bump the sync tail
+        int ret = sm->sync_tail->compare_and_swap(sm->sync_tail,
+                                                  current_sync_tail,
+                                                  current_sync_tail + 1);
+
+        // If we lost the race, let the thread that won continue trying to free segments.  A thread
+        // that has seen a larger sync tail may call the free segments function before us, which is
+        // why the free_segments function has the semantics of freeing up to the given segment.
+        if (ret < 0) {
+            return;
+        }
+
+        // The segment is no longer waiting on a reader, so neither is anything counted in it
+        _clear_count(sm, current_sync_tail);
+
+        // We won the race, now it's our responsibility to free this from the segment list.  If a
+        // reader still holds it, for instance a record read ahead or a cursor another consumer has
+        // not freed yet, that reader frees it when it lets go.  Waiting for it here could wait on
+        // ourselves.
+        // TODO: Return and handle different types of errors from the free_segments function
+        _free_segments(sm, current_sync_tail);
+    }
+}
+
+void _close_cursor(storage_manager_impl_t* sm, storage_manager_cursor_impl_t* cursor) {
+
+    // Free the underlying store cursor
+    cursor->underlying_cursor->destroy(cursor->underlying_cursor);
+
+    // Release this segment's usage by this cursor
+    if (cursor->shared_segment != NULL) {
+        _release_shared_read(sm, cursor->shared_segment);
+    } else {
+        _release_segment(sm, cursor->segment_number);
+    }
+
+    // Free the cursor
+    free(cursor);
+
+    return;
+}
+
+/*
+ * Pops the next record of the segment given by segment_number into buf, holding the segment only
+ * for as long as the copy takes.  Returns like store pop_into, the caller is responsible for retry
+ * logic.
+ */
+int _pop_into(storage_manager_impl_t* sm, int segment_number, void *buf, uint32_t cap,
+              uint32_t *len) {
+    segment_list_t *sl = sm->segment_list;
+
+    // Get this segment.  Increments the segment refcount
+    segment_t* segment = sl->get_segment_for_reading(sl, segment_number);
+    if (segment == NULL) {
+        return -1;
+    }
+
+    store_t* store = segment->store;
+    int ret = store->pop_into(store, buf, cap, len);
+    if (ret != 0 && ret != DECOMPRESSION_FAULT) {
+        sl->release_segment_for_reading(sl, segment_number);
+        return ret;
+    }
+
+    _release_segment(sm, segment_number);
+    return ret;
+}
+
+int _allocate_and_advance_write_segment(storage_manager_impl_t* sm, uint32_t current_write_segment) {
+
+    // Get the segment list
+    segment_list_t *sl = sm->segment_list;
+    uint64_t start = _latency_start(sm);
+
+    // Try to allocate the segment after what we think is the current write segment
+    int ret = sl->allocate_segment(sl, current_write_segment + 1);
+
+    // Only bump the segment number if we successfully allocated the segment.  This is only
+    // to reduce contention.  At this point we are guaranteed that the segment was
+    // allocated just because we called the function.
+    // TODO: Actually deal with the error.  It could fail for a reason besides that we lost
+    // the race and the segment was already allocated before we got to it.
+    if (ret >= 0) {
+
+        // We successfully allocated the segment.  Try to increment the segment number.  Only the
+        // thread that allocated it gets here, so this can not lose a race and never needs a retry
+        // or a backoff.
+        ensure(ck_pr_cas_32(&sm->write_segment, current_write_segment, current_write_segment + 1),
+               "Failed to increment the write segment number");
+    }
+
+    _latency_record(sm, SM_OP_ROTATE, start);
+    return 0;
+}
+
+
+int _sync_segments(storage_manager_impl_t* sm, int sync_currently_writing_segment);
+
+/*
+ * Lets go of the segment the single producer is on, before anything syncs it
+ */
+void _drop_write_handle(storage_manager_impl_t* sm) {
+    segment_t *segment = sm->write_handle;
+    if (segment != NULL) {
+        sm->write_handle = NULL;
+        sm->segment_list->release_segment_for_writing(sm->segment_list, segment->segment_number);
+    }
+}
+
+/*
+ * Appends a record for SM_SINGLE_PRODUCER, see _write_segments.  Nobody else writes or syncs, so
+ * the write segment can only move on here or in a sync, which both drop the handle.
+ */
+int _write_single(storage_manager_impl_t* sm, void *data, uint32_t size) {
+    segment_list_t *sl = sm->segment_list;
+
+    while (true) {
+        if (sm->write_handle == NULL) {
+            uint32_t current_write_segment = ck_pr_load_32(&sm->write_segment);
+            if (sl->is_empty(sl)) {
+                sl->allocate_segment(sl, current_write_segment);
+            }
+            sm->write_handle = sl->get_segment_for_writing(sl, current_write_segment);
+            ensure(sm->write_handle != NULL, "Write segment went away under the single producer");
+        }
+
+        segment_t *segment = sm->write_handle;
+        if (segment->store->write(segment->store, data, size) > 0) {
+            _count_written(sm, segment->segment_number, size);
+            return 0;
+        }
+
+        // Full, move on the same way _write_segments does
+        uint32_t full_segment = segment->segment_number;
+        _drop_write_handle(sm);
+        _sync_segments(sm, 0/*sync_currently_writing_segment*/);
+        ensure(_allocate_and_advance_write_segment(sm, full_segment) == 0,
+               "Failed to allocate and advance write segment");
+    }
+}
+
+/*
+ * Appends a block of data to the current write segment, allocating new segments as they fill up.
+ */
+int _write_segments(storage_manager_impl_t* sm, void *data, uint32_t size) {
+
+    if (sm->shared != NULL) {
+        return _write_shared(sm, data, size);
+    }
+    if (sm->single_producer) {
+        return _write_single(sm, data, size);
+    }
+
+    // Get the segment list
+    segment_list_t *sl = sm->segment_list;
+
+    // Keep retrying the write until we have written the data we are attempting to write
+    // TODO: When the errors are more granular, actually handle them here.  Right now we assert on
+    // all errors.
+    uint32_t store_offset = 0;
+    uint32_t current_write_segment = 0;
+    while (store_offset <= 0) {
+
+        // Get the current write segment on each attempt
+        current_write_segment = ck_pr_load_32(&sm->write_segment);
+
+        // Currently the invariant is that the segment list should always be full.  Once the functions
+        // to get segments return more granular errors, we can distinguish between failure to get a
+        // segment because it is not yet allocated, or failure to get a segment because of a bad state.
+        if (sl->is_empty(sl)) {
+
+            // TODO: Handle errors from this function.  Right now it can fail because another thread
+            // beat us to the allocation, rather than because the segment allocation failed.
+            // Differentiate between these two errors.
+            sl->allocate_segment(sl, current_write_segment);
+        }
+
+        // If we can't get a segment for writing, start over try again
+        // TODO: Return more granular errors from this function so we can distinguish between losing the
+        // race and a real error.
+        segment_t* segment = sl->get_segment_for_writing(sl, current_write_segment);
+        if (segment == NULL) {
+            continue;
+        }
+
+        store_t *write_store = segment->store;
+
+        uint32_t store_offset = write_store->write(write_store, data, size);
+
+        // If we have succeeded in writing, break out
+        if (store_offset > 0) {
+            _count_written(sm, current_write_segment, size);
+            break;
+        } else {
+
+            // Otherwise, attempt to allocate the next segment
+            // TODO: The write may fail for another reason, so we may not want to allocate a
+            // segment.  Improve error handling here.
+
+            // Release the current segment, since we are no longer writing to it
+            sl->release_segment_for_writing(sl, current_write_segment);
+
+            // Try to sync everything we can, but not the currently writing segment, since there may
+            // be contention.  This must not go through storage_manager->sync, which would try to
+            // spill the front ring while we may be in the middle of spilling it.
+            _sync_segments(sm, 0/*sync_currently_writing_segment*/);
+
+            // Actually do the allocation
+            ensure(_allocate_and_advance_write_segment(sm, current_write_segment) == 0,
+                   "Failed to allocate and advance write segment");
+        }
+    }
+
+    // Decrement the refcount on the segment, since we are not currently returning a cursor
+    sl->release_segment_for_writing(sl, current_write_segment);
+
+    return 0;
+}
+
+/*
+ * Gets the segment the single consumer is on, or the next readable one, or NULL if none is synced
+ */
+segment_t* _read_handle(storage_manager_impl_t* sm) {
+    segment_list_t *sl = sm->segment_list;
+
+    while (sm->read_handle == NULL) {
+        uint32_t current_read_segment = ck_pr_load_32(&sm->read_segment);
+        if (current_read_segment == ck_pr_load_32(&sm->next_close_segment)) {
+            return NULL;
+        }
+
+        sm->read_handle = sl->get_segment_for_reading(sl, current_read_segment);
+        if (sm->read_handle == NULL) {
+            ck_pr_store_32(&sm->read_segment, current_read_segment + 1);
+        }
+    }
+    return sm->read_handle;
+}
+
+/*
+ * Moves the single consumer past the segment it has read to the end.  Releasing it after the read
+ * segment has moved on frees it, unless cursors into it are still out.
+ */
+void _next_read_handle(storage_manager_impl_t* sm) {
+    uint32_t segment_number = sm->read_handle->segment_number;
+    sm->read_handle = NULL;
+    ck_pr_store_32(&sm->read_segment, segment_number + 1);
+    _release_segment(sm, segment_number);
+}
+
+/*
+ * Pops a record for SM_SINGLE_CONSUMER, see _pop_segments.  The cursor takes a reference of its own
+ * to the segment, which the handle already holds, so the segment list stays out of it.
+ */
+storage_manager_cursor_impl_t* _pop_single(storage_manager_impl_t* sm) {
+    segment_t *segment = NULL;
+    while ((segment = _read_handle(sm)) != NULL) {
+        store_cursor_t *store_cursor = segment->store->pop_cursor(segment->store);
+        if (store_cursor == NULL) {
+            _next_read_handle(sm);
+            continue;
+        }
+
+        ck_pr_inc_32(&segment->refcount);
+        storage_manager_cursor_impl_t *storage_manager_cursor = calloc(1, sizeof(storage_manager_cursor_impl_t));
+        ensure(storage_manager_cursor != NULL, "Storage manager cursor is null");
+        storage_manager_cursor->cursor.size = store_cursor->size;
+        storage_manager_cursor->cursor.data = store_cursor->data;
+        storage_manager_cursor->segment_number = segment->segment_number;
+        storage_manager_cursor->underlying_cursor = store_cursor;
+        return storage_manager_cursor;
+    }
+    return NULL;
+}
+
+/*
+ * Like _pop_single, but pops into a buffer, see _pop_segments_into
+ */
+int _pop_single_into(storage_manager_impl_t* sm, void *buf, uint32_t cap, uint32_t *len) {
+    segment_t *segment = NULL;
+    while ((segment = _read_handle(sm)) != NULL) {
+        int ret = segment->store->pop_into(segment->store, buf, cap, len);
+        if (ret >= 0) {
+            return ret;
+        }
+        _next_read_handle(sm);
+    }
+    return -1;
+}
+
+/**
+ * This returns a cursor that points at the beginning of the storage pool.  Internally it does this
+ * by finding the first segment in the storage pool and then creating a cursor at the correct
+ * location there.  Note that the storage manager has to keep track of the offset in the segment to
+ * where we have read, not the store itself.
+ *
+ * Note that allocating the cursor increments the refcount of the segment that it is a part of, so
+ * it must be explicitly freed.
+ */
+storage_manager_cursor_impl_t* _pop_segments(storage_manager_impl_t* sm, bool load) {
+
+    if (sm->shared != NULL) {
+        return _pop_shared(sm);
+    }
+    if (sm->single_consumer) {
+        return _pop_single(sm);
+    }
+
+    // A cursor that references a block of data in the storage manager
+    storage_manager_cursor_impl_t* read_cursor = NULL;
+
+    // Retry logic to deal with the fact that we may be racing other threads to get back a cursor
+    while (read_cursor == NULL) {
+
+        // Get the current read segment and the next close segment.
+        uint32_t current_read_segment = ck_pr_load_32(&sm->read_segment);
+        uint32_t next_close_segment = ck_pr_load_32(&sm->next_close_segment);
+
+        // Since we got the current read segment first, there is no case where we should see that it
+        // is greater than our next close segment
+        ensure(current_read_segment <= next_close_segment,
+               "Invariant broken: Our current read segment is greater than our next close segment, "
+               "which means we are reading from a segment that was not yet closed and reopened.");
+
+        // Make sure we aren't reading when the segment we need to read from has not been synced yet
+        if (current_read_segment == next_close_segment) {
+            return NULL;
+        }
+
+        // Try to pop a block of data from what we think is the current read segment
+        read_cursor = _pop_cursor(sm, current_read_segment, load);
+
+        // TODO: Return and handle errors from _pop_cursor
+        // If we failed to get the cursor, try to increment the read segment.  Note we are using CAS
+        // to make sure that two threads don't both increment the read segment unintentionally.  A
+        // failed CAS is not retried, and so is not backed off like the ones in the mmap store: it
+        // means another consumer already moved us past this segment, which is all we wanted, and
+        // the loop goes on to pop from wherever the read segment is now.
+        if (read_cursor == NULL) {
+            ck_pr_cas_32(&sm->read_segment, current_read_segment, current_read_segment + 1);
+        }
+    }
+
+    return read_cursor;
+}
+
+/*
+ * Like _pop_segments, but pops into a buffer with _pop_into.  A record that does not fit stays where
+ * it is, so the read segment only moves on once a segment is out of records.
+ */
+int _pop_segments_into(storage_manager_impl_t* sm, void *buf, uint32_t cap, uint32_t *len) {
+    if (sm->shared != NULL) {
+        return _pop_shared_into(sm, buf, cap, len);
+    }
+    if (sm->single_consumer) {
+        return _pop_single_into(sm, buf, cap, len);
+    }
+
+    while (true) {
+        uint32_t current_read_segment = ck_pr_load_32(&sm->read_segment);
+        uint32_t next_close_segment = ck_pr_load_32(&sm->next_close_segment);
+
+        ensure(current_read_segment <= next_close_segment,
+               "Invariant broken: Our current read segment is greater than our next close segment, "
+               "which means we are reading from a segment that was not yet closed and reopened.");
+
+        // Make sure we aren't reading when the segment we need to read from has not been synced yet
+        if (current_read_segment == next_close_segment) {
+            return -1;
+        }
+
+        int ret = _pop_into(sm, current_read_segment, buf, cap, len);
+        if (ret >= 0) {
+            return ret;
+        }
+
+        // Not backed off, see _pop_segments
+        ck_pr_cas_32(&sm->read_segment, current_read_segment, current_read_segment + 1);
+    }
+}
+
+/*
+ * Moves everything currently in the front ring to the segments, oldest first.  The caller must hold
+ * the producer lock.
+ */
+void _spill_ring(storage_manager_impl_t* sm) {
+
+    // Held records come off the ring before anything still in it, oldest last
+    ck_spinlock_fas_lock(&sm->held_lock);
+    storage_manager_cursor_impl_t* held = sm->held;
+    sm->held = NULL;
+    ck_spinlock_fas_unlock(&sm->held_lock);
+
+    storage_manager_cursor_impl_t* oldest = NULL;
+    while (held != NULL) {
+        storage_manager_cursor_impl_t* next = held->next;
+        held->next = oldest;
+        oldest = held;
+        held = next;
+    }
+
+    while (oldest != NULL) {
+        storage_manager_cursor_impl_t* next = oldest->next;
+        ck_pr_inc_32(&sm->spilled);
+        ensure(_write_segments(sm, oldest->cursor.data, oldest->cursor.size) == 0,
+               "Failed to spill record to segments");
+        free(oldest);
+        oldest = next;
+    }
+
+    // Count the records as spilled before they leave the ring, so that a consumer can never see an
+    // empty backlog while a record is in flight between the ring and the segments and jump ahead of
+    // it by popping a newer record from the ring
+    uint32_t pending = ck_ring_size(&sm->ring);
+    ck_pr_add_32(&sm->spilled, pending);
+
+    uint32_t moved = 0;
+    storage_manager_cursor_impl_t* record = NULL;
+    while (moved < pending && ck_ring_dequeue_spmc(&sm->ring, sm->ring_buffer, &record)) {
+        ensure(_write_segments(sm, record->cursor.data, record->cursor.size) == 0,
+               "Failed to spill record to segments");
+        free(record);
+        moved++;
+    }
+
+    // Consumers that got in before the count was raised took the rest straight from the ring
+    if (moved < pending) {
+        ck_pr_sub_32(&sm->spilled, pending - moved);
+    }
+}
+
+/*
+ * Accounts for a record popped from the segments.  Records left on disk by a previous run were
+ * never counted, so do not let them take the count below zero.
+ */
+void _release_spilled(storage_manager_impl_t* sm) {
+    uint32_t spilled = ck_pr_load_32(&sm->spilled);
+    while (spilled > 0 && !ck_pr_cas_32_value(&sm->spilled, spilled, spilled - 1, &spilled));
+}
+
+/*
+ * Holds back a record pop_into took off the front ring but could not fit
+ */
+void _hold_record(storage_manager_impl_t* sm, storage_manager_cursor_impl_t* record) {
+    ck_spinlock_fas_lock(&sm->held_lock);
+    record->next = sm->held;
+    sm->held = record;
+    ck_spinlock_fas_unlock(&sm->held_lock);
+}
+
+/*
+ * Takes the newest held record if it fits in cap bytes
+ *
+ * return
+ *  the record, or NULL if nothing is held or it does not fit, in which case *len is set to its size
+ */
+storage_manager_cursor_impl_t* _take_held(storage_manager_impl_t* sm, uint32_t cap,
+                                          uint32_t *len) {
+    *len = 0;
+    if (ck_pr_load_ptr(&sm->held) == NULL) {
+        return NULL;
+    }
+
+    ck_spinlock_fas_lock(&sm->held_lock);
+    storage_manager_cursor_impl_t* record = sm->held;
+    if (record != NULL && record->cursor.size > cap) {
+        *len = record->cursor.size;
+        record = NULL;
+    } else if (record != NULL) {
+        sm->held = record->next;
+    }
+    ck_spinlock_fas_unlock(&sm->held_lock);
+
+    return record;
+}
+
+/*
+ * Copies a popped record into buf and frees it, or holds it back if it does not fit.  Returns like
+ * pop_into.
+ */
+int _copy_record(storage_manager_impl_t* sm, storage_manager_cursor_impl_t* record, void *buf,
+                 uint32_t cap, uint32_t *len) {
+    *len = record->cursor.size;
+    if (record->cursor.size > cap) {
+        _hold_record(sm, record);
+        return 1;
+    }
+
+    memcpy(buf, record->cursor.data, record->cursor.size);
+    if (record->underlying_cursor == NULL) {
+        free(record);
+    } else {
+        _close_cursor(sm, record);
+    }
+    return 0;
+}
+
+void _free_ring(storage_manager_impl_t* sm) {
+    storage_manager_cursor_impl_t* record = NULL;
+    while (sm->held != NULL) {
+        record = sm->held;
+        sm->held = record->next;
+        free(record);
+    }
+    while (ck_ring_dequeue_spmc(&sm->ring, sm->ring_buffer, &record)) {
+        free(record);
+    }
+    free(sm->ring_buffer);
+    sm->ring_buffer = NULL;
+    pthread_mutex_destroy(&sm->producer_lock);
+}
+
+/*
+ * Trains the dictionary on the samples and hands it to the segment list.  The caller must hold the
+ * sample lock.
+ */
+void _train_dictionary(storage_manager_impl_t* sm) {
+    const void *samples[SM_DICTIONARY_SAMPLES];
+    char *sample = sm->samples;
+    for (uint32_t i = 0; i < sm->sample_count; i++) {
+        samples[i] = sample;
+        sample += sm->sample_sizes[i];
+    }
+
+    char *dictionary = malloc(SM_DICTIONARY_SIZE);
+    ensure(dictionary != NULL, "Failed to allocate dictionary");
+
+    uint32_t size = train_lz4_dictionary(samples, sm->sample_sizes, sm->sample_count,
+                                         dictionary, SM_DICTIONARY_SIZE);
+    if (size > 0) {
+        ensure(sm->segment_list->set_dictionary(sm->segment_list, dictionary, size) == 0,
+               "Failed to set dictionary");
+    }
+
+    free(dictionary);
+    free(sm->samples);
+    ck_pr_store_ptr(&sm->samples, NULL);
+}
+
+/*
+ * Keeps a copy of a record to train the dictionary on, training it once there are enough
+ */
+void _sample_record(storage_manager_impl_t* sm, void *data, uint32_t size) {
+    ck_spinlock_fas_lock(&sm->sample_lock);
+
+    // Someone else may have finished training while we waited
+    if (sm->samples != NULL) {
+        uint32_t room = SM_DICTIONARY_SAMPLE_BYTES - sm->sample_bytes;
+        uint32_t kept = size < room ? size : room;
+
+        memcpy(sm->samples + sm->sample_bytes, data, kept);
+        sm->sample_sizes[sm->sample_count++] = kept;
+        sm->sample_bytes += kept;
+
+        if (sm->sample_count == SM_DICTIONARY_SAMPLES ||
+            sm->sample_bytes == SM_DICTIONARY_SAMPLE_BYTES) {
+            _train_dictionary(sm);
+        }
+    }
+
+    ck_spinlock_fas_unlock(&sm->sample_lock);
+}
+
+void _free_samples(storage_manager_impl_t* sm) {
+    free(sm->samples);
+    sm->samples = NULL;
+}
+
+void _init_samples(storage_manager_impl_t* sm, int flags) {
+    ck_spinlock_fas_init(&sm->sample_lock);
+    sm->sample_count = 0;
+    sm->sample_bytes = 0;
+
+    if (flags & SM_LZ4_DICTIONARY) {
+        sm->samples = malloc(SM_DICTIONARY_SAMPLE_BYTES);
+        ensure(sm->samples != NULL, "Failed to allocate dictionary samples");
+    }
+}
+
+void _init_ring(storage_manager_impl_t* sm, int flags) {
+    ck_spinlock_fas_init(&sm->held_lock);
+    ck_pr_store_32(&sm->spilled, 0);
+    sm->held = NULL;
+
+    if (flags & SM_RING_BUFFER) {
+        sm->ring_buffer = calloc(SM_RING_SIZE, sizeof(ck_ring_buffer_t));
+        ensure(sm->ring_buffer != NULL, "Failed to allocate front ring");
+        ck_ring_init(&sm->ring, SM_RING_SIZE);
+        pthread_mutex_init(&sm->producer_lock, NULL);
+    }
+}
+
+/*
+ * Creates a latency histogram for each operation SM_LATENCY asks for, and for SM_OP_LAG when records
+ * carry SM_TIMESTAMPS
+ */
+void _init_latency(storage_manager_impl_t* sm, int flags) {
+    for (int operation = 0; operation < SM_OPERATIONS; operation++) {
+        if (operation == SM_OP_LAG ? sm->timestamps : (flags & SM_LATENCY)) {
+            sm->latency[operation] = sh_histogram_create();
+            ensure(sm->latency[operation] != NULL, "Failed to allocate latency histogram");
+        }
+    }
+}
+
+void _free_latency(storage_manager_impl_t* sm) {
+    for (int operation = 0; operation < SM_OPERATIONS; operation++) {
+        if (sm->latency[operation] != NULL) {
+            sh_histogram_destroy(sm->latency[operation]);
+        }
+    }
+}
+
+void _init_quota(storage_manager_impl_t* sm, const storage_manager_options_t *options) {
+    ensure(options->quota_policy <= SM_QUOTA_DROP_OLDEST, "Unknown quota policy");
+
+    sm->quota_policy = options->quota_policy;
+    sm->max_bytes = options->max_bytes;
+    sm->max_segments = options->max_segments;
+    if (sm->max_segments == 0 || sm->max_segments > SM_QUOTA_SEGMENTS) {
+        sm->max_segments = SM_QUOTA_SEGMENTS;
+    }
+    sm->quota_timeout_ms = options->quota_timeout_ms;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sm->quota_wakeup, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&sm->quota_lock, NULL);
+}
+
+void _free_quota(storage_manager_impl_t* sm) {
+    pthread_cond_destroy(&sm->quota_wakeup);
+    pthread_mutex_destroy(&sm->quota_lock);
+}
+
+/*
+ * Drops the calling thread to idle CPU and IO priority, so that it only gets what nobody else wants.
+ * Both are best effort.
+ */
+void _lower_priority() {
+    struct sched_param param = { .sched_priority = 0 };
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+    syscall(SYS_ioprio_set, SM_IOPRIO_WHO_PROCESS, 0,
+            SM_IOPRIO_CLASS_IDLE << SM_IOPRIO_CLASS_SHIFT);
+}
+
+/*
+ * Body of the SM_COMPACT thread.  Walks forward through the closed segments in the backlog,
+ * compacting each one once, and rests for as long as each one took.
+ */
+void* _compact_segments(void *arg) {
+    storage_manager_impl_t *sm = (storage_manager_impl_t*) arg;
+    segment_list_t *sl = sm->segment_list;
+
+    _lower_priority();
+
+    pthread_mutex_lock(&sm->compactor_lock);
+    while (!sm->compactor_stop) {
+        pthread_mutex_unlock(&sm->compactor_lock);
+
+        struct timespec start, now;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        long rest_ns = SM_COMPACT_IDLE_MS * 1000000L;
+
+        uint32_t segment = sm->next_compact_segment;
+        uint32_t first = ck_pr_load_32(&sm->read_segment) + SM_COMPACT_DISTANCE;
+        if (segment < first) segment = first;
+
+        // Segments before the next close segment are closed unless a reader got to them, in which
+        // case the segment list refuses
+        if (segment < ck_pr_load_32(&sm->next_close_segment)) {
+            sl->compact_segment(sl, segment, sm->compact_level);
+            sm->next_compact_segment = segment + 1;
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            rest_ns = (now.tv_sec - start.tv_sec) * 1000000000L + (now.tv_nsec - start.tv_nsec);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        struct timespec deadline = now;
+        deadline.tv_sec += rest_ns / 1000000000L;
+        deadline.tv_nsec += rest_ns % 1000000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        pthread_mutex_lock(&sm->compactor_lock);
+        if (!sm->compactor_stop) {
+            pthread_cond_timedwait(&sm->compactor_wakeup, &sm->compactor_lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&sm->compactor_lock);
+
+    return NULL;
+}
+
+void _start_compactor(storage_manager_impl_t* sm, int flags) {
+    if (!(flags & SM_COMPACT(0))) return;
+
+    sm->compact_level = (flags >> 12) & 0xF;
+    if (sm->compact_level == 0) sm->compact_level = 9;
+    sm->compactor_stop = 0;
+    sm->next_compact_segment = 0;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sm->compactor_wakeup, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&sm->compactor_lock, NULL);
+
+    ensure(pthread_create(&sm->compactor, NULL, &_compact_segments, sm) == 0,
+           "Failed to start compactor");
+}
+
+/*
+ * Stops the SM_COMPACT thread, waiting for a compaction in progress to finish
+ */
+void _stop_compactor(storage_manager_impl_t* sm) {
+    if (sm->compact_level == 0) return;
+
+    pthread_mutex_lock(&sm->compactor_lock);
+    sm->compactor_stop = 1;
+    pthread_cond_signal(&sm->compactor_wakeup);
+    pthread_mutex_unlock(&sm->compactor_lock);
+
+    pthread_join(sm->compactor, NULL);
+    pthread_cond_destroy(&sm->compactor_wakeup);
+    pthread_mutex_destroy(&sm->compactor_lock);
+    sm->compact_level = 0;
+}
+
+
+/*
+ * Body of an SM_ASYNC_WRITE worker.  Writes its queue out in order, compressing on the way into
+ * the segments, until told to stop with nothing left to write.
+ */
+void* _write_worker(void *arg) {
+    struct write_worker *worker = (struct write_worker*) arg;
+
+    pthread_mutex_lock(&worker->lock);
+    while (true) {
+        while (worker->head == NULL && !worker->stop) {
+            pthread_cond_wait(&worker->wakeup, &worker->lock);
+        }
+        if (worker->head == NULL) break;
+
+        struct write_request *request = worker->head;
+        worker->head = request->next;
+        if (worker->head == NULL) worker->tail = NULL;
+        pthread_mutex_unlock(&worker->lock);
+
+        // The producer was told the record was written long ago, so the next sync owns up to it
+        bool written = _write_segments(worker->sm, request->data, request->size) == 0;
+        free(request);
+
+        pthread_mutex_lock(&worker->lock);
+        if (!written) worker->failed++;
+        worker->done++;
+        pthread_cond_broadcast(&worker->written);
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    return NULL;
+}
+
+/*
+ * Queues a record for the calling thread's SM_ASYNC_WRITE worker, waiting if the worker is too far
+ * behind
+ */
+int _queue_write(storage_manager_impl_t* sm, void *data, uint32_t size) {
+
+    // Producers are spread over the workers in the order they first write, to any storage manager
+    static uint32_t producers = 0;
+    static __thread uint32_t producer = 0;
+    if (producer == 0) producer = ck_pr_faa_32(&producers, 1) + 1;
+
+    struct write_request *request = malloc(sizeof(struct write_request) + size);
+    if (request == NULL) {
+        return -1;
+    }
+    request->next = NULL;
+    request->size = size;
+    memcpy(request->data, data, size);
+
+    struct write_worker *worker = &sm->workers[producer % sm->worker_count];
+    pthread_mutex_lock(&worker->lock);
+    while (worker->queued - worker->done >= SM_ASYNC_QUEUE) {
+        pthread_cond_wait(&worker->written, &worker->lock);
+    }
+
+    if (worker->tail == NULL) {
+        worker->head = request;
+    } else {
+        worker->tail->next = request;
+    }
+    worker->tail = request;
+    worker->queued++;
+    pthread_cond_signal(&worker->wakeup);
+    pthread_mutex_unlock(&worker->lock);
+
+    return 0;
+}
+
+/*
+ * Waits for every record queued before this call to reach the segments.  Records queued meanwhile
+ * are left to the workers.  Returns how many records could not be written since the last drain.
+ */
+uint32_t _drain_writes(storage_manager_impl_t* sm) {
+    uint32_t failed = 0;
+    for (uint32_t i = 0; i < sm->worker_count; i++) {
+        struct write_worker *worker = &sm->workers[i];
+        pthread_mutex_lock(&worker->lock);
+        uint64_t queued = worker->queued;
+        while (worker->done < queued) {
+            pthread_cond_wait(&worker->written, &worker->lock);
+        }
+        failed += worker->failed;
+        worker->failed = 0;
+        pthread_mutex_unlock(&worker->lock);
+    }
+    return failed;
+}
+
+/*
+ * Number of workers for a worker pool flag, by default leaving one core to everyone else
+ */
+uint32_t _worker_count(uint32_t requested) {
+    if (requested > 0) return requested;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 2 ? (cores - 1 < 15 ? cores - 1 : 15) : 1;
+}
+
+void _start_writers(storage_manager_impl_t* sm, int flags) {
+    if (!(flags & SM_ASYNC_WRITE(0)) || (flags & SM_RING_BUFFER)) return;
+
+    uint32_t count = _worker_count((flags >> 16) & 0xF);
+
+    sm->workers = calloc(count, sizeof(struct write_worker));
+    ensure(sm->workers != NULL, "Failed to allocate write workers");
+    sm->worker_count = count;
+
+    for (uint32_t i = 0; i < count; i++) {
+        struct write_worker *worker = &sm->workers[i];
+        worker->sm = sm;
+        pthread_mutex_init(&worker->lock, NULL);
+        pthread_cond_init(&worker->wakeup, NULL);
+        pthread_cond_init(&worker->written, NULL);
+        ensure(pthread_create(&worker->thread, NULL, &_write_worker, worker) == 0,
+               "Failed to start write worker");
+    }
+}
+
+/*
+ * Stops the SM_ASYNC_WRITE workers once they have written everything queued
+ */
+void _stop_writers(storage_manager_impl_t* sm) {
+    if (sm->workers == NULL) return;
+
+    for (uint32_t i = 0; i < sm->worker_count; i++) {
+        struct write_worker *worker = &sm->workers[i];
+        pthread_mutex_lock(&worker->lock);
+        worker->stop = 1;
+        pthread_cond_signal(&worker->wakeup);
+        pthread_mutex_unlock(&worker->lock);
+    }
+
+    for (uint32_t i = 0; i < sm->worker_count; i++) {
+        struct write_worker *worker = &sm->workers[i];
+        pthread_join(worker->thread, NULL);
+        pthread_cond_destroy(&worker->written);
+        pthread_cond_destroy(&worker->wakeup);
+        pthread_mutex_destroy(&worker->lock);
+    }
+
+    free(sm->workers);
+    sm->workers = NULL;
+    sm->worker_count = 0;
+}
+
+/*
+ * Pops the next record from the segments for SM_READ_AHEAD and numbers it, without decompressing
+ * it.  Returns NULL if every slot is spoken for or there is nothing to pop.
+ */
+storage_manager_cursor_impl_t* _claim_ahead(storage_manager_impl_t* sm, uint64_t *sequence) {
+    pthread_mutex_lock(&sm->ready_lock);
+
+    // Consumers wake the workers again once they have taken half of them
+    uint64_t claimed = ck_pr_load_64(&sm->ahead_claimed);
+    if (claimed - ck_pr_load_64(&sm->ahead_taken) >= SM_READ_AHEAD_DEPTH) {
+        ck_pr_store_32(&sm->ready_full, 1);
+        pthread_mutex_unlock(&sm->ready_lock);
+        return NULL;
+    }
+
+    // Counted before the next pop can move the read segment past it
+    storage_manager_cursor_impl_t* record = _pop_segments(sm, false/*load*/);
+    if (record != NULL) {
+        ck_pr_inc_32(&sm->ahead[record->segment_number % MAX_SEGMENTS]);
+        ck_pr_store_64(&sm->ahead_claimed, claimed + 1);
+        *sequence = claimed;
+    }
+
+    pthread_mutex_unlock(&sm->ready_lock);
+    return record;
+}
+
+/*
+ * Decompresses a record from _claim_ahead and puts it in its slot for consumers.  Runs outside the
+ * ready lock, so that workers decompress side by side.
+ */
+void _publish_ahead(storage_manager_impl_t* sm, storage_manager_cursor_impl_t* record,
+                    uint64_t sequence) {
+    _load_record(record);
+
+    struct ready_slot *slot = &sm->ready_slots[sequence % SM_READ_AHEAD_DEPTH];
+    ck_pr_store_ptr(&slot->record, record);
+    ck_pr_fence_store();
+    ck_pr_store_64(&slot->sequence, sequence + 1);
+}
+
+/*
+ * Pops, decompresses and publishes the next record, for an SM_READ_AHEAD worker.  Returns false if
+ * the slots are full or there is nothing to pop.
+ */
+bool _read_ahead_one(storage_manager_impl_t* sm) {
+    uint64_t sequence = 0;
+    storage_manager_cursor_impl_t* record = _claim_ahead(sm, &sequence);
+    if (record == NULL) {
+        return false;
+    }
+
+    _publish_ahead(sm, record, sequence);
+    return true;
+}
+
+/*
+ * Body of an SM_READ_AHEAD worker.  Pops and decompresses records until SM_READ_AHEAD_DEPTH of them
+ * are waiting for consumers, sleeping whenever there is nothing to do.
+ */
+void* _read_ahead(void *arg) {
+    storage_manager_impl_t *sm = (storage_manager_impl_t*) arg;
+
+    pthread_mutex_lock(&sm->reader_lock);
+    while (!sm->reader_stop) {
+        uint32_t generation = sm->reader_generation;
+        pthread_mutex_unlock(&sm->reader_lock);
+
+        bool popped = _read_ahead_one(sm);
+
+        pthread_mutex_lock(&sm->reader_lock);
+        while (!popped && !sm->reader_stop && sm->reader_generation == generation) {
+            pthread_cond_wait(&sm->reader_wakeup, &sm->reader_lock);
+        }
+    }
+    pthread_mutex_unlock(&sm->reader_lock);
+
+    return NULL;
+}
+
+/*
+ * Wakes idle SM_READ_AHEAD workers, for when there might be something new to read
+ */
+void _wake_readers(storage_manager_impl_t* sm) {
+    if (sm->readers == NULL) return;
+
+    pthread_mutex_lock(&sm->reader_lock);
+    sm->reader_generation++;
+    pthread_cond_broadcast(&sm->reader_wakeup);
+    pthread_mutex_unlock(&sm->reader_lock);
+}
+
+/*
+ * Takes the oldest record popped ahead, held records first, and wakes the workers once consumers
+ * have taken half of the slots they had filled.  A record that is still being decompressed is
+ * waited for, nothing behind it is taken first.  Returns NULL when every record popped is taken.
+ */
+storage_manager_cursor_impl_t* _take_ready(storage_manager_impl_t* sm, uint32_t cap,
+                                           uint32_t *len) {
+    storage_manager_cursor_impl_t* record = _take_held(sm, cap, len);
+    if (record != NULL || *len > 0) {
+        return record;
+    }
+
+    uint64_t taken = ck_pr_load_64(&sm->ahead_taken);
+    while (taken < ck_pr_load_64(&sm->ahead_claimed)) {
+        struct ready_slot *slot = &sm->ready_slots[taken % SM_READ_AHEAD_DEPTH];
+
+        // Decompressing one record does not take long, so this only yields
+        if (ck_pr_load_64(&slot->sequence) != taken + 1) {
+            sched_yield();
+            taken = ck_pr_load_64(&sm->ahead_taken);
+            continue;
+        }
+
+        ck_pr_fence_load();
+        storage_manager_cursor_impl_t* ready = ck_pr_load_ptr(&slot->record);
+        if (ck_pr_cas_64(&sm->ahead_taken, taken, taken + 1)) {
+            record = ready;
+            taken++;
+            break;
+        }
+        taken = ck_pr_load_64(&sm->ahead_taken);
+    }
+
+    if (ck_pr_load_32(&sm->ready_full) &&
+        ck_pr_load_64(&sm->ahead_claimed) - taken <= SM_READ_AHEAD_DEPTH / 2 &&
+        ck_pr_cas_32(&sm->ready_full, 1, 0)) {
+        _wake_readers(sm);
+    }
+    return record;
+}
+
+/*
+ * Lets the sync tail move past the segment of a record read ahead, now that a consumer has it
+ */
+void _hand_over(storage_manager_impl_t* sm, storage_manager_cursor_impl_t* record) {
+    ck_pr_dec_32(&sm->ahead[record->segment_number % MAX_SEGMENTS]);
+}
+
+/*
+ * Pops the next record with SM_READ_AHEAD.  What the workers have popped is older than anything
+ * left in the segments.  A consumer that finds nothing ready pops and decompresses the next record
+ * itself, in turn with the workers, and then takes whatever is oldest.
+ */
+storage_manager_cursor_impl_t* _pop_ahead(storage_manager_impl_t* sm) {
+    uint32_t held_size = 0;
+    while (true) {
+        storage_manager_cursor_impl_t* record = _take_ready(sm, UINT32_MAX, &held_size);
+        if (record != NULL) {
+            _hand_over(sm, record);
+            return record;
+        }
+
+        uint64_t sequence = 0;
+        record = _claim_ahead(sm, &sequence);
+        if (record != NULL) {
+            _publish_ahead(sm, record, sequence);
+        } else if (ck_pr_load_64(&sm->ahead_taken) == ck_pr_load_64(&sm->ahead_claimed)) {
+            return NULL;
+        }
+    }
+}
+
+/*
+ * Like _pop_ahead, but pops into buf.  Records read ahead are already decompressed, so they are
+ * copied, and held back if they do not fit.
+ */
+int _pop_ahead_into(storage_manager_impl_t* sm, void *buf, uint32_t cap, uint32_t *len) {
+    while (true) {
+        storage_manager_cursor_impl_t* record = _take_ready(sm, cap, len);
+
+        // A held record that does not fit, *len is its size
+        if (record == NULL && *len > 0) {
+            return 1;
+        }
+
+        if (record != NULL) {
+            if (record->cursor.size <= cap) {
+                _hand_over(sm, record);
+            }
+            return _copy_record(sm, record, buf, cap, len);
+        }
+
+        uint64_t sequence = 0;
+        record = _claim_ahead(sm, &sequence);
+        if (record != NULL) {
+            _publish_ahead(sm, record, sequence);
+        } else if (ck_pr_load_64(&sm->ahead_taken) == ck_pr_load_64(&sm->ahead_claimed)) {
+            return -1;
+        }
+    }
+}
+
+void _start_readers(storage_manager_impl_t* sm, int flags) {
+    if (!(flags & SM_READ_AHEAD(0)) || (flags & SM_RING_BUFFER)) return;
+
+    sm->ready_slots = calloc(SM_READ_AHEAD_DEPTH, sizeof(struct ready_slot));
+    ensure(sm->ready_slots != NULL, "Failed to allocate read ahead slots");
+    sm->ahead_claimed = 0;
+    sm->ahead_taken = 0;
+    pthread_mutex_init(&sm->ready_lock, NULL);
+    sm->ahead = calloc(MAX_SEGMENTS, sizeof(uint32_t));
+    ensure(sm->ahead != NULL, "Failed to allocate read ahead counts");
+
+    pthread_cond_init(&sm->reader_wakeup, NULL);
+    pthread_mutex_init(&sm->reader_lock, NULL);
+
+    sm->reader_stop = 0;
+    sm->reader_generation = 0;
+    sm->ready_full = 0;
+    sm->reader_count = _worker_count((flags >> 24) & 0xF);
+    sm->readers = calloc(sm->reader_count, sizeof(pthread_t));
+    ensure(sm->readers != NULL, "Failed to allocate read ahead workers");
+
+    for (uint32_t i = 0; i < sm->reader_count; i++) {
+        ensure(pthread_create(&sm->readers[i], NULL, &_read_ahead, sm) == 0,
+               "Failed to start read ahead worker");
+    }
+}
+
+/*
+ * Stops the SM_READ_AHEAD workers and lets go of what they read ahead.  None of it was handed to a
+ * consumer, so the sync tail has not moved past its segments, and a reopened storage manager reads
+ * it again.
+ */
+void _stop_readers(storage_manager_impl_t* sm) {
+    if (sm->readers == NULL) return;
+
+    pthread_mutex_lock(&sm->reader_lock);
+    sm->reader_stop = 1;
+    pthread_cond_broadcast(&sm->reader_wakeup);
+    pthread_mutex_unlock(&sm->reader_lock);
+
+    for (uint32_t i = 0; i < sm->reader_count; i++) {
+        pthread_join(sm->readers[i], NULL);
+    }
+
+    uint32_t len = 0;
+    storage_manager_cursor_impl_t* record = NULL;
+    while ((record = _take_ready(sm, UINT32_MAX, &len)) != NULL) {
+
+        // Released without moving the sync tail, the record has not been consumed
+        record->underlying_cursor->destroy(record->underlying_cursor);
+        sm->segment_list->release_segment_for_reading(sm->segment_list, record->segment_number);
+        free(record);
+    }
+
+    pthread_mutex_destroy(&sm->ready_lock);
+    pthread_cond_destroy(&sm->reader_wakeup);
+    pthread_mutex_destroy(&sm->reader_lock);
+    free(sm->readers);
+    free(sm->ready_slots);
+    free(sm->ahead);
+    sm->readers = NULL;
+    sm->ready_slots = NULL;
+    sm->ahead = NULL;
+    sm->reader_count = 0;
+}
+
+//
+// Storage manager implementation
+//
+
+
+/*
+ * Writes a record to wherever it goes first, see write
+ */
+int _write(storage_manager_impl_t* sm, void *data, uint32_t size) {
+
+    if (sm->ring_buffer == NULL) {
+        if (sm->workers != NULL) {
+            return _queue_write(sm, data, size);
+        }
+        return _write_segments(sm, data, size);
+    }
+
+    // The record is handed to the consumer as is, so allocate it as a cursor with the data inline
+    storage_manager_cursor_impl_t* record = malloc(sizeof(storage_manager_cursor_impl_t) + size);
+    if (record == NULL) {
+        return -1;
+    }
+    record->cursor.size = size;
+    record->cursor.data = record + 1;
+    record->segment_number = 0;
+    record->underlying_cursor = NULL;
+    record->shared_segment = NULL;
+    record->next = NULL;
+    memcpy(record->cursor.data, data, size);
+
+    pthread_mutex_lock(&sm->producer_lock);
+
+    // Only go to disk once the ring is full, and then take everything in it along so the segments
+    // always hold the oldest records
+    if (!ck_ring_enqueue_spmc(&sm->ring, sm->ring_buffer, record)) {
+        _spill_ring(sm);
+        ensure(ck_ring_enqueue_spmc(&sm->ring, sm->ring_buffer, record),
+               "Front ring still full after spilling it");
+    }
+
+    pthread_mutex_unlock(&sm->producer_lock);
+
+    return 0;
+}
+
+/*
+ * Writes a record behind its SM_TIMESTAMPS enqueue time
+ */
+int _write_stamped(storage_manager_impl_t* sm, void *data, uint32_t size) {
+    char small[SM_STAMPED_STACK];
+    uint32_t stamped_size = SM_TIMESTAMP_SIZE + size;
+    ensure(stamped_size > size, "Record too large to timestamp");
+
+    char *stamped = stamped_size <= sizeof(small) ? small : malloc(stamped_size);
+    if (stamped == NULL) {
+        return -1;
+    }
+
+    uint64_t now = sh_stats_wall_ns();
+    memcpy(stamped, &now, SM_TIMESTAMP_SIZE);
+    memcpy(stamped + SM_TIMESTAMP_SIZE, data, size);
+    int ret = _write(sm, stamped, stamped_size);
+
+    if (stamped != small) {
+        free(stamped);
+    }
+
+    // Nothing was waiting, so this is the oldest record now
+    if (ret == 0 && ck_pr_load_64(&sm->oldest_time) == 0) {
+        ck_pr_cas_64(&sm->oldest_time, 0, now);
+    }
+    return ret;
+}
+
+/*
+ * Accounts for the SM_TIMESTAMPS enqueue time of a popped record, which the records still waiting
+ * were written about the same time as or after
+ */
+void _popped_stamp(storage_manager_impl_t* sm, uint64_t enqueue_time) {
+    uint64_t now = sh_stats_wall_ns();
+    sh_histogram_record(sm->latency[SM_OP_LAG], now > enqueue_time ? now - enqueue_time : 0);
+    ck_pr_store_64(&sm->oldest_time, enqueue_time);
+}
+
+storage_manager_cursor_impl_t* _pop_next(storage_manager_impl_t* sm);
+void _storage_manager_impl_free_cursor(storage_manager_t *storage_manager,
+                                       storage_manager_cursor_t *storage_manager_cursor);
+int _storage_manager_impl_sync(storage_manager_t *storage_manager,
+                               int sync_currently_writing_segment);
+
+/*
+ * Whether a record of size would take the queue past one of its quotas
+ */
+bool _over_quota(storage_manager_impl_t* sm, uint32_t size) {
+    if (sm->max_bytes != 0) {
+        uint64_t backlog_bytes = _backlog_bytes(sm);
+        if (backlog_bytes > 0 && backlog_bytes + size > sm->max_bytes) {
+            return true;
+        }
+    }
+
+    // Read first, so that the read segment can only have moved on since.  With SM_SHARED the
+    // segments of every process count.
+    uint32_t *read_segment_ptr = &sm->read_segment;
+    uint32_t *write_segment_ptr = &sm->write_segment;
+    if (sm->shared != NULL) {
+        read_segment_ptr = &sm->shared->control->read_segment;
+        write_segment_ptr = &sm->shared->control->write_segment;
+    }
+    uint32_t read_segment = ck_pr_load_32(read_segment_ptr);
+    uint32_t write_segment = ck_pr_load_32(write_segment_ptr);
+    return write_segment > read_segment && write_segment - read_segment > sm->max_segments;
+}
+
+/*
+ * Sets time to ms milliseconds from now, on the monotonic clock the quota condition waits on
+ */
+void _time_after(struct timespec *time, uint32_t ms) {
+    clock_gettime(CLOCK_MONOTONIC, time);
+    time->tv_sec += ms / 1000;
+    time->tv_nsec += (ms % 1000) * 1000000L;
+    if (time->tv_nsec >= 1000000000L) {
+        time->tv_sec++;
+        time->tv_nsec -= 1000000000L;
+    }
+}
+
+bool _time_before(const struct timespec *a, const struct timespec *b) {
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/*
+ * Waits for consumers to make room for a record of size under the quotas, for up to
+ * quota_timeout_ms if it is set.  Returns 0 once there is room, -2 if the wait timed out.
+ */
+int _wait_for_room(storage_manager_impl_t* sm, uint32_t size) {
+    struct timespec deadline;
+    _time_after(&deadline, sm->quota_timeout_ms);
+
+    sh_stats_add(sm->stats, SH_STAT_QUOTA_WAITS, 1);
+
+    // Consumers can only make room out of synced records, and this producer may be the one that
+    // would sync them
+    _storage_manager_impl_sync((storage_manager_t*) sm, 1/*sync_currently_writing_segment*/);
+
+    // Consumers look for waiters after making room, so once we are counted any room they make
+    // either shows up in the check or wakes us
+    pthread_mutex_lock(&sm->quota_lock);
+    ck_pr_inc_32(&sm->quota_waiters);
+    ck_pr_fence_memory();
+
+    int ret = 0;
+    while (_over_quota(sm, size)) {
+        struct timespec wait_until = deadline;
+        if (sm->shared != NULL) {
+
+            // Consumers in other processes can not wake us, so look again every so often
+            _time_after(&wait_until, SM_SHARED_QUOTA_POLL_MS);
+            if (sm->quota_timeout_ms != 0 && _time_before(&deadline, &wait_until)) {
+                wait_until = deadline;
+            }
+        } else if (sm->quota_timeout_ms == 0) {
+            pthread_cond_wait(&sm->quota_wakeup, &sm->quota_lock);
+            continue;
+        }
+
+        if (pthread_cond_timedwait(&sm->quota_wakeup, &sm->quota_lock,
+                                   &wait_until) == ETIMEDOUT &&
+            sm->quota_timeout_ms != 0 && !_time_before(&wait_until, &deadline)) {
+            ret = _over_quota(sm, size) ? -2 : 0;
+            break;
+        }
+    }
+
+    ck_pr_dec_32(&sm->quota_waiters);
+    pthread_mutex_unlock(&sm->quota_lock);
+    return ret;
+}
+
+/*
+ * Waits one SM_SHARED_QUOTA_POLL_MS on the quota condition, for an SM_SHARED writer that is out of
+ * segments after the quota policy let it through.  Consumers in this process wake it early.
+ */
+void _wait_for_segment(storage_manager_impl_t* sm) {
+    struct timespec wait_until;
+    _time_after(&wait_until, SM_SHARED_QUOTA_POLL_MS);
+
+    pthread_mutex_lock(&sm->quota_lock);
+    ck_pr_inc_32(&sm->quota_waiters);
+    pthread_cond_timedwait(&sm->quota_wakeup, &sm->quota_lock, &wait_until);
+    ck_pr_dec_32(&sm->quota_waiters);
+    pthread_mutex_unlock(&sm->quota_lock);
+}
+
+/*
+ * Pops and drops the oldest records until a record of size fits under the quotas, or there is
+ * nothing left to drop
+ */
+void _drop_oldest(storage_manager_impl_t* sm, uint32_t size) {
+    bool synced = false;
+    while (_over_quota(sm, size)) {
+        storage_manager_cursor_impl_t* dropped = _pop_next(sm);
+
+        // Only synced records can be popped, so sync the rest once before giving up on them
+        if (dropped == NULL && !synced) {
+            _storage_manager_impl_sync((storage_manager_t*) sm, 1/*sync_currently_writing_segment*/);
+            synced = true;
+            continue;
+        }
+        if (dropped == NULL) {
+            return;
+        }
+
+        uint32_t dropped_size = _unstamped_size(sm, dropped->cursor.size);
+        if (sm->timestamps && dropped->cursor.size >= SM_TIMESTAMP_SIZE) {
+            uint64_t enqueue_time = 0;
+            memcpy(&enqueue_time, dropped->cursor.data, SM_TIMESTAMP_SIZE);
+            ck_pr_store_64(&sm->oldest_time, enqueue_time);
+        }
+
+        _storage_manager_impl_free_cursor((storage_manager_t*) sm,
+                                          (storage_manager_cursor_t*) dropped);
+        sh_stats_add(sm->stats, SH_STAT_RECORDS_DROPPED, 1);
+        _count_popped(sm, dropped_size);
+    }
+}
+
+/*
+ * Makes room for a record of size under the quotas the way the quota policy says to.  Returns 0 if
+ * the record can be written, -2 if it is turned away.
+ */
+int _make_room(storage_manager_impl_t* sm, uint32_t size) {
+    int ret = 0;
+    switch (sm->quota_policy) {
+        case SM_QUOTA_BLOCK:
+            ret = _wait_for_room(sm, size);
+            break;
+        case SM_QUOTA_DROP_OLDEST:
+            _drop_oldest(sm, size);
+            break;
+        default:
+            ret = -2;
+            break;
+    }
 
-        // We successfully allocated the segment.  Try to increment the segment number
-        ensure(ck_pr_cas_32(&sm->write_segment, current_write_segment, current_write_segment + 1),
-               "Failed to increment the write segment number");
+    if (ret != 0) {
+        sh_stats_add(sm->stats, SH_STAT_QUOTA_REJECTIONS, 1);
     }
-    return 0;
+    return ret;
 }
 
-
-//
-// Storage manager implementation
-//
-
-
 int _storage_manager_impl_write(storage_manager_t *storage_manager, void *data, uint32_t size) {
 
     // Get the private storage manager struct
     storage_manager_impl_t *sm = (storage_manager_impl_t*) storage_manager;
 
-    // Get the segment list
-    segment_list_t *sl = sm->segment_list;
+    uint64_t start = _latency_start(sm);
 
-    // Keep retrying the write until we have written the data we are attempting to write
-    // TODO: When the errors are more granular, actually handle them here.  Right now we assert on
-    // all errors.
-    uint32_t store_offset = 0;
-    uint32_t current_write_segment = 0;
-    while (store_offset <= 0) {
+    if (_over_quota(sm, size)) {
+        int ret = _make_room(sm, size);
+        if (ret != 0) {
+            _latency_record(sm, SM_OP_WRITE, start);
+            return ret;
+        }
+    }
 
-        // Get the current write segment on each attempt
-        current_write_segment = ck_pr_load_32(&sm->write_segment);
+    // Dictionaries are trained on records as they were written, without timestamps
+    if (ck_pr_load_ptr(&sm->samples) != NULL) {
+        _sample_record(sm, data, size);
+    }
 
-        // Currently the invariant is that the segment list should always be full.  Once the functions
-        // to get segments return more granular errors, we can distinguish between failure to get a
-        // segment because it is not yet allocated, or failure to get a segment because of a bad state.
-        if (sl->is_empty(sl)) {
+    int ret = sm->timestamps ? _write_stamped(sm, data, size) : _write(sm, data, size);
+    if (ret == 0) {
+        sh_stats_add(sm->stats, SH_STAT_RECORDS_WRITTEN, 1);
+        sh_stats_add(sm->stats, SH_STAT_BYTES_WRITTEN, size);
+    }
 
-            // TODO: Handle errors from this function.  Right now it can fail because another thread
-            // beat us to the allocation, rather than because the segment allocation failed.
-            // Differentiate between these two errors.
-            sl->allocate_segment(sl, current_write_segment);
+    _latency_record(sm, SM_OP_WRITE, start);
+    return ret;
+}
+
+/*
+ * Pops the next record from wherever the oldest one is, see pop_cursor
+ */
+storage_manager_cursor_impl_t* _pop_next(storage_manager_impl_t* sm) {
+
+    // Read ahead and the front ring never go together
+    if (sm->readers != NULL) {
+        return _pop_ahead(sm);
+    }
+
+    // Anything readable in the segments is older than anything in the ring
+    storage_manager_cursor_impl_t* read_cursor = _pop_segments(sm, true/*load*/);
+    if (sm->ring_buffer == NULL) {
+        return read_cursor;
+    }
+
+    if (read_cursor == NULL && ck_pr_load_32(&sm->spilled) > 0) {
+
+        // Spilled records have not been synced yet, so make them readable rather than jump ahead of
+        // them.  If a producer is in the middle of spilling, let it finish and have the caller
+        // retry, since the record we need may not have reached the segments yet.  Otherwise every
+        // spill so far is complete, so sync without keeping producers waiting on it.
+        if (pthread_mutex_trylock(&sm->producer_lock) == 0) {
+            pthread_mutex_unlock(&sm->producer_lock);
+            _sync_segments(sm, 1/*sync_currently_writing_segment*/);
+            read_cursor = _pop_segments(sm, true/*load*/);
         }
 
-        // If we can't get a segment for writing, start over try again
-        // TODO: Return more granular errors from this function so we can distinguish between losing the
-        // race and a real error.
-        segment_t* segment = sl->get_segment_for_writing(sl, current_write_segment);
-        if (segment == NULL) {
-            continue;
+        if (read_cursor == NULL) {
+            return NULL;
         }
+    }
 
-        store_t *write_store = segment->store;
+    if (read_cursor != NULL) {
+        _release_spilled(sm);
+        return read_cursor;
+    }
 
-        uint32_t store_offset = write_store->write(write_store, data, size);
+    // Nothing is backed up on disk, hand over the oldest record in memory
+    uint32_t held_size = 0;
+    read_cursor = _take_held(sm, UINT32_MAX, &held_size);
+    if (read_cursor != NULL) {
+        return read_cursor;
+    }
 
-        // If we have succeeded in writing, break out
-        if (store_offset > 0) {
-            break;
-        } else {
+    if (ck_ring_dequeue_spmc(&sm->ring, sm->ring_buffer, &read_cursor)) {
+        return read_cursor;
+    }
 
-            // Otherwise, attempt to allocate the next segment
-            // TODO: The write may fail for another reason, so we may not want to allocate a
-            // segment.  Improve error handling here.
+    return NULL;
+}
 
-            // Release the current segment, since we are no longer writing to it
-            sl->release_segment_for_writing(sl, current_write_segment);
+/*
+ * Pops the next record from wherever the oldest one is into buf, see pop_into
+ */
+int _pop_next_into(storage_manager_impl_t* sm, void *buf, uint32_t cap, uint32_t *len) {
 
-            // Try to sync everything we can, but not the currently writing segment, since there may
-            // be contention
-            // TODO: Factor out the sync logic into a private shared helper
-            storage_manager->sync(storage_manager, 0/*sync_currently_writing_segment*/);
+    // Same order as pop_cursor, the segments and then the ring
+    if (sm->readers != NULL) {
+        return _pop_ahead_into(sm, buf, cap, len);
+    }
 
-            // Actually do the allocation
-            ensure(_allocate_and_advance_write_segment(sm, current_write_segment) == 0,
-                   "Failed to allocate and advance write segment");
+    int ret = _pop_segments_into(sm, buf, cap, len);
+    if (sm->ring_buffer == NULL) {
+        return ret;
+    }
+
+    if (ret < 0 && ck_pr_load_32(&sm->spilled) > 0) {
+        if (pthread_mutex_trylock(&sm->producer_lock) == 0) {
+            pthread_mutex_unlock(&sm->producer_lock);
+            _sync_segments(sm, 1/*sync_currently_writing_segment*/);
+            ret = _pop_segments_into(sm, buf, cap, len);
+        }
+
+        if (ret < 0) {
+            return -1;
         }
     }
 
-    // Decrement the refcount on the segment, since we are not currently returning a cursor
-    sl->release_segment_for_writing(sl, current_write_segment);
+    if (ret == 0 || ret == DECOMPRESSION_FAULT) {
+        _release_spilled(sm);
+    }
+    if (ret >= 0) {
+        return ret;
+    }
 
-    return 0;
+    storage_manager_cursor_impl_t* record = _take_held(sm, cap, len);
+    if (record == NULL && *len > 0) {
+        return 1;
+    }
+    if (record == NULL && !ck_ring_dequeue_spmc(&sm->ring, sm->ring_buffer, &record)) {
+        return -1;
+    }
+
+    // The ring can not take a record back at the front, so one that does not fit is held
+    return _copy_record(sm, record, buf, cap, len);
 }
 
-/**
- * This returns a cursor that points at the beginning of the storage pool.  Internally it does this
- * by finding the first segment in the storage pool and then creating a cursor at the correct
- * location there.  Note that the storage manager has to keep track of the offset in the segment to
- * where we have read, not the store itself.
- *
- * Note that allocating the cursor increments the refcount of the segment that it is a part of, so
- * it must be explicitly freed.
- */
 storage_manager_cursor_t* _storage_manager_impl_pop_cursor(storage_manager_t *storage_manager) {
 
     // Get the private storage manager struct
     storage_manager_impl_t *sm = (storage_manager_impl_t*) storage_manager;
 
-    // A cursor that references a block of data in the storage manager
-    storage_manager_cursor_impl_t* read_cursor = NULL;
+    uint64_t start = _latency_start(sm);
+    storage_manager_cursor_impl_t* read_cursor = _pop_next(sm);
 
-    // Retry logic to deal with the fact that we may be racing other threads to get back a cursor
-    while (read_cursor == NULL) {
+    // A record too short to have a timestamp is corrupt.  pop_cursor has no way to say so, so it
+    // is counted and passed over.
+    while (read_cursor != NULL && sm->timestamps && read_cursor->cursor.size < SM_TIMESTAMP_SIZE) {
+        _count_popped(sm, 0);
+        _storage_manager_impl_free_cursor(storage_manager, (storage_manager_cursor_t*) read_cursor);
+        read_cursor = _pop_next(sm);
+    }
+    if (read_cursor == NULL) {
+        if (sm->timestamps) {
+            ck_pr_store_64(&sm->oldest_time, 0);
+        }
+        return NULL;
+    }
 
-        // Get the current read segment and the next close segment.
-        uint32_t current_read_segment = ck_pr_load_32(&sm->read_segment);
-        uint32_t next_close_segment = ck_pr_load_32(&sm->next_close_segment);
+    // Take the timestamp off the front, the data stays where it is
+    read_cursor->cursor.enqueue_time_ns = 0;
+    if (sm->timestamps) {
+        memcpy(&read_cursor->cursor.enqueue_time_ns, read_cursor->cursor.data, SM_TIMESTAMP_SIZE);
+        read_cursor->cursor.data = ((char*) read_cursor->cursor.data) + SM_TIMESTAMP_SIZE;
+        read_cursor->cursor.size -= SM_TIMESTAMP_SIZE;
+        _popped_stamp(sm, read_cursor->cursor.enqueue_time_ns);
+    }
 
-        // Since we got the current read segment first, there is no case where we should see that it
-        // is greater than our next close segment
-        ensure(current_read_segment <= next_close_segment,
-               "Invariant broken: Our current read segment is greater than our next close segment, "
-               "which means we are reading from a segment that was not yet closed and reopened.");
+    _latency_record(sm, SM_OP_POP, start);
+    _count_popped(sm, read_cursor->cursor.size);
+    return (storage_manager_cursor_t*) read_cursor;
+}
 
-        // Make sure we aren't reading when the segment we need to read from has not been synced yet
-        if (current_read_segment == next_close_segment) {
-            return NULL;
-        }
+int _storage_manager_impl_pop_into(storage_manager_t *storage_manager, void *buf, uint32_t cap,
+                                   uint32_t *len) {
 
-        // Try to pop a block of data from what we think is the current read segment
-        read_cursor = _pop_cursor(sm, current_read_segment);
+    // Get the private storage manager struct
+    storage_manager_impl_t *sm = (storage_manager_impl_t*) storage_manager;
 
-        // TODO: Return and handle errors from _pop_cursor
-        // If we failed to get the cursor, try to increment the read segment.  Note we are using CAS
-        // to make sure that two threads don't both increment the read segment unintentionally.
-        if (read_cursor == NULL) {
-            ck_pr_cas_32(&sm->read_segment, current_read_segment, current_read_segment + 1);
-        }
+    uint64_t start = _latency_start(sm);
+    int ret = _pop_next_into(sm, buf, cap, len);
+    if (ret < 0 && sm->timestamps) {
+        ck_pr_store_64(&sm->oldest_time, 0);
     }
 
-    return (storage_manager_cursor_t*) read_cursor;
+    // A record too short to have a timestamp is corrupt
+    if (ret == 0 && sm->timestamps && *len < SM_TIMESTAMP_SIZE) {
+        ret = DECOMPRESSION_FAULT;
+    }
+
+    // Take the timestamp off the front, which means moving the data down over it
+    if (ret == 0 && sm->timestamps) {
+        uint64_t enqueue_time = 0;
+        memcpy(&enqueue_time, buf, SM_TIMESTAMP_SIZE);
+        *len -= SM_TIMESTAMP_SIZE;
+        memmove(buf, ((char*) buf) + SM_TIMESTAMP_SIZE, *len);
+        _popped_stamp(sm, enqueue_time);
+    }
+
+    if (ret == 0) {
+        _latency_record(sm, SM_OP_POP, start);
+        _count_popped(sm, *len);
+    }
+
+    // A corrupt record is not waiting any more either
+    if (ret == DECOMPRESSION_FAULT) {
+        *len = _unstamped_size(sm, *len);
+        _count_popped(sm, *len);
+    }
+    return ret;
 }
 
 void _storage_manager_impl_free_cursor(storage_manager_t *storage_manager, storage_manager_cursor_t *storage_manager_cursor) {
@@ -294,7 +2849,14 @@ void _storage_manager_impl_free_cursor(storage_manager_t *storage_manager, stora
 
     storage_manager_cursor_impl_t *storage_manager_cursor_impl = (storage_manager_cursor_impl_t*) storage_manager_cursor;
 
+    // Records from the front ring own their data and hold no segment
+    if (storage_manager_cursor_impl->underlying_cursor == NULL) {
+        free(storage_manager_cursor_impl);
+        return;
+    }
+
     // Free the cursor, which decrements the refcount on the corresponding segment
+    SH_PROBE1(pop__free, storage_manager_cursor_impl->segment_number);
     _close_cursor(sm, storage_manager_cursor_impl);
 
     // Do not free the segment here.  _close_cursor frees it if the refcount is zero.
@@ -302,6 +2864,18 @@ void _storage_manager_impl_free_cursor(storage_manager_t *storage_manager, stora
     return;
 }
 
+/*
+ * Lets go of the segments the single producer and consumer are on, before the segment list goes
+ */
+void _drop_handles(storage_manager_impl_t* sm) {
+    _drop_write_handle(sm);
+    if (sm->read_handle != NULL) {
+        sm->segment_list->release_segment_for_reading(sm->segment_list,
+                                                      sm->read_handle->segment_number);
+        sm->read_handle = NULL;
+    }
+}
+
 int _storage_manager_impl_destroy(storage_manager_t *storage_manager) {
 
     // Get the private storage manager struct
@@ -310,13 +2884,35 @@ int _storage_manager_impl_destroy(storage_manager_t *storage_manager) {
     // Get the segment list
     segment_list_t *sl = sm->segment_list;
 
+    // The compactor and the worker pools work on the segment list, so they have to go first
+    _stop_compactor(sm);
+    _stop_writers(sm);
+    _stop_readers(sm);
+
     // Zero out the storage manager before we free it
-    ((storage_manager_t *)sm)->write       = NULL;
-    ((storage_manager_t *)sm)->pop_cursor  = NULL;
-    ((storage_manager_t *)sm)->free_cursor = NULL;
-    ((storage_manager_t *)sm)->destroy     = NULL;
-    ((storage_manager_t *)sm)->close       = NULL;
-    ((storage_manager_t *)sm)->sync        = NULL;
+    ((storage_manager_t *)sm)->write         = NULL;
+    ((storage_manager_t *)sm)->pop_cursor    = NULL;
+    ((storage_manager_t *)sm)->pop_into      = NULL;
+    ((storage_manager_t *)sm)->free_cursor   = NULL;
+    ((storage_manager_t *)sm)->destroy       = NULL;
+    ((storage_manager_t *)sm)->close         = NULL;
+    ((storage_manager_t *)sm)->sync          = NULL;
+    ((storage_manager_t *)sm)->get_stats     = NULL;
+    ((storage_manager_t *)sm)->get_latency   = NULL;
+    ((storage_manager_t *)sm)->depth         = NULL;
+    ((storage_manager_t *)sm)->backlog_bytes = NULL;
+
+    // Records still in the front ring are dropped along with the data files
+    if (sm->ring_buffer != NULL) {
+        _free_ring(sm);
+    }
+
+    _free_samples(sm);
+
+    if (sm->shared != NULL) {
+        _close_shared(sm, true);
+    }
+    _drop_handles(sm);
 
     // Destroy the segment list
     sl->destroy(sl);
@@ -324,6 +2920,12 @@ int _storage_manager_impl_destroy(storage_manager_t *storage_manager) {
     // Destroy the persistent sync values
     sm->sync_head->destroy(sm->sync_head);
     sm->sync_tail->destroy(sm->sync_tail);
+    sm->codec->destroy(sm->codec);
+    _close_counts(sm, true);
+
+    sh_stats_destroy(sm->stats);
+    _free_latency(sm);
+    _free_quota(sm);
 
     // Free the storage manager itself
     free(sm);
@@ -339,13 +2941,41 @@ int _storage_manager_impl_close(storage_manager_t *storage_manager) {
     // Get the segment list
     segment_list_t *sl = sm->segment_list;
 
+    // The compactor and the worker pools work on the segment list, so they have to go first
+    _stop_compactor(sm);
+    _stop_writers(sm);
+    _stop_readers(sm);
+
+    // Records still in the front ring only exist in memory, put them on disk so a reopened storage
+    // manager sees them
+    if (sm->ring_buffer != NULL) {
+        pthread_mutex_lock(&sm->producer_lock);
+        _spill_ring(sm);
+        pthread_mutex_unlock(&sm->producer_lock);
+        _sync_segments(sm, 1/*sync_currently_writing_segment*/);
+        _free_ring(sm);
+    }
+
     // Zero out the storage manager before we free it
-    ((storage_manager_t *)sm)->write       = NULL;
-    ((storage_manager_t *)sm)->pop_cursor  = NULL;
-    ((storage_manager_t *)sm)->free_cursor = NULL;
-    ((storage_manager_t *)sm)->destroy     = NULL;
-    ((storage_manager_t *)sm)->close       = NULL;
-    ((storage_manager_t *)sm)->sync        = NULL;
+    ((storage_manager_t *)sm)->write         = NULL;
+    ((storage_manager_t *)sm)->pop_cursor    = NULL;
+    ((storage_manager_t *)sm)->pop_into      = NULL;
+    ((storage_manager_t *)sm)->free_cursor   = NULL;
+    ((storage_manager_t *)sm)->destroy       = NULL;
+    ((storage_manager_t *)sm)->close         = NULL;
+    ((storage_manager_t *)sm)->sync          = NULL;
+    ((storage_manager_t *)sm)->get_stats     = NULL;
+    ((storage_manager_t *)sm)->get_latency   = NULL;
+    ((storage_manager_t *)sm)->depth         = NULL;
+    ((storage_manager_t *)sm)->backlog_bytes = NULL;
+
+    _free_samples(sm);
+
+    // The segment being written is sealed on the way, like a sync
+    if (sm->shared != NULL) {
+        _close_shared(sm, false);
+    }
+    _drop_handles(sm);
 
     // Close the segment list
     sl->close(sl);
@@ -353,6 +2983,12 @@ int _storage_manager_impl_close(storage_manager_t *storage_manager) {
     // Close the persistent sync values
     sm->sync_head->close(sm->sync_head);
     sm->sync_tail->close(sm->sync_tail);
+    sm->codec->close(sm->codec);
+    _close_counts(sm, false);
+
+    sh_stats_destroy(sm->stats);
+    _free_latency(sm);
+    _free_quota(sm);
 
     // Free the storage manager itself
     free(sm);
@@ -365,6 +3001,119 @@ int _storage_manager_impl_sync(storage_manager_t *storage_manager, int sync_curr
     // Get the private storage manager struct
     storage_manager_impl_t *sm = (storage_manager_impl_t*) storage_manager;
 
+    uint64_t start = _latency_start(sm);
+
+    // A sync is a durability point, so everything written so far has to reach the segments first
+    uint32_t failed = 0;
+    if (sm->workers != NULL) {
+        failed = _drain_writes(sm);
+    }
+    if (sm->ring_buffer != NULL) {
+        pthread_mutex_lock(&sm->producer_lock);
+        _spill_ring(sm);
+        pthread_mutex_unlock(&sm->producer_lock);
+    }
+
+    int ret = _sync_segments(sm, sync_currently_writing_segment);
+    if (ret == 0 && failed > 0) {
+        ret = 1;
+    }
+
+    _latency_record(sm, SM_OP_SYNC, start);
+    return ret;
+}
+
+int _storage_manager_impl_get_stats(storage_manager_t *storage_manager,
+                                    storage_manager_stats_t *stats) {
+
+    // Get the private storage manager struct
+    storage_manager_impl_t *sm = (storage_manager_impl_t*) storage_manager;
+
+    uint64_t counters[SH_STAT_COUNT];
+    sh_stats_sum(sm->stats, counters);
+
+    stats->records_written = counters[SH_STAT_RECORDS_WRITTEN];
+    stats->bytes_written = counters[SH_STAT_BYTES_WRITTEN];
+    stats->records_popped = counters[SH_STAT_RECORDS_POPPED];
+    stats->bytes_popped = counters[SH_STAT_BYTES_POPPED];
+    stats->syncs = counters[SH_STAT_SYNCS];
+    stats->sync_ns = counters[SH_STAT_SYNC_NS];
+
+    stats->segments_allocated = counters[SH_STAT_SEGMENTS_ALLOCATED];
+    stats->segments_reopened = counters[SH_STAT_SEGMENTS_REOPENED];
+    stats->segments_closed = counters[SH_STAT_SEGMENTS_CLOSED];
+    stats->segments_freed = counters[SH_STAT_SEGMENTS_FREED];
+
+    // The shards are summed one after the other, so a segment can be seen going away but not
+    // coming in
+    uint64_t opened = stats->segments_allocated + stats->segments_reopened;
+    uint64_t gone = stats->segments_closed + stats->segments_freed;
+    stats->segments_open = opened > gone ? opened - gone : 0;
+
+    stats->store_bytes_written = counters[SH_STAT_STORE_BYTES_WRITTEN];
+    stats->write_retries = counters[SH_STAT_WRITE_RETRIES];
+    stats->pop_retries = counters[SH_STAT_POP_RETRIES];
+
+    stats->lz4_bytes_in = counters[SH_STAT_LZ4_BYTES_IN];
+    stats->lz4_bytes_out = counters[SH_STAT_LZ4_BYTES_OUT];
+    stats->lz4_raw_frames = counters[SH_STAT_LZ4_RAW_FRAMES];
+    stats->lz4_decompressions = counters[SH_STAT_LZ4_DECOMPRESSIONS];
+
+    uint64_t oldest_time = ck_pr_load_64(&sm->oldest_time);
+    uint64_t now = sh_stats_wall_ns();
+    stats->oldest_unconsumed_age_ns = oldest_time != 0 && now > oldest_time ? now - oldest_time : 0;
+
+    stats->quota_waits = counters[SH_STAT_QUOTA_WAITS];
+    stats->quota_rejections = counters[SH_STAT_QUOTA_REJECTIONS];
+    stats->records_dropped = counters[SH_STAT_RECORDS_DROPPED];
+
+    return 0;
+}
+
+int _storage_manager_impl_get_latency(storage_manager_t *storage_manager,
+                                      enum storage_manager_operation operation,
+                                      storage_manager_latency_t *latency) {
+
+    // Get the private storage manager struct
+    storage_manager_impl_t *sm = (storage_manager_impl_t*) storage_manager;
+
+    if (operation >= SM_OPERATIONS || sm->latency[operation] == NULL) {
+        return -1;
+    }
+
+    uint64_t counts[SH_HISTOGRAM_BUCKETS];
+    latency->count = sh_histogram_sum(sm->latency[operation], counts);
+    latency->p50_ns = sh_histogram_percentile(counts, 50);
+    latency->p90_ns = sh_histogram_percentile(counts, 90);
+    latency->p99_ns = sh_histogram_percentile(counts, 99);
+    latency->p999_ns = sh_histogram_percentile(counts, 99.9);
+    latency->max_ns = sh_histogram_percentile(counts, 100);
+    return 0;
+}
+
+uint64_t _storage_manager_impl_depth(storage_manager_t *storage_manager) {
+    return _depth((storage_manager_impl_t*) storage_manager);
+}
+
+uint64_t _storage_manager_impl_backlog_bytes(storage_manager_t *storage_manager) {
+    return _backlog_bytes((storage_manager_impl_t*) storage_manager);
+}
+
+/*
+ * Syncs every segment up to the current write segment, and that one too if
+ * sync_currently_writing_segment is set, then closes the synced segments nobody is reading.
+ */
+int _sync_segments(storage_manager_impl_t* sm, int sync_currently_writing_segment) {
+
+    if (sm->shared != NULL) {
+        return _sync_shared(sm, sync_currently_writing_segment);
+    }
+
+    // Syncing the write segment moves the write segment on, so the single producer lets go of it
+    if (sync_currently_writing_segment) {
+        _drop_write_handle(sm);
+    }
+
     // Get the segment list
     segment_list_t *sl = sm->segment_list;
 
@@ -434,7 +3183,16 @@ int _storage_manager_impl_sync(storage_manager_t *storage_manager, int sync_curr
         // TODO: This forces us to finish the sync for testing purposes, but perhaps we actually
         // want to return with some kind of error.  Think about the signature and guarantees
         // provided by this function.
+        uint64_t sync_start = sh_stats_now_ns();
         while (store_to_sync->sync(store_to_sync) != 0);
+        sh_stats_add(sm->stats, SH_STAT_SYNCS, 1);
+        sh_stats_add(sm->stats, SH_STAT_SYNC_NS, sh_stats_now_ns() - sync_start);
+
+        // The counts only feed depth and backlog_bytes, so they are not worth a second wait for the
+        // disk on every sync.  They go out along with it, and a crash before they land only leaves
+        // the counts of the last segments synced short.  Writers that finished just before the sync
+        // count once they are done, so this takes theirs too.
+        _sync_counts(sm, MS_ASYNC);
 
         // Increment the next sync segment (CAS to avoid incrementing more than once)
         sm->sync_head->compare_and_swap(sm->sync_head, current_sync_head, current_sync_head + 1);
@@ -471,6 +3229,7 @@ int _storage_manager_impl_sync(storage_manager_t *storage_manager, int sync_curr
            "Invariant broken: Our next close segment is greater than our current sync head, "
            "which means we have closed a segment that has not yet been synced.");
 
+    bool closed = false;
     while (next_close_segment < current_sync_head) {
 
         // Try to close this segment
@@ -486,33 +3245,141 @@ int _storage_manager_impl_sync(storage_manager_t *storage_manager, int sync_curr
                "Failed to advance the next close segment");
 
         next_close_segment = ck_pr_load_32(&sm->next_close_segment);
+        closed = true;
+    }
+
+    // Closed segments are readable, so there is something for the read ahead workers
+    if (closed) {
+        _wake_readers(sm);
     }
 
     return 0;
 }
 
+/*
+ * Strips the flags that do not apply to a codec or to SM_SHARED, and adds the ones the codec implies
+ */
+int _codec_flags(uint32_t codec_value, int flags) {
+
+    // These all work on segments that SM_SHARED hands to one process at a time.  SM_ASYNC_WRITE
+    // would also answer for the quota policy before it has had its say on the record.
+    if (codec_value & SM_CODEC_SHARED) {
+        flags = flags & ~(SM_RING_BUFFER | SM_COMPACT(0xF) | SM_READ_AHEAD(0xF) |
+                          SM_ASYNC_WRITE(0xF));
+    }
+
+    switch (SM_CODEC_EXTRACT(codec_value)) {
+        case SM_CODEC_NONE:
+            return flags & ~(SM_LZ4_DICTIONARY | SM_COMPACT(0xF));
+        case SM_CODEC_LZ4_FRAMED:
+            return flags | LZ4_BLOCKS;
+        case SM_CODEC_LZ4_STREAM:
+            return (flags & ~(SM_LZ4_DICTIONARY | LZ4_BLOCKS)) | LZ4_STREAM;
+        default:
+            return flags;
+    }
+}
+
+/*
+ * Points the segment list at the store stack for a codec, before any segment is allocated
+ */
+void _apply_codec(storage_manager_impl_t* sm, uint32_t codec_value) {
+    segment_list_t *sl = sm->segment_list;
+    enum storage_manager_codec codec = SM_CODEC_EXTRACT(codec_value);
+    int level = codec == SM_CODEC_LZ4HC ? SM_LEVEL_EXTRACT(codec_value) : 0;
+    sl->set_compression(sl, codec != SM_CODEC_NONE, level);
+}
+
+/*
+ * Turns SM_SINGLE_PRODUCER and SM_SINGLE_CONSUMER into the store flags they stand for, unless a mode
+ * that writes or pops from threads of its own is on
+ */
+int _single_flags(int flags, const storage_manager_options_t *options) {
+    if ((flags & SM_SINGLE_PRODUCER) && !(flags & (SM_RING_BUFFER | SM_ASYNC_WRITE(0)))) {
+        flags = flags | SINGLE_WRITER;
+    }
+    if ((flags & SM_SINGLE_CONSUMER) && !(flags & SM_READ_AHEAD(0)) &&
+        options->quota_policy != SM_QUOTA_DROP_OLDEST) {
+        flags = flags | SINGLE_READER;
+    }
+    return flags;
+}
+
+/*
+ * Sets up SM_SINGLE_PRODUCER and SM_SINGLE_CONSUMER from the flags _single_flags left
+ */
+void _init_single(storage_manager_impl_t* sm, int flags) {
+    sm->single_producer = (flags & SINGLE_WRITER) != 0;
+    sm->single_consumer = (flags & SINGLE_READER) != 0;
+}
+
+uint32_t _options_codec_value(const storage_manager_options_t *options) {
+    ensure(options->codec >= SM_CODEC_LZ4 && options->codec <= SM_CODEC_LZ4_STREAM,
+           "Unknown codec");
+    ensure(options->level >= 0 && options->level <= 16, "High compression level out of range");
+
+    int level = options->level;
+    if (options->codec != SM_CODEC_LZ4HC) level = 0;
+    else if (level == 0) level = 9;
+    return SM_CODEC_VALUE(options->codec, level);
+}
+
 // Storage manager constructor
 storage_manager_t* create_storage_manager(const char* base_dir, const char* name, int segment_size, int flags) {
+    storage_manager_options_t options = { .codec = SM_CODEC_LZ4, .level = 0, .flags = flags };
+    return create_storage_manager_with_options(base_dir, name, segment_size, &options);
+}
+
+storage_manager_t* create_storage_manager_with_options(const char* base_dir, const char* name,
+                                                       int segment_size,
+                                                       const storage_manager_options_t *options) {
+    uint32_t codec_value = _options_codec_value(options);
+    if (options->flags & SM_TIMESTAMPS) {
+        codec_value |= SM_CODEC_TIMESTAMPS;
+    }
+    if (options->flags & SM_SHARED) {
+        codec_value |= SM_CODEC_SHARED;
+    }
+    int flags = _single_flags(_codec_flags(codec_value, options->flags), options);
 
     // First, allocate the storage manager
     storage_manager_impl_t *sm = (storage_manager_impl_t*) calloc(1, sizeof(storage_manager_impl_t));
 
-    // Save the base_dir filename so we can unlock it when we close the storage_manager
-    sm->base_dir = base_dir;
-
     // TODO: Handle this error
     ensure(sm != NULL, "failed to allocate storage_manager");
 
+    // Save the base_dir filename so we can unlock it when we close the storage_manager
+    sm->base_dir = base_dir;
+    sm->timestamps = (codec_value & SM_CODEC_TIMESTAMPS) != 0;
+
     // Now initialize the methods
-    ((storage_manager_t *)sm)->write       = &_storage_manager_impl_write;
-    ((storage_manager_t *)sm)->pop_cursor  = &_storage_manager_impl_pop_cursor;
-    ((storage_manager_t *)sm)->free_cursor = &_storage_manager_impl_free_cursor;
-    ((storage_manager_t *)sm)->destroy     = &_storage_manager_impl_destroy;
-    ((storage_manager_t *)sm)->close       = &_storage_manager_impl_close;
-    ((storage_manager_t *)sm)->sync        = &_storage_manager_impl_sync;
+    ((storage_manager_t *)sm)->write         = &_storage_manager_impl_write;
+    ((storage_manager_t *)sm)->pop_cursor    = &_storage_manager_impl_pop_cursor;
+    ((storage_manager_t *)sm)->pop_into      = &_storage_manager_impl_pop_into;
+    ((storage_manager_t *)sm)->free_cursor   = &_storage_manager_impl_free_cursor;
+    ((storage_manager_t *)sm)->destroy       = &_storage_manager_impl_destroy;
+    ((storage_manager_t *)sm)->close         = &_storage_manager_impl_close;
+    ((storage_manager_t *)sm)->sync          = &_storage_manager_impl_sync;
+    ((storage_manager_t *)sm)->get_stats     = &_storage_manager_impl_get_stats;
+    ((storage_manager_t *)sm)->get_latency   = &_storage_manager_impl_get_latency;
+    ((storage_manager_t *)sm)->depth         = &_storage_manager_impl_depth;
+    ((storage_manager_t *)sm)->backlog_bytes = &_storage_manager_impl_backlog_bytes;
+
+    // Now initialize the counters, which the segment list gets too
+    sm->stats = sh_stats_create();
+    ensure(sm->stats != NULL, "Failed to allocate stats");
+    _init_latency(sm, flags);
+    _init_quota(sm, options);
+    _init_single(sm, flags);
+
+    // Now initialize the front ring and the dictionary samples, if we are using them
+    _init_ring(sm, flags);
+    _init_samples(sm, flags);
 
     // Now initialize the segment list
     sm->segment_list = create_segment_list(base_dir, name, segment_size, flags);
+    sm->segment_list->stats = sm->stats;
+    _apply_codec(sm, codec_value);
 
     // Now initialize the atomic sync values
     int atomic_sync_flags = 0;
@@ -532,29 +3399,104 @@ storage_manager_t* create_storage_manager(const char* base_dir, const char* name
     sm->sync_tail = create_persistent_atomic_value(base_dir, sync_tail_name, atomic_sync_flags);
     free(sync_tail_name);
 
+    char* codec_name = NULL;
+    ensure(asprintf(&codec_name, "%s.codec", name) > 0, "Failed to allocate codec_name");
+    sm->codec = create_persistent_atomic_value(base_dir, codec_name, atomic_sync_flags);
+    free(codec_name);
+    if (codec_value != 0) {
+        ensure(sm->codec->compare_and_swap(sm->codec, 0, codec_value) == 0,
+               "Failed to persist codec");
+    }
+    _open_counts(sm, base_dir, name, true);
+    if (codec_value & SM_CODEC_SHARED) {
+        _init_shared(sm, base_dir, name, true);
+    }
+
+    _start_compactor(sm, flags);
+    _start_writers(sm, flags);
+    _start_readers(sm, flags);
+
     return (storage_manager_t*) sm;
 }
 
 // Why do I have this as well as create?  Even the mmap store does nothing for this method.  Should
 // there be a destroy store?  A close store?
 storage_manager_t* open_storage_manager(const char* base_dir, const char* name, int segment_size, int flags) {
+    storage_manager_options_t options = { .codec = SM_CODEC_LZ4, .level = 0, .flags = flags };
+    return open_storage_manager_with_options(base_dir, name, segment_size, &options);
+}
+
+/*
+ * Opens the persisted codec of a queue.  Queues from before codecs were persisted were all lz4, so
+ * those get an lz4 one.
+ */
+persistent_atomic_value_t* _open_codec(const char* base_dir, const char* name) {
+    char* codec_name = NULL;
+    char* codec_path = NULL;
+    char* codec_temporary_path = NULL;
+    ensure(asprintf(&codec_name, "%s.codec", name) > 0, "Failed to allocate codec_name");
+    ensure(asprintf(&codec_path, "%s/%s", base_dir, codec_name) > 0,
+           "Failed to allocate codec_path");
+    ensure(asprintf(&codec_temporary_path, "%s.tmp", codec_path) > 0,
+           "Failed to allocate codec_temporary_path");
+
+    persistent_atomic_value_t* codec = NULL;
+    if (access(codec_path, F_OK) == 0 || access(codec_temporary_path, F_OK) == 0) {
+        codec = open_persistent_atomic_value(base_dir, codec_name);
+    } else {
+        codec = create_persistent_atomic_value(base_dir, codec_name, 0);
+    }
+    ensure(codec != NULL, "Failed to open codec");
+
+    free(codec_name);
+    free(codec_path);
+    free(codec_temporary_path);
+    return codec;
+}
+
+storage_manager_t* open_storage_manager_with_options(const char* base_dir, const char* name,
+                                                     int segment_size,
+                                                     const storage_manager_options_t *options) {
+    // Validated even though the persisted codec wins, so bad options fail the same either way
+    _options_codec_value(options);
+
+    persistent_atomic_value_t* codec = _open_codec(base_dir, name);
+    uint32_t codec_value = codec->get_value(codec);
+    int flags = _single_flags(_codec_flags(codec_value, options->flags), options);
 
     // First, allocate the storage manager
     storage_manager_impl_t *sm = (storage_manager_impl_t*) calloc(1, sizeof(storage_manager_impl_t));
 
-    // Save the base_dir filename so we can unlock it when we close the storage_manager
-    sm->base_dir = base_dir;
-
     // TODO: Handle this error
     ensure(sm != NULL, "failed to allocate storage_manager");
 
+    // Save the base_dir filename so we can unlock it when we close the storage_manager
+    sm->base_dir = base_dir;
+    sm->timestamps = (codec_value & SM_CODEC_TIMESTAMPS) != 0;
+
     // Now initialize the methods
-    ((storage_manager_t *)sm)->write       = &_storage_manager_impl_write;
-    ((storage_manager_t *)sm)->pop_cursor  = &_storage_manager_impl_pop_cursor;
-    ((storage_manager_t *)sm)->free_cursor = &_storage_manager_impl_free_cursor;
-    ((storage_manager_t *)sm)->destroy     = &_storage_manager_impl_destroy;
-    ((storage_manager_t *)sm)->close       = &_storage_manager_impl_close;
-    ((storage_manager_t *)sm)->sync        = &_storage_manager_impl_sync;
+    ((storage_manager_t *)sm)->write         = &_storage_manager_impl_write;
+    ((storage_manager_t *)sm)->pop_cursor    = &_storage_manager_impl_pop_cursor;
+    ((storage_manager_t *)sm)->pop_into      = &_storage_manager_impl_pop_into;
+    ((storage_manager_t *)sm)->free_cursor   = &_storage_manager_impl_free_cursor;
+    ((storage_manager_t *)sm)->destroy       = &_storage_manager_impl_destroy;
+    ((storage_manager_t *)sm)->close         = &_storage_manager_impl_close;
+    ((storage_manager_t *)sm)->sync          = &_storage_manager_impl_sync;
+    ((storage_manager_t *)sm)->get_stats     = &_storage_manager_impl_get_stats;
+    ((storage_manager_t *)sm)->get_latency   = &_storage_manager_impl_get_latency;
+    ((storage_manager_t *)sm)->depth         = &_storage_manager_impl_depth;
+    ((storage_manager_t *)sm)->backlog_bytes = &_storage_manager_impl_backlog_bytes;
+
+    // Now initialize the counters, which the segment list gets too
+    sm->stats = sh_stats_create();
+    ensure(sm->stats != NULL, "Failed to allocate stats");
+    _init_latency(sm, flags);
+    _init_quota(sm, options);
+    _init_single(sm, flags);
+
+    // Now initialize the front ring and the dictionary samples, if we are using them
+    _init_ring(sm, flags);
+    _init_samples(sm, flags);
 
     // Now initialize the atomic sync values
     char* sync_head_name = NULL;
@@ -578,13 +3520,26 @@ storage_manager_t* open_storage_manager(const char* base_dir, const char* name,
     sm->segment_list = open_segment_list(base_dir, name, segment_size, flags,
             sm->sync_tail->get_value(sm->sync_tail),
             sm->sync_head->get_value(sm->sync_head));
+    sm->segment_list->stats = sm->stats;
+    sm->codec = codec;
+    _apply_codec(sm, codec_value);
+    _open_counts(sm, base_dir, name, false);
+    _load_counts(sm);
 
-    // Initialize the current write segment
+    // Initialize the current write segment.  SM_SHARED claims segments as it needs them instead.
     sm->write_segment = sm->sync_head->get_value(sm->sync_head);
-    int ret = sm->segment_list->allocate_segment(sm->segment_list, sm->write_segment);
+    if (codec_value & SM_CODEC_SHARED) {
+        _init_shared(sm, base_dir, name, false);
+    } else {
+        int ret = sm->segment_list->allocate_segment(sm->segment_list, sm->write_segment);
+
+        // This should not fail.  This function should be called in a single threaded context
+        ensure(ret == 0, "Failed to allocate segment to write to");
+    }
 
-    // This should not fail.  This function should be called in a single threaded context
-    ensure(ret == 0, "Failed to allocate segment to write to");
+    _start_compactor(sm, flags);
+    _start_writers(sm, flags);
+    _start_readers(sm, flags);
 
     return (storage_manager_t*) sm;
 }
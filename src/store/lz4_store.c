@@ -1,99 +1,965 @@
 #include "store.h"
+#include "stats.h"
 #include <lz4.h>
+#include <lz4hc.h>
+#include <string.h>
+#include <ck_pr.h>
+#include <spinlock/fas.h>
+#include <pthread.h>
 
-#define MAX_DECOMP_ATTEMPTS 5
+// Every record is framed as [flags | compressed size, true size, bytes].  The flags live in the top
+// bits of the first word:
+//  RAW - the bytes are the record as it was written
+//  DICT - the bytes were compressed against the store's dictionary
+//  DICTIONARY - the bytes are the store's dictionary
+//  BLOCK - the bytes are an LZ4_BLOCKS block of records rather than a single record
+//  INFO - the bytes are the size of the largest frame in the store once decompressed
+//  STREAM - the bytes were compressed against the records before it, back to its restart frame
+// DICTIONARY and INFO frames only ever come before any records, and are not records themselves.
+// STREAM frames carry the delegate offset of their restart frame in a third word before the bytes.
+#define LZ4_FRAME_RAW        0x80000000U
+#define LZ4_FRAME_DICT       0x40000000U
+#define LZ4_FRAME_DICTIONARY 0x20000000U
+#define LZ4_FRAME_BLOCK      0x10000000U
+#define LZ4_FRAME_INFO       0x08000000U
+#define LZ4_FRAME_STREAM     0x04000000U
+#define LZ4_FRAME_SIZE_MASK  0x03FFFFFFU
+#define LZ4_FRAME_HEADER     (LZ4_FRAME_DICTIONARY | LZ4_FRAME_INFO)
+
+// An LZ4_BLOCKS block is the records back to back, then the offset of each record in the block,
+// then the number of records.  A block is flushed once it would go over LZ4_BLOCK_SIZE bytes of
+// records or LZ4_BLOCK_MAX_RECORDS records, and records bigger than a block get a frame of their
+// own.
+#define LZ4_BLOCK_SIZE (64 * 1024)
+#define LZ4_BLOCK_MAX_RECORDS 1024
+
+// An LZ4_STREAM store restarts every LZ4_STREAM_RESTART records with an ordinary frame, which is
+// as far back as a reader seeking into the middle has to go.  Records go through a window that
+// keeps the last LZ4_STREAM_HISTORY bytes of them, all lz4 can reach back anyway, and records
+// bigger than LZ4_STREAM_RECORD_MAX skip it and get an ordinary frame, so the next one restarts.
+// The window only slides once it is over twice the history, so that it never overlaps itself.
+#define LZ4_STREAM_RESTART 64
+#define LZ4_STREAM_HISTORY (64 * 1024)
+#define LZ4_STREAM_RECORD_MAX (64 * 1024)
+#define LZ4_STREAM_WINDOW ((LZ4_STREAM_HISTORY * 2) + LZ4_STREAM_RECORD_MAX)
+
+// Decompression buffers each thread keeps around for its next cursors
+#define LZ4_BUFFER_POOL 4
+
+// Records smaller than this are stored raw, lz4 can not find enough in them to pay for itself
+#define LZ4_RAW_THRESHOLD 64
+
+// How much of a record the compressibility probe looks at, and the size of its hash table
+#define LZ4_PROBE_SIZE 512
+#define LZ4_PROBE_HASH_LOG 8
+
+// The probe wants at least one repeated sequence per this many positions to bother compressing
+#define LZ4_PROBE_MATCH_RATIO 16
+
+// Dictionary training counts how many samples each sequence of LZ4_DICT_GRAM bytes shows up in,
+// then fills the dictionary with the runs of LZ4_DICT_SEGMENT bytes that cover the most common ones
+#define LZ4_DICT_GRAM 8
+#define LZ4_DICT_SEGMENT 64
+#define LZ4_DICT_HASH_LOG 16
+
+// lz4 can only reach back this far, so a larger dictionary would be wasted
+#define LZ4_DICT_MAX_SIZE (64 * 1024)
+
+// A decompressed block, shared by the cursors popped from it
+struct lz4_block {
+    uint32_t refcount; // Must be CAS guarded
+
+    // Next record to pop, guarded by the store's pop lock
+    uint32_t next;
+
+    uint32_t records;
+    uint32_t size;
+
+    // Delegate offset of the frame this came from
+    uint32_t offset;
+    uint32_t __padding;
+
+    char data[];
+};
+
+// Records of an LZ4_STREAM store decompressed back to back, so each one can be decompressed against
+// the ones before it
+struct lz4_window {
+    char *data;
+    uint32_t used;
+
+    // Delegate offsets of the restart frame the window holds records since, and of the frame after
+    // the last one in it.  restart is 0 while the window holds nothing to go on.
+    uint32_t restart;
+    uint32_t next;
+    uint32_t __padding;
+};
 
 struct lz4_store {
     store_t store;
     store_t *underlying_store;
+
+    // Dictionary records are compressed against, or NULL if there is none.  A store opened with a
+    // dictionary owns a copy of it, a reopened store points into its header frames, found the first
+    // time a reader needs it.
+    const char *dictionary;
+    char *owned_dictionary;
+
+    // Compression state with the dictionary already loaded, copied for each record
+    LZ4_stream_t *dictionary_stream;
+
+    // Largest frame in the store once decompressed, in the INFO frame of the delegate so it is
+    // persisted along with the records.  NULL for stores without one.
+    uint32_t *max_frame;
+
+    uint32_t dictionary_size;
+
+    // Bytes the header frames take up at the start of the delegate, and whether we have looked
+    uint32_t header_bytes;
+    uint32_t header_loaded;
+
+    // lz4 high compression level records are compressed with, 0 for lz4's fast mode
+    int level;
+
+    // LZ4_BLOCKS staging block and the offsets of the records in it, NULL until the first write.
+    // These and every write to the delegate in LZ4_BLOCKS mode are guarded by the block lock.
+    char *block;
+    uint32_t *block_offsets;
+
+    // Block popped records are being handed out of, and a frame pop_into popped but could not fit,
+    // both guarded by the pop lock
+    struct lz4_block *pop_block;
+    store_cursor_t *pending_frame;
+
+    // LZ4_STREAM compression state and the window of records it compresses against, NULL until the
+    // first write, and the restart frame and records since it.  Guarded by the block lock.
+    LZ4_stream_t *stream;
+    char *stream_window;
+    uint32_t stream_used;
+    uint32_t stream_records;
+    uint32_t stream_restart;
+    uint32_t __padding;
+
+    // Window pops decompress stream frames into, guarded by the pop lock
+    struct lz4_window pop_window;
+
+    uint32_t block_bytes;
+    uint32_t block_records;
+
+    // Set by sync, after which staged writes are refused like the delegate refuses its own
+    uint32_t sealed;
+
+    int flags;
+    ck_spinlock_fas_t block_lock;
+    ck_spinlock_fas_t pop_lock;
 };
 
 struct lz4_store_cursor {
     store_cursor_t cursor;
     store_cursor_t *delegate;
+    struct lz4_store *store;
+
+    // Buffer we decompress into.  The cursor data points straight into the delegate instead for
+    // raw records.
+    void *buffer;
+
+    // Block a popped cursor's record lives in, in which case there is no delegate
+    struct lz4_block *block;
+
     uint32_t buffer_size;
+
+    // Records in the block buffer holds and the one we are on, for cursors that walk blocks
+    uint32_t block_records;
+    uint32_t block_index;
     uint32_t __padding;
+
+    // Window stream frames are decompressed into, for cursors that walk them
+    struct lz4_window window;
 };
 
-uint32_t _lz4_store_write(store_t *store, void *data, uint32_t size) {
+// Compression state for each thread, so that compressing a record does not need to allocate one
+static __thread LZ4_stream_t __lz4_state;
+
+// The high compression state is far bigger, so each thread only allocates one if it needs it, and
+// the key frees it when the thread exits
+static pthread_key_t __lz4_hc_key;
+static pthread_once_t __lz4_hc_once = PTHREAD_ONCE_INIT;
+
+static void __lz4_hc_key_create() {
+    ensure(pthread_key_create(&__lz4_hc_key, &free) == 0,
+           "Failed to create high compression state key");
+}
+
+void* __lz4_hc_state() {
+    pthread_once(&__lz4_hc_once, &__lz4_hc_key_create);
+
+    void *state = pthread_getspecific(__lz4_hc_key);
+    if (state == NULL) {
+        state = malloc(LZ4_sizeofStateHC());
+        ensure(state != NULL, "Failed to allocate high compression state");
+        pthread_setspecific(__lz4_hc_key, state);
+    }
+    return state;
+}
+
+/*
+ * Cheap guess at whether a record is worth compressing, made by looking for the repeated four byte
+ * sequences lz4 itself would find at the start of the record.  Already compressed or encrypted
+ * data has next to none of them.
+ */
+bool __lz4_probe_compressible(const char *data, uint32_t size) {
+    uint32_t sample = size < LZ4_PROBE_SIZE ? size : LZ4_PROBE_SIZE;
+
+    // Last position + 1 each hashed sequence was seen at
+    uint16_t seen[1 << LZ4_PROBE_HASH_LOG];
+    memset(seen, 0, sizeof(seen));
+
+    uint32_t matches = 0;
+    for (uint32_t i = 0; i + sizeof(uint32_t) <= sample; i++) {
+        uint32_t sequence;
+        memcpy(&sequence, data + i, sizeof(uint32_t));
+        uint32_t hash = (sequence * 2654435761U) >> (32 - LZ4_PROBE_HASH_LOG);
+
+        if (seen[hash] != 0 && memcmp(data + seen[hash] - 1, data + i, sizeof(uint32_t)) == 0) {
+            matches++;
+        }
+        seen[hash] = i + 1;
+    }
+
+    return matches * LZ4_PROBE_MATCH_RATIO >= sample;
+}
+
+/*
+ * Builds the frame for a record at frame, which must have room for the larger of the two
+ * encodings.  Records that do not come out any smaller compressed are kept raw.  frame_flags are
+ * added to whatever the encoding needs.
+ *
+ * return
+ *  the size of the frame
+ */
+uint32_t __lz4_store_frame(struct lz4_store *lstore, void *frame, void *data, uint32_t size,
+                           bool raw, uint32_t frame_flags) {
+    void *body = frame + (sizeof(uint32_t) * 2);
+
+    if (!raw) {
+        int compress_size = 0;
+        uint32_t compress_flags = 0;
+        if (lstore->dictionary_stream != NULL) {
+            // Starting from a copy of the loaded state is much cheaper than loading the dictionary
+            memcpy(&__lz4_state, lstore->dictionary_stream, sizeof(LZ4_stream_t));
+            compress_size = LZ4_compress_continue(&__lz4_state, data, body, size);
+            compress_flags = LZ4_FRAME_DICT;
+        } else if (lstore->level > 0) {
+            compress_size = LZ4_compressHC2_withStateHC(__lz4_hc_state(), data, body, size,
+                                                        lstore->level);
+        } else {
+            compress_size = LZ4_compress_withState(&__lz4_state, data, body, size);
+        }
+        ensure(compress_size > 0, "Compression into LZ4_compressBound bytes failed");
+
+        if (compress_size < size) {
+            ((uint32_t*)frame)[0] = frame_flags | compress_flags | compress_size;
+            ((uint32_t*)frame)[1] = size;
+            sh_stats_add(lstore->store.stats, SH_STAT_LZ4_BYTES_IN, size);
+            sh_stats_add(lstore->store.stats, SH_STAT_LZ4_BYTES_OUT, compress_size);
+            return compress_size + (sizeof(uint32_t) * 2);
+        }
+    }
+
+    memcpy(body, data, size);
+    ((uint32_t*)frame)[0] = frame_flags | LZ4_FRAME_RAW | size;
+    ((uint32_t*)frame)[1] = size;
+    sh_stats_add(lstore->store.stats, SH_STAT_LZ4_BYTES_IN, size);
+    sh_stats_add(lstore->store.stats, SH_STAT_LZ4_BYTES_OUT, size);
+    sh_stats_add(lstore->store.stats, SH_STAT_LZ4_RAW_FRAMES, 1);
+    return size + (sizeof(uint32_t) * 2);
+}
+
+/*
+ * Raises the largest frame size recorded in an INFO frame to size
+ */
+static inline void __lz4_raise_max_frame(uint32_t *max_frame, uint32_t size) {
+    uint32_t max = ck_pr_load_32(max_frame);
+    while (max < size && !ck_pr_cas_32_value(max_frame, max, size, &max));
+}
+
+/*
+ * Writes an INFO frame to an empty delegate, returning where its largest frame size lives in the
+ * delegate so it can be raised in place, or NULL if the delegate cannot reserve
+ */
+uint32_t* __lz4_write_info(store_t *delegate) {
     uint32_t offset = 0;
+    uint32_t frame_size = sizeof(uint32_t) * 3;
+    if (delegate->reserve == NULL) return NULL;
 
-    struct lz4_store *lz_store = (struct lz4_store*) store;
+    uint32_t *frame = delegate->reserve(delegate, frame_size, &offset);
+    if (frame == NULL) return NULL;
+
+    frame[0] = LZ4_FRAME_INFO | sizeof(uint32_t);
+    frame[1] = sizeof(uint32_t);
+    frame[2] = 0;
+    delegate->commit(delegate, offset, frame_size);
+    return &frame[2];
+}
+
+/*
+ * The most a frame for size bytes can take up in the delegate, counting the delegate's own header
+ */
+static inline uint32_t __lz4_frame_bound(uint32_t size) {
+    int bound = LZ4_compressBound(size);
+    return (sizeof(uint32_t) * 3) + ((uint32_t) bound > size ? (uint32_t) bound : size);
+}
+
+/*
+ * Appends a frame for size bytes of data to the delegate
+ *
+ * return
+ *  the offset of the frame in the delegate, 0 if it did not fit
+ */
+uint32_t __lz4_store_append(struct lz4_store *lz_store, void *data, uint32_t size, bool raw,
+                            uint32_t frame_flags) {
+    uint32_t offset = 0;
     store_t *delegate = lz_store->underlying_store;
 
-    // TODO - What to do if size > LZ4_MAX ?
-    int comp_buffer_size = LZ4_compressBound(size);
-    int store_size = comp_buffer_size + (sizeof(uint32_t) * 2);
-
-    // TODO - I dont link this, it is dumb
-    // TODO - Can we avoid this allocation for small data ?
-    // .... Maybe prealloc one of these as a thread local that is
-    //  say 1-4mb (configurable) ?
-    //  with a size of less than 4mb using the pre-existing allocation
-    //  and a large one getting a heap alloc (that is play the same sort of
-    //  game that sun play in the JVM w.r.t TLABS ?)
-    void *buf = calloc(1, store_size);
-    if (buf == NULL) return -1;
-
-    void *comp_section = buf + (sizeof(uint32_t) * 2);
-    int compress_size = LZ4_compress(data, comp_section, size);
-    if (compress_size == 0) goto exit;
-
-    ((uint32_t*)buf)[0] = compress_size;
-    ((uint32_t*)buf)[1] = size;
-
-    offset = delegate->write(delegate, buf, 
-                             compress_size + (sizeof(uint32_t) * 2));
+    if (lz_store->max_frame != NULL) __lz4_raise_max_frame(lz_store->max_frame, size);
+
+    // Compressing might still come out no smaller, in which case the record is stored raw in the
+    // same space
+    uint32_t store_size = (sizeof(uint32_t) * 2) + size;
+    if (!raw) {
+        store_size = __lz4_frame_bound(size) - sizeof(uint32_t);
+    }
+
+    // Compress straight into the delegate, reserving enough for the worst case and giving back
+    // what we did not use at commit.  If the worst case does not fit, the record still might once
+    // compressed, so fall back to compressing on the side.
+    void *frame = NULL;
+    if (delegate->reserve != NULL) {
+        frame = delegate->reserve(delegate, store_size, &offset);
+    }
+
+    if (frame != NULL) {
+        return delegate->commit(delegate, offset,
+                                __lz4_store_frame(lz_store, frame, data, size, raw, frame_flags));
+    }
+
+    void *buf = malloc(store_size);
+    if (buf == NULL) return 0;
+
+    offset = delegate->write(delegate, buf,
+                             __lz4_store_frame(lz_store, buf, data, size, raw, frame_flags));
     // TODO check offset for errors, it might be, for instance
     // were we unable to store due to an out-of-space in the underlying
     // store ??
 
-exit:
-    // HACK FOR NOW
     free(buf);
     return offset;
 }
 
+/*
+ * Writes a record in a frame of its own
+ */
+uint32_t __lz4_store_write_record(struct lz4_store *lz_store, void *data, uint32_t size) {
+
+    // Records over LZ4_MAX_INPUT_SIZE can not be compressed at all.  With a dictionary even small
+    // records usually compress, so only whether they came out smaller decides.
+    ensure(size <= LZ4_FRAME_SIZE_MASK, "Record too large to frame");
+    bool raw = LZ4_compressBound(size) == 0;
+    if (lz_store->dictionary_stream == NULL) {
+        raw = raw || size < LZ4_RAW_THRESHOLD || !__lz4_probe_compressible(data, size);
+    }
+
+    return __lz4_store_append(lz_store, data, size, raw, 0);
+}
+
+/*
+ * Writes a record of an LZ4_STREAM store, compressed against the records before it unless it starts
+ * over with a restart frame
+ */
+uint32_t __lz4_store_stream(struct lz4_store *lz_store, void *data, uint32_t size) {
+    store_t *delegate = lz_store->underlying_store;
+    uint32_t offset = 0;
+
+    ck_spinlock_fas_lock(&lz_store->block_lock);
+
+    if (lz_store->stream == NULL) {
+        lz_store->stream = LZ4_createStream();
+        lz_store->stream_window = malloc(LZ4_STREAM_WINDOW);
+        ensure(lz_store->stream != NULL && lz_store->stream_window != NULL,
+               "Failed to allocate stream window");
+    }
+
+    // Too big for the window, so the record after it starts over
+    if (size > LZ4_STREAM_RECORD_MAX) {
+        offset = __lz4_store_write_record(lz_store, data, size);
+        if (offset != 0) lz_store->stream_records = 0;
+        goto end;
+    }
+
+    bool restart = lz_store->stream_records == 0;
+    uint32_t header = sizeof(uint32_t) * (restart ? 2 : 3);
+    uint32_t bound = LZ4_compressBound(size);
+    uint32_t frame_size = header + (bound > size ? bound : size);
+
+    // The stream only moves on once we know the frame fits
+    uint32_t *frame = delegate->reserve(delegate, frame_size, &offset);
+    if (frame == NULL) {
+        offset = 0;
+        goto end;
+    }
+
+    if (restart) {
+        LZ4_resetStream(lz_store->stream);
+        lz_store->stream_used = 0;
+    } else if (lz_store->stream_used + size > LZ4_STREAM_WINDOW) {
+        uint32_t keep = lz_store->stream_used < LZ4_STREAM_HISTORY ?
+                        lz_store->stream_used : LZ4_STREAM_HISTORY;
+        LZ4_saveDict(lz_store->stream, lz_store->stream_window, keep);
+        lz_store->stream_used = keep;
+    }
+
+    char *source = lz_store->stream_window + lz_store->stream_used;
+    memcpy(source, data, size);
+    lz_store->stream_used += size;
+
+    // The record is history for the next one even if it is stored raw
+    char *body = ((char*) frame) + header;
+    int compress_size = LZ4_compress_continue(lz_store->stream, source, body, size);
+    ensure(compress_size > 0, "Compression into LZ4_compressBound bytes failed");
+
+    uint32_t frame_flags = restart ? 0 : LZ4_FRAME_STREAM;
+    if (compress_size >= size) {
+        memcpy(body, source, size);
+        frame_flags |= LZ4_FRAME_RAW;
+        compress_size = size;
+        sh_stats_add(lz_store->store.stats, SH_STAT_LZ4_RAW_FRAMES, 1);
+    }
+    sh_stats_add(lz_store->store.stats, SH_STAT_LZ4_BYTES_IN, size);
+    sh_stats_add(lz_store->store.stats, SH_STAT_LZ4_BYTES_OUT, compress_size);
+
+    frame[0] = frame_flags | compress_size;
+    frame[1] = size;
+    if (!restart) frame[2] = lz_store->stream_restart;
+    offset = delegate->commit(delegate, offset, header + compress_size);
+
+    if (restart) lz_store->stream_restart = offset;
+    lz_store->stream_records = (lz_store->stream_records + 1) % LZ4_STREAM_RESTART;
+    if (lz_store->max_frame != NULL) __lz4_raise_max_frame(lz_store->max_frame, size);
+
+end:
+    ck_spinlock_fas_unlock(&lz_store->block_lock);
+    return offset;
+}
+
+/*
+ * The most the staging block takes up in the delegate once flushed, with records and bytes in it
+ */
+static inline uint32_t __lz4_block_bound(uint32_t bytes, uint32_t records) {
+    return __lz4_frame_bound(bytes + (sizeof(uint32_t) * (records + 1)));
+}
+
+/*
+ * Compresses the staging block into a frame of the delegate.  The caller must hold the block lock.
+ * Records are only ever staged if the block still fits afterwards, so this can not run out of room.
+ */
+void __lz4_store_flush_block(struct lz4_store *lz_store) {
+    uint32_t records = lz_store->block_records;
+    if (records == 0) return;
+
+    char *block = lz_store->block;
+    uint32_t size = lz_store->block_bytes;
+    memcpy(block + size, lz_store->block_offsets, sizeof(uint32_t) * records);
+    size += sizeof(uint32_t) * records;
+    memcpy(block + size, &records, sizeof(uint32_t));
+    size += sizeof(uint32_t);
+
+    ensure(__lz4_store_append(lz_store, block, size, false, LZ4_FRAME_BLOCK) != 0,
+           "Failed to flush a block that was known to fit");
+
+    lz_store->block_bytes = 0;
+    lz_store->block_records = 0;
+}
+
+/*
+ * Adds a record to the staging block, flushing the block first if it is full
+ */
+uint32_t __lz4_store_stage(struct lz4_store *lz_store, void *data, uint32_t size) {
+    store_t *delegate = lz_store->underlying_store;
+    uint32_t offset = 0;
+
+    ck_spinlock_fas_lock(&lz_store->block_lock);
+
+    // Like any other store, nothing more goes in once it is synced
+    if (lz_store->sealed) goto end;
+
+    if (lz_store->block == NULL) {
+        lz_store->block = malloc(LZ4_BLOCK_SIZE + (sizeof(uint32_t) * (LZ4_BLOCK_MAX_RECORDS + 1)));
+        lz_store->block_offsets = malloc(sizeof(uint32_t) * LZ4_BLOCK_MAX_RECORDS);
+        ensure(lz_store->block != NULL && lz_store->block_offsets != NULL,
+               "Failed to allocate staging block");
+    }
+
+    // Records too big for a block get their own frame, behind whatever is staged so they stay in
+    // order
+    if (size > LZ4_BLOCK_SIZE) {
+        __lz4_store_flush_block(lz_store);
+        offset = __lz4_store_write_record(lz_store, data, size);
+        goto end;
+    }
+
+    if (lz_store->block_bytes + size > LZ4_BLOCK_SIZE ||
+        lz_store->block_records == LZ4_BLOCK_MAX_RECORDS) {
+        __lz4_store_flush_block(lz_store);
+    }
+
+    // Only take the record if the block still fits with it.  Otherwise the store is nearly full,
+    // so get what is staged out and give the record a frame of its own, which is smaller than a
+    // block of one and fails like any other write if the store really is full.
+    uint32_t bound = __lz4_block_bound(lz_store->block_bytes + size, lz_store->block_records + 1);
+    if (bound >= delegate->capacity(delegate)) {
+        __lz4_store_flush_block(lz_store);
+        offset = __lz4_store_write_record(lz_store, data, size);
+        goto end;
+    }
+
+    memcpy(lz_store->block + lz_store->block_bytes, data, size);
+    lz_store->block_offsets[lz_store->block_records++] = lz_store->block_bytes;
+    ck_pr_store_32(&lz_store->block_bytes, lz_store->block_bytes + size);
+
+    // The record lands in the frame that starts here
+    offset = delegate->cursor(delegate);
+
+end:
+    ck_spinlock_fas_unlock(&lz_store->block_lock);
+    return offset;
+}
+
+/*
+ * Flushes the staging block and refuses any more writes, ahead of syncing the delegate
+ */
+void __lz4_store_seal(struct lz4_store *lz_store) {
+    ck_spinlock_fas_lock(&lz_store->block_lock);
+    if (lz_store->block != NULL) __lz4_store_flush_block(lz_store);
+    lz_store->sealed = 1;
+    ck_spinlock_fas_unlock(&lz_store->block_lock);
+}
+
+uint32_t _lz4_store_write(store_t *store, void *data, uint32_t size) {
+    struct lz4_store *lz_store = (struct lz4_store*) store;
+
+    if (lz_store->flags & LZ4_BLOCKS) {
+        return __lz4_store_stage(lz_store, data, size);
+    }
+
+    if (lz_store->flags & LZ4_STREAM) {
+        return __lz4_store_stream(lz_store, data, size);
+    }
+
+    return __lz4_store_write_record(lz_store, data, size);
+}
+
+bool __lz4_is_header_frame(store_cursor_t *delegate) {
+    return (((uint32_t*)delegate->data)[0] & LZ4_FRAME_HEADER) != 0;
+}
+
+/*
+ * Reads the header frames of a reopened store the first time a reader needs something from them.
+ * The delegate must be synced.
+ */
+void __lz4_store_load_header(struct lz4_store *lstore) {
+    if (ck_pr_load_32(&lstore->header_loaded)) return;
+
+    store_t *delegate = lstore->underlying_store;
+    store_cursor_t *cursor = delegate->open_cursor(delegate);
+    if (cursor == NULL) return;
+
+    // Racing readers find the same frames, so whoever stores last stores the same thing
+    uint32_t start = delegate->start_cursor(delegate);
+    enum store_read_status status = cursor->seek(cursor, start);
+    while (status == SUCCESS && __lz4_is_header_frame(cursor)) {
+        uint32_t frame_flags = ((uint32_t*)cursor->data)[0];
+        char *body = cursor->data + (sizeof(uint32_t) * 2);
+
+        if (frame_flags & LZ4_FRAME_DICTIONARY) {
+            ck_pr_store_32(&lstore->dictionary_size, ((uint32_t*)cursor->data)[1]);
+            ck_pr_fence_store();
+            ck_pr_store_ptr(&lstore->dictionary, body);
+        } else {
+            ck_pr_store_ptr(&lstore->max_frame, body);
+        }
+
+        ck_pr_store_32(&lstore->header_bytes, cursor->offset + sizeof(uint32_t) + cursor->size - start);
+        status = cursor->advance(cursor);
+    }
+
+    // Try again later if the header has not been synced yet
+    if (status == SUCCESS || status == END) {
+        ck_pr_fence_store();
+        ck_pr_store_32(&lstore->header_loaded, 1);
+    }
+    cursor->destroy(cursor);
+}
+
+/*
+ * Returns the dictionary of a store, or NULL if it has none
+ */
+const char* __lz4_store_dictionary(struct lz4_store *lstore) {
+    __lz4_store_load_header(lstore);
+    return ck_pr_load_ptr(&lstore->dictionary);
+}
+
+/*
+ * Returns the largest frame of a store once decompressed, or 0 if the store does not say
+ */
+uint32_t __lz4_store_max_frame(struct lz4_store *lstore) {
+    __lz4_store_load_header(lstore);
+    uint32_t *max_frame = ck_pr_load_ptr(&lstore->max_frame);
+    return max_frame == NULL ? 0 : ck_pr_load_32(max_frame);
+}
+
+//
+// Decompression buffers
+//
+
+struct lz4_buffer {
+    void *data;
+    uint32_t size;
+    uint32_t __padding;
+};
+
+static __thread struct lz4_buffer __lz4_buffers[LZ4_BUFFER_POOL];
+static __thread uint32_t __lz4_buffer_count;
+
+static pthread_key_t __lz4_buffer_key;
+static pthread_once_t __lz4_buffer_once = PTHREAD_ONCE_INIT;
+
+static void __lz4_buffers_free(void *unused) {
+    while (__lz4_buffer_count > 0) free(__lz4_buffers[--__lz4_buffer_count].data);
+}
+
+static void __lz4_buffer_key_create() {
+    ensure(pthread_key_create(&__lz4_buffer_key, &__lz4_buffers_free) == 0,
+           "Failed to create decompression buffer key");
+}
+
+/*
+ * Takes a buffer of at least size bytes from this thread's pool, or allocates one
+ */
+void* __lz4_buffer_take(uint32_t size, uint32_t *capacity) {
+    for (uint32_t i = 0; i < __lz4_buffer_count; i++) {
+        if (__lz4_buffers[i].size >= size) {
+            void *data = __lz4_buffers[i].data;
+            *capacity = __lz4_buffers[i].size;
+            __lz4_buffers[i] = __lz4_buffers[--__lz4_buffer_count];
+            return data;
+        }
+    }
+
+    // Nothing is big enough, so replace one rather than let the pool fill with small buffers
+    if (__lz4_buffer_count > 0) free(__lz4_buffers[--__lz4_buffer_count].data);
+
+    void *data = malloc(size);
+    *capacity = data == NULL ? 0 : size;
+    return data;
+}
+
+/*
+ * Gives a buffer back to this thread's pool, which may not be the pool it came from
+ */
+void __lz4_buffer_give(void *data, uint32_t size) {
+    if (data == NULL) return;
+
+    if (__lz4_buffer_count == LZ4_BUFFER_POOL) {
+        free(data);
+        return;
+    }
+
+    // The key only exists to free the pool when the thread exits
+    if (__lz4_buffer_count == 0) {
+        pthread_once(&__lz4_buffer_once, &__lz4_buffer_key_create);
+        pthread_setspecific(__lz4_buffer_key, __lz4_buffers);
+    }
+
+    __lz4_buffers[__lz4_buffer_count].data = data;
+    __lz4_buffers[__lz4_buffer_count].size = size;
+    __lz4_buffer_count++;
+}
+
+/*
+ * Makes sure a cursor's buffer holds size bytes.  The buffer is sized for the largest frame in the
+ * store, so a cursor gets it once and never grows it.
+ */
+bool __lz4_cursor_reserve(struct lz4_store_cursor *lcursor, uint32_t size) {
+    if (lcursor->buffer_size >= size) return true;
+
+    uint32_t max_frame = __lz4_store_max_frame(lcursor->store);
+    if (max_frame > size) size = max_frame;
+
+    __lz4_buffer_give(lcursor->buffer, lcursor->buffer_size);
+    lcursor->buffer = __lz4_buffer_take(size, &lcursor->buffer_size);
+    return lcursor->buffer != NULL;
+}
+
+bool __lz4_is_block_frame(store_cursor_t *delegate) {
+    return (((uint32_t*)delegate->data)[0] & LZ4_FRAME_BLOCK) != 0;
+}
+
+/*
+ * Decompresses the frame the delegate cursor is on into dest, which must have room for its true
+ * size.
+ *
+ * return
+ *  the true size, or -1 if the frame is corrupt
+ */
+int __lz4_frame_decompress(struct lz4_store *lstore, store_cursor_t *delegate, char *dest) {
+    uint32_t frame_flags = ((uint32_t*)delegate->data)[0] & ~LZ4_FRAME_SIZE_MASK;
+    uint32_t comp_size = ((uint32_t*)delegate->data)[0] & LZ4_FRAME_SIZE_MASK;
+    uint32_t true_size = ((uint32_t*)delegate->data)[1];
+    const char *src = delegate->data + (sizeof(uint32_t) * 2);
+
+    if (frame_flags & LZ4_FRAME_RAW) {
+        memcpy(dest, src, true_size);
+        return true_size;
+    }
+
+    sh_stats_add(lstore->store.stats, SH_STAT_LZ4_DECOMPRESSIONS, 1);
+
+    int decompressed = 0;
+    if (frame_flags & LZ4_FRAME_DICT) {
+        const char *dictionary = __lz4_store_dictionary(lstore);
+        if (dictionary == NULL) return -1;
+        decompressed = LZ4_decompress_safe_usingDict(src, dest, comp_size, true_size, dictionary,
+                                                     ck_pr_load_32(&lstore->dictionary_size));
+    } else {
+        decompressed = LZ4_decompress_safe(src, dest, comp_size, true_size);
+    }
+
+    return decompressed == (int) true_size ? decompressed : -1;
+}
+
+bool __lz4_is_stream_frame(store_cursor_t *delegate) {
+    return (((uint32_t*)delegate->data)[0] & LZ4_FRAME_STREAM) != 0;
+}
+
+/*
+ * Whether the frame the delegate cursor is on goes through the window.  Stream frames have to, and
+ * once a reader has a window the ordinary frames that fit do too, since they are the restart frames
+ * the stream frames after them build on.
+ */
+bool __lz4_window_takes(struct lz4_window *window, store_cursor_t *delegate) {
+    if (__lz4_is_stream_frame(delegate)) return true;
+    return window->data != NULL && !__lz4_is_block_frame(delegate) &&
+           ((uint32_t*)delegate->data)[1] <= LZ4_STREAM_RECORD_MAX;
+}
+
+/*
+ * Decompresses the frame the delegate cursor is on onto the end of the window, which must already
+ * hold everything since the frame's restart frame if it is a stream frame
+ *
+ * return
+ *  the true size, or -1 if the frame is corrupt
+ */
+int __lz4_window_append(struct lz4_store *lstore, struct lz4_window *window,
+                        store_cursor_t *delegate) {
+    uint32_t frame_flags = ((uint32_t*)delegate->data)[0] & ~LZ4_FRAME_SIZE_MASK;
+    uint32_t comp_size = ((uint32_t*)delegate->data)[0] & LZ4_FRAME_SIZE_MASK;
+    uint32_t true_size = ((uint32_t*)delegate->data)[1];
+    ensure(true_size <= LZ4_STREAM_RECORD_MAX, "Record too large for the stream window");
+
+    // Slide the same way the writer does, keeping everything lz4 can reach back to
+    if (!(frame_flags & LZ4_FRAME_STREAM)) {
+        window->used = 0;
+        window->restart = delegate->offset;
+    } else if (window->used + true_size > LZ4_STREAM_WINDOW) {
+        uint32_t keep = window->used < LZ4_STREAM_HISTORY ? window->used : LZ4_STREAM_HISTORY;
+        memmove(window->data, window->data + window->used - keep, keep);
+        window->used = keep;
+    }
+
+    char *dest = window->data + window->used;
+    int decompressed = 0;
+    if (!(frame_flags & LZ4_FRAME_STREAM)) {
+        decompressed = __lz4_frame_decompress(lstore, delegate, dest);
+    } else if (frame_flags & LZ4_FRAME_RAW) {
+        memcpy(dest, delegate->data + (sizeof(uint32_t) * 3), true_size);
+        decompressed = true_size;
+    } else {
+        sh_stats_add(lstore->store.stats, SH_STAT_LZ4_DECOMPRESSIONS, 1);
+        uint32_t history = window->used < LZ4_STREAM_HISTORY ? window->used : LZ4_STREAM_HISTORY;
+        decompressed = LZ4_decompress_safe_usingDict(delegate->data + (sizeof(uint32_t) * 3), dest,
+                                                     comp_size, true_size, dest - history, history);
+    }
+
+    if (decompressed != (int) true_size) {
+        window->restart = 0;
+        return -1;
+    }
+
+    window->used += true_size;
+    window->next = delegate->offset + sizeof(uint32_t) + delegate->size;
+    return decompressed;
+}
+
+/*
+ * Decompresses the frame the delegate cursor is on into the window, first replaying the frames
+ * since its restart frame if the window does not already end right before it.  Readers going
+ * through a store in order never have to.
+ *
+ * return
+ *  the true size, or -1 if the frame is corrupt.  *data is set to the record in the window, which
+ *  stays valid until the window takes another frame.
+ */
+int __lz4_window_decompress(struct lz4_store *lstore, struct lz4_window *window,
+                            store_cursor_t *delegate, void **data) {
+    if (window->data == NULL) {
+        uint32_t capacity = 0;
+        window->data = __lz4_buffer_take(LZ4_STREAM_WINDOW, &capacity);
+        if (window->data == NULL) return -1;
+        window->restart = 0;
+    }
+
+    if (__lz4_is_stream_frame(delegate)) {
+        uint32_t restart = ((uint32_t*)delegate->data)[2];
+        if (window->restart != restart || window->next != delegate->offset) {
+            store_t *underlying = lstore->underlying_store;
+            store_cursor_t *replay = underlying->open_cursor(underlying);
+            if (replay == NULL) return -1;
+
+            enum store_read_status status = replay->seek(replay, restart);
+            while (status == SUCCESS && replay->offset < delegate->offset) {
+                if (__lz4_window_append(lstore, window, replay) < 0) break;
+                status = replay->advance(replay);
+            }
+            replay->destroy(replay);
+
+            if (window->restart != restart || window->next != delegate->offset) return -1;
+        }
+    }
+
+    // Appending can slide the window, so find the record from its end
+    int decompressed = __lz4_window_append(lstore, window, delegate);
+    if (decompressed >= 0) *data = window->data + window->used - decompressed;
+    return decompressed;
+}
+
+/*
+ * Finds record index of a decompressed block
+ */
+void __lz4_block_record(const char *block, uint32_t size, uint32_t index, void **data,
+                        uint32_t *record_size) {
+    uint32_t records = 0;
+    memcpy(&records, block + size - sizeof(uint32_t), sizeof(uint32_t));
+    uint32_t table = size - (sizeof(uint32_t) * (records + 1));
+
+    uint32_t start = 0;
+    uint32_t end = table;
+    memcpy(&start, block + table + (sizeof(uint32_t) * index), sizeof(uint32_t));
+    if (index + 1 < records) {
+        memcpy(&end, block + table + (sizeof(uint32_t) * (index + 1)), sizeof(uint32_t));
+    }
+    ensure(start <= end && end <= table, "Corrupt block offset table");
+
+    *data = (void*) (block + start);
+    *record_size = end - start;
+}
+
+/*
+ * Returns the number of records in a decompressed block
+ */
+uint32_t __lz4_block_records(const char *block, uint32_t size) {
+    ensure(size >= sizeof(uint32_t), "Corrupt block");
+    uint32_t records = 0;
+    memcpy(&records, block + size - sizeof(uint32_t), sizeof(uint32_t));
+    ensure(records > 0 && (sizeof(uint32_t) * (records + 1)) <= size, "Corrupt block");
+    return records;
+}
+
+/*
+ * Decompresses a block frame into the cursor's buffer and puts the cursor on its first record
+ */
+enum store_read_status __lz4_cursor_load_block(store_cursor_t *cursor,
+                                               struct lz4_store_cursor *lcursor,
+                                               store_cursor_t *delegate) {
+    uint32_t true_size = ((uint32_t*)delegate->data)[1];
+    if (!__lz4_cursor_reserve(lcursor, true_size)) return ERROR;
+
+    if (__lz4_frame_decompress(lcursor->store, delegate, lcursor->buffer) < 0) {
+        return DECOMPRESSION_FAULT;
+    }
+
+    lcursor->block_records = __lz4_block_records(lcursor->buffer, true_size);
+    lcursor->block_index = 0;
+    __lz4_block_record(lcursor->buffer, true_size, 0, &cursor->data, &cursor->size);
+    cursor->offset = delegate->offset;
+    return SUCCESS;
+}
+
 enum store_read_status __lz4_store_decompress(enum store_read_status status,
                                               store_cursor_t *cursor,
                                               struct lz4_store_cursor *lcursor,
                                               store_cursor_t *delegate) {
 
+    // Header frames are not records, step over them
+    while (status == SUCCESS && __lz4_is_header_frame(delegate)) {
+        status = delegate->advance(delegate);
+    }
+
+    lcursor->block_records = 0;
     if (status != SUCCESS) return status;
 
-    uint32_t comp_size = ((uint32_t*)delegate->data)[0];
-    uint32_t true_size = ((uint32_t*)delegate->data)[1];
+    if (__lz4_is_block_frame(delegate)) {
+        return __lz4_cursor_load_block(cursor, lcursor, delegate);
+    }
 
-    if (lcursor->buffer_size < true_size) {
-        void *buffer = realloc(cursor->data, true_size);
-        if (buffer == NULL) return ERROR;
-        cursor->data = buffer;
-        lcursor->buffer_size = true_size;
+    if (__lz4_window_takes(&lcursor->window, delegate)) {
+        int decompressed = __lz4_window_decompress(lcursor->store, &lcursor->window, delegate,
+                                                   &cursor->data);
+        if (decompressed < 0) return DECOMPRESSION_FAULT;
+        cursor->size = decompressed;
+        cursor->offset = delegate->offset;
+        return status;
     }
 
-    char *src = delegate->data + (sizeof(uint32_t) * 2);
+    uint32_t frame_flags = ((uint32_t*)delegate->data)[0] & ~LZ4_FRAME_SIZE_MASK;
+    uint32_t true_size = ((uint32_t*)delegate->data)[1];
 
-    for (int attempts = 0; attempts < MAX_DECOMP_ATTEMPTS; attempts++) {
-        uint32_t decompressed = LZ4_decompress_safe(src, cursor->data,
-                                                    comp_size, true_size);
-        if (decompressed < true_size) {
-            lcursor->buffer_size *= 2;
-            void *buffer = realloc(cursor->data, lcursor->buffer_size);
-            if (buffer == NULL) return ERROR;
-            cursor->data = buffer;
-        } else {
-            cursor->size = decompressed;
-            cursor->offset = delegate->offset;
-            return status;
-        }
+    // Raw records are handed back straight from the delegate, which keeps them valid for as long
+    // as this cursor is
+    if (frame_flags & LZ4_FRAME_RAW) {
+        cursor->data = delegate->data + (sizeof(uint32_t) * 2);
+        cursor->size = true_size;
+        cursor->offset = delegate->offset;
+        return status;
     }
 
-    return DECOMPRESSION_FAULT;
+    // The frame says exactly how big the record is, so one decompression either fits or the frame
+    // is corrupt
+    if (!__lz4_cursor_reserve(lcursor, true_size)) return ERROR;
+    if (__lz4_frame_decompress(lcursor->store, delegate, lcursor->buffer) < 0) {
+        return DECOMPRESSION_FAULT;
+    }
+
+    cursor->data = lcursor->buffer;
+    cursor->size = true_size;
+    cursor->offset = delegate->offset;
+    return status;
 }
 
 enum store_read_status _lz4_cursor_advance(store_cursor_t *cursor) {
     struct lz4_store_cursor *lcursor = (struct lz4_store_cursor*) cursor;
     store_cursor_t *delegate = lcursor->delegate;
+
+    // A record popped out of a block has nothing around it to move to
+    if (delegate == NULL) return END;
+
+    // The rest of a block is already decompressed
+    if (lcursor->block_index + 1 < lcursor->block_records) {
+        lcursor->block_index++;
+        __lz4_block_record(lcursor->buffer, ((uint32_t*)delegate->data)[1], lcursor->block_index,
+                           &cursor->data, &cursor->size);
+        return SUCCESS;
+    }
+
     return __lz4_store_decompress(delegate->advance(delegate), cursor,
                                   lcursor, delegate);
 }
@@ -102,20 +968,29 @@ enum store_read_status _lz4_cursor_seek(store_cursor_t *cursor,
                                              uint32_t offset) {
     struct lz4_store_cursor *lcursor = (struct lz4_store_cursor*) cursor;
     store_cursor_t *delegate = lcursor->delegate;
+    if (delegate == NULL) return END;
     return __lz4_store_decompress(delegate->seek(delegate, offset), cursor,
                                   lcursor, delegate);
 }
 
+void __lz4_block_release(struct lz4_block *block) {
+    bool zero = false;
+    ck_pr_dec_32_zero(&block->refcount, &zero);
+    if (zero) free(block);
+}
+
 void _lz4_cursor_destroy(store_cursor_t *cursor) {
     // TODO - Rather than deallocate, how about we return this cursor
     // to a thread local pool ?
 
     struct lz4_store_cursor *lcursor = (struct lz4_store_cursor*) cursor;
     store_cursor_t *delegate = lcursor->delegate;
-    delegate->destroy(delegate);
+    if (delegate != NULL) delegate->destroy(delegate);
+    if (lcursor->block != NULL) __lz4_block_release(lcursor->block);
 
-    void *data = cursor->data;
-    if (data != NULL) free(data);
+    // The buffers go back to this thread for the next cursor
+    __lz4_buffer_give(lcursor->buffer, lcursor->buffer_size);
+    __lz4_buffer_give(lcursor->window.data, LZ4_STREAM_WINDOW);
     free(cursor);
 }
 
@@ -134,6 +1009,7 @@ store_cursor_t* _lz4_store_open_cursor(store_t *store) {
     if (cursor == NULL) return NULL;
 
     cursor->delegate = delegate_cursor;
+    cursor->store = lstore;
     ((store_cursor_t*)cursor)->seek    = &_lz4_cursor_seek;
     ((store_cursor_t*)cursor)->advance = &_lz4_cursor_advance;
     ((store_cursor_t*)cursor)->destroy = &_lz4_cursor_destroy;
@@ -141,25 +1017,148 @@ store_cursor_t* _lz4_store_open_cursor(store_t *store) {
     return (store_cursor_t*) cursor;
 }
 
-store_cursor_t* _lz4_store_pop_cursor(store_t *store) {
+/*
+ * Decompresses the block frame a popped delegate cursor is on, taking ownership of the cursor
+ */
+struct lz4_block* __lz4_block_pop(struct lz4_store *lstore, store_cursor_t *delegate_cursor) {
+    uint32_t true_size = ((uint32_t*)delegate_cursor->data)[1];
+    struct lz4_block *block = malloc(sizeof(struct lz4_block) + true_size);
+    ensure(block != NULL, "Failed to allocate block");
+
+    ensure(__lz4_frame_decompress(lstore, delegate_cursor, block->data) >= 0,
+           "Failed to decompress block");
+
+    // The store holds a reference until it moves on to the next block
+    block->refcount = 1;
+    block->next = 0;
+    block->records = __lz4_block_records(block->data, true_size);
+    block->size = true_size;
+    block->offset = delegate_cursor->offset;
+
+    delegate_cursor->destroy(delegate_cursor);
+    return block;
+}
+
+/*
+ * Moves on to the next record to pop.  Returns the delegate cursor of a record in a frame of its
+ * own, or NULL if the record is the next one in the pop block, or if there is nothing left.
+ * Records are handed out of the current block until it runs out, and only then is the next frame
+ * popped, so the caller must hold the pop lock to keep everything in order.
+ */
+store_cursor_t* __lz4_store_next_frame(struct lz4_store *lstore) {
+    store_t *delegate = lstore->underlying_store;
+
+    // A frame pop_into could not fit is older than anything left in the delegate
+    store_cursor_t *delegate_cursor = lstore->pending_frame;
+    if (delegate_cursor != NULL) {
+        lstore->pending_frame = NULL;
+        return delegate_cursor;
+    }
+
+    struct lz4_block *block = lstore->pop_block;
+    while (block == NULL || block->next == block->records) {
+        delegate_cursor = delegate->pop_cursor(delegate);
+        if (delegate_cursor == NULL) return NULL;
+
+        // Header frames are not records, pop the one after them
+        if (__lz4_is_header_frame(delegate_cursor)) {
+            delegate_cursor->destroy(delegate_cursor);
+            continue;
+        }
+
+        // A record in a frame of its own
+        if (!__lz4_is_block_frame(delegate_cursor)) return delegate_cursor;
+
+        if (lstore->pop_block != NULL) __lz4_block_release(lstore->pop_block);
+        block = lstore->pop_block = __lz4_block_pop(lstore, delegate_cursor);
+    }
+
+    return NULL;
+}
+
+static inline bool __lz4_block_popped(struct lz4_block *block) {
+    return block == NULL || block->next == block->records;
+}
+
+/*
+ * Pops the next record, see pop_cursor.  Unless load is set, a record in a frame of its own is
+ * left compressed for _lz4_store_load_cursor.  Records out of blocks and stream frames always come
+ * back loaded, since blocks are decompressed once for all their records and stream frames have to
+ * be decompressed in order.
+ */
+store_cursor_t* __lz4_store_pop(store_t *store, bool load) {
     // Get cursor from underlying store.  Return null if it fails.
     struct lz4_store *lstore = (struct lz4_store*) store;
-    store_t *delegate = lstore->underlying_store;
-    ensure(delegate != NULL, "Bad store");
+    ensure(lstore->underlying_store != NULL, "Bad store");
 
-    store_cursor_t *delegate_cursor = delegate->pop_cursor(delegate);
-    if (delegate_cursor == NULL) return NULL;
+    ck_spinlock_fas_lock(&lstore->pop_lock);
+
+    store_cursor_t *delegate_cursor = __lz4_store_next_frame(lstore);
+    struct lz4_block *block = lstore->pop_block;
+    uint32_t index = 0;
+    if (delegate_cursor == NULL) {
+        if (__lz4_block_popped(block)) {
+            ck_spinlock_fas_unlock(&lstore->pop_lock);
+            return NULL;
+        }
+        index = block->next++;
+        ck_pr_inc_32(&block->refcount);
+    }
+
+    // Stream frames build on the ones popped before them, so they are decompressed in order with
+    // the lock held, and copied out before the next pop moves the window on
+    void *streamed = NULL;
+    uint32_t streamed_size = 0;
+    uint32_t streamed_capacity = 0;
+    if (delegate_cursor != NULL && __lz4_window_takes(&lstore->pop_window, delegate_cursor)) {
+        void *record = NULL;
+        int decompressed = __lz4_window_decompress(lstore, &lstore->pop_window, delegate_cursor,
+                                                   &record);
+        ensure(decompressed >= 0, "Failed to decompress cursor");
+
+        streamed_size = decompressed;
+        streamed = __lz4_buffer_take(streamed_size, &streamed_capacity);
+        ensure(streamed != NULL, "Failed to allocate cursor buffer");
+        memcpy(streamed, record, streamed_size);
+    }
+
+    ck_spinlock_fas_unlock(&lstore->pop_lock);
 
     // Allocate an empty cursor
     struct lz4_store_cursor *cursor = calloc(1, sizeof(struct lz4_store_cursor));
     if (cursor == NULL) return NULL;
 
     // Initialize the cursor
-    cursor->delegate = delegate_cursor;
+    cursor->store = lstore;
     ((store_cursor_t*)cursor)->seek    = &_lz4_cursor_seek;
     ((store_cursor_t*)cursor)->advance = &_lz4_cursor_advance;
     ((store_cursor_t*)cursor)->destroy = &_lz4_cursor_destroy;
 
+    if (delegate_cursor == NULL) {
+        cursor->block = block;
+        __lz4_block_record(block->data, block->size, index, &((store_cursor_t*)cursor)->data,
+                           &((store_cursor_t*)cursor)->size);
+        ((store_cursor_t*)cursor)->offset = block->offset;
+        return (store_cursor_t*) cursor;
+    }
+
+    cursor->delegate = delegate_cursor;
+    if (streamed != NULL) {
+        cursor->buffer = streamed;
+        cursor->buffer_size = streamed_capacity;
+        ((store_cursor_t*)cursor)->data = streamed;
+        ((store_cursor_t*)cursor)->size = streamed_size;
+        ((store_cursor_t*)cursor)->offset = delegate_cursor->offset;
+        return (store_cursor_t*) cursor;
+    }
+
+    if (!load) {
+        ((store_cursor_t*)cursor)->data = NULL;
+        ((store_cursor_t*)cursor)->size = ((uint32_t*)delegate_cursor->data)[1];
+        ((store_cursor_t*)cursor)->offset = delegate_cursor->offset;
+        return (store_cursor_t*) cursor;
+    }
+
     // Decompress the cursor
     ensure(__lz4_store_decompress(SUCCESS, (store_cursor_t*) cursor, cursor, delegate_cursor) == SUCCESS,
            "Failed to decompress cursor");
@@ -167,6 +1166,88 @@ store_cursor_t* _lz4_store_pop_cursor(store_t *store) {
     return (store_cursor_t*) cursor;
 }
 
+store_cursor_t* _lz4_store_pop_cursor(store_t *store) {
+    return __lz4_store_pop(store, true);
+}
+
+store_cursor_t* _lz4_store_pop_cursor_unloaded(store_t *store) {
+    return __lz4_store_pop(store, false);
+}
+
+/*
+ * Decompresses a record _lz4_store_pop_cursor_unloaded left.  Nothing but the cursor is touched,
+ * so any number of these run at once.
+ */
+enum store_read_status _lz4_store_load_cursor(store_t *store, store_cursor_t *cursor) {
+    struct lz4_store_cursor *lcursor = (struct lz4_store_cursor*) cursor;
+    if (cursor->data != NULL || lcursor->delegate == NULL) return SUCCESS;
+    return __lz4_store_decompress(SUCCESS, cursor, lcursor, lcursor->delegate);
+}
+
+int _lz4_store_pop_into(store_t *store, void *buf, uint32_t cap, uint32_t *len) {
+    struct lz4_store *lstore = (struct lz4_store*) store;
+    ensure(lstore->underlying_store != NULL, "Bad store");
+
+    ck_spinlock_fas_lock(&lstore->pop_lock);
+
+    store_cursor_t *delegate_cursor = __lz4_store_next_frame(lstore);
+    if (delegate_cursor == NULL) {
+        struct lz4_block *block = lstore->pop_block;
+        if (__lz4_block_popped(block)) {
+            ck_spinlock_fas_unlock(&lstore->pop_lock);
+            return -1;
+        }
+
+        void *data = NULL;
+        __lz4_block_record(block->data, block->size, block->next, &data, len);
+        if (*len > cap) {
+            ck_spinlock_fas_unlock(&lstore->pop_lock);
+            return 1;
+        }
+
+        // Copy outside the lock, the reference keeps the block around until we are done
+        block->next++;
+        ck_pr_inc_32(&block->refcount);
+        ck_spinlock_fas_unlock(&lstore->pop_lock);
+
+        memcpy(buf, data, *len);
+        __lz4_block_release(block);
+        return 0;
+    }
+
+    // Leave a frame that does not fit for whoever pops next
+    *len = ((uint32_t*)delegate_cursor->data)[1];
+    if (*len > cap) {
+        lstore->pending_frame = delegate_cursor;
+        ck_spinlock_fas_unlock(&lstore->pop_lock);
+        return 1;
+    }
+
+    // Stream frames are decompressed in order, with the lock held, see _lz4_store_pop_cursor
+    // A corrupt frame has been popped all the same, so the next pop moves on past it
+    int ret = 0;
+    if (__lz4_window_takes(&lstore->pop_window, delegate_cursor)) {
+        void *record = NULL;
+        if (__lz4_window_decompress(lstore, &lstore->pop_window, delegate_cursor, &record) >= 0) {
+            memcpy(buf, record, *len);
+        } else {
+            ret = DECOMPRESSION_FAULT;
+        }
+        ck_spinlock_fas_unlock(&lstore->pop_lock);
+        delegate_cursor->destroy(delegate_cursor);
+        return ret;
+    }
+
+    ck_spinlock_fas_unlock(&lstore->pop_lock);
+
+    // Straight from the frame into the caller's buffer, no cursor buffer in between
+    if (__lz4_frame_decompress(lstore, delegate_cursor, buf) < 0) {
+        ret = DECOMPRESSION_FAULT;
+    }
+    delegate_cursor->destroy(delegate_cursor);
+    return ret;
+}
+
 /**
  * Return remaining capacity of the store
  */
@@ -185,7 +1266,9 @@ uint32_t _lz4_store_cursor(store_t *store) {
     struct lz4_store *lstore = (struct lz4_store*) store;
     store_t *delegate = lstore->underlying_store;
     ensure(delegate != NULL, "Bad store");
-    return delegate->cursor(delegate);
+
+    // Staged records count, so that a store with nothing but a staged block does not look empty
+    return delegate->cursor(delegate) + ck_pr_load_32(&lstore->block_bytes);
 }
 
 /**
@@ -195,7 +1278,10 @@ uint32_t _lz4_store_start_cursor(store_t *store) {
     struct lz4_store *lstore = (struct lz4_store*) store;
     store_t *delegate = lstore->underlying_store;
     ensure(delegate != NULL, "Bad store");
-    return delegate->start_cursor(delegate);
+
+    // Header frames are not data.  Until a reader has found them they are still skipped on the way
+    // through, the delegate may not be synced yet to look for them here.
+    return delegate->start_cursor(delegate) + ck_pr_load_32(&lstore->header_bytes);
 }
 
 /**
@@ -209,9 +1295,36 @@ uint32_t _lz4_store_sync(store_t *store) {
     struct lz4_store *lstore = (struct lz4_store*) store;
     store_t *delegate = lstore->underlying_store;
     ensure(delegate != NULL, "Bad store");
+
+    if (lstore->flags & LZ4_BLOCKS) __lz4_store_seal(lstore);
     return delegate->sync(delegate);
 }
 
+void __lz4_store_free_blocks(struct lz4_store *lstore) {
+    free(lstore->block);
+    free(lstore->block_offsets);
+    if (lstore->pop_block != NULL) __lz4_block_release(lstore->pop_block);
+    if (lstore->pending_frame != NULL) lstore->pending_frame->destroy(lstore->pending_frame);
+    if (lstore->stream != NULL) LZ4_freeStream(lstore->stream);
+    free(lstore->stream_window);
+    free(lstore->pop_window.data);
+    lstore->stream = NULL;
+    lstore->stream_window = NULL;
+    lstore->pop_window.data = NULL;
+    lstore->block = NULL;
+    lstore->block_offsets = NULL;
+    lstore->pop_block = NULL;
+    lstore->pending_frame = NULL;
+}
+
+void __lz4_store_free_dictionary(struct lz4_store *lstore) {
+    if (lstore->dictionary_stream != NULL) LZ4_freeStream(lstore->dictionary_stream);
+    if (lstore->owned_dictionary != NULL) free(lstore->owned_dictionary);
+    lstore->dictionary_stream = NULL;
+    lstore->owned_dictionary = NULL;
+    lstore->dictionary = NULL;
+}
+
 /**
  * Close this store (and optionally sync), all
  * calls to the store once closed are undefined
@@ -225,9 +1338,17 @@ int _lz4_store_close(store_t *store, bool sync) {
     store_t *delegate = lstore->underlying_store;
     ensure(delegate != NULL, "Bad store");
 
+    // Staged records have to make it into the delegate before it syncs
+    if (sync && (lstore->flags & LZ4_BLOCKS)) __lz4_store_seal(lstore);
+
     store->write        = NULL;
+    store->reserve      = NULL;
+    store->commit       = NULL;
     store->open_cursor  = NULL;
     store->pop_cursor   = NULL;
+    store->pop_cursor_unloaded = NULL;
+    store->load_cursor  = NULL;
+    store->pop_into     = NULL;
     store->capacity     = NULL;
     store->cursor       = NULL;
     store->start_cursor = NULL;
@@ -235,6 +1356,8 @@ int _lz4_store_close(store_t *store, bool sync) {
     store->close        = NULL;
     store->destroy      = NULL;
 
+    __lz4_store_free_dictionary(lstore);
+    __lz4_store_free_blocks(lstore);
     free(lstore);
     return delegate->close(delegate, sync);
 }
@@ -254,8 +1377,13 @@ int _lz4_store_destroy(store_t *store) {
     int status = delegate->destroy(delegate);
 
     store->write        = NULL;
+    store->reserve      = NULL;
+    store->commit       = NULL;
     store->open_cursor  = NULL;
     store->pop_cursor   = NULL;
+    store->pop_cursor_unloaded = NULL;
+    store->load_cursor  = NULL;
+    store->pop_into     = NULL;
     store->capacity     = NULL;
     store->cursor       = NULL;
     store->start_cursor = NULL;
@@ -263,6 +1391,8 @@ int _lz4_store_destroy(store_t *store) {
     store->close        = NULL;
     store->destroy      = NULL;
 
+    __lz4_store_free_dictionary(lstore);
+    __lz4_store_free_blocks(lstore);
     free(lstore);
     return status;
 }
@@ -273,11 +1403,24 @@ store_t* open_lz4_store(store_t *underlying_store, int flags) {
     struct lz4_store *store = (struct lz4_store*) calloc(1, sizeof(struct lz4_store));
     if (store == NULL) return NULL;
 
+    // Stream frames are built in place in the delegate, and a block can not be streamed
+    ensure(!(flags & LZ4_STREAM) || !(flags & LZ4_BLOCKS), "LZ4_STREAM and LZ4_BLOCKS both set");
+    ensure(!(flags & LZ4_STREAM) || underlying_store->reserve != NULL,
+           "LZ4_STREAM needs a store that can reserve");
+
     store->underlying_store = underlying_store;
+    store->flags = flags;
+    ck_spinlock_fas_init(&store->block_lock);
+    ck_spinlock_fas_init(&store->pop_lock);
 
     ((store_t *)store)->write        = &_lz4_store_write;
+    ((store_t *)store)->reserve      = NULL;
+    ((store_t *)store)->commit       = NULL;
     ((store_t *)store)->open_cursor  = &_lz4_store_open_cursor;
     ((store_t *)store)->pop_cursor   = &_lz4_store_pop_cursor;
+    ((store_t *)store)->pop_cursor_unloaded = &_lz4_store_pop_cursor_unloaded;
+    ((store_t *)store)->load_cursor  = &_lz4_store_load_cursor;
+    ((store_t *)store)->pop_into     = &_lz4_store_pop_into;
     ((store_t *)store)->capacity     = &_lz4_store_capacity;
     ((store_t *)store)->cursor       = &_lz4_store_cursor;
     ((store_t *)store)->start_cursor = &_lz4_store_start_cursor;
@@ -287,3 +1430,265 @@ store_t* open_lz4_store(store_t *underlying_store, int flags) {
 
     return (store_t *)store;
 }
+
+store_t* create_lz4_store(store_t *underlying_store, int flags) {
+    // Readers find the header in the first frames, so only a new store can take one
+    ensure(underlying_store->cursor(underlying_store) ==
+           underlying_store->start_cursor(underlying_store),
+           "Attempted to create an lz4 store over one that already has data");
+
+    struct lz4_store *store = (struct lz4_store*) open_lz4_store(underlying_store, flags);
+    if (store == NULL) return NULL;
+
+    store->max_frame = __lz4_write_info(underlying_store);
+    if (store->max_frame != NULL) {
+        store->header_bytes = sizeof(uint32_t) * 4;
+    }
+
+    // Nothing to read back, the header is whatever we just wrote
+    store->header_loaded = 1;
+    return (store_t *)store;
+}
+
+store_t* create_lz4hc_store(store_t *underlying_store, int level, int flags) {
+    ensure(level >= 0 && level <= 16, "High compression level out of range");
+
+    struct lz4_store *store = (struct lz4_store*) create_lz4_store(underlying_store, flags);
+    if (store == NULL) return NULL;
+
+    store->level = level == 0 ? 9 : level;
+    return (store_t *)store;
+}
+
+store_t* open_lz4_store_with_dictionary(store_t *underlying_store, const void *dictionary,
+                                        uint32_t size, int flags) {
+    ensure(size > 0 && size <= LZ4_DICT_MAX_SIZE, "Dictionary size out of range");
+
+    struct lz4_store *store = (struct lz4_store*) create_lz4_store(underlying_store, flags);
+    if (store == NULL) return NULL;
+
+    uint32_t frame_size = (sizeof(uint32_t) * 2) + size;
+    char *frame = malloc(frame_size);
+    if (frame == NULL) return (store_t *)store;
+
+    ((uint32_t*)frame)[0] = LZ4_FRAME_DICTIONARY | size;
+    ((uint32_t*)frame)[1] = size;
+    memcpy(frame + (sizeof(uint32_t) * 2), dictionary, size);
+
+    // A store too small to hold the dictionary just goes without
+    uint32_t offset = underlying_store->write(underlying_store, frame, frame_size);
+    free(frame);
+    if (offset == 0) return (store_t *)store;
+
+    store->owned_dictionary = malloc(size);
+    store->dictionary_stream = LZ4_createStream();
+    ensure(store->owned_dictionary != NULL && store->dictionary_stream != NULL,
+           "Failed to allocate dictionary");
+
+    memcpy(store->owned_dictionary, dictionary, size);
+    LZ4_loadDict(store->dictionary_stream, store->owned_dictionary, size);
+
+    store->dictionary = store->owned_dictionary;
+    store->dictionary_size = size;
+    store->header_bytes += sizeof(uint32_t) + frame_size;
+
+    return (store_t *)store;
+}
+
+//
+// Compaction
+//
+
+uint32_t compact_lz4_store(store_t *source, store_t *dest, int level, uint32_t *source_bytes) {
+    struct lz4_store *lsource = (struct lz4_store*) source;
+    store_t *delegate = lsource->underlying_store;
+    *source_bytes = 0;
+
+    // Work frame by frame rather than record by record, so that blocks stay blocks
+    store_cursor_t *cursor = delegate->open_cursor(delegate);
+    if (cursor == NULL) return 0;
+
+    // The high compression state is a few hundred KB, too big to keep around per thread for the
+    // odd compaction
+    void *state = malloc(LZ4_sizeofStateHC());
+    char *buffer = NULL;
+    char *frame = NULL;
+    struct lz4_window window = { .data = NULL };
+    uint32_t buffer_capacity = 0;
+    uint32_t frame_capacity = 0;
+    uint32_t dest_bytes = 0;
+
+    // Readers size their buffers from the INFO frame, so dest gets one of its own
+    uint32_t *max_frame = __lz4_write_info(dest);
+    if (max_frame != NULL) dest_bytes += sizeof(uint32_t) * 4;
+
+    enum store_read_status status = cursor->seek(cursor, delegate->start_cursor(delegate));
+    while (state != NULL && status == SUCCESS) {
+
+        // Everything up to the end of this frame, the dictionary frame included
+        *source_bytes = cursor->offset + sizeof(uint32_t) + cursor->size -
+                        delegate->start_cursor(delegate);
+
+        // The source's header goes away, nothing in dest is compressed against its dictionary
+        if (__lz4_is_header_frame(cursor)) {
+            status = cursor->advance(cursor);
+            continue;
+        }
+
+        uint32_t size = ((uint32_t*)cursor->data)[1];
+        uint32_t needed = __lz4_frame_bound(size);
+        if (buffer_capacity < size || frame_capacity < needed) {
+            char *grown_buffer = realloc(buffer, size + 1);
+            if (grown_buffer != NULL) buffer = grown_buffer;
+            char *grown_frame = realloc(frame, needed);
+            if (grown_frame != NULL) frame = grown_frame;
+            if (grown_buffer == NULL || grown_frame == NULL) break;
+            buffer_capacity = size;
+            frame_capacity = needed;
+        }
+
+        // Stream frames come out on their own, which is what the high compression mode makes up for
+        if (__lz4_window_takes(&window, cursor)) {
+            void *record = NULL;
+            if (__lz4_window_decompress(lsource, &window, cursor, &record) < 0) break;
+            memcpy(buffer, record, size);
+        } else if (__lz4_frame_decompress(lsource, cursor, buffer) < 0) {
+            break;
+        }
+
+        // Same framing as a regular write, minus the dictionary, so the result reads back through
+        // open_lz4_store
+        uint32_t frame_flags = ((uint32_t*)cursor->data)[0] & LZ4_FRAME_BLOCK;
+        char *body = frame + (sizeof(uint32_t) * 2);
+        int compress_size = 0;
+        if (LZ4_compressBound(size) > 0) {
+            compress_size = LZ4_compressHC2_withStateHC(state, buffer, body, size, level);
+        }
+
+        uint32_t frame_size = 0;
+        if (compress_size > 0 && compress_size < size) {
+            ((uint32_t*)frame)[0] = frame_flags | compress_size;
+            frame_size = compress_size + (sizeof(uint32_t) * 2);
+        } else {
+            memcpy(body, buffer, size);
+            ((uint32_t*)frame)[0] = frame_flags | LZ4_FRAME_RAW | size;
+            frame_size = size + (sizeof(uint32_t) * 2);
+        }
+        ((uint32_t*)frame)[1] = size;
+
+        if (dest->write(dest, frame, frame_size) == 0) break;
+        if (max_frame != NULL) __lz4_raise_max_frame(max_frame, size);
+
+        dest_bytes += frame_size + sizeof(uint32_t);
+        status = cursor->advance(cursor);
+    }
+
+    cursor->destroy(cursor);
+    free(buffer);
+    free(frame);
+    free(window.data);
+    free(state);
+    return status == END ? dest_bytes : 0;
+}
+
+//
+// Dictionary training
+//
+
+struct __lz4_dict_candidate {
+    const char *start;
+    uint32_t size;
+    uint32_t score;
+};
+
+static inline uint32_t __lz4_dict_hash(const char *gram) {
+    uint64_t sequence;
+    memcpy(&sequence, gram, sizeof(uint64_t));
+    return (uint32_t) ((sequence * 0x9E3779B97F4A7C15ULL) >> (64 - LZ4_DICT_HASH_LOG));
+}
+
+/*
+ * Scores a run by how many samples the sequences in it show up in.  Sequences unique to one sample
+ * are of no use to any other record, so they do not count.
+ */
+static uint32_t __lz4_dict_score(const uint32_t *counts, const char *start, uint32_t size) {
+    uint32_t score = 0;
+    for (uint32_t i = 0; i + LZ4_DICT_GRAM <= size; i++) {
+        uint32_t count = counts[__lz4_dict_hash(start + i)];
+        if (count > 1) score += count;
+    }
+    return score;
+}
+
+static int __lz4_dict_compare(const void *a, const void *b) {
+    uint32_t score_a = ((const struct __lz4_dict_candidate*) a)->score;
+    uint32_t score_b = ((const struct __lz4_dict_candidate*) b)->score;
+    return (score_a < score_b) - (score_a > score_b);
+}
+
+uint32_t train_lz4_dictionary(const void **samples, const uint32_t *sizes, uint32_t count,
+                              void *dictionary, uint32_t capacity) {
+    if (capacity > LZ4_DICT_MAX_SIZE) capacity = LZ4_DICT_MAX_SIZE;
+
+    // For each sequence, the number of samples it shows up in, and the last sample that counted
+    uint32_t table_size = 1 << LZ4_DICT_HASH_LOG;
+    uint32_t *counts = calloc(table_size, sizeof(uint32_t));
+    uint32_t *last_sample = calloc(table_size, sizeof(uint32_t));
+    ensure(counts != NULL && last_sample != NULL, "Failed to allocate dictionary training tables");
+
+    uint32_t candidates = 0;
+    for (uint32_t s = 0; s < count; s++) {
+        const char *sample = samples[s];
+        for (uint32_t i = 0; i + LZ4_DICT_GRAM <= sizes[s]; i++) {
+            uint32_t hash = __lz4_dict_hash(sample + i);
+            if (last_sample[hash] != s + 1) {
+                last_sample[hash] = s + 1;
+                counts[hash]++;
+            }
+        }
+        candidates += (sizes[s] + (LZ4_DICT_SEGMENT / 2) - 1) / (LZ4_DICT_SEGMENT / 2);
+    }
+    free(last_sample);
+
+    // Every half segment of every sample is a candidate run
+    struct __lz4_dict_candidate *candidate = calloc(candidates + 1, sizeof(*candidate));
+    ensure(candidate != NULL, "Failed to allocate dictionary candidates");
+
+    uint32_t n = 0;
+    for (uint32_t s = 0; s < count; s++) {
+        for (uint32_t i = 0; i < sizes[s]; i += LZ4_DICT_SEGMENT / 2) {
+            uint32_t size = sizes[s] - i < LZ4_DICT_SEGMENT ? sizes[s] - i : LZ4_DICT_SEGMENT;
+            candidate[n].start = ((const char*) samples[s]) + i;
+            candidate[n].size = size;
+            candidate[n].score = __lz4_dict_score(counts, candidate[n].start, size);
+            n++;
+        }
+    }
+    qsort(candidate, n, sizeof(*candidate), &__lz4_dict_compare);
+
+    // Take the best runs first, and put them at the end of the dictionary where matches are
+    // cheapest to reach.  Once a run is in, its sequences stop counting so the same content is not
+    // picked twice.
+    char *out = dictionary;
+    uint32_t position = capacity;
+    for (uint32_t c = 0; c < n && position > 0; c++) {
+        uint32_t score = __lz4_dict_score(counts, candidate[c].start, candidate[c].size);
+
+        // Most of this run is already covered
+        if (score == 0 || score < candidate[c].score / 2) continue;
+
+        uint32_t size = candidate[c].size < position ? candidate[c].size : position;
+        position -= size;
+        memcpy(out + position, candidate[c].start, size);
+
+        for (uint32_t i = 0; i + LZ4_DICT_GRAM <= candidate[c].size; i++) {
+            counts[__lz4_dict_hash(candidate[c].start + i)] = 0;
+        }
+    }
+
+    free(candidate);
+    free(counts);
+
+    memmove(out, out + position, capacity - position);
+    return capacity - position;
+}
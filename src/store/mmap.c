@@ -1,4 +1,6 @@
 #include "store.h"
+#include "stats.h"
+#include "probes.h"
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -7,6 +9,15 @@
 #include <sys/mman.h>
 #include <string.h>
 #include <ck_pr.h>
+#include <ck_backoff.h>
+
+// SOFTHEAP_NO_CONTENTION_TUNING builds without the cache lines and the backoff below, to measure
+// what they are worth.  The lines shrink to a word, which keeps the struct free of padding.
+#ifdef SOFTHEAP_NO_CONTENTION_TUNING
+#define MMAP_LINE sizeof(uint64_t)
+#else
+#define MMAP_LINE CK_MD_CACHELINE
+#endif
 
 #define EXTRACT_SYNCING(x) ((x & 0x80000000U) >> 31)
 #define SET_SYNCING(x) (x | (1 << 31))
@@ -18,8 +29,13 @@ struct mmap_store {
     int flags;
     void* mapping;
     uint32_t capacity;
+    uint32_t __padding;
+    char* filename;
+
+    // Writers and readers each move their own cursor, so they are kept a cache line apart, and away
+    // from the fields above that everyone reads
+    char __writer_line[MMAP_LINE];
 
-    uint32_t read_cursor;  // MUST BE CAS GUARDED
     uint32_t write_cursor; // MUST BE CAS GUARDED
     uint32_t last_sync;    // MUST BE CAS GUARDED
 
@@ -28,9 +44,18 @@ struct mmap_store {
     uint32_t syncing_and_writers;
     uint32_t synced;
 
-    char* filename;
+    char __reader_line[MMAP_LINE];
+
+    uint32_t read_cursor;  // MUST BE CAS GUARDED
+
+    char __end_line[MMAP_LINE - sizeof(uint32_t)];
 };
 
+// Spins before retrying a compare and swap another thread won, starting short and doubling up to
+// the ceiling.  ck's own ceiling is far longer than any of these races last.
+#define MMAP_BACKOFF_INITIALIZER (1 << 2)
+#define MMAP_BACKOFF_CEILING (1 << 10)
+
 struct mmap_store_cursor {
     store_cursor_t cursor;
     struct mmap_store *store;
@@ -38,20 +63,29 @@ struct mmap_store_cursor {
     uint32_t next_offset;
 };
 
+static inline void __mmap_backoff(ck_backoff_t *backoff) {
+#ifdef SOFTHEAP_NO_CONTENTION_TUNING
+    (void) backoff;
+#else
+    ck_backoff_eb(backoff);
+    if (*backoff > MMAP_BACKOFF_CEILING) {
+        *backoff = MMAP_BACKOFF_CEILING;
+    }
+#endif
+}
+
 /*
- * Write data into the store implementation
- *
- * params
- *  *data - data to write
- *  size - amount to write
+ * Registers a writer with the store, so that a sync waits for it to finish
  *
  * return
- *  -1 - Capacity exceeded
+ *  false - the store has started syncing and no longer takes writes
  */
-uint32_t _mmap_write(store_t *store, void *data, uint32_t size) {
-    struct mmap_store *mstore = (struct mmap_store*) store;
-    void * mapping = mstore->mapping;
-    ensure(mapping != NULL, "Bad mapping");
+bool __mmap_acquire_writer(struct mmap_store *mstore) {
+
+    // A single writer is also the only one to sync, so nothing can start syncing under it
+    if (mstore->flags & SINGLE_WRITER) {
+        return EXTRACT_SYNCING(ck_pr_load_32(&mstore->syncing_and_writers)) == 0;
+    }
 
     // We must ensure that no writes are happening during a sync.  To do this, we pack both the
     // "syncing" bit and the number of writers in the same 32 bit value.
@@ -60,8 +94,8 @@ uint32_t _mmap_write(store_t *store, void *data, uint32_t size) {
     // 3. Increment the number of writers
     // 4. Try to Compare and Swap this value
     // 5. Repeat if CAS fails
-    bool writers_incremented = false;
-    while (!writers_incremented) {
+    ck_backoff_t backoff = MMAP_BACKOFF_INITIALIZER;
+    while (true) {
 
         // 1.
         uint32_t syncing_and_writers = ck_pr_load_32(&mstore->syncing_and_writers);
@@ -74,14 +108,93 @@ uint32_t _mmap_write(store_t *store, void *data, uint32_t size) {
 
         // 2.
         if (syncing == 1) {
-            return 0;
+            return false;
         }
 
         // 3.
         // 4.
         if (ck_pr_cas_32(&mstore->syncing_and_writers, syncing_and_writers, syncing_and_writers + 1)) {
-            writers_incremented = true;
+            return true;
         }
+        __mmap_backoff(&backoff);
+    }
+}
+
+void __mmap_release_writer(struct mmap_store *mstore) {
+
+    // A single writer was never counted.  The fence publishes its record, as the compare and swap
+    // below does for the others.
+    if (mstore->flags & SINGLE_WRITER) {
+        ck_pr_fence_store();
+        return;
+    }
+
+    // Decrement the number of writers to indicate that we are finished writing
+    // 1. Load the "syncing_and_writers" value
+    // 2. Decrement the number of writers
+    // 3. Try to Compare and Swap this value
+    // 4. Repeat if CAS fails
+    ck_backoff_t backoff = MMAP_BACKOFF_INITIALIZER;
+    while (true) {
+
+        // 1.
+        uint32_t syncing_and_writers = ck_pr_load_32(&mstore->syncing_and_writers);
+        uint32_t writers = EXTRACT_WRITERS(syncing_and_writers);
+
+        // Invariants
+        ensure(writers > 0, "Would decrement the number of writers below zero");
+        ensure(ck_pr_load_32(&mstore->synced) == 0,
+               "The sync should not have gone through since we are not done writing");
+
+        // 2.
+        // 3.
+        if (ck_pr_cas_32(&mstore->syncing_and_writers, syncing_and_writers, syncing_and_writers - 1)) {
+            return;
+        }
+        __mmap_backoff(&backoff);
+    }
+}
+
+/*
+ * Moves the write or read cursor from old_pos to new_pos, which fails if another writer or reader
+ * moved it first.  A single writer or reader has its cursor to itself, so a plain store will do.
+ */
+static inline bool __mmap_move_write_cursor(struct mmap_store *mstore, uint32_t old_pos,
+                                            uint32_t new_pos) {
+    if (mstore->flags & SINGLE_WRITER) {
+        ck_pr_store_32(&mstore->write_cursor, new_pos);
+        return true;
+    }
+    return ck_pr_cas_32(&mstore->write_cursor, old_pos, new_pos);
+}
+
+static inline bool __mmap_move_read_cursor(struct mmap_store *mstore, uint32_t old_pos,
+                                           uint32_t new_pos) {
+    if (mstore->flags & SINGLE_READER) {
+        ck_pr_store_32(&mstore->read_cursor, new_pos);
+        return true;
+    }
+    return ck_pr_cas_32(&mstore->read_cursor, old_pos, new_pos);
+}
+
+/*
+ * Reserve space for a block in the store implementation.  The size header is written straight
+ * away with the reserved size, commit shrinks it if it can.
+ *
+ * params
+ *  size - most the block can take up
+ *  *offset - set to the offset of the block
+ *
+ * return
+ *  NULL - Capacity exceeded or the store is syncing
+ */
+void* _mmap_reserve(store_t *store, uint32_t size, uint32_t *offset) {
+    struct mmap_store *mstore = (struct mmap_store*) store;
+    void * mapping = mstore->mapping;
+    ensure(mapping != NULL, "Bad mapping");
+
+    if (!__mmap_acquire_writer(mstore)) {
+        return NULL;
     }
 
     ensure(ck_pr_load_32(&mstore->synced) == 0, "A writer should not get here when the store is synced");
@@ -92,15 +205,8 @@ uint32_t _mmap_write(store_t *store, void *data, uint32_t size) {
 
     uint32_t cursor_pos = 0;
     uint32_t new_pos = 0;
-    uint32_t ret = 0;
-
-    // Assert if we are trying to write a block larger than the capacity of this store, and the
-    // store is empty.  This is to die fast on the case where we have a block that we can never
-    // write to any store of this size.
-    // TODO: Actually handle this case gracefully
-    ensure(((mstore->capacity - store->start_cursor(store)) >= required_size) ||
-           (ck_pr_load_32(write_cursor) != store->start_cursor(store)),
-           "Attempting to write a block of data larger than the total capacity of our store");
+    uint64_t retries = 0;
+    ck_backoff_t backoff = MMAP_BACKOFF_INITIALIZER;
 
     while (true) {
         cursor_pos = ck_pr_load_32(write_cursor);
@@ -108,24 +214,57 @@ uint32_t _mmap_write(store_t *store, void *data, uint32_t size) {
         uint32_t remaining = mstore->capacity - cursor_pos;
 
         if (remaining <= required_size) {
-            // TODO: Structure this code better.  Right now, this works because "ret" is still zero,
-            // and we return zero in the case where our data couldn't be written because the store
-            // was full.
-            goto decrement_writers;
+            __mmap_release_writer(mstore);
+            return NULL;
         }
 
         new_pos = cursor_pos + required_size;
-        if (ck_pr_cas_32(write_cursor, cursor_pos, new_pos)) {
+        if (__mmap_move_write_cursor(mstore, cursor_pos, new_pos)) {
             break;
         }
+        retries++;
+        __mmap_backoff(&backoff);
+    }
+    if (retries > 0) {
+        sh_stats_add(store->stats, SH_STAT_WRITE_RETRIES, retries);
+        SH_PROBE1(write__retry, retries);
     }
+    SH_PROBE2(write__reserve, cursor_pos, size);
     ensure(new_pos != 0, "Invalid write position");
     ensure(cursor_pos != 0, "Invalid cursor position");
 
     void *dest = (mapping + cursor_pos);
     ((uint32_t*)dest)[0] = (uint32_t) size;
-    dest += sizeof(uint32_t);
-    memcpy(dest, data, size);
+
+    *offset = cursor_pos;
+    return dest + sizeof(uint32_t);
+}
+
+/*
+ * Commit a block reserved by _mmap_reserve
+ *
+ * return
+ *  the offset of the block
+ */
+uint32_t _mmap_commit(store_t *store, uint32_t offset, uint32_t size) {
+    struct mmap_store *mstore = (struct mmap_store*) store;
+    void * mapping = mstore->mapping;
+    ensure(mapping != NULL, "Bad mapping");
+
+    uint32_t *header = (uint32_t*) (mapping + offset);
+    uint32_t reserved = header[0];
+    ensure(size <= reserved, "Committed more than was reserved");
+
+    // Give back the unused space, which only works if nobody has reserved after us.  Nobody reads
+    // the header until the sync, which waits for us, so it is safe to change here.
+    if (size < reserved &&
+        __mmap_move_write_cursor(mstore,
+                                 offset + sizeof(uint32_t) + reserved,
+                                 offset + sizeof(uint32_t) + size)) {
+        header[0] = size;
+    }
+
+    uint32_t new_pos = offset + sizeof(uint32_t) + header[0];
 
     // If our new cursor is 32 pages past where we have last synced, try to sync
     // TODO: Make this tunable
@@ -143,40 +282,45 @@ uint32_t _mmap_write(store_t *store, void *data, uint32_t size) {
 
     ensure(ck_pr_load_32(&mstore->synced) == 0, "A writer should not be here when the store is synced");
 
-    // Return the position in the store that we wrote to
-    // TODO: Clean up the error handling and return values for this function
-    ret = cursor_pos;
+    sh_stats_add(store->stats, SH_STAT_STORE_BYTES_WRITTEN, header[0]);
+    SH_PROBE2(write__commit, offset, header[0]);
 
-    bool writers_decremented = false;
-decrement_writers:
-    // TODO: Need to initialize here, otherwise writers_decremented will be true and uninitialized
-    // in the case where we jump to this label.  Structure this function better.
-    writers_decremented = false;
+    __mmap_release_writer(mstore);
 
-    // Decrement the number of writers to indicate that we are finished writing
-    // 1. Load the "syncing_and_writers" value
-    // 2. Decrement the number of writers
-    // 3. Try to Compare and Swap this value
-    // 4. Repeat if CAS fails
-    while (!writers_decremented) {
+    // Return the position in the store that we wrote to
+    return offset;
+}
 
-        // 1.
-        uint32_t syncing_and_writers = ck_pr_load_32(&mstore->syncing_and_writers);
-        uint32_t writers = EXTRACT_WRITERS(syncing_and_writers);
+/*
+ * Write data into the store implementation
+ *
+ * params
+ *  *data - data to write
+ *  size - amount to write
+ *
+ * return
+ *  0 - Capacity exceeded or the store is syncing
+ */
+uint32_t _mmap_write(store_t *store, void *data, uint32_t size) {
+    struct mmap_store *mstore = (struct mmap_store*) store;
+    uint32_t offset = 0;
 
-        // Invariants
-        ensure(writers > 0, "Would decrement the number of writers below zero");
-        ensure(ck_pr_load_32(&mstore->synced) == 0,
-               "The sync should not have gone through since we are not done writing");
+    // Assert if we are trying to write a block larger than the capacity of this store, and the
+    // store is empty.  This is to die fast on the case where we have a block that we can never
+    // write to any store of this size.  A reservation is only an upper bound, so this check is
+    // left to the caller there.
+    // TODO: Actually handle this case gracefully
+    ensure(((mstore->capacity - store->start_cursor(store)) >= (sizeof(uint32_t) + size)) ||
+           (ck_pr_load_32(&mstore->write_cursor) != store->start_cursor(store)),
+           "Attempting to write a block of data larger than the total capacity of our store");
 
-        // 2.
-        // 3.
-        if (ck_pr_cas_32(&mstore->syncing_and_writers, syncing_and_writers, syncing_and_writers - 1)) {
-            writers_decremented = true;
-        }
+    void *dest = _mmap_reserve(store, size, &offset);
+    if (dest == NULL) {
+        return 0;
     }
 
-    return ret;
+    memcpy(dest, data, size);
+    return _mmap_commit(store, offset, size);
 }
 
 enum store_read_status __mmap_cursor_position(struct mmap_store_cursor *cursor,
@@ -285,6 +429,7 @@ store_cursor_t* _mmap_pop_cursor(store_t *store) {
 
     // Save the current offset so we can try to CAS later
     uint32_t current_offset = ck_pr_load_32(&mstore->read_cursor);
+    ck_backoff_t backoff = MMAP_BACKOFF_INITIALIZER;
 
     // If the first cursor has not been returned, don't advance.  Instead seek to the beginning.
     if (current_offset == -1) {
@@ -299,11 +444,15 @@ store_cursor_t* _mmap_pop_cursor(store_t *store) {
 
         // Set the read cursor.  Note we are setting it to the offset of the thing we are reading,
         // because of the logic below
-        if (ck_pr_cas_32(&mstore->read_cursor, current_offset, next_offset)) {
+        if (__mmap_move_read_cursor(mstore, current_offset, next_offset)) {
+            SH_PROBE2(pop__claim, next_offset, ((store_cursor_t*) cursor)->size);
             return (store_cursor_t*) cursor;
         }
 
         // If we failed to CAS, reload the current offset and drop down to the normal logic below
+        sh_stats_add(store->stats, SH_STAT_POP_RETRIES, 1);
+        SH_PROBE1(pop__retry, next_offset);
+        __mmap_backoff(&backoff);
         current_offset = ck_pr_load_32(&mstore->read_cursor);
     }
 
@@ -323,11 +472,15 @@ store_cursor_t* _mmap_pop_cursor(store_t *store) {
     while (ret != END) {
 
         // If we succeed, return the cursor we made
-        if (ck_pr_cas_32(&mstore->read_cursor, current_offset, next_offset)) {
+        if (__mmap_move_read_cursor(mstore, current_offset, next_offset)) {
+            SH_PROBE2(pop__claim, next_offset, ((store_cursor_t*) cursor)->size);
             return (store_cursor_t*) cursor;
         }
 
         // Otherwise, try again
+        sh_stats_add(store->stats, SH_STAT_POP_RETRIES, 1);
+        SH_PROBE1(pop__retry, next_offset);
+        __mmap_backoff(&backoff);
 
         // Save the current offset so we can try to CAS later
         current_offset = ck_pr_load_32(&mstore->read_cursor);
@@ -348,12 +501,63 @@ store_cursor_t* _mmap_pop_cursor(store_t *store) {
     return NULL;
 }
 
+/*
+ * Pops the next record straight into buf.  A record bigger than cap is left where it is for a
+ * retry with a bigger buffer, since records in the mapping never move.
+ *
+ * return
+ *  0 - success, len is the size of the record
+ *  1 - the record did not fit, len is the size it needs
+ *  -1 - nothing left to pop
+ */
+int _mmap_pop_into(store_t *store, void *buf, uint32_t cap, uint32_t *len) {
+    struct mmap_store *mstore = (struct mmap_store*) store;
+    ensure(ck_pr_load_32(&mstore->synced) == 1, "We should not be reading the store before it has been synced");
+
+    // Nothing escapes this function, so the cursor can live on the stack
+    struct mmap_store_cursor cursor;
+    memset(&cursor, 0, sizeof(cursor));
+    cursor.store = mstore;
+    ck_backoff_t backoff = MMAP_BACKOFF_INITIALIZER;
+
+    while (true) {
+
+        // Same as _mmap_pop_cursor, the read cursor is the offset of the last record popped
+        uint32_t current_offset = ck_pr_load_32(&mstore->read_cursor);
+        enum store_read_status ret;
+        if (current_offset == -1) {
+            ret = _mmap_cursor_seek((store_cursor_t*) &cursor, store->start_cursor(store));
+        } else {
+            ret = _mmap_cursor_seek((store_cursor_t*) &cursor, current_offset);
+            ensure(ret == SUCCESS, "Failed to seek");
+            ret = _mmap_cursor_advance((store_cursor_t*) &cursor);
+        }
+
+        if (ret == END) return -1;
+        ensure(ret == SUCCESS, "Failed to advance");
+
+        *len = ((store_cursor_t*) &cursor)->size;
+        if (*len > cap) return 1;
+
+        if (__mmap_move_read_cursor(mstore, current_offset, ((store_cursor_t*) &cursor)->offset)) {
+            memcpy(buf, ((store_cursor_t*) &cursor)->data, *len);
+            SH_PROBE2(pop__claim, ((store_cursor_t*) &cursor)->offset, *len);
+            return 0;
+        }
+        sh_stats_add(store->stats, SH_STAT_POP_RETRIES, 1);
+        SH_PROBE1(pop__retry, ((store_cursor_t*) &cursor)->offset);
+        __mmap_backoff(&backoff);
+    }
+}
+
 
 /**
- * Return remaining capacity of the store
+ * Return remaining capacity of the store.  A block of size bytes only fits if this is larger than
+ * size plus the uint32_t in front of it.
  */
 uint32_t _mmap_capacity(store_t *store) {
-    return EXIT_FAILURE;
+    struct mmap_store *mstore = (struct mmap_store*) store;
+    return mstore->capacity - ck_pr_load_32(&mstore->write_cursor);
 }
 
 /**
@@ -388,6 +592,7 @@ uint32_t _mmap_sync(store_t *store) {
     uint32_t write_cursor = ck_pr_load_32(&mstore->write_cursor);
 
     ensure(write_cursor > sizeof(uint32_t) * 2, "Attempted to sync an empty store");
+    SH_PROBE2(store__sync__begin, mstore->filename, write_cursor);
 
     // We must ensure that no writes are happening during a sync.  To do this, we pack both the
     // "syncing" bit and the number of writers in the same 32 bit value.
@@ -395,6 +600,7 @@ uint32_t _mmap_sync(store_t *store) {
     // 2. Set that we are syncing
     // 3. Try to Compare and Swap this value
     // 4. Repeat until "writers" == 0
+    ck_backoff_t backoff = MMAP_BACKOFF_INITIALIZER;
     while (1) {
 
         // 1.
@@ -418,6 +624,7 @@ uint32_t _mmap_sync(store_t *store) {
         if (writers == 0) {
             break;
         }
+        __mmap_backoff(&backoff);
     }
 
     // The point we have written up to
@@ -429,6 +636,7 @@ uint32_t _mmap_sync(store_t *store) {
     //mprotect(mapping, off, PROT_READ);
     ensure(msync(mstore->mapping, write_cursor, MS_SYNC) == 0, "Unable to msync");
     ensure(fsync(mstore->fd) == 0, "Unable to fsync");
+    SH_PROBE2(store__sync__end, mstore->filename, write_cursor);
 
     // Record that we synced successfully.  This will allow readers to progress.
     ck_pr_store_32(&mstore->synced, 1);
@@ -467,8 +675,11 @@ int _mmap_close(store_t *store, bool sync) {
     free(mstore->filename);
 
     store->write        = NULL;
+    store->reserve      = NULL;
+    store->commit       = NULL;
     store->open_cursor  = NULL;
     store->pop_cursor   = NULL;
+    store->pop_into     = NULL;
     store->capacity     = NULL;
     store->cursor       = NULL;
     store->start_cursor = NULL;
@@ -503,8 +714,11 @@ int _mmap_destroy(store_t *store) {
     free(mstore->filename);
 
     store->write        = NULL;
+    store->reserve      = NULL;
+    store->commit       = NULL;
     store->open_cursor  = NULL;
     store->pop_cursor   = NULL;
+    store->pop_into     = NULL;
     store->capacity     = NULL;
     store->cursor       = NULL;
     store->start_cursor = NULL;
@@ -581,8 +795,11 @@ store_t* create_mmap_store(uint32_t size, const char* base_dir, const char* name
     ensure(store->write_cursor != 0, "Cursor incorrect");
 
     ((store_t *)store)->write        = &_mmap_write;
+    ((store_t *)store)->reserve      = &_mmap_reserve;
+    ((store_t *)store)->commit       = &_mmap_commit;
     ((store_t *)store)->open_cursor  = &_mmap_open_cursor;
     ((store_t *)store)->pop_cursor   = &_mmap_pop_cursor;
+    ((store_t *)store)->pop_into     = &_mmap_pop_into;
     ((store_t *)store)->capacity     = &_mmap_capacity;
     ((store_t *)store)->cursor       = &_mmap_cursor;
     ((store_t *)store)->start_cursor = &_mmap_start_cursor;
@@ -642,8 +859,11 @@ store_t* open_mmap_store(const char* base_dir, const char* name, int flags) {
     ensure(store->write_cursor != 0, "Cursor incorrect");
 
     ((store_t *)store)->write        = &_mmap_write;
+    ((store_t *)store)->reserve      = &_mmap_reserve;
+    ((store_t *)store)->commit       = &_mmap_commit;
     ((store_t *)store)->open_cursor  = &_mmap_open_cursor;
     ((store_t *)store)->pop_cursor   = &_mmap_pop_cursor;
+    ((store_t *)store)->pop_into     = &_mmap_pop_into;
     ((store_t *)store)->capacity     = &_mmap_capacity;
     ((store_t *)store)->cursor       = &_mmap_cursor;
     ((store_t *)store)->start_cursor = &_mmap_start_cursor;
@@ -0,0 +1,156 @@
+#include "chunked_list.h"
+
+#include <greatest.h>
+
+#include <stdint.h>
+#include <string.h>
+
+// Enough keys to split the first chunk many times over
+static const uint32_t NUM_KEYS = 20 * CL_CHUNK_SIZE;
+
+// A pseudo random permutation of 0 .. NUM_KEYS - 1
+static uint32_t permuted_key(uint32_t i) {
+    return (uint32_t) (((uint64_t) i * 7919) % NUM_KEYS);
+}
+
+struct iteration {
+    uint32_t count;
+    uint32_t last;
+    int ordered;
+    int values_match;
+};
+
+static void check_entry(uint32_t key, uint32_t value, void *ctx) {
+    struct iteration *it = (struct iteration*) ctx;
+    if (it->count > 0 && key <= it->last) it->ordered = 0;
+    if (value != key + 1) it->values_match = 0;
+    it->last = key;
+    it->count++;
+}
+
+static struct iteration iterate(chunked_list_t *list) {
+    struct iteration it = { 0, 0, 1, 1 };
+    list->iterate(list, check_entry, &it);
+    return it;
+}
+
+TEST test_insert_find_delete() {
+    chunked_list_t *list = create_chunked_list();
+    ASSERT(list != NULL);
+
+    uint32_t value = 0;
+    ASSERT_EQ(list->find(list, 42, &value), -1);
+    ASSERT_EQ(list->delete(list, 42), -1);
+
+    ASSERT_EQ(list->insert(list, 42, 43), 0);
+    ASSERT_EQ(list->insert(list, 42, 44), -1);
+    ASSERT_EQ(list->find(list, 42, &value), 0);
+    ASSERT_EQ(value, 43);
+
+    // The extremes of the key space
+    ASSERT_EQ(list->insert(list, 0, 1), 0);
+    ASSERT_EQ(list->insert(list, UINT32_MAX, 7), 0);
+    ASSERT_EQ(list->find(list, UINT32_MAX, &value), 0);
+    ASSERT_EQ(value, 7);
+
+    ASSERT_EQ(list->delete(list, 42), 0);
+    ASSERT_EQ(list->delete(list, 42), -1);
+    ASSERT_EQ(list->find(list, 42, NULL), -1);
+    ASSERT_EQ(list->find(list, 0, NULL), 0);
+
+    // Deleted keys can come back
+    ASSERT_EQ(list->insert(list, 42, 45), 0);
+    ASSERT_EQ(list->find(list, 42, &value), 0);
+    ASSERT_EQ(value, 45);
+
+    list->destroy(list);
+    PASS();
+}
+
+TEST test_split_and_merge() {
+    chunked_list_t *list = create_chunked_list();
+    ASSERT(list != NULL);
+
+    // Fill enough to force splits
+    for (uint32_t i = 0; i < NUM_KEYS; i++) {
+        ASSERT_EQ(list->insert(list, permuted_key(i), permuted_key(i) + 1), 0);
+    }
+
+    struct iteration it = iterate(list);
+    ASSERT_EQ(it.count, NUM_KEYS);
+    ASSERT(it.ordered);
+    ASSERT(it.values_match);
+
+    uint32_t chunks = 0;
+    for (struct list_chunk *chunk = (struct list_chunk*) list->head; chunk != NULL;
+         chunk = (struct list_chunk*) (chunk->next & ~((uint64_t) 1))) {
+        chunks++;
+    }
+    ASSERT(chunks > 1);
+
+    for (uint32_t i = 0; i < NUM_KEYS; i++) {
+        uint32_t value = 0;
+        ASSERT_EQ(list->find(list, i, &value), 0);
+        ASSERT_EQ(value, i + 1);
+    }
+
+    // Delete all but every 64th key, which drains chunks and forces merges
+    for (uint32_t i = 0; i < NUM_KEYS; i++) {
+        uint32_t key = permuted_key(i);
+        if (key % 64 != 0) ASSERT_EQ(list->delete(list, key), 0);
+    }
+
+    it = iterate(list);
+    ASSERT_EQ(it.count, NUM_KEYS / 64);
+    ASSERT(it.ordered);
+
+    uint32_t merged = 0;
+    for (struct list_chunk *chunk = (struct list_chunk*) list->head; chunk != NULL;
+         chunk = (struct list_chunk*) (chunk->next & ~((uint64_t) 1))) {
+        merged++;
+    }
+    ASSERT(merged < chunks);
+
+    for (uint32_t i = 0; i < NUM_KEYS; i++) {
+        ASSERT_EQ(list->find(list, i, NULL), i % 64 == 0 ? 0 : -1);
+    }
+
+    list->destroy(list);
+    PASS();
+}
+
+TEST test_churn() {
+    chunked_list_t *list = create_chunked_list();
+    ASSERT(list != NULL);
+
+    // Repeatedly insert and delete the same small set, which fills chunks with dead entries
+    for (uint32_t round = 0; round < 50; round++) {
+        for (uint32_t i = 0; i < CL_CHUNK_SIZE; i++) {
+            ASSERT_EQ(list->insert(list, i * 3, i * 3 + 1), 0);
+        }
+        for (uint32_t i = 0; i < CL_CHUNK_SIZE; i++) {
+            if (i % 2 == round % 2) ASSERT_EQ(list->delete(list, i * 3), 0);
+        }
+        for (uint32_t i = 0; i < CL_CHUNK_SIZE; i++) {
+            if (i % 2 != round % 2) ASSERT_EQ(list->delete(list, i * 3), 0);
+        }
+        ASSERT_EQ(iterate(list).count, 0);
+    }
+
+    list->destroy(list);
+    PASS();
+}
+
+SUITE(chunked_list_basic_suite) {
+    RUN_TEST(test_insert_find_delete);
+    RUN_TEST(test_split_and_merge);
+    RUN_TEST(test_churn);
+}
+
+GREATEST_MAIN_DEFS();
+
+int main(int argc, char **argv) {
+    GREATEST_MAIN_BEGIN();
+    RUN_SUITE(chunked_list_basic_suite);
+    GREATEST_MAIN_END();
+}
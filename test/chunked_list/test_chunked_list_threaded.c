@@ -0,0 +1,141 @@
+#include "chunked_list.h"
+
+#include <greatest.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <ck_pr.h>
+
+#define NUM_THREADS 8
+static const uint32_t KEYS_PER_THREAD = 20000;
+
+static chunked_list_t *list = NULL;
+
+// Successful inserts and deletes per key, for the contended test
+static uint32_t *inserted = NULL;
+static uint32_t *deleted = NULL;
+
+/*
+ * Each thread owns the keys congruent to its id, inserts them all, deletes every other one and
+ * checks what it can see of its own keys along the way
+ */
+void *disjoint_worker(void *data) {
+    uint32_t id = (uint32_t) (uintptr_t) data;
+
+    for (uint32_t i = 0; i < KEYS_PER_THREAD; i++) {
+        uint32_t key = i * NUM_THREADS + id;
+        ensure(list->insert(list, key, key + 1) == 0, "Failed to insert owned key");
+    }
+    for (uint32_t i = 0; i < KEYS_PER_THREAD; i += 2) {
+        uint32_t key = i * NUM_THREADS + id;
+        ensure(list->delete(list, key) == 0, "Failed to delete owned key");
+    }
+    for (uint32_t i = 0; i < KEYS_PER_THREAD; i++) {
+        uint32_t key = i * NUM_THREADS + id;
+        uint32_t value = 0;
+        int found = list->find(list, key, &value);
+        if (i % 2 == 0) {
+            ensure(found == -1, "Found deleted key");
+        } else {
+            ensure(found == 0 && value == key + 1, "Lost live key");
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Every thread fights over the same keys.  Exactly one insert can win per key at a time, and
+ * deletes can only remove what was inserted.
+ */
+void *contended_worker(void *data) {
+    uint32_t id = (uint32_t) (uintptr_t) data;
+
+    for (uint32_t round = 0; round < 4; round++) {
+        for (uint32_t i = 0; i < KEYS_PER_THREAD; i++) {
+            uint32_t key = (i * 7 + id) % KEYS_PER_THREAD;
+            if (list->insert(list, key, key) == 0) ck_pr_inc_32(&inserted[key]);
+            if ((i + id) % 3 == 0 && list->delete(list, key) == 0) ck_pr_inc_32(&deleted[key]);
+        }
+    }
+    return NULL;
+}
+
+static uint32_t live = 0;
+static uint32_t last = 0;
+static int ordered = 1;
+static void count_entry(uint32_t key, uint32_t value, void *ctx) {
+    if (live > 0 && key <= last) ordered = 0;
+    last = key;
+    live++;
+}
+
+TEST test_disjoint_keys() {
+    list = create_chunked_list();
+    ASSERT(list != NULL);
+
+    pthread_t threads[NUM_THREADS];
+    for (uintptr_t i = 0; i < NUM_THREADS; i++) {
+        ASSERT_EQ(pthread_create(&threads[i], NULL, disjoint_worker, (void*) i), 0);
+    }
+    for (int i = 0; i < NUM_THREADS; i++) {
+        ASSERT_EQ(pthread_join(threads[i], NULL), 0);
+    }
+
+    live = 0;
+    ordered = 1;
+    list->iterate(list, count_entry, NULL);
+    ASSERT_EQ(live, NUM_THREADS * KEYS_PER_THREAD / 2);
+    ASSERT(ordered);
+
+    list->destroy(list);
+    PASS();
+}
+
+TEST test_contended_keys() {
+    list = create_chunked_list();
+    ASSERT(list != NULL);
+    inserted = calloc(KEYS_PER_THREAD, sizeof(uint32_t));
+    deleted = calloc(KEYS_PER_THREAD, sizeof(uint32_t));
+    ASSERT(inserted != NULL && deleted != NULL);
+
+    pthread_t threads[NUM_THREADS];
+    for (uintptr_t i = 0; i < NUM_THREADS; i++) {
+        ASSERT_EQ(pthread_create(&threads[i], NULL, contended_worker, (void*) i), 0);
+    }
+    for (int i = 0; i < NUM_THREADS; i++) {
+        ASSERT_EQ(pthread_join(threads[i], NULL), 0);
+    }
+
+    // Every key is present exactly when it was inserted once more than it was deleted
+    uint32_t expected = 0;
+    for (uint32_t key = 0; key < KEYS_PER_THREAD; key++) {
+        ASSERT(inserted[key] == deleted[key] || inserted[key] == deleted[key] + 1);
+        int present = inserted[key] == deleted[key] + 1;
+        ASSERT_EQ(list->find(list, key, NULL), present ? 0 : -1);
+        expected += present;
+    }
+
+    live = 0;
+    ordered = 1;
+    list->iterate(list, count_entry, NULL);
+    ASSERT_EQ(live, expected);
+    ASSERT(ordered);
+
+    free(inserted);
+    free(deleted);
+    list->destroy(list);
+    PASS();
+}
+
+SUITE(chunked_list_threaded_suite) {
+    RUN_TEST(test_disjoint_keys);
+    RUN_TEST(test_contended_keys);
+}
+
+GREATEST_MAIN_DEFS();
+
+int main(int argc, char **argv) {
+    GREATEST_MAIN_BEGIN();
+    RUN_SUITE(chunked_list_threaded_suite);
+    GREATEST_MAIN_END();
+}
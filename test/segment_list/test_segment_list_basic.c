@@ -5,9 +5,17 @@
 // TODO: Remove
 #include "store.h"
 
+#include <stdio.h>
+#include <sys/stat.h>
+
 #define SIZE 32 * 1024 * 1024
 #define NUM_WRITES 32
 
+// Segment size and record count for compaction, enough records that high compression has something
+// to find across them
+#define COMPACT_SIZE (1024 * 1024)
+#define COMPACT_WRITES 512
+
 int check_segment(segment_t *segment, int expected_refcount) {
     ASSERT_EQ(segment->refcount, expected_refcount);
     ASSERT(segment->store != NULL);
@@ -153,11 +161,75 @@ TEST test_create_allocate_get_release_free_and_destroy() {
     PASS();
 }
 
+uint32_t compact_record(char *buffer, uint32_t i) {
+    uint32_t size = 0;
+    for (uint32_t j = 0; j < 16; j++) {
+        size += sprintf(buffer + size, "record %u line %u: the quick brown fox %u ", i, j, i * j);
+    }
+    return size;
+}
+
+TEST test_compact_segment() {
+
+    segment_list_t *segment_list = create_segment_list(".", "test_segment_list.str", COMPACT_SIZE,
+                                                       DELETE_IF_EXISTS);
+    ASSERT(segment_list != NULL);
+
+    // Fill a segment and close it
+    // FREE -> WRITING -> CLOSED
+    char record[1024];
+    ASSERT(segment_list->allocate_segment(segment_list, 0) >= 0);
+    segment_t *segment = segment_list->get_segment_for_writing(segment_list, 0);
+    ASSERT(segment != NULL);
+    for (uint32_t i = 0; i < COMPACT_WRITES; i++) {
+        uint32_t size = compact_record(record, i);
+        ASSERT(segment->store->write(segment->store, record, size) > 0);
+    }
+    ASSERT_EQ(segment->store->sync(segment->store), 0);
+    ASSERT(segment_list->release_segment_for_writing(segment_list, 0) >= 0);
+    ASSERT(segment_list->close_segment(segment_list, 0) >= 0);
+
+    struct stat before, after;
+    ASSERT_EQ(stat("./test_segment_list.str0", &before), 0);
+
+    // Rewrite it, it takes up less disk but is the same size
+    ASSERT_EQ(segment_list->compact_segment(segment_list, 0, 9), 0);
+    ASSERT_EQ(stat("./test_segment_list.str0", &after), 0);
+    ASSERT_EQ(after.st_size, before.st_size);
+    ASSERT(after.st_blocks < before.st_blocks);
+
+    // The records read back as they were written
+    // CLOSED -> READING
+    segment = segment_list->get_segment_for_reading(segment_list, 0);
+    ASSERT(segment != NULL);
+    store_cursor_t *cursor = segment->store->open_cursor(segment->store);
+    ASSERT(cursor != NULL);
+    enum store_read_status status = cursor->seek(cursor, segment->store->start_cursor(segment->store));
+    for (uint32_t i = 0; i < COMPACT_WRITES; i++) {
+        ASSERT_EQ(status, SUCCESS);
+        uint32_t size = compact_record(record, i);
+        ASSERT_EQ(cursor->size, size);
+        ASSERT_EQ(memcmp(cursor->data, record, size), 0);
+        status = cursor->advance(cursor);
+    }
+    ASSERT_EQ(status, END);
+    cursor->destroy(cursor);
+
+    // A segment someone is reading can not be compacted
+    ASSERT_EQ(segment_list->compact_segment(segment_list, 0, 9), -1);
+    ASSERT(segment_list->release_segment_for_reading(segment_list, 0) >= 0);
+
+    ASSERT_EQ(segment_list->destroy(segment_list), 0);
+
+    PASS();
+}
+
 SUITE(segment_list_suite) {
     RUN_TEST(test_create_and_destroy);
     RUN_TEST(test_create_allocate_and_destroy);
     RUN_TEST(test_create_allocate_get_release_and_destroy);
     RUN_TEST(test_create_allocate_get_release_free_and_destroy);
+    RUN_TEST(test_compact_segment);
 }
 
 GREATEST_MAIN_DEFS();
@@ -5,6 +5,13 @@
 // TODO: Remove
 #include "store.h"
 
+// For compacting a segment directly
+#include "segment_list.h"
+
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
 #define SIZE 32 * 1024 * 1024
 #define NUM_WRITES 32
 
@@ -234,6 +241,522 @@ TEST test_multi_segment_read_persistent() {
     PASS();
 }
 
+TEST test_dictionary_read() {
+
+    // Small segments, so that most of them are allocated after the dictionary is trained
+    storage_manager = create_storage_manager(".", "test_storage_manager.str", 64 * 1024,
+                                             DELETE_IF_EXISTS | SM_LZ4_DICTIONARY);
+    ASSERT(storage_manager != NULL);
+
+    char record[128];
+    for (uint32_t i = 0; i < 4096; i++) {
+        int size = sprintf(record, "{\"id\": %u, \"type\": \"view\", \"page\": \"/item/%u\"}",
+                           i, i % 17);
+        ASSERT_EQ(storage_manager->write(storage_manager, record, size), 0);
+    }
+
+    ASSERT_EQ(storage_manager->sync(storage_manager, 1), 0);
+
+    for (uint32_t i = 0; i < 4096; i++) {
+        int size = sprintf(record, "{\"id\": %u, \"type\": \"view\", \"page\": \"/item/%u\"}",
+                           i, i % 17);
+        storage_manager_cursor_t* cursor = storage_manager->pop_cursor(storage_manager);
+        ASSERT(cursor != NULL);
+        ASSERT_EQ(cursor->size, size);
+        ASSERT_EQ(memcmp(cursor->data, record, size), 0);
+        storage_manager->free_cursor(storage_manager, cursor);
+    }
+    ASSERT(storage_manager->pop_cursor(storage_manager) == NULL);
+
+    // Cleanup
+    storage_manager->destroy(storage_manager);
+
+    PASS();
+}
+
+// Long enough to be compressed in the first place
+#define COMPACT_RECORD "{\"id\": %u, \"type\": \"view\", \"page\": \"/item/%u\", " \
+                       "\"referrer\": \"/item/%u\", \"agent\": \"test\"}"
+
+// Enough records to fill a few segments, each big enough that what high compression saves on them
+// adds up to whole blocks on disk
+#define COMPACT_SEGMENT_SIZE (1024 * 1024)
+#define COMPACT_WRITES (32 * 1024)
+
+TEST test_compacted_read() {
+
+    storage_manager = create_storage_manager(".", "test_storage_manager.str", COMPACT_SEGMENT_SIZE,
+                                             DELETE_IF_EXISTS);
+    ASSERT(storage_manager != NULL);
+
+    char record[128];
+    for (uint32_t i = 0; i < COMPACT_WRITES; i++) {
+        int size = sprintf(record, COMPACT_RECORD, i, i % 17, i % 13);
+        ASSERT_EQ(storage_manager->write(storage_manager, record, size), 0);
+    }
+    ASSERT_EQ(storage_manager->sync(storage_manager, 1), 0);
+    ASSERT_EQ(storage_manager->close(storage_manager), 0);
+
+    // Compact the first segment the way the SM_COMPACT thread does, over the closed queue, so
+    // that nothing races it
+    segment_list_t *segment_list = open_segment_list(".", "test_storage_manager.str",
+                                                     COMPACT_SEGMENT_SIZE, 0, 0, 1);
+    ASSERT(segment_list != NULL);
+    struct stat before, after;
+    ASSERT_EQ(stat("./test_storage_manager.str0", &before), 0);
+    ASSERT_EQ(segment_list->compact_segment(segment_list, 0, 9), 0);
+    ASSERT_EQ(stat("./test_storage_manager.str0", &after), 0);
+    ASSERT(after.st_blocks < before.st_blocks);
+    ASSERT_EQ(segment_list->close(segment_list), 0);
+
+    // The storage manager reads the compacted segment like any other
+    storage_manager = open_storage_manager(".", "test_storage_manager.str", COMPACT_SEGMENT_SIZE,
+                                           0);
+    ASSERT(storage_manager != NULL);
+    for (uint32_t i = 0; i < COMPACT_WRITES; i++) {
+        int size = sprintf(record, COMPACT_RECORD, i, i % 17, i % 13);
+        storage_manager_cursor_t* cursor = storage_manager->pop_cursor(storage_manager);
+        ASSERT(cursor != NULL);
+        ASSERT_EQ(cursor->size, size);
+        ASSERT_EQ(memcmp(cursor->data, record, size), 0);
+        storage_manager->free_cursor(storage_manager, cursor);
+    }
+    ASSERT(storage_manager->pop_cursor(storage_manager) == NULL);
+
+    // Cleanup
+    storage_manager->destroy(storage_manager);
+
+    PASS();
+}
+
+TEST test_block_read() {
+
+    // Segments smaller than a block, so segments fill up before their blocks do
+    storage_manager = create_storage_manager(".", "test_storage_manager.str", 16 * 1024,
+                                             DELETE_IF_EXISTS | LZ4_BLOCKS);
+    ASSERT(storage_manager != NULL);
+
+    char record[128];
+    for (uint32_t i = 0; i < 4096; i++) {
+        int size = sprintf(record, COMPACT_RECORD, i, i % 17, i % 13);
+        ASSERT_EQ(storage_manager->write(storage_manager, record, size), 0);
+    }
+
+    ASSERT_EQ(storage_manager->sync(storage_manager, 1), 0);
+
+    for (uint32_t i = 0; i < 4096; i++) {
+        int size = sprintf(record, COMPACT_RECORD, i, i % 17, i % 13);
+        storage_manager_cursor_t* cursor = storage_manager->pop_cursor(storage_manager);
+        ASSERT(cursor != NULL);
+        ASSERT_EQ(cursor->size, size);
+        ASSERT_EQ(memcmp(cursor->data, record, size), 0);
+        storage_manager->free_cursor(storage_manager, cursor);
+    }
+    ASSERT(storage_manager->pop_cursor(storage_manager) == NULL);
+
+    // Cleanup
+    storage_manager->destroy(storage_manager);
+
+    PASS();
+}
+
+TEST test_pop_into() {
+    int flags[] = { 0, LZ4_BLOCKS };
+    char record[512];
+    char buf[512];
+
+    for (int f = 0; f < 2; f++) {
+        storage_manager = create_storage_manager(".", "test_storage_manager.str", 16 * 1024,
+                                                 DELETE_IF_EXISTS | flags[f]);
+        ASSERT(storage_manager != NULL);
+
+        // Every tenth record is too big for a small buffer
+        for (uint32_t i = 0; i < 1000; i++) {
+            int size = sprintf(record, COMPACT_RECORD, i, i % 17, i % 13);
+            if (i % 10 == 0) size += sprintf(record + size, "%0300u", i);
+            ASSERT_EQ(storage_manager->write(storage_manager, record, size), 0);
+        }
+
+        ASSERT_EQ(storage_manager->sync(storage_manager, 1), 0);
+
+        for (uint32_t i = 0; i < 1000; i++) {
+            int size = sprintf(record, COMPACT_RECORD, i, i % 17, i % 13);
+            if (i % 10 == 0) size += sprintf(record + size, "%0300u", i);
+
+            // A record that does not fit stays first in line, for either kind of pop
+            uint32_t len = 0;
+            if (i % 10 == 0) {
+                ASSERT_EQ(storage_manager->pop_into(storage_manager, buf, 128, &len), 1);
+                ASSERT_EQ(len, size);
+            }
+
+            if (i % 20 == 0) {
+                storage_manager_cursor_t* cursor = storage_manager->pop_cursor(storage_manager);
+                ASSERT(cursor != NULL);
+                ASSERT_EQ(cursor->size, size);
+                ASSERT_EQ(memcmp(cursor->data, record, size), 0);
+                storage_manager->free_cursor(storage_manager, cursor);
+                continue;
+            }
+
+            ASSERT_EQ(storage_manager->pop_into(storage_manager, buf, sizeof(buf), &len), 0);
+            ASSERT_EQ(len, size);
+            ASSERT_EQ(memcmp(buf, record, size), 0);
+        }
+
+        uint32_t len = 0;
+        ASSERT_EQ(storage_manager->pop_into(storage_manager, buf, sizeof(buf), &len), -1);
+
+        // Cleanup
+        storage_manager->destroy(storage_manager);
+    }
+
+    PASS();
+}
+
+TEST test_codecs() {
+    enum storage_manager_codec codecs[] = {
+        SM_CODEC_LZ4, SM_CODEC_NONE, SM_CODEC_LZ4HC, SM_CODEC_LZ4_FRAMED, SM_CODEC_LZ4_STREAM
+    };
+    char record[512];
+    char buf[512];
+
+    for (int c = 0; c < 5; c++) {
+        storage_manager_options_t options = {
+            .codec = codecs[c], .level = 0, .flags = DELETE_IF_EXISTS | SM_COMPACT(9)
+        };
+        storage_manager = create_storage_manager_with_options(".", "test_storage_manager.str",
+                                                              16 * 1024, &options);
+        ASSERT(storage_manager != NULL);
+
+        for (uint32_t i = 0; i < 1000; i++) {
+            int size = sprintf(record, COMPACT_RECORD, i, i % 17, i % 13);
+            if (i % 10 == 0) size += sprintf(record + size, "%0300u", i);
+            ASSERT_EQ(storage_manager->write(storage_manager, record, size), 0);
+        }
+
+        ASSERT_EQ(storage_manager->sync(storage_manager, 1), 0);
+        storage_manager->close(storage_manager);
+
+        // The codec is persisted, so plain open_storage_manager reads the records back
+        storage_manager = open_storage_manager(".", "test_storage_manager.str", 16 * 1024, 0);
+        ASSERT(storage_manager != NULL);
+
+        for (uint32_t i = 0; i < 1000; i++) {
+            int size = sprintf(record, COMPACT_RECORD, i, i % 17, i % 13);
+            if (i % 10 == 0) size += sprintf(record + size, "%0300u", i);
+
+            uint32_t len = 0;
+            if (i % 10 == 0) {
+                ASSERT_EQ(storage_manager->pop_into(storage_manager, buf, 128, &len), 1);
+                ASSERT_EQ(len, size);
+            }
+
+            if (i % 20 == 0) {
+                storage_manager_cursor_t* cursor = storage_manager->pop_cursor(storage_manager);
+                ASSERT(cursor != NULL);
+                ASSERT_EQ(cursor->size, size);
+                ASSERT_EQ(memcmp(cursor->data, record, size), 0);
+                storage_manager->free_cursor(storage_manager, cursor);
+                continue;
+            }
+
+            ASSERT_EQ(storage_manager->pop_into(storage_manager, buf, sizeof(buf), &len), 0);
+            ASSERT_EQ(len, size);
+            ASSERT_EQ(memcmp(buf, record, size), 0);
+        }
+
+        uint32_t len = 0;
+        ASSERT_EQ(storage_manager->pop_into(storage_manager, buf, sizeof(buf), &len), -1);
+
+        // Cleanup
+        storage_manager->destroy(storage_manager);
+    }
+
+    PASS();
+}
+
+TEST test_stats() {
+    char record[512];
+    uint64_t bytes = 0;
+
+    storage_manager = create_storage_manager(".", "test_storage_manager.str", 16 * 1024,
+                                             DELETE_IF_EXISTS);
+    ASSERT(storage_manager != NULL);
+
+    storage_manager_stats_t stats;
+    ASSERT_EQ(storage_manager->get_stats(storage_manager, &stats), 0);
+    ASSERT_EQ(stats.records_written, 0);
+
+    for (uint32_t i = 0; i < 1000; i++) {
+        int size = sprintf(record, COMPACT_RECORD, i, i % 17, i % 13);
+        ASSERT_EQ(storage_manager->write(storage_manager, record, size), 0);
+        bytes += size;
+    }
+    ASSERT_EQ(storage_manager->sync(storage_manager, 1), 0);
+
+    for (uint32_t i = 0; i < 1000; i++) {
+        storage_manager_cursor_t* cursor = storage_manager->pop_cursor(storage_manager);
+        ASSERT(cursor != NULL);
+        storage_manager->free_cursor(storage_manager, cursor);
+    }
+    ASSERT(storage_manager->pop_cursor(storage_manager) == NULL);
+
+    ASSERT_EQ(storage_manager->get_stats(storage_manager, &stats), 0);
+    ASSERT_EQ(stats.records_written, 1000);
+    ASSERT_EQ(stats.bytes_written, bytes);
+    ASSERT_EQ(stats.records_popped, 1000);
+    ASSERT_EQ(stats.bytes_popped, bytes);
+
+    // The records span several segments, each synced once, and all but the last are read and freed
+    ASSERT(stats.segments_allocated > 2);
+    ASSERT(stats.syncs >= stats.segments_allocated - 1);
+    ASSERT(stats.sync_ns > 0);
+    ASSERT(stats.segments_freed > 0);
+    ASSERT_EQ(stats.segments_open, stats.segments_allocated + stats.segments_reopened -
+                                   stats.segments_closed - stats.segments_freed);
+
+    // Every record went through lz4, the ones that did not fit at the end of a segment twice, and
+    // the segments hold them compressed plus frame headers
+    ASSERT(stats.lz4_bytes_in >= bytes);
+    ASSERT(stats.lz4_bytes_out < stats.lz4_bytes_in);
+    ASSERT(stats.store_bytes_written > stats.lz4_bytes_out);
+    ASSERT(stats.lz4_decompressions > 0);
+
+    // Cleanup
+    storage_manager->destroy(storage_manager);
+    PASS();
+}
+
+TEST test_latency() {
+    char record[512];
+    storage_manager_latency_t latency;
+
+    // Off unless asked for
+    storage_manager = create_storage_manager(".", "test_storage_manager.str", 16 * 1024,
+                                             DELETE_IF_EXISTS);
+    ASSERT(storage_manager != NULL);
+    ASSERT_EQ(storage_manager->get_latency(storage_manager, SM_OP_WRITE, &latency), -1);
+    storage_manager->destroy(storage_manager);
+
+    storage_manager = create_storage_manager(".", "test_storage_manager.str", 16 * 1024,
+                                             DELETE_IF_EXISTS | SM_LATENCY);
+    ASSERT(storage_manager != NULL);
+
+    for (uint32_t i = 0; i < 1000; i++) {
+        int size = sprintf(record, COMPACT_RECORD, i, i % 17, i % 13);
+        ASSERT_EQ(storage_manager->write(storage_manager, record, size), 0);
+    }
+    ASSERT_EQ(storage_manager->sync(storage_manager, 1), 0);
+
+    for (uint32_t i = 0; i < 1000; i++) {
+        storage_manager_cursor_t* cursor = storage_manager->pop_cursor(storage_manager);
+        ASSERT(cursor != NULL);
+        storage_manager->free_cursor(storage_manager, cursor);
+    }
+
+    // Pops that find nothing are not counted
+    ASSERT(storage_manager->pop_cursor(storage_manager) == NULL);
+
+    ASSERT_EQ(storage_manager->get_latency(storage_manager, SM_OP_WRITE, &latency), 0);
+    ASSERT_EQ(latency.count, 1000);
+    ASSERT(latency.p50_ns > 0);
+    ASSERT(latency.p50_ns <= latency.p90_ns);
+    ASSERT(latency.p90_ns <= latency.p99_ns);
+    ASSERT(latency.p99_ns <= latency.p999_ns);
+    ASSERT(latency.p999_ns <= latency.max_ns);
+
+    ASSERT_EQ(storage_manager->get_latency(storage_manager, SM_OP_POP, &latency), 0);
+    ASSERT_EQ(latency.count, 1000);
+    ASSERT_EQ(storage_manager->get_latency(storage_manager, SM_OP_SYNC, &latency), 0);
+    ASSERT_EQ(latency.count, 1);
+
+    // The records span several segments, and all but the last are freed once read
+    ASSERT_EQ(storage_manager->get_latency(storage_manager, SM_OP_ROTATE, &latency), 0);
+    ASSERT(latency.count > 2);
+    ASSERT_EQ(storage_manager->get_latency(storage_manager, SM_OP_FREE, &latency), 0);
+    ASSERT(latency.count > 0);
+
+    // Cleanup
+    storage_manager->destroy(storage_manager);
+    PASS();
+}
+
+TEST test_timestamps() {
+    char record[512];
+    char buf[512];
+    storage_manager_stats_t stats;
+    storage_manager_latency_t latency;
+
+    storage_manager = create_storage_manager(".", "test_storage_manager.str", 16 * 1024,
+                                             DELETE_IF_EXISTS | SM_TIMESTAMPS);
+    ASSERT(storage_manager != NULL);
+
+    // Only good to the second, so allow one either side
+    uint64_t before = ((uint64_t) time(NULL) - 1) * 1000000000ULL;
+
+    for (uint32_t i = 0; i < 1000; i++) {
+        int size = sprintf(record, COMPACT_RECORD, i, i % 17, i % 13);
+        ASSERT_EQ(storage_manager->write(storage_manager, record, size), 0);
+    }
+    ASSERT_EQ(storage_manager->sync(storage_manager, 1), 0);
+
+    // Nothing has been popped, so the oldest record is the first one written
+    sleep(1);
+    ASSERT_EQ(storage_manager->get_stats(storage_manager, &stats), 0);
+    ASSERT(stats.oldest_unconsumed_age_ns >= 900000000ULL);
+
+    for (uint32_t i = 0; i < 500; i++) {
+        int size = sprintf(record, COMPACT_RECORD, i, i % 17, i % 13);
+        storage_manager_cursor_t* cursor = storage_manager->pop_cursor(storage_manager);
+        ASSERT(cursor != NULL);
+        ASSERT_EQ(cursor->size, size);
+        ASSERT_EQ(memcmp(cursor->data, record, size), 0);
+        ASSERT(cursor->enqueue_time_ns > before);
+        storage_manager->free_cursor(storage_manager, cursor);
+    }
+    storage_manager->close(storage_manager);
+
+    // Reopened without the flag, the records still carry their timestamps
+    storage_manager = open_storage_manager(".", "test_storage_manager.str", 16 * 1024, 0);
+    ASSERT(storage_manager != NULL);
+
+    uint32_t popped = 0;
+    uint32_t len = 0;
+    storage_manager_cursor_t* cursor = storage_manager->pop_cursor(storage_manager);
+    ASSERT(cursor != NULL);
+    ASSERT(cursor->enqueue_time_ns > before);
+    storage_manager->free_cursor(storage_manager, cursor);
+    popped++;
+
+    // A record that does not fit asks for room for its timestamp as well
+    ASSERT_EQ(storage_manager->pop_into(storage_manager, buf, 8, &len), 1);
+    ASSERT(len > 8);
+    uint32_t needed = len;
+    ASSERT_EQ(storage_manager->pop_into(storage_manager, buf, needed, &len), 0);
+    ASSERT_EQ(len, needed - 8);
+    popped++;
+
+    while (storage_manager->pop_into(storage_manager, buf, sizeof(buf), &len) == 0) {
+        ASSERT_EQ(buf[0], '{');
+        popped++;
+    }
+
+    // Records read again after the reopen all count towards the lag
+    ASSERT(popped >= 500);
+    ASSERT_EQ(storage_manager->get_latency(storage_manager, SM_OP_LAG, &latency), 0);
+    ASSERT_EQ(latency.count, popped);
+    ASSERT(latency.p50_ns >= 900000000ULL);
+
+    // Everything has been popped
+    ASSERT_EQ(storage_manager->get_stats(storage_manager, &stats), 0);
+    ASSERT_EQ(stats.oldest_unconsumed_age_ns, 0);
+
+    // Cleanup
+    storage_manager->destroy(storage_manager);
+    PASS();
+}
+
+TEST test_depth() {
+    char record[512];
+    char buf[512];
+    uint32_t len = 0;
+
+    storage_manager = create_storage_manager(".", "test_storage_manager.str", 16 * 1024,
+                                             DELETE_IF_EXISTS | SM_TIMESTAMPS);
+    ASSERT(storage_manager != NULL);
+    ASSERT_EQ(storage_manager->depth(storage_manager), 0);
+    ASSERT_EQ(storage_manager->backlog_bytes(storage_manager), 0);
+
+    // Records count as waiting as soon as they are written, synced or not
+    uint64_t bytes = 0;
+    for (uint32_t i = 0; i < 1000; i++) {
+        int size = sprintf(record, COMPACT_RECORD, i, i % 17, i % 13);
+        ASSERT_EQ(storage_manager->write(storage_manager, record, size), 0);
+        bytes += size;
+    }
+    ASSERT_EQ(storage_manager->depth(storage_manager), 1000);
+    ASSERT_EQ(storage_manager->backlog_bytes(storage_manager), bytes);
+    ASSERT_EQ(storage_manager->sync(storage_manager, 1), 0);
+
+    for (uint32_t i = 0; i < 300; i++) {
+        ASSERT_EQ(storage_manager->pop_into(storage_manager, buf, sizeof(buf), &len), 0);
+        bytes -= len;
+    }
+    ASSERT_EQ(storage_manager->depth(storage_manager), 700);
+    ASSERT_EQ(storage_manager->backlog_bytes(storage_manager), bytes);
+    storage_manager->close(storage_manager);
+
+    // The segment being read when it closed is read again from the start, so its records are
+    // waiting again
+    storage_manager = open_storage_manager(".", "test_storage_manager.str", 16 * 1024, 0);
+    ASSERT(storage_manager != NULL);
+    uint64_t depth = storage_manager->depth(storage_manager);
+    uint64_t backlog_bytes = storage_manager->backlog_bytes(storage_manager);
+    ASSERT(depth >= 700 && depth < 1000);
+    ASSERT(backlog_bytes >= bytes);
+
+    uint64_t popped = 0;
+    uint64_t popped_bytes = 0;
+    while (storage_manager->pop_into(storage_manager, buf, sizeof(buf), &len) == 0) {
+        popped++;
+        popped_bytes += len;
+    }
+    ASSERT_EQ(popped, depth);
+    ASSERT_EQ(popped_bytes, backlog_bytes);
+    ASSERT_EQ(storage_manager->depth(storage_manager), 0);
+    ASSERT_EQ(storage_manager->backlog_bytes(storage_manager), 0);
+
+    // Cleanup
+    storage_manager->destroy(storage_manager);
+    PASS();
+}
+
+TEST test_missing_timestamp() {
+    char buf[512];
+    uint32_t len = 0;
+
+    storage_manager_options_t options = { .codec = SM_CODEC_NONE,
+                                          .flags = DELETE_IF_EXISTS | SM_TIMESTAMPS };
+    storage_manager = create_storage_manager_with_options(".", "test_storage_manager.str",
+                                                          16 * 1024, &options);
+    ASSERT(storage_manager != NULL);
+    ASSERT_EQ(storage_manager->write(storage_manager, "first", 5), 0);
+    ASSERT_EQ(storage_manager->sync(storage_manager, 1), 0);
+    storage_manager->close(storage_manager);
+
+    // Rewrite the segment behind the storage manager's back, with two records too short for a
+    // timestamp
+    char stamped[8 + 6] = { 0 };
+    store_t *segment = create_mmap_store(16 * 1024, ".", "test_storage_manager.str0",
+                                         DELETE_IF_EXISTS);
+    ASSERT(segment != NULL);
+    memcpy(stamped + 8, "first", 5);
+    ASSERT(segment->write(segment, stamped, 8 + 5) > 0);
+    memcpy(stamped + 8, "second", 6);
+    ASSERT(segment->write(segment, "bad", 3) > 0);
+    ASSERT(segment->write(segment, stamped, sizeof(stamped)) > 0);
+    ASSERT(segment->write(segment, "bad", 3) > 0);
+    ASSERT_EQ(segment->close(segment, true), 0);
+
+    // pop_into reports the short record as corrupt, pop_cursor passes over it
+    storage_manager = open_storage_manager(".", "test_storage_manager.str", 16 * 1024, 0);
+    ASSERT(storage_manager != NULL);
+    ASSERT_EQ(storage_manager->pop_into(storage_manager, buf, sizeof(buf), &len), 0);
+    ASSERT_EQ(len, 5);
+    ASSERT_EQ(storage_manager->pop_into(storage_manager, buf, sizeof(buf), &len),
+              DECOMPRESSION_FAULT);
+    ASSERT_EQ(len, 0);
+    ASSERT_EQ(storage_manager->pop_into(storage_manager, buf, sizeof(buf), &len), 0);
+    ASSERT_EQ(len, 6);
+    ASSERT_EQ(memcmp(buf, "second", 6), 0);
+    ASSERT(storage_manager->pop_cursor(storage_manager) == NULL);
+
+    // Cleanup
+    storage_manager->destroy(storage_manager);
+    PASS();
+}
+
 SUITE(storage_manager_suite) {
     RUN_TEST(test_write);
     RUN_TEST(test_read);
@@ -241,6 +764,16 @@ SUITE(storage_manager_suite) {
     RUN_TEST(test_multi_segment_read);
     RUN_TEST(test_read_persistent);
     RUN_TEST(test_multi_segment_read_persistent);
+    RUN_TEST(test_dictionary_read);
+    RUN_TEST(test_compacted_read);
+    RUN_TEST(test_block_read);
+    RUN_TEST(test_pop_into);
+    RUN_TEST(test_codecs);
+    RUN_TEST(test_stats);
+    RUN_TEST(test_latency);
+    RUN_TEST(test_timestamps);
+    RUN_TEST(test_depth);
+    RUN_TEST(test_missing_timestamp);
 }
 
 GREATEST_MAIN_DEFS();
@@ -0,0 +1,224 @@
+#include <greatest.h>
+#include "storage_manager.h"
+
+// For "DELETE_IF_EXISTS"
+// TODO: Remove
+#include "store.h"
+
+#include <pthread.h>
+#include <ck_pr.h>
+
+#define SIZE 32 * 1024 * 1024
+
+// Enough records to fill the front ring a couple of times over
+#define NUM_WRITES 10000
+#define NUM_THREADS 4
+
+static struct storage_manager *storage_manager;
+
+static uint64_t total_read = 0;
+static uint64_t total_sum = 0;
+
+TEST test_ring_read_without_sync() {
+
+    storage_manager = create_storage_manager(".", "test_storage_manager_ring.str", SIZE,
+                                             DELETE_IF_EXISTS | SM_RING_BUFFER);
+    ASSERT(storage_manager != NULL);
+
+    char *data = "abcdefghijklmnopqrstuvwxyz";
+    size_t size = strlen(data);
+    ASSERT_EQ(storage_manager->write(storage_manager, data, size), 0);
+
+    // The record comes straight out of memory, no sync needed
+    storage_manager_cursor_t* cursor = storage_manager->pop_cursor(storage_manager);
+    ASSERT(cursor != NULL);
+    ASSERT_EQ(cursor->size, size);
+    ASSERT_EQ(memcmp(data, cursor->data, size), 0);
+    storage_manager->free_cursor(storage_manager, cursor);
+
+    ASSERT(storage_manager->pop_cursor(storage_manager) == NULL);
+
+    storage_manager->destroy(storage_manager);
+    PASS();
+}
+
+TEST test_ring_spill_order() {
+
+    storage_manager = create_storage_manager(".", "test_storage_manager_ring.str", SIZE,
+                                             DELETE_IF_EXISTS | SM_RING_BUFFER);
+    ASSERT(storage_manager != NULL);
+
+    // Fill the ring past capacity so the oldest records end up in the segments
+    for (uint32_t i = 0; i < NUM_WRITES; i++) {
+        ASSERT_EQ(storage_manager->write(storage_manager, &i, sizeof(uint32_t)), 0);
+    }
+
+    // Records come back in order regardless of whether they were spilled
+    for (uint32_t i = 0; i < NUM_WRITES; i++) {
+        storage_manager_cursor_t* cursor = storage_manager->pop_cursor(storage_manager);
+        ASSERT(cursor != NULL);
+        ASSERT_EQ(cursor->size, sizeof(uint32_t));
+        ASSERT_EQ(*((uint32_t*) cursor->data), i);
+        storage_manager->free_cursor(storage_manager, cursor);
+    }
+
+    ASSERT(storage_manager->pop_cursor(storage_manager) == NULL);
+
+    storage_manager->destroy(storage_manager);
+    PASS();
+}
+
+TEST test_ring_close_persists() {
+
+    storage_manager = create_storage_manager(".", "test_storage_manager_ring.str", SIZE,
+                                             DELETE_IF_EXISTS | SM_RING_BUFFER);
+    ASSERT(storage_manager != NULL);
+
+    for (uint32_t i = 0; i < 100; i++) {
+        ASSERT_EQ(storage_manager->write(storage_manager, &i, sizeof(uint32_t)), 0);
+    }
+
+    // Records that only lived in the ring must survive a close
+    storage_manager->close(storage_manager);
+
+    storage_manager = open_storage_manager(".", "test_storage_manager_ring.str", SIZE, 0);
+    ASSERT(storage_manager != NULL);
+
+    for (uint32_t i = 0; i < 100; i++) {
+        storage_manager_cursor_t* cursor = storage_manager->pop_cursor(storage_manager);
+        ASSERT(cursor != NULL);
+        ASSERT_EQ(*((uint32_t*) cursor->data), i);
+        storage_manager->free_cursor(storage_manager, cursor);
+    }
+
+    ASSERT(storage_manager->pop_cursor(storage_manager) == NULL);
+
+    storage_manager->destroy(storage_manager);
+    PASS();
+}
+
+TEST test_ring_pop_into() {
+
+    storage_manager = create_storage_manager(".", "test_storage_manager_ring.str", SIZE,
+                                             DELETE_IF_EXISTS | SM_RING_BUFFER);
+    ASSERT(storage_manager != NULL);
+
+    char big[256];
+    memset(big, 'b', sizeof(big));
+    for (uint32_t i = 0; i < 100; i++) {
+        ASSERT_EQ(storage_manager->write(storage_manager, &i, sizeof(uint32_t)), 0);
+    }
+    ASSERT_EQ(storage_manager->write(storage_manager, big, sizeof(big)), 0);
+    ASSERT_EQ(storage_manager->write(storage_manager, big, 16), 0);
+
+    char buf[sizeof(big)];
+    uint32_t len = 0;
+    for (uint32_t i = 0; i < 100; i++) {
+        ASSERT_EQ(storage_manager->pop_into(storage_manager, buf, sizeof(uint32_t), &len), 0);
+        ASSERT_EQ(len, sizeof(uint32_t));
+        ASSERT_EQ(*((uint32_t*) buf), i);
+    }
+
+    // The big record is held back rather than lost, and still comes out first
+    ASSERT_EQ(storage_manager->pop_into(storage_manager, buf, 32, &len), 1);
+    ASSERT_EQ(len, sizeof(big));
+    ASSERT_EQ(storage_manager->pop_into(storage_manager, buf, 32, &len), 1);
+    ASSERT_EQ(storage_manager->pop_into(storage_manager, buf, sizeof(buf), &len), 0);
+    ASSERT_EQ(len, sizeof(big));
+    ASSERT_EQ(storage_manager->pop_into(storage_manager, buf, 32, &len), 0);
+    ASSERT_EQ(len, 16);
+    ASSERT_EQ(storage_manager->pop_into(storage_manager, buf, 32, &len), -1);
+
+    // Held records survive a close like the rest of the ring
+    ASSERT_EQ(storage_manager->write(storage_manager, big, sizeof(big)), 0);
+    ASSERT_EQ(storage_manager->pop_into(storage_manager, buf, 32, &len), 1);
+    storage_manager->close(storage_manager);
+
+    storage_manager = open_storage_manager(".", "test_storage_manager_ring.str", SIZE, 0);
+    ASSERT(storage_manager != NULL);
+    ASSERT_EQ(storage_manager->pop_into(storage_manager, buf, sizeof(buf), &len), 0);
+    ASSERT_EQ(len, sizeof(big));
+    ASSERT_EQ(storage_manager->pop_into(storage_manager, buf, sizeof(buf), &len), -1);
+
+    storage_manager->destroy(storage_manager);
+    PASS();
+}
+
+void * ring_writer(void* arg) {
+    for (uint32_t i = 1; i <= NUM_WRITES; i++) {
+        ensure(storage_manager->write(storage_manager, &i, sizeof(uint32_t)) == 0,
+               "Failed to write");
+    }
+    return NULL;
+}
+
+void * ring_reader(void* arg) {
+    uint64_t *done = (uint64_t*) arg;
+    while (true) {
+        storage_manager_cursor_t* cursor = storage_manager->pop_cursor(storage_manager);
+        if (cursor == NULL) {
+            if (ck_pr_load_64(done) == 1 &&
+                ck_pr_load_64(&total_read) == NUM_WRITES * NUM_THREADS) {
+                break;
+            }
+            continue;
+        }
+        ck_pr_add_64(&total_sum, *((uint32_t*) cursor->data));
+        ck_pr_inc_64(&total_read);
+        storage_manager->free_cursor(storage_manager, cursor);
+    }
+    return NULL;
+}
+
+TEST test_ring_threaded() {
+
+    storage_manager = create_storage_manager(".", "test_storage_manager_ring.str", SIZE,
+                                             DELETE_IF_EXISTS | SM_RING_BUFFER);
+    ASSERT(storage_manager != NULL);
+
+    ck_pr_store_64(&total_read, 0);
+    ck_pr_store_64(&total_sum, 0);
+    uint64_t done = 0;
+
+    pthread_t writers[NUM_THREADS], readers[NUM_THREADS];
+    for (int i = 0; i < NUM_THREADS; i++) {
+        pthread_create(&writers[i], NULL, &ring_writer, NULL);
+        pthread_create(&readers[i], NULL, &ring_reader, &done);
+    }
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        pthread_join(writers[i], NULL);
+    }
+
+    // Push out anything a reader was waiting on behind a spill
+    storage_manager->sync(storage_manager, 1);
+    ck_pr_store_64(&done, 1);
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        pthread_join(readers[i], NULL);
+    }
+
+    // Every record was read exactly once
+    uint64_t per_thread = ((uint64_t) NUM_WRITES * (NUM_WRITES + 1)) / 2;
+    ASSERT_EQ(ck_pr_load_64(&total_read), NUM_WRITES * NUM_THREADS);
+    ASSERT_EQ(ck_pr_load_64(&total_sum), per_thread * NUM_THREADS);
+
+    storage_manager->destroy(storage_manager);
+    PASS();
+}
+
+SUITE(storage_manager_ring_suite) {
+    RUN_TEST(test_ring_read_without_sync);
+    RUN_TEST(test_ring_spill_order);
+    RUN_TEST(test_ring_close_persists);
+    RUN_TEST(test_ring_pop_into);
+    RUN_TEST(test_ring_threaded);
+}
+
+GREATEST_MAIN_DEFS();
+
+int main(int argc, char **argv) {
+    GREATEST_MAIN_BEGIN();
+    RUN_SUITE(storage_manager_ring_suite);
+    GREATEST_MAIN_END();
+}
@@ -0,0 +1,335 @@
+#include "storage_manager.h"
+
+// For "DELETE_IF_EXISTS"
+// TODO: Remove
+#include "store.h"
+
+#include <greatest.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+
+// Small segments, so that the processes go through plenty of them
+#define SIZE 64 * 1024
+
+#define NUM_WRITES 10000
+#define NUM_PROCESSES 4
+
+#define NAME "test_storage_manager_shared.str"
+
+struct record {
+    uint32_t process;
+    uint32_t sequence;
+};
+
+/*
+ * Each process opens the queue for itself, a storage manager never crosses a fork
+ */
+static struct storage_manager* open_shared() {
+    return open_storage_manager(".", NAME, SIZE, SM_SHARED);
+}
+
+static int wait_for_children(pid_t *children, int count) {
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        int status = 0;
+        if (waitpid(children[i], &status, 0) != children[i] || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0) {
+            failed++;
+        }
+    }
+    return failed;
+}
+
+static void produce(uint32_t process) {
+    struct storage_manager *storage_manager = open_shared();
+    for (uint32_t i = 0; i < NUM_WRITES; i++) {
+        struct record record = { .process = process, .sequence = i };
+        if (storage_manager->write(storage_manager, &record, sizeof(record)) != 0) {
+            _exit(1);
+        }
+    }
+    storage_manager->sync(storage_manager, 1);
+    storage_manager->close(storage_manager);
+    _exit(0);
+}
+
+TEST test_shared_producers() {
+    struct storage_manager *storage_manager = create_storage_manager(".", NAME, SIZE,
+                                                                     DELETE_IF_EXISTS | SM_SHARED);
+    ASSERT(storage_manager != NULL);
+
+    pid_t children[NUM_PROCESSES];
+    for (uint32_t i = 0; i < NUM_PROCESSES; i++) {
+        children[i] = fork();
+        ASSERT(children[i] >= 0);
+        if (children[i] == 0) {
+            produce(i);
+        }
+    }
+    ASSERT_EQ(wait_for_children(children, NUM_PROCESSES), 0);
+    ASSERT_EQ(storage_manager->depth(storage_manager), NUM_WRITES * NUM_PROCESSES);
+
+    // A single consumer sees each producer's records in the order they were written
+    uint32_t next[NUM_PROCESSES] = { 0 };
+    uint32_t total = 0;
+    storage_manager_cursor_t *cursor = NULL;
+    while ((cursor = storage_manager->pop_cursor(storage_manager)) != NULL) {
+        ASSERT_EQ(cursor->size, sizeof(struct record));
+        struct record *record = (struct record*) cursor->data;
+        ASSERT(record->process < NUM_PROCESSES);
+        ASSERT_EQ(record->sequence, next[record->process]);
+        next[record->process]++;
+        total++;
+        storage_manager->free_cursor(storage_manager, cursor);
+    }
+
+    ASSERT_EQ(total, NUM_WRITES * NUM_PROCESSES);
+    ASSERT_EQ(storage_manager->depth(storage_manager), 0);
+    ASSERT_EQ(storage_manager->backlog_bytes(storage_manager), 0);
+
+    storage_manager->destroy(storage_manager);
+    PASS();
+}
+
+static void consume(int fd) {
+    struct storage_manager *storage_manager = open_shared();
+    uint64_t result[2] = { 0, 0 };
+    uint32_t value = 0;
+    uint32_t len = 0;
+    while (storage_manager->pop_into(storage_manager, &value, sizeof(value), &len) == 0) {
+        result[0]++;
+        result[1] += value;
+    }
+    storage_manager->close(storage_manager);
+
+    ssize_t written = write(fd, result, sizeof(result));
+    _exit(written == sizeof(result) ? 0 : 1);
+}
+
+TEST test_shared_consumers() {
+    struct storage_manager *storage_manager = create_storage_manager(".", NAME, SIZE,
+                                                                     DELETE_IF_EXISTS | SM_SHARED);
+    ASSERT(storage_manager != NULL);
+
+    for (uint32_t i = 1; i <= NUM_WRITES * NUM_PROCESSES; i++) {
+        ASSERT_EQ(storage_manager->write(storage_manager, &i, sizeof(i)), 0);
+    }
+    ASSERT_EQ(storage_manager->sync(storage_manager, 1), 0);
+
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+    pid_t children[NUM_PROCESSES];
+    for (uint32_t i = 0; i < NUM_PROCESSES; i++) {
+        children[i] = fork();
+        ASSERT(children[i] >= 0);
+        if (children[i] == 0) {
+            close(fds[0]);
+            consume(fds[1]);
+        }
+    }
+    close(fds[1]);
+    ASSERT_EQ(wait_for_children(children, NUM_PROCESSES), 0);
+
+    // Every record went to exactly one consumer
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t result[2];
+    while (read(fds[0], result, sizeof(result)) == sizeof(result)) {
+        count += result[0];
+        sum += result[1];
+    }
+    close(fds[0]);
+
+    uint64_t total = NUM_WRITES * NUM_PROCESSES;
+    ASSERT_EQ(count, total);
+    ASSERT_EQ(sum, (total * (total + 1)) / 2);
+    ASSERT_EQ(storage_manager->depth(storage_manager), 0);
+    ASSERT(storage_manager->pop_cursor(storage_manager) == NULL);
+
+    storage_manager->destroy(storage_manager);
+    PASS();
+}
+
+/*
+ * Pops part of a segment and writes without syncing, then dies holding both segments
+ */
+static void die_holding_segments() {
+    struct storage_manager *storage_manager = open_shared();
+    for (int i = 0; i < 100; i++) {
+        storage_manager_cursor_t *cursor = storage_manager->pop_cursor(storage_manager);
+        if (cursor == NULL) {
+            _exit(1);
+        }
+        storage_manager->free_cursor(storage_manager, cursor);
+    }
+
+    uint32_t lost = UINT32_MAX;
+    for (int i = 0; i < 100; i++) {
+        storage_manager->write(storage_manager, &lost, sizeof(lost));
+    }
+    _exit(0);
+}
+
+TEST test_shared_dead_process() {
+    struct storage_manager *storage_manager = create_storage_manager(".", NAME, SIZE,
+                                                                     DELETE_IF_EXISTS | SM_SHARED);
+    ASSERT(storage_manager != NULL);
+
+    for (uint32_t i = 0; i < 1000; i++) {
+        ASSERT_EQ(storage_manager->write(storage_manager, &i, sizeof(i)), 0);
+    }
+    ASSERT_EQ(storage_manager->sync(storage_manager, 1), 0);
+
+    pid_t child = fork();
+    ASSERT(child >= 0);
+    if (child == 0) {
+        die_holding_segments();
+    }
+    ASSERT_EQ(wait_for_children(&child, 1), 0);
+
+    // The segment the dead process claimed is still its own until someone cleans up after it
+    ASSERT_EQ(storage_manager->depth(storage_manager), 1000 - 100 + 100);
+    ASSERT(storage_manager->pop_cursor(storage_manager) == NULL);
+
+    // Opening the queue does.  What it popped is back, what it did not sync is gone.
+    struct storage_manager *reopened = open_shared();
+    ASSERT(reopened != NULL);
+    ASSERT_EQ(reopened->depth(reopened), 1000);
+
+    for (uint32_t i = 0; i < 1000; i++) {
+        uint32_t value = 0;
+        uint32_t len = 0;
+        ASSERT_EQ(reopened->pop_into(reopened, &value, sizeof(value), &len), 0);
+        ASSERT_EQ(value, i);
+    }
+    uint32_t value = 0;
+    uint32_t len = 0;
+    ASSERT_EQ(reopened->pop_into(reopened, &value, sizeof(value), &len), -1);
+    ASSERT_EQ(reopened->depth(reopened), 0);
+
+    reopened->close(reopened);
+    storage_manager->destroy(storage_manager);
+    PASS();
+}
+
+/*
+ * Writes and syncs some records, then writes more without syncing and waits to be killed
+ */
+static void write_until_killed(int fd) {
+    struct storage_manager *storage_manager = open_shared();
+    for (uint32_t i = 0; i < 1000; i++) {
+        if (storage_manager->write(storage_manager, &i, sizeof(i)) != 0) {
+            _exit(1);
+        }
+    }
+    storage_manager->sync(storage_manager, 1);
+
+    uint32_t lost = UINT32_MAX;
+    for (int i = 0; i < 100; i++) {
+        storage_manager->write(storage_manager, &lost, sizeof(lost));
+    }
+
+    char ready = 1;
+    if (write(fd, &ready, sizeof(ready)) != sizeof(ready)) {
+        _exit(1);
+    }
+    while (true) {
+        pause();
+    }
+}
+
+TEST test_shared_killed_writer() {
+    struct storage_manager *storage_manager = create_storage_manager(".", NAME, SIZE,
+                                                                     DELETE_IF_EXISTS | SM_SHARED);
+    ASSERT(storage_manager != NULL);
+
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+    pid_t child = fork();
+    ASSERT(child >= 0);
+    if (child == 0) {
+        close(fds[0]);
+        write_until_killed(fds[1]);
+    }
+    close(fds[1]);
+
+    char ready = 0;
+    ASSERT_EQ(read(fds[0], &ready, sizeof(ready)), sizeof(ready));
+    close(fds[0]);
+
+    // Its segment stays claimed for as long as it is alive, whatever anyone else does
+    ASSERT_EQ(storage_manager->depth(storage_manager), 1000 + 100);
+    uint32_t marker = 1000;
+    ASSERT_EQ(storage_manager->write(storage_manager, &marker, sizeof(marker)), 0);
+    ASSERT_EQ(storage_manager->sync(storage_manager, 1), 0);
+    ASSERT_EQ(storage_manager->depth(storage_manager), 1000 + 100 + 1);
+
+    // Killed, the kernel drops its lease and the next claim recovers the segment it was writing
+    ASSERT_EQ(kill(child, SIGKILL), 0);
+    int status = 0;
+    ASSERT_EQ(waitpid(child, &status, 0), child);
+    ASSERT(WIFSIGNALED(status));
+
+    marker = 1001;
+    ASSERT_EQ(storage_manager->write(storage_manager, &marker, sizeof(marker)), 0);
+    ASSERT_EQ(storage_manager->sync(storage_manager, 1), 0);
+    ASSERT_EQ(storage_manager->depth(storage_manager), 1000 + 2);
+
+    for (uint32_t i = 0; i < 1000 + 2; i++) {
+        uint32_t value = 0;
+        uint32_t len = 0;
+        ASSERT_EQ(storage_manager->pop_into(storage_manager, &value, sizeof(value), &len), 0);
+        ASSERT_EQ(value, i);
+    }
+    uint32_t value = 0;
+    uint32_t len = 0;
+    ASSERT_EQ(storage_manager->pop_into(storage_manager, &value, sizeof(value), &len), -1);
+    ASSERT_EQ(storage_manager->depth(storage_manager), 0);
+
+    storage_manager->destroy(storage_manager);
+    PASS();
+}
+
+TEST test_shared_async_quota() {
+    storage_manager_options_t options = { .codec = SM_CODEC_NONE,
+                                          .flags = DELETE_IF_EXISTS | SM_SHARED |
+                                                   SM_ASYNC_WRITE(1),
+                                          .quota_policy = SM_QUOTA_FAIL, .max_segments = 1 };
+    struct storage_manager *storage_manager = create_storage_manager_with_options(".", NAME, SIZE,
+                                                                                  &options);
+    ASSERT(storage_manager != NULL);
+
+    // SM_ASYNC_WRITE is off under SM_SHARED, so the write the quota turns away is the one told
+    uint32_t written = 0;
+    int ret = 0;
+    while ((ret = storage_manager->write(storage_manager, &written, sizeof(written))) == 0) {
+        written++;
+        ASSERT(written < SIZE);
+    }
+    ASSERT_EQ(ret, -2);
+    ASSERT(written > 0);
+    ASSERT_EQ(storage_manager->sync(storage_manager, 1), 0);
+    ASSERT_EQ(storage_manager->depth(storage_manager), written);
+
+    storage_manager->destroy(storage_manager);
+    PASS();
+}
+
+SUITE(storage_manager_shared_suite) {
+    RUN_TEST(test_shared_producers);
+    RUN_TEST(test_shared_consumers);
+    RUN_TEST(test_shared_dead_process);
+    RUN_TEST(test_shared_killed_writer);
+    RUN_TEST(test_shared_async_quota);
+}
+
+GREATEST_MAIN_DEFS();
+
+int main(int argc, char **argv) {
+    GREATEST_MAIN_BEGIN();
+    RUN_SUITE(storage_manager_shared_suite);
+    GREATEST_MAIN_END();
+}
@@ -14,6 +14,7 @@
 
 #include <signal.h>
 
+#include <time.h>
 #include <unistd.h>
 
 static storage_manager_t *storage_manager;
@@ -410,12 +411,438 @@ TEST threaded_simultaneous_write_and_read_persistence_storage_manager_test() {
     PASS();
 }
 
+#define ASYNC_PRODUCERS 4
+#define ASYNC_WRITES 2000
+
+void * test_async_write(void* id) {
+    uint32_t record[2] = { *((uint32_t*) id), 0 };
+    for (record[1] = 0; record[1] < ASYNC_WRITES; record[1]++) {
+        ensure(storage_manager->write(storage_manager, record, sizeof(record)) == 0,
+               "Failed to write");
+    }
+    return NULL;
+}
+
+TEST threaded_async_write_storage_manager_test() {
+
+    // Allocate storage manager, with more workers than cores to make sure they really interleave
+    storage_manager = create_storage_manager(".", "test_storage_manager.str", 16 * 1024,
+                                             DELETE_IF_EXISTS | SM_ASYNC_WRITE(3));
+    ASSERT(storage_manager != NULL);
+
+    uint32_t ids[ASYNC_PRODUCERS];
+    pthread_t producers[ASYNC_PRODUCERS];
+    for (uint32_t i = 0; i < ASYNC_PRODUCERS; i++) {
+        ids[i] = i;
+        pthread_create(&producers[i], NULL, &test_async_write, &ids[i]);
+    }
+    for (uint32_t i = 0; i < ASYNC_PRODUCERS; i++) {
+        pthread_join(producers[i], NULL);
+    }
+
+    // Sync waits for the workers, after which everything is readable
+    ASSERT_EQ(storage_manager->sync(storage_manager, 1), 0);
+
+    // Each producer's records come back in the order it wrote them
+    uint32_t next[ASYNC_PRODUCERS] = { 0 };
+    storage_manager_cursor_t *cursor = storage_manager->pop_cursor(storage_manager);
+    while (cursor != NULL) {
+        ASSERT_EQ(cursor->size, sizeof(uint32_t) * 2);
+        uint32_t *record = (uint32_t*) cursor->data;
+        ASSERT(record[0] < ASYNC_PRODUCERS);
+        ASSERT_EQ(record[1], next[record[0]]);
+        next[record[0]]++;
+        storage_manager->free_cursor(storage_manager, cursor);
+        cursor = storage_manager->pop_cursor(storage_manager);
+    }
+
+    for (uint32_t i = 0; i < ASYNC_PRODUCERS; i++) {
+        ASSERT_EQ(next[i], ASYNC_WRITES);
+    }
+
+    // Cleanup
+    storage_manager->destroy(storage_manager);
+
+    PASS();
+}
+
+#define READ_AHEAD_WRITES 4000
+#define READ_AHEAD_RECORD "{\"id\": %u, \"type\": \"view\", \"padding\": \"%0100u\"}"
+
+TEST threaded_read_ahead_storage_manager_test() {
+
+    // Small segments, so the workers read well ahead across segment boundaries
+    storage_manager = create_storage_manager(".", "test_storage_manager.str", 16 * 1024,
+                                             DELETE_IF_EXISTS | SM_READ_AHEAD(3));
+    ASSERT(storage_manager != NULL);
+
+    char record[256];
+    for (uint32_t i = 0; i < READ_AHEAD_WRITES; i++) {
+        int size = sprintf(record, READ_AHEAD_RECORD, i, i);
+        ASSERT_EQ(storage_manager->write(storage_manager, record, size), 0);
+    }
+    ASSERT_EQ(storage_manager->sync(storage_manager, 1), 0);
+
+    // Consume some in order, and close with the workers holding more
+    char *seen = calloc(READ_AHEAD_WRITES, 1);
+    ASSERT(seen != NULL);
+    for (uint32_t i = 0; i < READ_AHEAD_WRITES / 2; i++) {
+        storage_manager_cursor_t *cursor = storage_manager->pop_cursor(storage_manager);
+        ASSERT(cursor != NULL);
+        uint32_t id = 0;
+        ASSERT_EQ(sscanf(cursor->data, "{\"id\": %u", &id), 1);
+        ASSERT_EQ(id, i);
+        ASSERT_EQ(cursor->size, sprintf(record, READ_AHEAD_RECORD, id, id));
+        ASSERT_EQ(memcmp(cursor->data, record, cursor->size), 0);
+        seen[id] = 1;
+        storage_manager->free_cursor(storage_manager, cursor);
+    }
+    storage_manager->close(storage_manager);
+
+    // Nothing that was not consumed went missing, and what was read ahead comes back in order,
+    // along with the consumed records of its segment
+    storage_manager = open_storage_manager(".", "test_storage_manager.str", 16 * 1024,
+                                           SM_READ_AHEAD(3));
+    ASSERT(storage_manager != NULL);
+
+    uint32_t len = 0;
+    uint32_t next = 0;
+    while (storage_manager->pop_into(storage_manager, record, sizeof(record), &len) == 0) {
+        uint32_t id = 0;
+        record[len] = '\0';
+        ASSERT_EQ(sscanf(record, "{\"id\": %u", &id), 1);
+        ASSERT(id < READ_AHEAD_WRITES);
+        ASSERT(next == 0 ? id <= READ_AHEAD_WRITES / 2 : id == next);
+        next = id + 1;
+        seen[id] = 1;
+    }
+
+    for (uint32_t i = 0; i < READ_AHEAD_WRITES; i++) {
+        ASSERT_EQ(seen[i], 1);
+    }
+
+    // Cleanup
+    storage_manager->destroy(storage_manager);
+    free(seen);
+
+    PASS();
+}
+
+#define QUOTA_RECORD 100
+#define QUOTA_RECORDS 10
+#define QUOTA_WRITES 200
+
+static storage_manager_t* create_quota_storage_manager(enum storage_manager_quota_policy policy,
+                                                       uint32_t timeout_ms) {
+    storage_manager_options_t options = { .codec = SM_CODEC_NONE, .flags = DELETE_IF_EXISTS,
+                                          .quota_policy = policy,
+                                          .max_bytes = QUOTA_RECORD * QUOTA_RECORDS,
+                                          .quota_timeout_ms = timeout_ms };
+    return create_storage_manager_with_options(".", "test_storage_manager_threaded.str",
+                                               4 * 1024, &options);
+}
+
+TEST threaded_quota_fail_storage_manager_test() {
+    char record[QUOTA_RECORD];
+    memset(record, 'q', sizeof(record));
+    storage_manager_stats_t stats;
+
+    storage_manager = create_quota_storage_manager(SM_QUOTA_FAIL, 0);
+    ASSERT(storage_manager != NULL);
+
+    for (int i = 0; i < QUOTA_RECORDS; i++) {
+        ASSERT_EQ(storage_manager->write(storage_manager, record, sizeof(record)), 0);
+    }
+    ASSERT_EQ(storage_manager->write(storage_manager, record, sizeof(record)), -2);
+    ASSERT_EQ(storage_manager->depth(storage_manager), QUOTA_RECORDS);
+
+    // Popping one makes room for one
+    ASSERT_EQ(storage_manager->sync(storage_manager, 1), 0);
+    storage_manager_cursor_t* cursor = storage_manager->pop_cursor(storage_manager);
+    ASSERT(cursor != NULL);
+    storage_manager->free_cursor(storage_manager, cursor);
+    ASSERT_EQ(storage_manager->write(storage_manager, record, sizeof(record)), 0);
+    ASSERT_EQ(storage_manager->write(storage_manager, record, sizeof(record)), -2);
+
+    ASSERT_EQ(storage_manager->get_stats(storage_manager, &stats), 0);
+    ASSERT_EQ(stats.quota_rejections, 2);
+    ASSERT_EQ(stats.quota_waits, 0);
+
+    storage_manager->destroy(storage_manager);
+    PASS();
+}
+
+TEST threaded_quota_drop_oldest_storage_manager_test() {
+    char record[QUOTA_RECORD];
+    memset(record, 'q', sizeof(record));
+    storage_manager_stats_t stats;
+
+    storage_manager = create_quota_storage_manager(SM_QUOTA_DROP_OLDEST, 0);
+    ASSERT(storage_manager != NULL);
+
+    for (uint32_t i = 0; i < QUOTA_WRITES; i++) {
+        memcpy(record, &i, sizeof(i));
+        ASSERT_EQ(storage_manager->write(storage_manager, record, sizeof(record)), 0);
+    }
+    ASSERT_EQ(storage_manager->depth(storage_manager), QUOTA_RECORDS);
+    ASSERT_EQ(storage_manager->sync(storage_manager, 1), 0);
+
+    // Only the newest records are left
+    for (uint32_t i = QUOTA_WRITES - QUOTA_RECORDS; i < QUOTA_WRITES; i++) {
+        storage_manager_cursor_t* cursor = storage_manager->pop_cursor(storage_manager);
+        ASSERT(cursor != NULL);
+        ASSERT_EQ(*((uint32_t*) cursor->data), i);
+        storage_manager->free_cursor(storage_manager, cursor);
+    }
+    ASSERT(storage_manager->pop_cursor(storage_manager) == NULL);
+
+    ASSERT_EQ(storage_manager->get_stats(storage_manager, &stats), 0);
+    ASSERT_EQ(stats.records_dropped, QUOTA_WRITES - QUOTA_RECORDS);
+    ASSERT_EQ(stats.records_popped, QUOTA_WRITES);
+
+    storage_manager->destroy(storage_manager);
+    PASS();
+}
+
+void * test_quota_write(void* arg) {
+    uint64_t *done = (uint64_t*) arg;
+    char record[QUOTA_RECORD];
+    memset(record, 'q', sizeof(record));
+    for (uint32_t i = 0; i < QUOTA_WRITES; i++) {
+        memcpy(record, &i, sizeof(i));
+        ensure(storage_manager->write(storage_manager, record, sizeof(record)) == 0,
+               "Failed to write");
+        ensure(storage_manager->depth(storage_manager) <= QUOTA_RECORDS, "Quota exceeded");
+    }
+    ck_pr_store_64(done, 1);
+    return NULL;
+}
+
+TEST threaded_quota_block_storage_manager_test() {
+    char record[QUOTA_RECORD];
+    memset(record, 'q', sizeof(record));
+    storage_manager_stats_t stats;
+
+    // Nobody reads, so the write gives up
+    storage_manager = create_quota_storage_manager(SM_QUOTA_BLOCK, 50);
+    ASSERT(storage_manager != NULL);
+    for (int i = 0; i < QUOTA_RECORDS; i++) {
+        ASSERT_EQ(storage_manager->write(storage_manager, record, sizeof(record)), 0);
+    }
+    ASSERT_EQ(storage_manager->write(storage_manager, record, sizeof(record)), -2);
+    ASSERT_EQ(storage_manager->get_stats(storage_manager, &stats), 0);
+    ASSERT_EQ(stats.quota_waits, 1);
+    ASSERT_EQ(stats.quota_rejections, 1);
+    storage_manager->destroy(storage_manager);
+
+    // The writer keeps waiting for the reader to catch up, and never loses a record
+    storage_manager = create_quota_storage_manager(SM_QUOTA_BLOCK, 0);
+    ASSERT(storage_manager != NULL);
+
+    uint64_t done = 0;
+    pthread_t writer;
+    pthread_create(&writer, NULL, &test_quota_write, &done);
+
+    uint32_t next = 0;
+    while (next < QUOTA_WRITES) {
+        storage_manager_cursor_t* cursor = storage_manager->pop_cursor(storage_manager);
+        if (cursor == NULL) {
+
+            // The writer syncs before it waits, the records after its last wait need this
+            if (ck_pr_load_64(&done) == 1) {
+                storage_manager->sync(storage_manager, 1);
+            }
+            usleep(1000);
+            continue;
+        }
+        ASSERT_EQ(*((uint32_t*) cursor->data), next);
+        storage_manager->free_cursor(storage_manager, cursor);
+        next++;
+    }
+    pthread_join(writer, NULL);
+
+    ASSERT_EQ(storage_manager->get_stats(storage_manager, &stats), 0);
+    ASSERT(stats.quota_waits > 0);
+    ASSERT_EQ(stats.quota_rejections, 0);
+    ASSERT_EQ(storage_manager->depth(storage_manager), 0);
+
+    storage_manager->destroy(storage_manager);
+    PASS();
+}
+
+#define SPSC_WRITES 20000
+#define SPSC_SYNC_EVERY 1000
+
+void * test_single_write(void* arg) {
+    for (uint32_t i = 0; i < SPSC_WRITES; i++) {
+        ensure(storage_manager->write(storage_manager, &i, sizeof(i)) == 0, "Write failed");
+        if ((i + 1) % SPSC_SYNC_EVERY == 0) {
+            storage_manager->sync(storage_manager, 1);
+        }
+    }
+    return NULL;
+}
+
+TEST threaded_single_producer_consumer_storage_manager_test() {
+    storage_manager_options_t options = { .codec = SM_CODEC_NONE,
+                                          .flags = DELETE_IF_EXISTS | SM_SINGLE_PRODUCER |
+                                                   SM_SINGLE_CONSUMER };
+    storage_manager = create_storage_manager_with_options(".", "test_storage_manager_threaded.str",
+                                                          4 * 1024, &options);
+    ASSERT(storage_manager != NULL);
+
+    pthread_t producer;
+    ASSERT_EQ(pthread_create(&producer, NULL, test_single_write, NULL), 0);
+
+    // This thread is the one consumer, taking turns between the two ways to pop
+    uint32_t next = 0;
+    while (next < SPSC_WRITES) {
+        uint32_t value = 0;
+        uint32_t len = 0;
+        if (next % 2 == 0) {
+            storage_manager_cursor_t* cursor = storage_manager->pop_cursor(storage_manager);
+            if (cursor == NULL) {
+                sched_yield();
+                continue;
+            }
+            ASSERT_EQ(cursor->size, sizeof(uint32_t));
+            memcpy(&value, cursor->data, sizeof(uint32_t));
+            storage_manager->free_cursor(storage_manager, cursor);
+        } else if (storage_manager->pop_into(storage_manager, &value, sizeof(value), &len) != 0) {
+            sched_yield();
+            continue;
+        }
+        ASSERT_EQ(value, next);
+        next++;
+    }
+
+    ASSERT_EQ(pthread_join(producer, NULL), 0);
+    ASSERT(storage_manager->pop_cursor(storage_manager) == NULL);
+    ASSERT_EQ(storage_manager->depth(storage_manager), 0);
+
+    storage_manager->destroy(storage_manager);
+    PASS();
+}
+
+TEST threaded_read_ahead_order_storage_manager_test(int workers) {
+    storage_manager_options_t options = { .codec = SM_CODEC_NONE,
+                                          .flags = DELETE_IF_EXISTS | SM_READ_AHEAD(workers) };
+    storage_manager = create_storage_manager_with_options(".", "test_storage_manager_threaded.str",
+                                                          4 * 1024, &options);
+    ASSERT(storage_manager != NULL);
+
+    pthread_t producer;
+    ASSERT_EQ(pthread_create(&producer, NULL, test_single_write, NULL), 0);
+
+    // One consumer sees records in the order they were written, however the workers and the
+    // consumer split the popping between them
+    uint32_t next = 0;
+    while (next < SPSC_WRITES) {
+        uint32_t value = 0;
+        uint32_t len = 0;
+        if (next % 2 == 0) {
+            storage_manager_cursor_t* cursor = storage_manager->pop_cursor(storage_manager);
+            if (cursor == NULL) {
+                sched_yield();
+                continue;
+            }
+            ASSERT_EQ(cursor->size, sizeof(uint32_t));
+            memcpy(&value, cursor->data, sizeof(uint32_t));
+            storage_manager->free_cursor(storage_manager, cursor);
+        } else if (storage_manager->pop_into(storage_manager, &value, sizeof(value), &len) != 0) {
+            sched_yield();
+            continue;
+        }
+        ASSERT_EQ(value, next);
+        next++;
+    }
+
+    ASSERT_EQ(pthread_join(producer, NULL), 0);
+    ASSERT(storage_manager->pop_cursor(storage_manager) == NULL);
+
+    storage_manager->destroy(storage_manager);
+    PASS();
+}
+
+#define DECODE_RECORDS 4096
+#define DECODE_RECORD_SIZE (32 * 1024)
+
+/*
+ * Writes DECODE_RECORDS compressible records, and returns how many of them a single consumer pops
+ * per second with the given number of read ahead workers, checking they come back in order
+ */
+static double read_ahead_decode_rate(int workers, char *record, char *buf) {
+    storage_manager_options_t options = { .codec = SM_CODEC_LZ4,
+                                          .flags = DELETE_IF_EXISTS | SM_READ_AHEAD(workers) };
+    storage_manager = create_storage_manager_with_options(".", "test_storage_manager_threaded.str",
+                                                          4 * 1024 * 1024, &options);
+    ensure(storage_manager != NULL, "Failed to create storage manager");
+
+    for (uint32_t i = 0; i < DECODE_RECORDS; i++) {
+        uint32_t seed = i;
+        for (uint32_t at = 0; at + 64 <= DECODE_RECORD_SIZE; at += 64) {
+            seed = seed * 1103515245 + 12345;
+            sprintf(record + at, "{\"id\": %010u, \"type\": \"view\", \"value\": \"%08x\"},    \n",
+                    i, seed >> 16);
+        }
+        ensure(storage_manager->write(storage_manager, record, DECODE_RECORD_SIZE) == 0,
+               "Write failed");
+    }
+    ensure(storage_manager->sync(storage_manager, 1) == 0, "Sync failed");
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint32_t len = 0;
+    for (uint32_t i = 0; i < DECODE_RECORDS; i++) {
+        ensure(storage_manager->pop_into(storage_manager, buf, DECODE_RECORD_SIZE, &len) == 0,
+               "Pop failed");
+        uint32_t id = 0;
+        ensure(len == DECODE_RECORD_SIZE && sscanf(buf, "{\"id\": %u", &id) == 1 && id == i,
+               "Records out of order");
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ensure(storage_manager->pop_into(storage_manager, buf, DECODE_RECORD_SIZE, &len) == -1,
+           "Records left over");
+
+    storage_manager->destroy(storage_manager);
+    return DECODE_RECORDS / ((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+TEST threaded_read_ahead_decode_storage_manager_test() {
+    char *record = calloc(1, DECODE_RECORD_SIZE + 64);
+    char *buf = calloc(1, DECODE_RECORD_SIZE + 1);
+    ASSERT(record != NULL && buf != NULL);
+
+    // Workers decompress side by side, so more of them keep a consumer busier.  With one, the
+    // consumer decompresses alongside it whenever it runs dry.
+    double one = read_ahead_decode_rate(1, record, buf);
+    double four = read_ahead_decode_rate(4, record, buf);
+    printf("Records decoded per second, 1 worker: %.0f, 4 workers: %.0f\n", one, four);
+    free(record);
+    free(buf);
+
+    if (sysconf(_SC_NPROCESSORS_ONLN) <= 4) {
+        SKIPm("Needs more than 4 cores for the workers to decompress side by side");
+    }
+    ASSERT(four > one * 1.25);
+    PASS();
+}
+
 SUITE(storage_manager_threadtest_suite) {
     RUN_TEST(threaded_write_storage_manager_test);
     RUN_TEST(threaded_read_storage_manager_test);
     RUN_TEST(threaded_write_and_read_storage_manager_test);
     RUN_TEST(threaded_simultaneous_write_and_read_storage_manager_test);
     RUN_TEST(threaded_simultaneous_write_and_read_persistence_storage_manager_test);
+    RUN_TEST(threaded_async_write_storage_manager_test);
+    RUN_TEST(threaded_read_ahead_storage_manager_test);
+    RUN_TEST(threaded_quota_fail_storage_manager_test);
+    RUN_TEST(threaded_quota_drop_oldest_storage_manager_test);
+    RUN_TEST(threaded_quota_block_storage_manager_test);
+    RUN_TEST(threaded_single_producer_consumer_storage_manager_test);
+    RUN_TESTp(threaded_read_ahead_order_storage_manager_test, 1);
+    RUN_TESTp(threaded_read_ahead_order_storage_manager_test, 4);
+    RUN_TEST(threaded_read_ahead_decode_storage_manager_test);
 }
 
 GREATEST_MAIN_DEFS();
@@ -1,6 +1,9 @@
 #include <greatest.h>
 #include "store.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+
 // This is duplicated to avoid externing this struct
 struct lz4_store {
     store_t store;
@@ -150,10 +153,569 @@ TEST test_store_persistence() {
     PASS();
 }
 
+TEST test_raw_records() {
+
+    // Create new lz4 store
+    store_t *delegate = create_mmap_store(SIZE, ".", "test_lz4store.str", DELETE_IF_EXISTS);
+    ASSERT(delegate != NULL);
+    store = (struct lz4_store*) open_lz4_store(delegate, 0);
+    ASSERT(store != NULL);
+    store_t *s = (store_t*) store;
+
+    // Frames are [uint32_t size][uint32_t flags | compressed size][uint32_t true size][bytes]
+    uint32_t frame_overhead = sizeof(uint32_t) * 3;
+
+    // Small records are stored as is
+    char small[32];
+    memset(small, 'S', sizeof(small));
+    uint32_t small_offset = s->write(s, small, sizeof(small));
+    ASSERT(small_offset > 0);
+    ASSERT_EQ(s->cursor(s), small_offset + frame_overhead + sizeof(small));
+
+    // So are records that look incompressible
+    size_t noise_size = 4096;
+    unsigned char *noise = malloc(noise_size);
+    ASSERT(noise != NULL);
+    uint32_t state = 12345;
+    for (size_t i = 0; i < noise_size; i++) {
+        state = state * 1103515245 + 12345;
+        noise[i] = state >> 24;
+    }
+    uint32_t noise_offset = s->write(s, noise, noise_size);
+    ASSERT(noise_offset > 0);
+    ASSERT_EQ(s->cursor(s), noise_offset + frame_overhead + noise_size);
+
+    // While compressible ones still shrink
+    char *text = calloc(1, noise_size);
+    ASSERT(text != NULL);
+    for (size_t i = 0; i < noise_size; i++) {
+        text[i] = "{\"key\": \"value\"}, "[i % 18];
+    }
+    uint32_t text_offset = s->write(s, text, noise_size);
+    ASSERT(text_offset > 0);
+    ASSERT(s->cursor(s) < text_offset + noise_size / 4);
+
+    ASSERT_EQ(s->sync(s), 0);
+
+    // All of them read back the same
+    store_cursor_t *cursor = s->open_cursor(s);
+    ASSERT(cursor != NULL);
+    ASSERT_EQ(cursor->seek(cursor, small_offset), SUCCESS);
+    ASSERT_EQ(cursor->size, sizeof(small));
+    ASSERT_EQ(memcmp(cursor->data, small, sizeof(small)), 0);
+    ASSERT_EQ(cursor->advance(cursor), SUCCESS);
+    ASSERT_EQ(cursor->size, noise_size);
+    ASSERT_EQ(memcmp(cursor->data, noise, noise_size), 0);
+    ASSERT_EQ(cursor->advance(cursor), SUCCESS);
+    ASSERT_EQ(cursor->size, noise_size);
+    ASSERT_EQ(memcmp(cursor->data, text, noise_size), 0);
+    ASSERT_EQ(cursor->advance(cursor), END);
+
+    // Cleanup
+    cursor->destroy(cursor);
+    s->destroy(s);
+    free(noise);
+    free(text);
+
+    PASS();
+}
+
+// Small records that look alike, the case dictionaries are for
+static uint32_t make_record(char *buffer, uint32_t i) {
+    return sprintf(buffer, "{\"id\": %u, \"type\": \"click\", \"user\": \"user-%u\", "
+                           "\"page\": \"/products/%u\", \"ok\": true}", i, i * 7, i % 13);
+}
+
+TEST test_dictionary() {
+    const uint32_t samples = 200;
+    const uint32_t records = 1000;
+    char *sample_data = calloc(samples, 128);
+    const void *sample_pointers[samples];
+    uint32_t sample_sizes[samples];
+    for (uint32_t i = 0; i < samples; i++) {
+        sample_pointers[i] = sample_data + i * 128;
+        sample_sizes[i] = make_record(sample_data + i * 128, i);
+    }
+
+    char dictionary[4096];
+    uint32_t dictionary_size = train_lz4_dictionary(sample_pointers, sample_sizes, samples,
+                                                    dictionary, sizeof(dictionary));
+    ASSERT(dictionary_size > 0);
+    ASSERT(dictionary_size <= sizeof(dictionary));
+
+    // Write the same records with and without the dictionary
+    store_t *plain = open_lz4_store(create_mmap_store(SIZE, ".", "test_lz4store_plain.str",
+                                                      DELETE_IF_EXISTS), 0);
+    store_t *s = open_lz4_store_with_dictionary(create_mmap_store(SIZE, ".", "test_lz4store.str",
+                                                                  DELETE_IF_EXISTS),
+                                                dictionary, dictionary_size, 0);
+    ASSERT(plain != NULL && s != NULL);
+
+    // The dictionary frame is not data
+    ASSERT_EQ(s->start_cursor(s), s->cursor(s));
+
+    char record[128];
+    for (uint32_t i = 0; i < records; i++) {
+        uint32_t size = make_record(record, i + samples);
+        ASSERT(plain->write(plain, record, size) > 0);
+        ASSERT(s->write(s, record, size) > 0);
+    }
+
+    uint32_t plain_bytes = plain->cursor(plain) - plain->start_cursor(plain);
+    uint32_t dictionary_bytes = s->cursor(s) - s->start_cursor(s);
+    ASSERT(dictionary_bytes * 3 < plain_bytes * 2);
+    plain->destroy(plain);
+
+    ASSERT_EQ(s->sync(s), 0);
+    ASSERT_EQ(s->close(s, 0), 0);
+
+    // A reopened store finds its dictionary in the data file
+    s = open_lz4_store(open_mmap_store(".", "test_lz4store.str", 0), 0);
+    ASSERT(s != NULL);
+
+    store_cursor_t *cursor = s->pop_cursor(s);
+    for (uint32_t i = 0; i < records; i++) {
+        ASSERT(cursor != NULL);
+        uint32_t size = make_record(record, i + samples);
+        ASSERT_EQ(cursor->size, size);
+        ASSERT_EQ(memcmp(cursor->data, record, size), 0);
+        cursor->destroy(cursor);
+        cursor = s->pop_cursor(s);
+    }
+    ASSERT(cursor == NULL);
+
+    // Cleanup
+    s->destroy(s);
+    free(sample_data);
+
+    PASS();
+}
+
+TEST test_blocks() {
+    const uint32_t records = 5000;
+
+    // Write the same records one frame each and in blocks, with one record too big for a block in
+    // the middle
+    store_t *plain = open_lz4_store(create_mmap_store(SIZE, ".", "test_lz4store_plain.str",
+                                                      DELETE_IF_EXISTS), 0);
+    store_t *s = open_lz4_store(create_mmap_store(SIZE, ".", "test_lz4store.str",
+                                                  DELETE_IF_EXISTS), LZ4_BLOCKS);
+    ASSERT(plain != NULL && s != NULL);
+
+    uint32_t big_size = 100 * 1024;
+    char *big = calloc(1, big_size);
+    ASSERT(big != NULL);
+
+    // Incompressible, so it takes up the same space either way
+    uint32_t seed = 1;
+    for (uint32_t i = 0; i < big_size; i++) {
+        seed = seed * 1103515245 + 12345;
+        big[i] = seed >> 24;
+    }
+
+    char record[128];
+    for (uint32_t i = 0; i < records; i++) {
+        uint32_t size = make_record(record, i);
+        ASSERT(plain->write(plain, record, size) > 0);
+        ASSERT(s->write(s, record, size) > 0);
+        if (i == records / 2) ASSERT(s->write(s, big, big_size) > 0);
+    }
+
+    // Nothing has been flushed since the big record, but the store does not look empty
+    ASSERT(s->cursor(s) != s->start_cursor(s));
+    ASSERT_EQ(s->sync(s), 0);
+
+    // Once synced, it takes no more
+    ASSERT_EQ(s->write(s, record, 16), 0);
+
+    uint32_t plain_bytes = plain->cursor(plain) - plain->start_cursor(plain);
+    uint32_t block_bytes = s->cursor(s) - s->start_cursor(s) - big_size;
+    ASSERT(block_bytes * 2 < plain_bytes);
+    plain->destroy(plain);
+
+    // Walk the records
+    store_cursor_t *cursor = s->open_cursor(s);
+    ASSERT(cursor != NULL);
+    enum store_read_status status = cursor->seek(cursor, s->start_cursor(s));
+    for (uint32_t i = 0; i < records; i++) {
+        ASSERT_EQ(status, SUCCESS);
+        uint32_t size = make_record(record, i);
+        ASSERT_EQ(cursor->size, size);
+        ASSERT_EQ(memcmp(cursor->data, record, size), 0);
+        status = cursor->advance(cursor);
+        if (i == records / 2) {
+            ASSERT_EQ(status, SUCCESS);
+            ASSERT_EQ(cursor->size, big_size);
+            status = cursor->advance(cursor);
+        }
+    }
+    ASSERT_EQ(status, END);
+    cursor->destroy(cursor);
+
+    // Pop them, holding on to a few cursors across block boundaries
+    store_cursor_t *held[8];
+    for (uint32_t i = 0; i < records; i++) {
+        cursor = s->pop_cursor(s);
+        ASSERT(cursor != NULL);
+        uint32_t size = make_record(record, i);
+        ASSERT_EQ(cursor->size, size);
+        ASSERT_EQ(memcmp(cursor->data, record, size), 0);
+        if (i % 700 == 0 && i / 700 < 8) {
+            held[i / 700] = cursor;
+        } else {
+            cursor->destroy(cursor);
+        }
+        if (i == records / 2) {
+            cursor = s->pop_cursor(s);
+            ASSERT(cursor != NULL);
+            ASSERT_EQ(cursor->size, big_size);
+            cursor->destroy(cursor);
+        }
+    }
+    ASSERT(s->pop_cursor(s) == NULL);
+
+    for (uint32_t i = 0; i < 8; i++) {
+        uint32_t size = make_record(record, i * 700);
+        ASSERT_EQ(held[i]->size, size);
+        ASSERT_EQ(memcmp(held[i]->data, record, size), 0);
+        held[i]->destroy(held[i]);
+    }
+
+    // Cleanup
+    s->destroy(s);
+    free(big);
+
+    PASS();
+}
+
+TEST test_reopen_sizes() {
+    const uint32_t records = 200;
+
+    // Records of very different sizes, the largest in the middle, so a reader that sized its
+    // buffer from the first record would have to grow it
+    store_t *s = create_lz4_store(create_mmap_store(SIZE, ".", "test_lz4store.str",
+                                                    DELETE_IF_EXISTS), 0);
+    ASSERT(s != NULL);
+
+    char *record = malloc(100 + records * 64);
+    ASSERT(record != NULL);
+    for (uint32_t i = 0; i < records; i++) {
+        uint32_t size = 100 + ((i * 37) % records) * 64;
+        memset(record, 'a' + (i % 26), size);
+        ASSERT(s->write(s, record, size) > 0);
+    }
+    ASSERT_EQ(s->close(s, true), 0);
+
+    s = open_lz4_store(open_mmap_store(".", "test_lz4store.str", 0), 0);
+    ASSERT(s != NULL);
+
+    // The header is not a record, in either kind of walk
+    store_cursor_t *cursor = s->open_cursor(s);
+    ASSERT(cursor != NULL);
+    enum store_read_status status = cursor->seek(cursor, s->start_cursor(s));
+    for (uint32_t i = 0; i < records; i++) {
+        ASSERT_EQ(status, SUCCESS);
+        ASSERT_EQ(cursor->size, 100 + ((i * 37) % records) * 64);
+        ASSERT_EQ(((char*)cursor->data)[cursor->size - 1], 'a' + (i % 26));
+        status = cursor->advance(cursor);
+    }
+    ASSERT_EQ(status, END);
+    cursor->destroy(cursor);
+
+    for (uint32_t i = 0; i < records; i++) {
+        cursor = s->pop_cursor(s);
+        ASSERT(cursor != NULL);
+        ASSERT_EQ(cursor->size, 100 + ((i * 37) % records) * 64);
+        ASSERT_EQ(((char*)cursor->data)[0], 'a' + (i % 26));
+        cursor->destroy(cursor);
+    }
+    ASSERT(s->pop_cursor(s) == NULL);
+
+    // Cleanup
+    s->destroy(s);
+    free(record);
+
+    PASS();
+}
+
+TEST test_stream() {
+    const uint32_t records = 3000;
+
+    // Write the same records one frame each and streamed, with one record too big for the stream
+    // window in the middle
+    store_t *plain = open_lz4_store(create_mmap_store(SIZE, ".", "test_lz4store_plain.str",
+                                                      DELETE_IF_EXISTS), 0);
+    store_t *s = create_lz4_store(create_mmap_store(SIZE, ".", "test_lz4store.str",
+                                                    DELETE_IF_EXISTS), LZ4_STREAM);
+    ASSERT(plain != NULL && s != NULL);
+
+    uint32_t big_size = 100 * 1024;
+    char *big = calloc(1, big_size);
+    ASSERT(big != NULL);
+    uint32_t seed = 1;
+    for (uint32_t i = 0; i < big_size; i++) {
+        seed = seed * 1103515245 + 12345;
+        big[i] = seed >> 24;
+    }
+
+    uint32_t *offsets = calloc(records, sizeof(uint32_t));
+    ASSERT(offsets != NULL);
+
+    char record[128];
+    for (uint32_t i = 0; i < records; i++) {
+        uint32_t size = make_record(record, i);
+        ASSERT(plain->write(plain, record, size) > 0);
+        offsets[i] = s->write(s, record, size);
+        ASSERT(offsets[i] > 0);
+        if (i == records / 2) ASSERT(s->write(s, big, big_size) > 0);
+    }
+
+    uint32_t plain_bytes = plain->cursor(plain) - plain->start_cursor(plain);
+    uint32_t stream_bytes = s->cursor(s) - s->start_cursor(s) - big_size;
+    ASSERT(stream_bytes * 2 < plain_bytes);
+    plain->destroy(plain);
+
+    ASSERT_EQ(s->close(s, true), 0);
+    s = open_lz4_store(open_mmap_store(".", "test_lz4store.str", 0), 0);
+    ASSERT(s != NULL);
+
+    // Walk the records
+    store_cursor_t *cursor = s->open_cursor(s);
+    ASSERT(cursor != NULL);
+    enum store_read_status status = cursor->seek(cursor, s->start_cursor(s));
+    for (uint32_t i = 0; i < records; i++) {
+        ASSERT_EQ(status, SUCCESS);
+        uint32_t size = make_record(record, i);
+        ASSERT_EQ(cursor->size, size);
+        ASSERT_EQ(memcmp(cursor->data, record, size), 0);
+        status = cursor->advance(cursor);
+        if (i == records / 2) {
+            ASSERT_EQ(status, SUCCESS);
+            ASSERT_EQ(cursor->size, big_size);
+            ASSERT_EQ(memcmp(cursor->data, big, big_size), 0);
+            status = cursor->advance(cursor);
+        }
+    }
+    ASSERT_EQ(status, END);
+
+    // Seeking into the middle of a stream goes back to its restart point
+    for (uint32_t i = 7; i < records; i += 397) {
+        ASSERT_EQ(cursor->seek(cursor, offsets[i]), SUCCESS);
+        uint32_t size = make_record(record, i);
+        ASSERT_EQ(cursor->size, size);
+        ASSERT_EQ(memcmp(cursor->data, record, size), 0);
+
+        ASSERT_EQ(cursor->advance(cursor), SUCCESS);
+        if (i == records / 2) continue;
+        size = make_record(record, i + 1);
+        ASSERT_EQ(cursor->size, size);
+        ASSERT_EQ(memcmp(cursor->data, record, size), 0);
+    }
+    cursor->destroy(cursor);
+
+    // Pop them, holding on to some cursors and leaving the big record behind once
+    store_cursor_t *held[8];
+    for (uint32_t i = 0; i < records; i++) {
+        uint32_t size = make_record(record, i);
+        if (i % 2 == 0) {
+            char buf[128];
+            uint32_t len = 0;
+            ASSERT_EQ(s->pop_into(s, buf, sizeof(buf), &len), 0);
+            ASSERT_EQ(len, size);
+            ASSERT_EQ(memcmp(buf, record, size), 0);
+        } else {
+            cursor = s->pop_cursor(s);
+            ASSERT(cursor != NULL);
+            ASSERT_EQ(cursor->size, size);
+            ASSERT_EQ(memcmp(cursor->data, record, size), 0);
+            if (i % 350 == 1 && i / 350 < 8) {
+                held[i / 350] = cursor;
+            } else {
+                cursor->destroy(cursor);
+            }
+        }
+        if (i == records / 2) {
+            char buf[128];
+            uint32_t len = 0;
+            ASSERT_EQ(s->pop_into(s, buf, sizeof(buf), &len), 1);
+            ASSERT_EQ(len, big_size);
+            cursor = s->pop_cursor(s);
+            ASSERT(cursor != NULL);
+            ASSERT_EQ(cursor->size, big_size);
+            cursor->destroy(cursor);
+        }
+    }
+    ASSERT(s->pop_cursor(s) == NULL);
+
+    for (uint32_t i = 0; i < 8; i++) {
+        uint32_t size = make_record(record, i * 350 + 1);
+        ASSERT_EQ(held[i]->size, size);
+        ASSERT_EQ(memcmp(held[i]->data, record, size), 0);
+        held[i]->destroy(held[i]);
+    }
+
+    // Cleanup
+    s->destroy(s);
+    free(offsets);
+    free(big);
+
+    PASS();
+}
+
+static uint32_t make_large_record(char *buffer, uint32_t i) {
+    uint32_t size = 0;
+    for (uint32_t j = 0; j < 100; j++) size += make_record(buffer + size, i * 100 + j);
+    return size;
+}
+
+TEST test_stream_window() {
+    const uint32_t records = 300;
+
+    // Records big enough that the window slides many times between restart points
+    store_t *s = create_lz4_store(create_mmap_store(SIZE, ".", "test_lz4store.str",
+                                                    DELETE_IF_EXISTS), LZ4_STREAM);
+    ASSERT(s != NULL);
+
+    char *record = malloc(100 * 128);
+    uint32_t *offsets = calloc(records, sizeof(uint32_t));
+    ASSERT(record != NULL && offsets != NULL);
+    for (uint32_t i = 0; i < records; i++) {
+        uint32_t size = make_large_record(record, i);
+        offsets[i] = s->write(s, record, size);
+        ASSERT(offsets[i] > 0);
+    }
+    ASSERT_EQ(s->sync(s), 0);
+
+    store_cursor_t *cursor = s->open_cursor(s);
+    ASSERT(cursor != NULL);
+    enum store_read_status status = cursor->seek(cursor, s->start_cursor(s));
+    for (uint32_t i = 0; i < records; i++) {
+        ASSERT_EQ(status, SUCCESS);
+        uint32_t size = make_large_record(record, i);
+        ASSERT_EQ(cursor->size, size);
+        ASSERT_EQ(memcmp(cursor->data, record, size), 0);
+        status = cursor->advance(cursor);
+    }
+    ASSERT_EQ(status, END);
+
+    ASSERT_EQ(cursor->seek(cursor, offsets[records - 2]), SUCCESS);
+    uint32_t size = make_large_record(record, records - 2);
+    ASSERT_EQ(cursor->size, size);
+    ASSERT_EQ(memcmp(cursor->data, record, size), 0);
+    cursor->destroy(cursor);
+
+    for (uint32_t i = 0; i < records; i++) {
+        cursor = s->pop_cursor(s);
+        ASSERT(cursor != NULL);
+        size = make_large_record(record, i);
+        ASSERT_EQ(cursor->size, size);
+        ASSERT_EQ(memcmp(cursor->data, record, size), 0);
+        cursor->destroy(cursor);
+    }
+    ASSERT(s->pop_cursor(s) == NULL);
+
+    // Cleanup
+    s->destroy(s);
+    free(offsets);
+    free(record);
+
+    PASS();
+}
+
+TEST test_corrupt_frame() {
+    store_t *s = create_lz4_store(create_mmap_store(SIZE, ".", "test_lz4store.str",
+                                                    DELETE_IF_EXISTS), 0);
+    ASSERT(s != NULL);
+
+    char text[4096];
+    for (size_t i = 0; i < sizeof(text); i++) {
+        text[i] = "{\"key\": \"value\"}, "[i % 18];
+    }
+    uint32_t offsets[3];
+    for (int i = 0; i < 3; i++) {
+        offsets[i] = s->write(s, text, sizeof(text));
+        ASSERT(offsets[i] > 0);
+    }
+    ASSERT_EQ(s->close(s, true), 0);
+
+    // Scribble over the compressed bytes of the middle frame, after its three uint32_t headers
+    uint32_t frame_size = offsets[2] - offsets[1] - sizeof(uint32_t) * 3;
+    char garbage[4096];
+    memset(garbage, 0xFF, sizeof(garbage));
+    int fd = open("test_lz4store.str", O_RDWR);
+    ASSERT(fd >= 0);
+    ASSERT_EQ(lseek(fd, offsets[1] + sizeof(uint32_t) * 3, SEEK_SET),
+              offsets[1] + sizeof(uint32_t) * 3);
+    ASSERT_EQ(write(fd, garbage, frame_size), frame_size);
+    close(fd);
+
+    s = open_lz4_store(open_mmap_store(".", "test_lz4store.str", 0), 0);
+    ASSERT(s != NULL);
+
+    // The corrupt record is reported and skipped, the ones around it still come back
+    char buf[4096];
+    uint32_t len = 0;
+    ASSERT_EQ(s->pop_into(s, buf, sizeof(buf), &len), 0);
+    ASSERT_EQ(memcmp(buf, text, sizeof(text)), 0);
+    ASSERT_EQ(s->pop_into(s, buf, sizeof(buf), &len), DECOMPRESSION_FAULT);
+    ASSERT_EQ(len, sizeof(text));
+    ASSERT_EQ(s->pop_into(s, buf, sizeof(buf), &len), 0);
+    ASSERT_EQ(memcmp(buf, text, sizeof(text)), 0);
+    ASSERT_EQ(s->pop_into(s, buf, sizeof(buf), &len), -1);
+
+    s->destroy(s);
+    PASS();
+}
+
+TEST test_unloaded() {
+    store_t *s = create_lz4_store(create_mmap_store(SIZE, ".", "test_lz4store.str",
+                                                    DELETE_IF_EXISTS), 0);
+    ASSERT(s != NULL);
+
+    char text[3][4096];
+    for (int r = 0; r < 3; r++) {
+        for (size_t i = 0; i < sizeof(text[r]); i++) {
+            text[r][i] = "{\"key\": \"value\"}, "[(i + r) % 18];
+        }
+        ASSERT(s->write(s, text[r], sizeof(text[r])) > 0);
+    }
+    ASSERT_EQ(s->sync(s), 0);
+
+    // Popped in order, but left compressed, with the size already known
+    store_cursor_t *cursors[3];
+    for (int r = 0; r < 3; r++) {
+        cursors[r] = s->pop_cursor_unloaded(s);
+        ASSERT(cursors[r] != NULL);
+        ASSERT_EQ(cursors[r]->data, NULL);
+        ASSERT_EQ(cursors[r]->size, sizeof(text[r]));
+    }
+    ASSERT_EQ(s->pop_cursor_unloaded(s), NULL);
+
+    // Loading does not depend on the order records were popped in
+    for (int r = 2; r >= 0; r--) {
+        ASSERT_EQ(s->load_cursor(s, cursors[r]), SUCCESS);
+        ASSERT_EQ(cursors[r]->size, sizeof(text[r]));
+        ASSERT_EQ(memcmp(cursors[r]->data, text[r], sizeof(text[r])), 0);
+        ASSERT_EQ(s->load_cursor(s, cursors[r]), SUCCESS);
+        cursors[r]->destroy(cursors[r]);
+    }
+
+    s->destroy(s);
+    PASS();
+}
+
 SUITE(lz4store_suite) {
     RUN_TEST(test_basic_store);
     RUN_TEST(test_compress_and_store);
     RUN_TEST(test_store_persistence);
+    RUN_TEST(test_raw_records);
+    RUN_TEST(test_dictionary);
+    RUN_TEST(test_blocks);
+    RUN_TEST(test_reopen_sizes);
+    RUN_TEST(test_stream);
+    RUN_TEST(test_stream_window);
+    RUN_TEST(test_corrupt_frame);
+    RUN_TEST(test_unloaded);
 }
 
 GREATEST_MAIN_DEFS();
@@ -356,6 +356,57 @@ TEST test_full_store() {
     PASS();
 }
 
+TEST test_reserve_commit() {
+
+    // Allocate the store
+    store = (struct mmap_store*) create_mmap_store(SIZE, ".", "test_store.str", DELETE_IF_EXISTS);
+    ASSERT(store != NULL);
+    store_t *s = (store_t*) store;
+
+    // The last reservation gives back what it did not use
+    uint32_t a_offset = 0;
+    char *a = s->reserve(s, 100, &a_offset);
+    ASSERT(a != NULL);
+    memset(a, 'A', 40);
+    ASSERT_EQ(s->commit(s, a_offset, 40), a_offset);
+    ASSERT_EQ(s->cursor(s), a_offset + sizeof(uint32_t) + 40);
+
+    // An earlier reservation can not, once another has been made behind it
+    uint32_t b_offset = 0, c_offset = 0;
+    char *b = s->reserve(s, 100, &b_offset);
+    char *c = s->reserve(s, 100, &c_offset);
+    ASSERT(b != NULL && c != NULL);
+    memset(b, 'B', 40);
+    memset(c, 'C', 100);
+    ASSERT_EQ(s->commit(s, b_offset, 40), b_offset);
+    ASSERT_EQ(s->commit(s, c_offset, 100), c_offset);
+    ASSERT_EQ(c_offset, b_offset + sizeof(uint32_t) + 100);
+
+    ASSERT_EQ(s->sync(s), 0);
+
+    store_cursor_t *cursor = s->open_cursor(s);
+    ASSERT(cursor != NULL);
+    ASSERT_EQ(cursor->seek(cursor, a_offset), SUCCESS);
+    ASSERT_EQ(cursor->size, 40);
+    ASSERT_EQ(((char*) cursor->data)[39], 'A');
+    ASSERT_EQ(cursor->advance(cursor), SUCCESS);
+    ASSERT_EQ(cursor->size, 100);
+    ASSERT_EQ(((char*) cursor->data)[0], 'B');
+    ASSERT_EQ(cursor->advance(cursor), SUCCESS);
+    ASSERT_EQ(cursor->size, 100);
+    ASSERT_EQ(((char*) cursor->data)[99], 'C');
+    ASSERT_EQ(cursor->advance(cursor), END);
+    cursor->destroy(cursor);
+
+    // No reservations once the store has synced
+    ASSERT(s->reserve(s, 100, &a_offset) == NULL);
+
+    // Cleanup
+    s->destroy(s);
+
+    PASS();
+}
+
 SUITE(mmap_store_suite) {
     RUN_TEST(test_size_written);
     RUN_TEST(test_basic_store);
@@ -363,6 +414,7 @@ SUITE(mmap_store_suite) {
     RUN_TEST(test_actual_mapping);
     RUN_TEST(test_store_persistence);
     RUN_TEST(test_full_store);
+    RUN_TEST(test_reserve_commit);
 }
 
 GREATEST_MAIN_DEFS();
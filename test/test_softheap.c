@@ -0,0 +1,363 @@
+#include "softheap.h"
+#include "softheap_typed.h"
+
+#include <greatest.h>
+
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+
+static const uint32_t NUM_ELEMENTS = 10000;
+
+// Keys are small integers smuggled through the key pointer
+static int compare_keys(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t) a;
+    uintptr_t y = (uintptr_t) b;
+    return (x > y) - (x < y);
+}
+
+// A pseudo random permutation of 0 .. NUM_ELEMENTS - 1
+static uintptr_t permuted_key(uint32_t i) {
+    return (i * 7919) % NUM_ELEMENTS;
+}
+
+static uint32_t iterated = 0;
+static void count_element(void *key, void *value) {
+    iterated++;
+}
+
+TEST test_exact_heap_order() {
+
+    // With an error this large no rank is ever corrupted, so this is an exact heap
+    softheap_t *heap = sh_create(INT_MAX, compare_keys, 0);
+    ASSERT(heap != NULL);
+
+    for (uint32_t i = 0; i < NUM_ELEMENTS; i++) {
+        ASSERT_EQ(sh_add(heap, (void*) permuted_key(i), (void*) permuted_key(i)), 0);
+    }
+    ASSERT_EQ(sh_cardinality(heap), NUM_ELEMENTS);
+
+    iterated = 0;
+    ASSERT_EQ(sh_iterate(heap, count_element), 0);
+    ASSERT_EQ(iterated, NUM_ELEMENTS);
+
+    for (uint32_t i = 0; i < NUM_ELEMENTS; i++) {
+        void *key = NULL;
+        void *value = NULL;
+        ASSERT_EQ(sh_extractmin(heap, &key, &value), 0);
+        ASSERT_EQ((uintptr_t) key, i);
+        ASSERT_EQ((uintptr_t) value, i);
+    }
+
+    void *key = NULL;
+    ASSERT_EQ(sh_extractmin(heap, &key, NULL), -1);
+    ASSERT_EQ(sh_cardinality(heap), 0);
+
+    sh_destroy(heap);
+    PASS();
+}
+
+TEST test_corrupted_heap_returns_everything() {
+
+    // A coarse heap may hand elements out of order, but must hand every one back exactly once
+    softheap_t *heap = sh_create(2, compare_keys, 0);
+    ASSERT(heap != NULL);
+
+    for (uint32_t i = 0; i < NUM_ELEMENTS; i++) {
+        ASSERT_EQ(sh_add(heap, (void*) permuted_key(i), NULL), 0);
+    }
+
+    char *seen = calloc(NUM_ELEMENTS, sizeof(char));
+    ASSERT(seen != NULL);
+
+    void *key = NULL;
+    while (sh_extractmin(heap, &key, NULL) == 0) {
+        ASSERT((uintptr_t) key < NUM_ELEMENTS);
+        ASSERT_EQ(seen[(uintptr_t) key], 0);
+        seen[(uintptr_t) key] = 1;
+    }
+
+    for (uint32_t i = 0; i < NUM_ELEMENTS; i++) {
+        ASSERT_EQ(seen[i], 1);
+    }
+
+    free(seen);
+    sh_destroy(heap);
+    PASS();
+}
+
+TEST test_build_and_extract_batch() {
+
+    softheap_t *heap = sh_create(INT_MAX, compare_keys, 0);
+    ASSERT(heap != NULL);
+
+    void **keys = calloc(NUM_ELEMENTS, sizeof(void*));
+    void **values = calloc(NUM_ELEMENTS, sizeof(void*));
+    ASSERT(keys != NULL && values != NULL);
+    for (uint32_t i = 0; i < NUM_ELEMENTS; i++) {
+        keys[i] = (void*) permuted_key(i);
+        values[i] = (void*) (permuted_key(i) + 1);
+    }
+
+    // Build on top of a heap that already has something in it
+    ASSERT_EQ(sh_add(heap, (void*) (uintptr_t) NUM_ELEMENTS, NULL), 0);
+    ASSERT_EQ(sh_build(heap, keys, values, NUM_ELEMENTS), 0);
+    ASSERT_EQ(sh_cardinality(heap), NUM_ELEMENTS + 1);
+
+    // Pull everything back out in uneven batches
+    uint32_t next = 0;
+    while (next < NUM_ELEMENTS) {
+        uint32_t got = sh_extract_batch(heap, 37, keys, values);
+        ASSERT(got > 0);
+        for (uint32_t i = 0; i < got; i++, next++) {
+            ASSERT_EQ((uintptr_t) keys[i], next);
+            if (next < NUM_ELEMENTS) ASSERT_EQ((uintptr_t) values[i], next + 1);
+        }
+    }
+    ASSERT_EQ(sh_extract_batch(heap, 37, keys, values), 0);
+    ASSERT_EQ(sh_cardinality(heap), 0);
+
+    free(keys);
+    free(values);
+    sh_destroy(heap);
+    PASS();
+}
+
+TEST test_meld() {
+
+    softheap_t *evens = sh_create(INT_MAX, compare_keys, 0);
+    softheap_t *odds = sh_create(INT_MAX, compare_keys, 0);
+    ASSERT(evens != NULL && odds != NULL);
+
+    for (uint32_t i = 0; i < NUM_ELEMENTS; i++) {
+        uintptr_t key = permuted_key(i);
+        ASSERT_EQ(sh_add(key % 2 == 0 ? evens : odds, (void*) key, NULL), 0);
+    }
+
+    ASSERT_EQ(sh_meld(evens, odds), 0);
+    ASSERT_EQ(sh_cardinality(evens), NUM_ELEMENTS);
+    ASSERT_EQ(sh_cardinality(odds), 0);
+
+    // The source no longer owns any memory, destroying it must not take the melded nodes
+    sh_destroy(odds);
+
+    for (uint32_t i = 0; i < NUM_ELEMENTS; i++) {
+        void *key = NULL;
+        ASSERT_EQ(sh_extractmin(evens, &key, NULL), 0);
+        ASSERT_EQ((uintptr_t) key, i);
+    }
+
+    sh_destroy(evens);
+    PASS();
+}
+
+TEST test_typed_u32() {
+
+    sh_u32_t *heap = sh_u32_create(INT_MAX, 0);
+    ASSERT(heap != NULL);
+
+    uint32_t *keys = calloc(NUM_ELEMENTS, sizeof(uint32_t));
+    ASSERT(keys != NULL);
+    for (uint32_t i = 0; i < NUM_ELEMENTS; i++) keys[i] = permuted_key(i);
+
+    // Half built in bulk, half added one at a time
+    ASSERT_EQ(sh_u32_build(heap, keys, NULL, NUM_ELEMENTS / 2), 0);
+    for (uint32_t i = NUM_ELEMENTS / 2; i < NUM_ELEMENTS; i++) {
+        ASSERT_EQ(sh_u32_add(heap, keys[i], (void*) (uintptr_t) keys[i]), 0);
+    }
+    ASSERT_EQ(sh_u32_cardinality(heap), NUM_ELEMENTS);
+
+    uint32_t next = 0;
+    while (next < NUM_ELEMENTS) {
+        uint32_t got = sh_u32_extract_batch(heap, 64, keys, NULL);
+        ASSERT(got > 0);
+        for (uint32_t i = 0; i < got; i++, next++) ASSERT_EQ(keys[i], next);
+    }
+
+    uint32_t key = 0;
+    ASSERT_EQ(sh_u32_extractmin(heap, &key, NULL), -1);
+
+    free(keys);
+    sh_u32_destroy(heap);
+    PASS();
+}
+
+TEST test_typed_u64_meld() {
+
+    sh_u64_t *low = sh_u64_create(INT_MAX, 0);
+    sh_u64_t *high = sh_u64_create(INT_MAX, 0);
+    ASSERT(low != NULL && high != NULL);
+
+    // Keys past 32 bits, to be sure nothing is truncated on the way through
+    for (uint32_t i = 0; i < NUM_ELEMENTS; i++) {
+        uint64_t key = ((uint64_t) permuted_key(i) << 33) | 1;
+        ASSERT_EQ(sh_u64_add(key & (1ULL << 33) ? high : low, key, NULL), 0);
+    }
+    ASSERT_EQ(sh_u64_meld(low, high), 0);
+    sh_u64_destroy(high);
+
+    for (uint32_t i = 0; i < NUM_ELEMENTS; i++) {
+        uint64_t key = 0;
+        ASSERT_EQ(sh_u64_extractmin(low, &key, NULL), 0);
+        ASSERT_EQ(key, ((uint64_t) i << 33) | 1);
+    }
+
+    sh_u64_destroy(low);
+    PASS();
+}
+
+TEST test_typed_double() {
+
+    sh_double_t *heap = sh_double_create(INT_MAX, 0);
+    ASSERT(heap != NULL);
+
+    for (uint32_t i = 0; i < NUM_ELEMENTS; i++) {
+        double key = ((double) permuted_key(i) - (NUM_ELEMENTS / 2)) / 4.0;
+        ASSERT_EQ(sh_double_add(heap, key, NULL), 0);
+    }
+
+    double last = -1.0 * NUM_ELEMENTS;
+    double key = 0;
+    while (sh_double_extractmin(heap, &key, NULL) == 0) {
+        ASSERT(key > last);
+        last = key;
+    }
+    ASSERT_EQ(sh_double_cardinality(heap), 0);
+
+    sh_double_destroy(heap);
+    PASS();
+}
+
+TEST test_typed_argmin() {
+
+    uint32_t keys32[SH_MAX_RANK];
+    uint64_t keys64[SH_MAX_RANK];
+    double keysd[SH_MAX_RANK];
+
+    srand(42);
+    for (int round = 0; round < 1000; round++) {
+        // Few distinct values so that ties are common, with some sentinels mixed in
+        for (int i = 0; i < SH_MAX_RANK; i++) {
+            int r = rand() % 16;
+            keys32[i] = r == 0 ? UINT32_MAX : (uint32_t) r + 0x7FFFFFF0;
+            keys64[i] = r == 0 ? UINT64_MAX : ((uint64_t) r << 60) | (uint64_t) r;
+            keysd[i] = r == 0 ? INFINITY : (double) r - 8.0;
+        }
+
+        uint_fast32_t best32 = 0, best64 = 0, bestd = 0;
+        for (int i = 1; i < SH_MAX_RANK; i++) {
+            if (keys32[i] < keys32[best32]) best32 = i;
+            if (keys64[i] < keys64[best64]) best64 = i;
+            if (keysd[i] < keysd[bestd]) bestd = i;
+        }
+
+        ASSERT_EQ(sh_argmin_u32(keys32), best32);
+        ASSERT_EQ(sh_argmin_u64(keys64), best64);
+        ASSERT_EQ(sh_argmin_double(keysd), bestd);
+    }
+    PASS();
+}
+
+TEST test_typed_sentinel_keys() {
+
+    // Keys equal to the empty rank sentinel must still come back out
+    sh_u32_t *heap = sh_u32_create(INT_MAX, 0);
+    ASSERT(heap != NULL);
+
+    for (uint32_t i = 0; i < 100; i++) {
+        ASSERT_EQ(sh_u32_add(heap, i % 2 == 0 ? UINT32_MAX : i, NULL), 0);
+    }
+
+    uint32_t key = 0;
+    for (uint32_t i = 1; i < 100; i += 2) {
+        ASSERT_EQ(sh_u32_extractmin(heap, &key, NULL), 0);
+        ASSERT_EQ(key, i);
+    }
+    for (uint32_t i = 0; i < 50; i++) {
+        ASSERT_EQ(sh_u32_extractmin(heap, &key, NULL), 0);
+        ASSERT_EQ(key, UINT32_MAX);
+    }
+    ASSERT_EQ(sh_u32_extractmin(heap, &key, NULL), -1);
+
+    sh_u32_destroy(heap);
+    PASS();
+}
+
+TEST test_typed_corrupted_returns_everything() {
+
+    sh_u64_t *heap = sh_u64_create(2, 0);
+    ASSERT(heap != NULL);
+
+    for (uint32_t i = 0; i < NUM_ELEMENTS; i++) {
+        ASSERT_EQ(sh_u64_add(heap, permuted_key(i), NULL), 0);
+    }
+
+    char *seen = calloc(NUM_ELEMENTS, sizeof(char));
+    ASSERT(seen != NULL);
+
+    uint64_t key = 0;
+    while (sh_u64_extractmin(heap, &key, NULL) == 0) {
+        ASSERT(key < NUM_ELEMENTS);
+        ASSERT_EQ(seen[key], 0);
+        seen[key] = 1;
+    }
+    for (uint32_t i = 0; i < NUM_ELEMENTS; i++) ASSERT_EQ(seen[i], 1);
+
+    free(seen);
+    sh_u64_destroy(heap);
+    PASS();
+}
+
+SH_BYTES_PROTOTYPE(bytes12, 12)
+
+TEST test_typed_bytes() {
+
+    sh_bytes12_t *heap = sh_bytes12_create(INT_MAX, 0);
+    ASSERT(heap != NULL);
+
+    // Big endian so that memcmp order is numeric order
+    for (uint32_t i = 0; i < NUM_ELEMENTS; i++) {
+        uint32_t k = permuted_key(i);
+        sh_bytes12_key_t key;
+        memset(key.bytes, 0xAB, sizeof(key.bytes));
+        key.bytes[0] = (k >> 24) & 0xFF;
+        key.bytes[1] = (k >> 16) & 0xFF;
+        key.bytes[2] = (k >> 8) & 0xFF;
+        key.bytes[3] = k & 0xFF;
+        ASSERT_EQ(sh_bytes12_add(heap, key, NULL), 0);
+    }
+
+    for (uint32_t i = 0; i < NUM_ELEMENTS; i++) {
+        sh_bytes12_key_t key;
+        ASSERT_EQ(sh_bytes12_extractmin(heap, &key, NULL), 0);
+        uint32_t k = ((uint32_t) key.bytes[0] << 24) | ((uint32_t) key.bytes[1] << 16) |
+                     ((uint32_t) key.bytes[2] << 8) | key.bytes[3];
+        ASSERT_EQ(k, i);
+        ASSERT_EQ(key.bytes[11], 0xAB);
+    }
+
+    sh_bytes12_destroy(heap);
+    PASS();
+}
+
+SUITE(softheap_suite) {
+    RUN_TEST(test_exact_heap_order);
+    RUN_TEST(test_corrupted_heap_returns_everything);
+    RUN_TEST(test_build_and_extract_batch);
+    RUN_TEST(test_meld);
+    RUN_TEST(test_typed_u32);
+    RUN_TEST(test_typed_u64_meld);
+    RUN_TEST(test_typed_double);
+    RUN_TEST(test_typed_bytes);
+    RUN_TEST(test_typed_argmin);
+    RUN_TEST(test_typed_sentinel_keys);
+    RUN_TEST(test_typed_corrupted_returns_everything);
+}
+
+GREATEST_MAIN_DEFS();
+
+int main(int argc, char **argv) {
+    GREATEST_MAIN_BEGIN();
+    RUN_SUITE(softheap_suite);
+    GREATEST_MAIN_END();
+}